@@ -0,0 +1,404 @@
+/**
+ * bench.cpp
+ *
+ * Drive BiliApi against the mock server with many accounts and rooms,
+ * and report the throughput, the latency of each call and the cpu time per request,
+ * then optionally subscribe rooms to the broadcast the mock server replays
+ */
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+#include "https.h"
+#include "bilibili.h"
+#include "pool.h"
+#include "net.h"
+#include "capture.h"
+#include "metrics.h"
+#include "limiter.h"
+#include "tls.h"
+#include "live.h"
+
+// the calls of each account, and the number of requests each of them sends
+enum Call { SIGN, MEDAL, EXP, PLAY_INFO, ENTRY, HEARTBEAT, POLL, CALLS };
+static const char *call_names[CALLS] = {"sign", "fansMedal", "getExp", "roomPlayInfo", "enterRoom", "heartBeat",
+                                        "pollRooms"};
+
+typedef struct {
+    size_t account;
+    uint32_t roomid;
+} RoomJob;
+
+// latencies of every call, filled by all lanes
+class Recorder {
+public:
+    void record(Call call, std::chrono::steady_clock::duration latency) {
+        std::lock_guard<std::mutex> lock(m);
+        latencies[call].push_back(std::chrono::duration<double, std::milli>(latency).count());
+    }
+
+    // count a failure, as a timeout if the request has run out of its deadline
+    void fail(const std::exception &e) {
+        std::lock_guard<std::mutex> lock(m);
+        if (std::string(e.what()).compare(0, 18, "No response within") == 0) {
+            ++timeouts;
+        } else {
+            ++errors;
+        }
+    }
+
+    // time a call and record it, return whether it succeeded
+    template <typename F>
+    bool time(Call call, F fn) {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = true;
+        try {
+            fn();
+        } catch (const std::exception &e) {
+            fail(e);
+            ok = false;
+        }
+        record(call, std::chrono::steady_clock::now() - start);
+        return ok;
+    }
+
+    std::mutex m;
+    std::vector<double> latencies[CALLS];
+    size_t errors = 0, timeouts = 0;
+};
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+           + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// run fn(i) for every i below n on concurrency threads
+template <typename F>
+static void parallel(size_t n, size_t concurrency, F fn) {
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> lanes;
+    for (size_t t = 0; t < concurrency; ++t) {
+        lanes.emplace_back([&next, n, &fn] {
+            for (size_t i = next++; i < n; i = next++) {
+                fn(i);
+            }
+        });
+    }
+    for (std::thread &lane : lanes) {
+        lane.join();
+    }
+}
+
+// the times the recording of the mock broadcast starts and ends the stream of its room, and the plays awaited
+static const size_t RECORDED_STREAMS = 2;
+static const size_t PLAYS = 2;
+
+/**
+ * subscribe rooms to the broadcast of host:port, which replays its recording and then closes,
+ * and wait until each room has heard it PLAYS times, over as many connections, or until timeout
+ * return whether every room has
+ */
+static bool bench_broadcast(const std::string &host, uint16_t port, size_t rooms, std::chrono::seconds timeout) {
+    typedef struct {
+        size_t subscribed, live, preparing;
+    } Heard;
+    const uint32_t first_room = 1000;
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<Heard> heard(rooms, Heard{0, 0, 0});
+    size_t done = 0;
+    auto complete = [] (const Heard &h) {
+        return h.subscribed >= PLAYS && h.live >= PLAYS * RECORDED_STREAMS && h.preparing >= PLAYS * RECORDED_STREAMS;
+    };
+    // the mock server replays from the first heartbeat on, which comes after a second
+    LiveSocket::Endpoint endpoint = {host, port, "/sub", std::chrono::seconds(1)};
+    auto subscriber = std::make_shared<LiveSubscriber>([&] (uint32_t roomid, LiveSubscriber::Event event) {
+        std::lock_guard<std::mutex> lock(m);
+        Heard &h = heard[roomid - first_room];
+        bool was = complete(h);
+        switch (event) {
+            case LiveSubscriber::Event::SUBSCRIBED:
+                ++h.subscribed;
+                break;
+            case LiveSubscriber::Event::LIVE:
+                ++h.live;
+                break;
+            case LiveSubscriber::Event::PREPARING:
+                ++h.preparing;
+                break;
+        }
+        if (!was && complete(h) && ++done == rooms) {
+            cv.notify_all();
+        }
+    }, endpoint);
+
+    // every room reconnects when the recording ends, which the subscriber reports on stderr
+    std::streambuf *err = std::cerr.rdbuf(nullptr);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rooms; ++i) {
+        subscriber->subscribe(first_room + static_cast<uint32_t>(i), 0, "");
+    }
+    {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait_for(lock, timeout, [&] { return done == rooms; });
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    subscriber->stop();
+    std::cerr.rdbuf(err);
+
+    Heard total = {0, 0, 0};
+    for (const Heard &h : heard) {
+        total.subscribed += h.subscribed;
+        total.live += h.live;
+        total.preparing += h.preparing;
+    }
+    std::cout << std::setprecision(1) << "broadcast rooms=" << rooms << " complete=" << done
+              << " subscriptions=" << total.subscribed << " live=" << total.live << " preparing=" << total.preparing
+              << " in " << elapsed << " s" << std::endl;
+    return done == rooms;
+}
+
+int main(int argc, char *argv[]) {
+    std::string server = "127.0.0.1:8443";
+    size_t accounts = 8;
+    size_t concurrency = 8;
+    size_t connections = 0;
+    std::string metrics_path;
+    bool limited = false;
+    bool http2 = false;
+    bool ktls = false;
+    size_t broadcast_rooms = 0;
+    bool strict = false;
+    RetryPolicy policy = HttpsClient::get_default_policy();
+    int opt;
+    while ((opt = getopt(argc, argv, "s:a:j:c:R:m:l2Kt:HFL:")) != -1) {
+        switch (opt) {
+            case 's':
+                server = optarg;
+                break;
+            case 'a':
+                accounts = std::stoul(optarg);
+                break;
+            case 'j':
+                concurrency = std::max<size_t>(std::stoul(optarg), 1);
+                break;
+            case 'c':
+                // the connections of the pool, one per lane by default, fewer make requests wait for one
+                connections = std::stoul(optarg);
+                break;
+            case 'R':
+                // record the responses into a corpus for bili-micro
+                capture_open(optarg);
+                break;
+            case '2':
+                // offer http/2, every request is then multiplexed on one connection
+                http2 = true;
+                break;
+            case 'K':
+                // let the kernel encrypt the records where it can, to compare with encryption in user space
+                ktls = true;
+                break;
+            case 't':
+                // the deadline of each request in milliseconds, 0 for none
+                policy.deadline = std::chrono::milliseconds(std::stoul(optarg));
+                break;
+            case 'H':
+                // hedge the idempotent requests slower than the p95 of their endpoint
+                policy.hedge = true;
+                break;
+            case 'F':
+                // fail on any error but a timeout, even of a copy whose sibling has answered,
+                // against a server which neither fails nor closes, so that the client has made it up
+                strict = true;
+                break;
+            case 'L':
+                // subscribe this many rooms to the broadcast of the server afterwards
+                broadcast_rooms = std::stoul(optarg);
+                break;
+            case 'l':
+                // keep the rate limits of the endpoints and accounts, which are lifted to measure the client alone
+                limited = true;
+                break;
+            case 'm':
+                // the phases of each connection and request, also written on SIGUSR1
+                metrics_path = optarg;
+                metrics_dump_on_signal(SIGUSR1, metrics_path);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-s host:port] [-a accounts] [-j concurrency] [-c connections]"
+                          << " [-R corpus] [-m metrics] [-l] [-2] [-K] [-t deadline ms] [-H] [-F] [-L broadcast rooms]" << std::endl;
+                return 1;
+        }
+    }
+
+    if (!limited) {
+        RateLimiter::endpoint_options.rate = 0;
+        RateLimiter::account_options.rate = 0;
+    }
+    HttpsClient::ssl_init();
+    if (ktls) {
+        tls_enable_ktls();
+    }
+    size_t colon = server.rfind(':');
+    tcp_redirect(BiliApi::host, server.substr(0, colon), static_cast<uint16_t>(std::stoul(server.substr(colon + 1))));
+    ConnectionPool::set_default_options({connections > 0 ? connections : concurrency, 1, std::chrono::seconds(60), http2});
+    HttpsClient::set_default_policy(policy);
+
+    // the mock server may still be starting
+    std::shared_ptr<HttpsClient> connection;
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            connection = std::make_shared<HttpsClient>(BiliApi::host, "");
+            connection->wait_established();
+            break;
+        } catch (const std::exception &e) {
+            if (attempt == 50) {
+                std::cerr << "Fail to connect to " << server << ": " << e.what() << std::endl;
+                return 1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    std::vector<std::unique_ptr<BiliApi>> apis;
+    for (size_t i = 0; i < accounts; ++i) {
+        std::string id = std::to_string(10000 + i);
+        apis.push_back(std::make_unique<BiliApi>("DedeUserID=" + id + "; bili_jct=csrf" + id + "; SESSDATA=" + id, connection));
+    }
+
+    // the api prints a line per room, which is not what is measured
+    std::streambuf *out = std::cout.rdbuf(nullptr);
+
+    Recorder recorder;
+    std::vector<RoomJob> rooms;
+    std::vector<std::vector<uint32_t>> account_rooms(accounts);
+    std::mutex rooms_mutex;
+    std::atomic<size_t> requests(0);
+    double cpu_start = cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+
+    parallel(accounts, concurrency, [&] (size_t i) {
+        BiliApi &api = *apis[i];
+        std::string recvdata;
+        recorder.time(Call::SIGN, [&] { api.sign(recvdata); });
+        std::vector<uint32_t> ids;
+        recorder.time(Call::MEDAL, [&] { api.fansMedal(ids); });
+        // one request per page of medals
+        requests += 1 + std::max<size_t>((ids.size() + 29) / 30, 1);
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        for (uint32_t roomid : ids) {
+            rooms.push_back({i, roomid});
+        }
+        account_rooms[i] = ids;
+    });
+    parallel(rooms.size(), concurrency, [&] (size_t i) {
+        BiliApi &api = *apis[rooms[i].account];
+        uint32_t roomid = rooms[i].roomid;
+        // the chat and the like, signed with the server time estimated from the Date headers
+        recorder.time(Call::EXP, [&] { api.getExp(roomid); });
+        recorder.time(Call::PLAY_INFO, [&] { api.roomPlayInfo(roomid); });
+        recorder.time(Call::ENTRY, [&] { api.enterRoom(roomid); });
+        recorder.time(Call::HEARTBEAT, [&] { api.heartBeat(roomid); });
+        requests += 5;
+    });
+    // the live status of all rooms of an account pipelined in one batch, as the monitor polls them
+    parallel(accounts, concurrency, [&] (size_t i) {
+        BiliApi &api = *apis[i];
+        std::vector<PreparedRequest> polls;
+        for (uint32_t roomid : account_rooms[i]) {
+            polls.push_back(api.play_info_request(roomid));
+        }
+        requests += polls.size();
+        recorder.time(Call::POLL, [&] {
+            for (std::future<std::string> &response : api.client()->async_writeread_batch(std::move(polls))) {
+                try {
+                    BiliApi::parse_live_status(response.get());
+                } catch (const std::exception &e) {
+                    recorder.fail(e);
+                }
+            }
+        });
+    });
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = cpu_seconds() - cpu_start;
+    std::cout.rdbuf(out);
+    std::cout.clear();
+
+    std::cout << "accounts=" << accounts << " rooms=" << rooms.size() << " concurrency=" << concurrency
+              << " requests=" << requests << " errors=" << recorder.errors << " timeouts=" << recorder.timeouts
+              << std::endl;
+    std::cout << std::fixed << std::setprecision(1)
+              << "throughput " << static_cast<double>(requests) / elapsed << " req/s in " << elapsed << " s, cpu "
+              << cpu * 1e6 / static_cast<double>(requests) << " us/req" << std::endl;
+    if (ktls) {
+        // connections fall back to user space where the kernel or the cipher lacks support
+        HostMetrics &host = metrics_host(BiliApi::host);
+        std::cout << "ktls send on " << host.ktls_send << " and receive on " << host.ktls_recv << " of "
+                  << host.connects << " connections" << std::endl;
+    }
+    std::cout << std::left << std::setw(14) << "call" << std::right << std::setw(8) << "count"
+              << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "p999 ms" << std::endl;
+    std::cout << std::setprecision(3);
+    for (int call = 0; call < CALLS; ++call) {
+        std::vector<double> &latencies = recorder.latencies[call];
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::left << std::setw(14) << call_names[call] << std::right << std::setw(8) << latencies.size()
+                  << std::setw(10) << percentile(latencies, 0.5) << std::setw(10) << percentile(latencies, 0.99)
+                  << std::setw(10) << percentile(latencies, 0.999) << std::endl;
+    }
+    if (strict) {
+        // the copies given up at their deadline may wait for a connection held by a stalled response
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+    }
+    if (!metrics_path.empty()) {
+        metrics_dump(metrics_path);
+    }
+    // a copy written after its request has been settled, such as a chat the caller has been told is not sent
+    bool failed = strict && recorder.errors > 0;
+    metrics_for_each([strict, &failed] (const EndpointMetrics &m) {
+        if (m.late_writes > 0) {
+            std::cerr << m.late_writes << " requests of " << m.name << " written after they were settled" << std::endl;
+            failed = true;
+        }
+        if (strict && m.status[0] > 0) {
+            std::cerr << m.status[0] << " requests of " << m.name << " failed without a response" << std::endl;
+            failed = true;
+        }
+    }, [] (const HostMetrics &) {});
+    if (failed) {
+        return 1;
+    }
+    if (broadcast_rooms > 0) {
+        uint16_t port = static_cast<uint16_t>(std::stoul(server.substr(colon + 1)));
+        if (!bench_broadcast(server.substr(0, colon), port, broadcast_rooms, std::chrono::seconds(10))) {
+            std::cerr << "Some rooms have not heard the broadcast through" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
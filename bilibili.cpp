@@ -1,21 +1,16 @@
 #include <iostream>
-#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <stdexcept>
 
 #include "bilibili.h"
+#include "json.h"
+#include "checkpoint.h"
+#include "servertime.h"
 
-size_t read_json(const std::string &recvdata, const std::string &name, size_t pos, uint32_t &value) {
-    pos = recvdata.find(name, pos);
-    if (pos == std::string::npos) {
-        return pos;
-    }
-    pos += name.length();
-    value = 0;
-    while (recvdata[pos] != ',') {
-        value = value * 10 + recvdata[pos] - '0';
-        ++pos;
-    }
-    return pos;
-}
+// medals requested per page of fansMedal
+static const size_t MEDAL_PAGE_SIZE = 30;
 
 const std::string Bilibili::host = "www.bilibili.com";
 
@@ -29,7 +24,10 @@ void Bilibili::get_index(std::string &recvdata) {
 
 const std::string BiliApi::host = "api.live.bilibili.com";
 
-BiliApi::BiliApi(const std::string &cookie) : connection(host, cookie) {
+BiliApi::BiliApi(const std::string &cookie) : BiliApi(cookie, std::make_shared<HttpsClient>(host, cookie)) {}
+
+BiliApi::BiliApi(const std::string &cookie, std::shared_ptr<HttpsClient> connection)
+    : connection(std::move(connection)), cookie(cookie) {
     const std::string str_bili_jct = "bili_jct=";
     const std::string str_DedeUserID = "DedeUserID=";
 
@@ -48,158 +46,299 @@ BiliApi::BiliApi(const std::string &cookie) : connection(host, cookie) {
     pos += str_DedeUserID.length();
     end = cookie.find(';', pos);
     anchor_id = cookie.substr(pos, end - pos);
+
+    // field(0) is the room id in every template that has one
+    const std::string roomid = RequestTemplate::field(0);
+    sign_template = this->connection->compile(request(HttpsMethod::GET, "/xlive/web-ucenter/v1/sign/DoSign"), nullptr);
+    timestamp_template = this->connection->compile(
+        request(HttpsMethod::GET, "/xlive/open-interface/v1/rtc/getTimestamp"), nullptr);
+    medal_template = this->connection->compile(request(HttpsMethod::GET, "/xlive/app-ucenter/v1/fansMedal/panel?page=" +
+        RequestTemplate::field(0) + "&page_size=" + std::to_string(MEDAL_PAGE_SIZE)), nullptr);
+    play_info_template = this->connection->compile(
+        request(HttpsMethod::GET, "/xlive/web-room/v2/index/getRoomPlayInfo?room_id=" + roomid), nullptr);
+    danmu_info_template = this->connection->compile(
+        request(HttpsMethod::GET, "/xlive/web-room/v1/index/getDanmuInfo?id=" + roomid + "&type=0"), nullptr);
+
+    {
+        HttpsRequest req = request(HttpsMethod::POST, "/msg/send");
+        Form form = {
+            {"bubble", "0"},
+            {"msg", RequestTemplate::field(1)},
+            {"color", "16777215"},
+            {"mode", "1"},
+            {"fontsize", "25"},
+            {"rnd", "1681331507"},
+            {"roomid", roomid},
+            {"csrf", csrf_token},
+            {"csrf_token", csrf_token}
+        };
+        WebkitForm data(form, req.header);
+        req.header.emplace("Origin", "https://live.bilibili.com");
+        req.header.emplace("Referer", "https://live.bilibili.com/" + roomid + "/");
+        chat_template = this->connection->compile(req, data.c_str());
+    }
+    {
+        HttpsRequest req = request(HttpsMethod::POST, "/xlive/app-ucenter/v1/like_info_v3/like/likeReportV3");
+        Form form = {
+            {"room_id", roomid},
+            {"anchor_id", anchor_id},
+            {"ts", RequestTemplate::field(1)},
+            {"csrf", csrf_token},
+            {"csrf_token", csrf_token},
+            {"visit_id", ""}
+        };
+        FormUrlencoded data(form, req.header);
+        like_template = this->connection->compile(req, data.c_str());
+    }
+    {
+        HttpsRequest req = request(HttpsMethod::POST, "/xlive/web-room/v1/index/roomEntryAction");
+        Form form = {
+            {"room_id", roomid},
+            {"platform", "pc"},
+            {"csrf_token", csrf_token},
+            {"csrf", csrf_token},
+            {"visit_id", ""}
+        };
+        FormUrlencoded data(form, req.header);
+        entry_template = this->connection->compile(req, data.c_str());
+    }
+    {
+        HttpsRequest req = request(HttpsMethod::GET, "/relation/v1/Feed/heartBeat");
+        req.header.emplace("Origin", "https://www.bilibili.com");
+        req.header.emplace("Referer", "https://live.bilibili.com/" + roomid);
+        heartbeat_template = this->connection->compile(req, nullptr);
+    }
 }
 
-void BiliApi::bullet_chat(const uint32_t roomid, const std::string &msg) {
-    std::string recvdata;
+HttpsRequest BiliApi::request(HttpsMethod method, const std::string &url) const {
     HttpsRequest req;
-    req.url = "/msg/send";
-    req.method = HttpsMethod::POST;
+    req.url = url;
+    req.method = method;
     req.header = HttpsClient::default_header;
+    req.cookie = cookie;
+    return req;
+}
 
-    Form form = {
-        {"bubble", "0"},
-        {"msg", msg},
-        {"color", "16777215"},
-        {"mode", "1"},
-        {"fontsize", "25"},
-        {"rnd", "1681331507"},
-        {"roomid", std::to_string(roomid)},
-        {"csrf", csrf_token},
-        {"csrf_token", csrf_token}
-    };
-    WebkitForm data(form, req.header);
+PreparedRequest BiliApi::chat_request(const uint32_t roomid, const std::string &msg) const {
+    return chat_template.fill({std::to_string(roomid), msg});
+}
 
-    req.header.emplace("Origin", "https://live.bilibili.com");
-    req.header.emplace("Referer", "https://live.bilibili.com/" + std::to_string(roomid) + "/");
-    connection.writeread(req, data.c_str(), recvdata);
+void BiliApi::bullet_chat(const uint32_t roomid, const std::string &msg) {
+    std::string recvdata;
+    connection->writeread(chat_request(roomid, msg), recvdata);
 }
 
 void BiliApi::sign(std::string &recvdata) {
-    HttpsRequest req;
-    req.url = "/xlive/web-ucenter/v1/sign/DoSign";
-    req.method = HttpsMethod::GET;
-    req.header = HttpsClient::default_header;
-    connection.writeread(req, nullptr, recvdata);
+    if (checkpoint != nullptr && checkpoint->done(uid(), 0, Checkpoint::SIGN)) {
+        recvdata.clear();
+        return;
+    }
+    connection->writeread(sign_template.fill(), recvdata);
+    if (checkpoint != nullptr) {
+        checkpoint->mark(uid(), 0, Checkpoint::SIGN);
+    }
 }
 
 uint32_t BiliApi::timeStamp() {
-    std::string recvdata;
-    HttpsRequest req;
-    req.url = "/xlive/open-interface/v1/rtc/getTimestamp";
-    req.method = HttpsMethod::GET;
-    req.header = HttpsClient::default_header;
-    connection.writeread(req, nullptr, recvdata);
-
-    const std::string str_timestamp = "\"timestamp\":";
     uint32_t ret = 0;
-    read_json(recvdata, str_timestamp, 0, ret);
+    JsonExtractor json;
+    json.on_number("data.timestamp", [&ret] (int64_t value) { ret = static_cast<uint32_t>(value); });
+    auto sent = std::chrono::steady_clock::now();
+    connection->writeread(timestamp_template.fill(), [&json] (const char *data, size_t len) { json.feed(data, len); });
+    json.finish();
+    // the round trip bounds when the server read its clock, which syncs the clock of every account
+    ServerClock::of(host).observe(ret, sent, std::chrono::steady_clock::now());
     return ret;
 }
 
-void BiliApi::fansMedal(std::vector<uint32_t> &room_id) {
-    std::string recvdata;
-    HttpsRequest req;
-    // change page_size if the total number is greater than 30
-    req.url = "/xlive/app-ucenter/v1/fansMedal/panel?page=1&page_size=30";
-    req.method = HttpsMethod::GET;
-    req.header = HttpsClient::default_header;
-    connection.writeread(req, nullptr, recvdata);
+uint32_t BiliApi::server_time() {
+    std::optional<int64_t> now = ServerClock::of(host).now();
+    return now ? static_cast<uint32_t>(*now) : timeStamp();
+}
+
+PreparedRequest BiliApi::medal_request(size_t page) const {
+    return medal_template.fill({std::to_string(page)});
+}
+
+void BiliApi::fansMedal(const std::function<void(const Medal &medal)> &on_medal) {
+    std::vector<Medal> first;
+    int64_t total = 0;
+    JsonExtractor json;
+    ExpPlanner::parse(json, first);
+    json.on_number("data.total_number", [&total] (int64_t value) { total = value; });
+    connection->writeread(medal_request(1), [&json] (const char *data, size_t len) { json.feed(data, len); });
+    json.finish();
+
+    // the pages after the first complete in the reactor thread, in any order, and are handed over here
+    struct Pages {
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<std::vector<Medal>> ready;
+        size_t left;
+        std::exception_ptr error;
+    };
+    struct Page {
+        JsonExtractor json;
+        std::vector<Medal> medals;
+    };
+    size_t pages = total > 0 ? (static_cast<size_t>(total) + MEDAL_PAGE_SIZE - 1) / MEDAL_PAGE_SIZE : 1;
+    auto state = std::make_shared<Pages>();
+    state->left = pages - 1;
+    for (size_t i = 2; i <= pages; ++i) {
+        auto page = std::make_shared<Page>();
+        ExpPlanner::parse(page->json, page->medals);
+        connection->submit(medal_request(i), [page] (const char *data, size_t len) {
+            page->json.feed(data, len);
+        }, [state, page] (std::exception_ptr error, HttpsResponse &response) {
+            if (!error && response.status / 100 != 2) {
+                error = status_error(response.status);
+            }
+            if (!error) {
+                try {
+                    page->json.finish();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+            std::lock_guard<std::mutex> lock(state->m);
+            if (error) {
+                state->error = state->error ? state->error : error;
+            } else {
+                state->ready.push_back(std::move(page->medals));
+            }
+            --state->left;
+            state->cv.notify_one();
+        });
+    }
 
-    const std::string str_roomid = "\"room_id\":";
-    uint32_t id = 0;
-    size_t pos = read_json(recvdata, str_roomid, 0, id);
-    while (pos != std::string::npos) {
-        room_id.push_back(id);
-        pos = read_json(recvdata, str_roomid, pos, id);
+    for (const Medal &medal : first) {
+        on_medal(medal);
+    }
+    std::unique_lock<std::mutex> lock(state->m);
+    while (true) {
+        state->cv.wait(lock, [&state] { return state->left == 0 || !state->ready.empty(); });
+        if (state->ready.empty()) {
+            break;
+        }
+        std::vector<Medal> medals = std::move(state->ready.front());
+        state->ready.pop_front();
+        lock.unlock();
+        for (const Medal &medal : medals) {
+            on_medal(medal);
+        }
+        lock.lock();
+    }
+    if (state->error) {
+        std::rethrow_exception(state->error);
     }
 }
 
+void BiliApi::fansMedal(std::vector<uint32_t> &room_id) {
+    fansMedal([&room_id] (const Medal &medal) { room_id.push_back(medal.roomid); });
+}
+
+PreparedRequest BiliApi::like_request(const uint32_t roomid, const uint32_t ts) const {
+    return like_template.fill({std::to_string(roomid), std::to_string(ts)});
+}
+
 void BiliApi::likeRoom(const uint32_t roomid) {
     std::string recvdata;
-    HttpsRequest req;
-    req.url = "/xlive/app-ucenter/v1/like_info_v3/like/likeReportV3";
-    req.method = HttpsMethod::POST;
-    req.header = HttpsClient::default_header;
+    connection->writeread(like_request(roomid, server_time()), recvdata);
+}
 
-    Form form = {
-        {"room_id", std::to_string(roomid)},
-        {"anchor_id", anchor_id},
-        {"ts", std::to_string(timeStamp())},
-        {"csrf", csrf_token},
-        {"csrf_token", csrf_token},
-        {"visit_id", ""}
-    };
-    FormUrlencoded data(form, req.header);
+PreparedRequest BiliApi::play_info_request(const uint32_t roomid) const {
+    return play_info_template.fill({std::to_string(roomid)});
+}
+
+PreparedRequest BiliApi::entry_request(const uint32_t roomid) const {
+    return entry_template.fill({std::to_string(roomid)});
+}
 
-    connection.writeread(req, data.c_str(), recvdata);
+PreparedRequest BiliApi::heartbeat_request(const uint32_t roomid) const {
+    return heartbeat_template.fill({std::to_string(roomid)});
+}
+
+PreparedRequest BiliApi::danmu_info_request(const uint32_t roomid) const {
+    return danmu_info_template.fill({std::to_string(roomid)});
 }
 
 uint32_t BiliApi::roomPlayInfo(const uint32_t roomid) {
-    std::string recvdata;
-    HttpsRequest req;
-    req.url = "/xlive/web-room/v2/index/getRoomPlayInfo?room_id=" + std::to_string(roomid);
-    req.method = HttpsMethod::GET;
-    req.header = HttpsClient::default_header;
-    connection.writeread(req, nullptr, recvdata);
+    uint32_t ret = 0;
+    JsonExtractor json;
+    json.on_number("data.live_status", [&ret] (int64_t value) { ret = static_cast<uint32_t>(value); });
+    connection->writeread(play_info_request(roomid), [&json] (const char *data, size_t len) { json.feed(data, len); });
+    json.finish();
+    return ret;
+}
 
-    const std::string str_live_status = "\"live_status\":";
+uint32_t BiliApi::parse_live_status(const std::string &recvdata) {
     uint32_t ret = 0;
-    read_json(recvdata, str_live_status, 0, ret);
+    JsonExtractor json;
+    json.on_number("data.live_status", [&ret] (int64_t value) { ret = static_cast<uint32_t>(value); });
+    json.feed(recvdata.data(), recvdata.length());
+    json.finish();
     return ret;
 }
 
+std::string BiliApi::parse_danmu_token(const std::string &recvdata) {
+    std::string token;
+    JsonExtractor json;
+    json.on_string("data.token", [&token] (const std::string &value) { token = value; });
+    json.feed(recvdata.data(), recvdata.length());
+    json.finish();
+    return token;
+}
+
 void BiliApi::enterRoom(const uint32_t roomid) {
     std::string recvdata;
-    HttpsRequest req;
-    req.url = "/xlive/web-room/v1/index/roomEntryAction";
-    req.method = HttpsMethod::POST;
-    req.header = HttpsClient::default_header;
-
-    Form form = {
-        {"room_id", std::to_string(roomid)},
-        {"platform", "pc"},
-        {"csrf_token", csrf_token},
-        {"csrf", csrf_token},
-        {"visit_id", ""}
-    };
-    FormUrlencoded data(form, req.header);
-
-    connection.writeread(req, data.c_str(), recvdata);
+    connection->writeread(entry_request(roomid), recvdata);
 }
 
 void BiliApi::heartBeat(const uint32_t room_id) {
     std::string recvdata;
-    HttpsRequest req;
-    req.url = "/relation/v1/Feed/heartBeat";
-    req.method = HttpsMethod::GET;
-    req.header = HttpsClient::default_header;
-    req.header.emplace("Origin", "https://www.bilibili.com");
-    req.header.emplace("Referer", "https://live.bilibili.com/" + std::to_string(room_id));
-    connection.writeread(req, nullptr, recvdata);
+    connection->writeread(heartbeat_request(room_id), recvdata);
 }
 
-void BiliApi::getExp(const uint32_t roomid) {
-    bullet_chat(roomid, "1");
-    likeRoom(roomid);
-    std::cout << "Room id = " << roomid << " bullet chat and like sent" << std::endl;
-    bool live = false;
-    return;
-    while (true) {
-        uint32_t status = roomPlayInfo(roomid);
-        if (live) {
-            if (status == 1) {
-                heartBeat(roomid);
-                std::this_thread::sleep_for(std::chrono::seconds(30));
-            } else {
-                live = false;
-                std::cout << "Room id = " << roomid << " ends the stream." << std::endl;
+void BiliApi::getExp(const uint32_t roomid, uint8_t actions) {
+    uint32_t done = checkpoint != nullptr ? checkpoint->done(uid(), roomid) : 0;
+    // the steps earning nothing more count as done
+    if (!(actions & EXP_CHAT)) {
+        done |= Checkpoint::CHAT;
+    }
+    if (!(actions & EXP_LIKE)) {
+        done |= Checkpoint::LIKE;
+    }
+    if ((done & Checkpoint::CHAT) && (done & Checkpoint::LIKE)) {
+        std::cout << "Room id = " << roomid << " bullet chat and like already sent today" << std::endl;
+        return;
+    }
+    // the like takes the server time from the shared clock, so it no longer waits for the chat and a getTimestamp
+    // and both are pipelined in one round trip
+    std::vector<PreparedRequest> requests;
+    std::vector<Checkpoint::Step> steps;
+    if (!(done & Checkpoint::CHAT)) {
+        requests.push_back(chat_request(roomid, "1"));
+        steps.push_back(Checkpoint::CHAT);
+    }
+    if (!(done & Checkpoint::LIKE)) {
+        requests.push_back(like_request(roomid, server_time()));
+        steps.push_back(Checkpoint::LIKE);
+    }
+    std::vector<std::future<std::string>> responses = connection->async_writeread_batch(std::move(requests));
+    std::exception_ptr first;
+    for (size_t i = 0; i < responses.size(); ++i) {
+        try {
+            responses[i].get();
+            if (checkpoint != nullptr) {
+                checkpoint->mark(uid(), roomid, steps[i]);
             }
-        } else if (status == 1) {
-            std::cout << "Room id = " << roomid << " starts the stream." << std::endl;
-            enterRoom(roomid);
-            live = true;
+        } catch (...) {
+            first = first ? first : std::current_exception();
         }
-        std::this_thread::sleep_for(std::chrono::seconds(10));
     }
+    if (first) {
+        std::rethrow_exception(first);
+    }
+    const char *sent = steps.size() == 2 ? "bullet chat and like" : steps[0] == Checkpoint::CHAT ? "bullet chat" : "like";
+    std::cout << "Room id = " << roomid << " " << sent << " sent" << std::endl;
 }
@@ -9,8 +9,14 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <functional>
 
 #include "https.h"
+#include "planner.h"
+
+class JsonExtractor;
+class Checkpoint;
 
 class Bilibili {
 public:
@@ -24,22 +30,75 @@ private:
 
 class BiliApi {
 public:
+    // open a dedicated connection for the account
     BiliApi(const std::string &cookie);
+    // issue the requests of the account through a connection shared with other accounts
+    BiliApi(const std::string &cookie, std::shared_ptr<HttpsClient> connection);
     ~BiliApi() = default;
+    static const std::string host;
     void bullet_chat(const uint32_t roomid, const std::string &msg);
+    // recvdata is left empty if the checkpoint tells that the account has signed today
     void sign(std::string &recvdata);
     uint32_t timeStamp();
+    /**
+     * call on_medal with each medal, page by page as soon as each page is parsed
+     * the first page tells how many medals there are, and the other pages are then requested at once
+     */
+    void fansMedal(const std::function<void(const Medal &medal)> &on_medal);
+    // the rooms of all medals, whatever is left to do in them
     void fansMedal(std::vector<uint32_t> &room_id);
     void likeRoom(const uint32_t roomid);
     uint32_t roomPlayInfo(const uint32_t roomid);
     void enterRoom(const uint32_t roomid);
     void heartBeat(const uint32_t roomid);
-    void getExp(const uint32_t roomid);
+    // send the chat and the like among actions, the steps the checkpoint records as done today are skipped
+    void getExp(const uint32_t roomid, uint8_t actions = EXP_ALL);
+
+    // record the progress of the account in checkpoint, which must outlive the api, nullptr records nothing
+    void set_checkpoint(Checkpoint *checkpoint) { this->checkpoint = checkpoint; }
+
+    // the requests of roomPlayInfo, enterRoom and heartBeat, for callers driving rooms asynchronously
+    PreparedRequest play_info_request(const uint32_t roomid) const;
+    PreparedRequest entry_request(const uint32_t roomid) const;
+    PreparedRequest heartbeat_request(const uint32_t roomid) const;
+
+    // the request of the token authenticating a subscription to the broadcast of roomid
+    PreparedRequest danmu_info_request(const uint32_t roomid) const;
+
+    // read the live status from the response of roomPlayInfo, 1 when the room is streaming
+    static uint32_t parse_live_status(const std::string &recvdata);
+
+    // read the token from the response of danmu_info_request
+    static std::string parse_danmu_token(const std::string &recvdata);
+
+    // the user id of the account
+    uint64_t uid() const { return std::stoull(anchor_id); }
+
+    // the client issuing the requests of the account
+    const std::shared_ptr<HttpsClient> &client() const { return connection; }
 private:
-    static const std::string host;
-    HttpsClient connection;
+    // fill in the method, url, default header and cookie of the account
+    HttpsRequest request(HttpsMethod method, const std::string &url) const;
+
+    // fill in the templates of bullet_chat and likeRoom, so that they can also be sent in a batch
+    PreparedRequest chat_request(const uint32_t roomid, const std::string &msg) const;
+    PreparedRequest like_request(const uint32_t roomid, const uint32_t ts) const;
+
+    // the request of one page of fansMedal
+    PreparedRequest medal_request(size_t page) const;
+
+    // the server time estimated by the clock of the host, or asked with timeStamp() if the clock is not synced
+    uint32_t server_time();
+
+    std::shared_ptr<HttpsClient> connection;
+    std::string cookie;
     std::string csrf_token;
     std::string anchor_id;
+    Checkpoint *checkpoint = nullptr;
+
+    // the request to each endpoint with the header, cookie and csrf token of the account, serialized once
+    RequestTemplate sign_template, timestamp_template, medal_template, chat_template, like_template;
+    RequestTemplate play_info_template, entry_template, heartbeat_template, danmu_info_template;
 };
 
 #endif /* _BILIBILI_H_ */
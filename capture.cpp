@@ -0,0 +1,55 @@
+#include <fstream>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+
+#include "capture.h"
+
+static std::mutex capture_mutex;
+static std::ofstream corpus;
+static std::atomic<bool> enabled(false);
+
+void capture_open(const std::string &path) {
+    std::lock_guard<std::mutex> lock(capture_mutex);
+    corpus.open(path, std::ios::binary | std::ios::app);
+    if (!corpus) {
+        throw std::runtime_error("Fail to open " + path);
+    }
+    enabled = true;
+}
+
+bool capture_enabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void capture_write(const std::string &label, const std::string &bytes) {
+    std::lock_guard<std::mutex> lock(capture_mutex);
+    corpus << label << '\t' << bytes.length() << '\n';
+    corpus.write(bytes.data(), static_cast<std::streamsize>(bytes.length()));
+    corpus << '\n';
+    corpus.flush();
+}
+
+std::vector<CapturedResponse> capture_load(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Fail to open " + path);
+    }
+    std::vector<CapturedResponse> responses;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t tab = line.rfind('\t');
+        if (tab == std::string::npos) {
+            throw std::runtime_error(path + ": malformed record " + std::to_string(responses.size()));
+        }
+        CapturedResponse response;
+        response.label = line.substr(0, tab);
+        response.bytes.resize(std::stoul(line.substr(tab + 1)));
+        in.read(&response.bytes[0], static_cast<std::streamsize>(response.bytes.length()));
+        if (!in || in.get() != '\n') {
+            throw std::runtime_error(path + ": truncated record " + std::to_string(responses.size()));
+        }
+        responses.push_back(std::move(response));
+    }
+    return responses;
+}
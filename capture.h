@@ -0,0 +1,34 @@
+/**
+ * capture.h
+ *
+ * Header file for the recording of raw responses into a corpus, replayed by the micro-benchmarks
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <string>
+#include <vector>
+
+// the bytes of one response as they arrived, head and body, with the request line it answers
+typedef struct {
+    std::string label;
+    std::string bytes;
+} CapturedResponse;
+
+/**
+ * Append every response received afterwards to the corpus file at path, throws if it cannot be opened.
+ * Each record is "<label>\t<length>\n", the raw bytes and "\n".
+ */
+void capture_open(const std::string &path);
+
+// whether responses are being recorded
+bool capture_enabled();
+
+// append one response to the corpus, can be called from any thread
+void capture_write(const std::string &label, const std::string &bytes);
+
+// read every response of the corpus file at path, throws if it cannot be read or is malformed
+std::vector<CapturedResponse> capture_load(const std::string &path);
+
+#endif /* _CAPTURE_H_ */
@@ -0,0 +1,119 @@
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+
+#include "checkpoint.h"
+
+// the header takes the first record slots
+static const char MAGIC[8] = {'B', 'I', 'L', 'I', 'C', 'K', 'P', '1'};
+static const size_t HEADER = 64;
+
+// the api resets the daily exp at midnight of Beijing time
+static uint32_t today() {
+    return static_cast<uint32_t>((time(NULL) + 8 * 3600) / 86400);
+}
+
+// the key of the record of a room, never 0 which marks a free slot
+static uint64_t record_key(uint64_t uid, uint32_t roomid) {
+    uint64_t x = uid * 0x9e3779b97f4a7c15ULL ^ roomid;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x == 0 ? 1 : x;
+}
+
+Checkpoint::Checkpoint(const std::string &path) : size(HEADER + CAPACITY * 2 * sizeof(uint64_t)) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        throw std::runtime_error("Fail to open " + path);
+    }
+    // another process may be creating the file at the same time
+    flock(fd, LOCK_EX);
+    struct stat st;
+    char magic[sizeof(MAGIC)] = {};
+    bool valid = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == size &&
+                 pread(fd, magic, sizeof(magic), 0) == static_cast<ssize_t>(sizeof(magic)) &&
+                 memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    if (!valid) {
+        if (st.st_size != 0) {
+            std::cerr << path << " is not a checkpoint of this version, starting over" << std::endl;
+        }
+        // the magic is written last, so that a crash in the middle leaves a file that is made again
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, static_cast<off_t>(size)) == -1 ||
+            fsync(fd) == -1 || pwrite(fd, MAGIC, sizeof(MAGIC), 0) != static_cast<ssize_t>(sizeof(MAGIC))) {
+            flock(fd, LOCK_UN);
+            close(fd);
+            throw std::runtime_error("Fail to initialize " + path);
+        }
+    }
+    flock(fd, LOCK_UN);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Fail to map " + path);
+    }
+    records = reinterpret_cast<uint64_t *>(static_cast<char *>(p) + HEADER);
+}
+
+Checkpoint::~Checkpoint() {
+    msync(reinterpret_cast<char *>(records) - HEADER, size, MS_ASYNC);
+    munmap(reinterpret_cast<char *>(records) - HEADER, size);
+    close(fd);
+}
+
+uint64_t *Checkpoint::slot(uint64_t key) const {
+    // open addressing with linear probing, records are never removed so a free slot ends the probe
+    size_t start = static_cast<size_t>(key % CAPACITY);
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        uint64_t *record = records + 2 * ((start + i) % CAPACITY);
+        uint64_t found = __atomic_load_n(record, __ATOMIC_ACQUIRE);
+        if (found == key || found == 0) {
+            return record;
+        }
+    }
+    return nullptr;
+}
+
+uint32_t Checkpoint::done(uint64_t uid, uint32_t roomid) const {
+    uint64_t key = record_key(uid, roomid);
+    uint64_t *record = slot(key);
+    if (record == nullptr || __atomic_load_n(record, __ATOMIC_ACQUIRE) != key) {
+        return 0;
+    }
+    uint64_t state = __atomic_load_n(record + 1, __ATOMIC_ACQUIRE);
+    return static_cast<uint32_t>(state >> 32) == today() ? static_cast<uint32_t>(state) : 0;
+}
+
+void Checkpoint::mark(uint64_t uid, uint32_t roomid, Step step) {
+    uint64_t key = record_key(uid, roomid);
+    uint64_t *record;
+    while ((record = slot(key)) != nullptr) {
+        uint64_t expected = 0;
+        // claim the free slot, unless another thread or process has just claimed it
+        if (__atomic_load_n(record, __ATOMIC_ACQUIRE) == key ||
+            __atomic_compare_exchange_n(record, &expected, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+            expected == key) {
+            break;
+        }
+    }
+    if (record == nullptr) {
+        return;
+    }
+    uint64_t day = today();
+    uint64_t state = __atomic_load_n(record + 1, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        // the steps of an earlier day are forgotten
+        uint64_t steps = (state >> 32) == day ? (state & 0xffffffffULL) : 0;
+        next = day << 32 | steps | step;
+    } while (!__atomic_compare_exchange_n(record + 1, &state, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
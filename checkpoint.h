@@ -0,0 +1,57 @@
+/**
+ * checkpoint.h
+ *
+ * Header file for the progress of the accounts through the day, kept in a memory-mapped file
+ */
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * The steps done today for each room of each account, so that a run started again skips them without any request.
+ * Each record is two aligned 8-byte words of a shared mapping updated with atomic operations:
+ * a record is never torn when the process crashes, and processes sharing the file see each other's progress at once.
+ * Records from earlier days are reused in place, the day being that of Beijing time when the api resets.
+ */
+class Checkpoint {
+public:
+    // the steps of a room, and of the account itself under room 0
+    enum Step : uint32_t {
+        CHAT = 1,
+        LIKE = 2,
+        SIGN = 1,
+        // every room of the account has earned its exp
+        ROOMS = 2
+    };
+
+    // the number of records the file holds, enough for every medal of thousands of accounts
+    static const size_t CAPACITY = 1 << 16;
+
+    // open the file at path, creating it if needed, throws if it cannot be mapped
+    explicit Checkpoint(const std::string &path);
+    ~Checkpoint();
+
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+
+    // the steps done today for the room of the account
+    uint32_t done(uint64_t uid, uint32_t roomid) const;
+    bool done(uint64_t uid, uint32_t roomid, Step step) const { return (done(uid, roomid) & step) != 0; }
+
+    // record step as done today, nothing is recorded if the file is full
+    void mark(uint64_t uid, uint32_t roomid, Step step);
+private:
+    // the slot of the record of key, or of the free slot where it goes, nullptr if the file is full
+    uint64_t *slot(uint64_t key) const;
+
+    int fd;
+    size_t size;
+    // the records, each a key and a state made of the day and the steps
+    uint64_t *records;
+};
+
+#endif /* _CHECKPOINT_H_ */
@@ -0,0 +1,720 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <openssl/err.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+#include <errno.h>
+
+#include "connection.h"
+#include "tls.h"
+#include "net.h"
+#include "capture.h"
+#include "limiter.h"
+#include "http2.h"
+
+Connection::Connection(Reactor &reactor, SSL_CTX *ctx, const std::string &host, bool http2)
+    : reactor(reactor), ctx(ctx), host(host), metrics(metrics_host(host)), clock(ServerClock::of(host)),
+      established_once(false), state(State::CLOSED), ssl(NULL), sockfd(-1), interest(0), driving(false), written(0),
+      pending_write(0), early_data(0), sent_early(false), ktls_send(false), _keep_alive(0), closing(false), http2(http2) {}
+
+Connection::~Connection() {
+    shutdown();
+}
+
+void Connection::establish(std::function<void(std::exception_ptr)> done) {
+    on_established = std::move(done);
+    ++metrics.connects;
+    if (established_once) {
+        ++metrics.reconnects;
+    }
+    state = State::CONNECTING;
+    std::weak_ptr<Connection> self = shared_from_this();
+    connecting = tcp_connect(reactor, host, 443, [self] (std::exception_ptr error, int fd) {
+        if (auto c = self.lock()) {
+            c->connected(error, fd);
+        } else if (fd != -1) {
+            ::close(fd);
+        }
+    });
+}
+
+void Connection::connected(std::exception_ptr error, int fd) {
+    connecting.reset();
+    if (error) {
+        fail(error);
+        return;
+    }
+    sockfd = fd;
+    phase_start = std::chrono::steady_clock::now();
+    try {
+        ssl = SSL_new(ctx);
+        if (ssl == NULL) {
+            throw std::runtime_error("SSL_new fails");
+        }
+        SSL_set_fd(ssl, sockfd);
+        SSL_set_connect_state(ssl);
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        if (http2 && SSL_set_alpn_protos(ssl, h2::ALPN, h2::ALPN_LENGTH) != 0) {
+            throw std::runtime_error("SSL_set_alpn_protos fails");
+        }
+        early_data = tls_resume(ssl, host);
+        if (http2) {
+            // early data would have to be written in the protocol the server is yet to select
+            early_data = 0;
+        }
+        sent_early = false;
+
+        state = State::HANDSHAKE;
+        interest = EPOLLOUT;
+        std::weak_ptr<Connection> self = shared_from_this();
+        reactor.add(sockfd, interest, [self] (uint32_t) {
+            if (auto c = self.lock()) {
+                c->drive();
+            }
+        });
+    } catch (...) {
+        fail(std::current_exception());
+        return;
+    }
+    drive();
+}
+
+void Connection::re_establish() {
+    shutdown();
+    establish(nullptr);
+}
+
+void Connection::submit(std::shared_ptr<Exchange> exchange) {
+    exchange->connection = shared_from_this();
+    if (h2 && state == State::READY && queue.empty() && h2->can_start()) {
+        // a new stream goes out with the next write, whatever the other streams wait for
+        h2->start(std::move(exchange));
+        drive();
+        return;
+    }
+    queue.push_back(std::move(exchange));
+    if (state == State::CLOSED) {
+        // the server has closed the idle connection
+        establish(nullptr);
+    } else if (state == State::READY) {
+        drive();
+    }
+}
+
+void Connection::close() {
+    fail(std::make_exception_ptr(std::runtime_error("Connection closed")));
+}
+
+void Connection::abandon(const std::shared_ptr<Exchange> &exchange) {
+    exchange->cancelled = true;
+    if (h2 && h2->cancel(exchange)) {
+        // the other streams go on, the reset goes out with the next write
+        drive();
+        return;
+    }
+    // a request not written yet is dropped before its turn to be written comes,
+    // and one behind others waits for their responses, which are still wanted
+    if (!queue.empty() && queue.front() == exchange && exchange->sent > 0) {
+        abandon_front();
+    }
+}
+
+bool Connection::abandon_front() {
+    // closing would lose the requests written behind it which are not idempotent, its response is discarded instead
+    for (auto &other : queue) {
+        if (other != queue.front() && other->sent > 0 && !other->idempotent) {
+            return false;
+        }
+    }
+    // responses come in order, so the only way past this one is another connection,
+    // the server has processed none of the requests behind it, which are sent again as never written
+    queue.pop_front();
+    std::deque<std::shared_ptr<Exchange>> unanswered = take_unanswered();
+    shutdown();
+    Batch batch;
+    for (auto &exchange : unanswered) {
+        if (!exchange->cancelled) {
+            exchange->sent = 0;
+            batch.push_back(exchange);
+        }
+    }
+    resend(std::move(batch));
+    return true;
+}
+
+void Connection::drop_cancelled() {
+    // the bytes of a write to repeat have been taken by tls already
+    size_t covered = pending_write;
+    bool dropped = false;
+    for (size_t i = written; i < queue.size();) {
+        Exchange &exchange = *queue[i];
+        if (covered > 0) {
+            covered -= std::min(covered, exchange.request.length() - exchange.sent);
+        } else if (exchange.cancelled && exchange.sent == 0) {
+            // the request after it waits for the same response it would have
+            if (!exchange.pipelined && i + 1 < queue.size()) {
+                queue[i + 1]->pipelined = false;
+            }
+            queue.erase(queue.begin() + static_cast<std::ptrdiff_t>(i));
+            dropped = true;
+            continue;
+        }
+        ++i;
+    }
+    if (dropped && queue.empty()) {
+        notify();
+    }
+}
+
+size_t Connection::pending() const {
+    return queue.size() + refused.size() + (h2 ? h2->active() : 0);
+}
+
+bool Connection::accepting() const {
+    return state == State::READY && queue.empty() && (h2 ? h2->can_start() : true);
+}
+
+std::deque<std::shared_ptr<Exchange>> Connection::take_unanswered() {
+    std::deque<std::shared_ptr<Exchange>> unanswered;
+    if (h2) {
+        for (auto &exchange : h2->take_unanswered()) {
+            unanswered.push_back(std::move(exchange));
+        }
+    }
+    unanswered.insert(unanswered.end(), refused.begin(), refused.end());
+    unanswered.insert(unanswered.end(), queue.begin(), queue.end());
+    refused.clear();
+    queue.clear();
+    return unanswered;
+}
+
+void Connection::shutdown() {
+    connecting.reset();
+    if (ssl != NULL) {
+        if (state == State::READY) {
+            if (h2) {
+                // tell the server, as far as the socket takes it at once
+                h2->go_away();
+                PooledBuffer sendbuf;
+                size_t len = h2->gather(sendbuf.data(), sendbuf.size());
+                ERR_clear_error();
+                SSL_write(ssl, sendbuf.data(), static_cast<int>(len));
+            }
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        ssl = NULL;
+    }
+    if (sockfd != -1) {
+        reactor.remove(sockfd);
+        ::close(sockfd);
+        sockfd = -1;
+    }
+    state = State::CLOSED;
+    h2.reset();
+    interest = 0;
+    written = 0;
+    pending_write = 0;
+    early_data = 0;
+    ktls_send = false;
+    closing = false;
+}
+
+void Connection::fail(std::exception_ptr error) {
+    if (state != State::READY) {
+        ++metrics.failures;
+    }
+    std::deque<std::shared_ptr<Exchange>> failed = take_unanswered();
+    shutdown();
+    if (on_established) {
+        auto done = std::move(on_established);
+        on_established = nullptr;
+        done(error);
+    }
+    for (auto &exchange : failed) {
+        finish_exchange(*exchange, error);
+    }
+    notify();
+}
+
+void Connection::drive() {
+    // a callback may submit another request to this connection, which is served by the running loop
+    if (driving) {
+        return;
+    }
+    driving = true;
+    uint32_t want = 0;
+    try {
+        if (state == State::HANDSHAKE && early_data > 0) {
+            want = write_early_data();
+        }
+        if (state == State::HANDSHAKE && early_data == 0) {
+            ERR_clear_error();
+            int ret = SSL_connect(ssl);
+            if (ret == 1) {
+                state = State::READY;
+                _last_used = std::chrono::steady_clock::now();
+                metrics.tls.record(_last_used - phase_start);
+                established_once = true;
+                ktls_send = tls_ktls_send(ssl);
+                metrics.ktls_send += ktls_send;
+                metrics.ktls_recv += tls_ktls_recv(ssl);
+                if (sent_early && SSL_get_early_data_status(ssl) != SSL_EARLY_DATA_ACCEPTED) {
+                    // the server has dropped the early data, write the requests again
+                    for (auto &exchange : queue) {
+                        exchange->sent = 0;
+                    }
+                    written = 0;
+                }
+                const unsigned char *alpn;
+                unsigned int alpn_length;
+                SSL_get0_alpn_selected(ssl, &alpn, &alpn_length);
+                if (alpn_length == 2 && memcmp(alpn, "h2", 2) == 0) {
+                    h2 = std::make_shared<Http2Session>(
+                        [this] (std::shared_ptr<Exchange> exchange, std::exception_ptr error) {
+                            answered(std::move(exchange), error);
+                        },
+                        [this] (std::shared_ptr<Exchange> exchange) { refused.push_back(std::move(exchange)); });
+                }
+                if (on_established) {
+                    auto done = std::move(on_established);
+                    on_established = nullptr;
+                    done(nullptr);
+                }
+            } else {
+                switch (SSL_get_error(ssl, ret)) {
+                    case SSL_ERROR_WANT_READ:
+                        want = EPOLLIN;
+                        break;
+                    case SSL_ERROR_WANT_WRITE:
+                        want = EPOLLOUT;
+                        break;
+                    default:
+                        throw std::runtime_error("ssl connect fails");
+                }
+            }
+        }
+        if (state == State::READY) {
+            want = h2 ? transfer_h2() : transfer();
+        }
+    } catch (...) {
+        driving = false;
+        fail(std::current_exception());
+        return;
+    }
+    driving = false;
+    if (state != State::CLOSED && want != interest) {
+        interest = want;
+        reactor.modify(sockfd, interest);
+    }
+}
+
+// count the copy about to be written in the metrics of its endpoint if its request has been settled,
+// which must not happen for one that has not been written at all
+static void count_late(const Exchange &exchange) {
+    EndpointMetrics *m = exchange.request.metrics();
+    if (m != nullptr && exchange.cancelled && exchange.sent == 0) {
+        ++m->late_writes;
+    }
+}
+
+uint32_t Connection::write_early_data() {
+    PooledBuffer sendbuf;
+    drop_cancelled();
+    while (written < queue.size() && queue[written]->idempotent && (written == 0 || queue[written]->pipelined)) {
+        Exchange &exchange = *queue[written];
+        size_t left = exchange.request.length() - exchange.sent;
+        if (left > early_data) {
+            break;
+        }
+        size_t len = exchange.request.gather(exchange.sent, sendbuf.data(), sendbuf.size());
+        size_t n = 0;
+        ERR_clear_error();
+        if (SSL_write_early_data(ssl, sendbuf.data(), len, &n) == 1) {
+            pending_write = 0;
+            count_late(exchange);
+            exchange.sent += n;
+            early_data -= n;
+            sent_early = true;
+            if (exchange.sent == exchange.request.length()) {
+                exchange.written_at = std::chrono::steady_clock::now();
+                ++written;
+            }
+            continue;
+        }
+        switch (SSL_get_error(ssl, 0)) {
+            case SSL_ERROR_WANT_WRITE:
+                pending_write = len;
+                return EPOLLOUT;
+            case SSL_ERROR_WANT_READ:
+                pending_write = len;
+                return EPOLLIN;
+            default:
+                throw std::runtime_error("SSL_write_early_data fails");
+        }
+    }
+    // the rest waits for the handshake
+    early_data = 0;
+    return 0;
+}
+
+size_t Connection::gather(char *out, size_t len) const {
+    size_t copied = 0;
+    for (size_t i = written; i < queue.size() && (i == 0 || queue[i]->pipelined) && copied < len; ++i) {
+        const Exchange &exchange = *queue[i];
+        copied += exchange.request.gather(exchange.sent, out + copied, len - copied);
+    }
+    return copied;
+}
+
+size_t Connection::gather(struct iovec *iov, size_t count) const {
+    size_t filled = 0;
+    for (size_t i = written; i < queue.size() && (i == 0 || queue[i]->pipelined) && filled < count; ++i) {
+        const Exchange &exchange = *queue[i];
+        filled += exchange.request.segments(exchange.sent, iov + filled, count - filled);
+    }
+    return filled;
+}
+
+ssize_t Connection::send_plain() {
+    struct iovec iov[64];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = gather(iov, sizeof(iov) / sizeof(iov[0]));
+    ssize_t n;
+    do {
+        n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        return n;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return -1;
+    }
+    if (n == 0 || errno == EPIPE || errno == ECONNRESET) {
+        return 0;
+    }
+    throw std::runtime_error(std::string("sendmsg fails: ") + strerror(errno));
+}
+
+void Connection::advance(size_t n) {
+    while (n > 0) {
+        Exchange &exchange = *queue[written];
+        count_late(exchange);
+        size_t k = std::min(n, exchange.request.length() - exchange.sent);
+        exchange.sent += k;
+        n -= k;
+        if (exchange.sent == exchange.request.length()) {
+            exchange.written_at = std::chrono::steady_clock::now();
+            ++written;
+        }
+    }
+}
+
+uint32_t Connection::transfer() {
+    PooledBuffer sendbuf, recvbuf;
+    while (true) {
+        uint32_t want = 0;
+        bool progress = false;
+
+        // send data, pipelined requests are written without waiting for the responses before them
+        drop_cancelled();
+        while (written < queue.size() && (written == 0 || queue[written]->pipelined)) {
+            if (ktls_send) {
+                // the pieces of the requests go to the kernel as they are, without a copy into a record
+                ssize_t n = send_plain();
+                if (n > 0) {
+                    advance(static_cast<size_t>(n));
+                    progress = true;
+                    continue;
+                }
+                if (n == 0) {
+                    closed();
+                    return interest;
+                }
+                want |= EPOLLOUT;
+                break;
+            }
+            size_t len = gather(sendbuf.data(), sendbuf.size());
+            ERR_clear_error();
+            int ret = SSL_write(ssl, sendbuf.data(), static_cast<int>(len));
+            if (ret > 0) {
+                pending_write = 0;
+                advance(static_cast<size_t>(ret));
+                progress = true;
+                continue;
+            }
+            int err = SSL_get_error(ssl, ret);
+            if (err == SSL_ERROR_WANT_WRITE) {
+                pending_write = len;
+                want |= EPOLLOUT;
+            } else if (err == SSL_ERROR_WANT_READ) {
+                pending_write = len;
+                want |= EPOLLIN;
+            } else if (err == SSL_ERROR_ZERO_RETURN || err == SSL_ERROR_SYSCALL) {
+                // server side closes the connection
+                closed();
+                return interest;
+            } else {
+                throw std::runtime_error("SSL_write fails");
+            }
+            break;
+        }
+
+        // receive data, while idle this notices when the server closes the connection
+        ERR_clear_error();
+        int ret = SSL_read(ssl, recvbuf.data(), static_cast<int>(recvbuf.size()));
+        if (ret > 0) {
+            progress = true;
+            // bytes arriving while idle are not expected and discarded
+            const char *data = recvbuf.data();
+            size_t len = static_cast<size_t>(ret);
+            while (!queue.empty() && len > 0) {
+                Exchange &exchange = *queue.front();
+                if (!exchange.received_any) {
+                    exchange.first_byte = std::chrono::steady_clock::now();
+                    exchange.received_any = true;
+                }
+                size_t used = exchange.parser.feed(data, len, exchange.response);
+                exchange.received += used;
+                if (capture_enabled()) {
+                    exchange.captured.append(data, used);
+                }
+                data += used;
+                len -= used;
+                if (!exchange.parser.done()) {
+                    break;
+                }
+                if (complete()) {
+                    return interest;
+                }
+            }
+        } else {
+            int err = SSL_get_error(ssl, ret);
+            if (err == SSL_ERROR_WANT_READ) {
+                want |= EPOLLIN;
+            } else if (err == SSL_ERROR_WANT_WRITE) {
+                want |= EPOLLOUT;
+            } else if (err == SSL_ERROR_ZERO_RETURN || err == SSL_ERROR_SYSCALL) {
+                // server side closes the connection
+                closed();
+                return interest;
+            } else {
+                throw std::runtime_error("SSL_read fails");
+            }
+        }
+
+        if (!progress) {
+            return want;
+        }
+    }
+}
+
+uint32_t Connection::transfer_h2() {
+    // a callback may close the connection, which drops its session
+    std::shared_ptr<Http2Session> session = h2;
+    PooledBuffer sendbuf, recvbuf;
+    while (true) {
+        uint32_t want = 0;
+        bool progress = false;
+
+        // requests queued while the streams were all taken start as streams end
+        while (!queue.empty() && session->can_start()) {
+            std::shared_ptr<Exchange> exchange = std::move(queue.front());
+            queue.pop_front();
+            // the headers of a stream go out as soon as it starts, a cancelled request must not start
+            if (!exchange->cancelled) {
+                session->start(std::move(exchange));
+            }
+        }
+
+        // the frames of every stream go out together
+        while (session->has_output()) {
+            size_t len = session->gather(sendbuf.data(), sendbuf.size());
+            ERR_clear_error();
+            int ret = SSL_write(ssl, sendbuf.data(), static_cast<int>(len));
+            if (ret > 0) {
+                session->advance(static_cast<size_t>(ret));
+                progress = true;
+                continue;
+            }
+            int err = SSL_get_error(ssl, ret);
+            if (err == SSL_ERROR_WANT_WRITE) {
+                want |= EPOLLOUT;
+            } else if (err == SSL_ERROR_WANT_READ) {
+                want |= EPOLLIN;
+            } else if (err == SSL_ERROR_ZERO_RETURN || err == SSL_ERROR_SYSCALL) {
+                closed();
+                return interest;
+            } else {
+                throw std::runtime_error("SSL_write fails");
+            }
+            break;
+        }
+
+        ERR_clear_error();
+        int ret = SSL_read(ssl, recvbuf.data(), static_cast<int>(recvbuf.size()));
+        if (ret > 0) {
+            progress = true;
+            session->feed(recvbuf.data(), static_cast<size_t>(ret));
+            if (h2 != session) {
+                return interest;
+            }
+        } else {
+            int err = SSL_get_error(ssl, ret);
+            if (err == SSL_ERROR_WANT_READ) {
+                want |= EPOLLIN;
+            } else if (err == SSL_ERROR_WANT_WRITE) {
+                want |= EPOLLOUT;
+            } else if (err == SSL_ERROR_ZERO_RETURN || err == SSL_ERROR_SYSCALL) {
+                closed();
+                return interest;
+            } else {
+                throw std::runtime_error("SSL_read fails");
+            }
+        }
+
+        if (session->going_away() && session->active() == 0 && !session->has_output()) {
+            // the server has answered every stream it is going to, the rest goes to a new connection
+            closed();
+            return interest;
+        }
+        if (!progress) {
+            return want;
+        }
+    }
+}
+
+void Connection::answered(std::shared_ptr<Exchange> exchange, std::exception_ptr error) {
+    // the frames of a stream are not captured, the corpus holds http/1.1 responses for the parser
+    if (!error) {
+        _last_used = std::chrono::steady_clock::now();
+        clock.observe(exchange->response, exchange->written_at, exchange->first_byte);
+    }
+    finish_exchange(*exchange, error);
+    if (accepting()) {
+        notify();
+    }
+}
+
+void finish_exchange(Exchange &exchange, std::exception_ptr error) {
+    EndpointMetrics *m = exchange.request.metrics();
+    if (m != nullptr) {
+        auto now = std::chrono::steady_clock::now();
+        ++m->requests;
+        m->bytes_sent += exchange.sent;
+        m->bytes_received += exchange.received;
+        int status = error ? 0 : exchange.response.status;
+        ++m->status[status >= 100 && status < 600 ? status / 100 : 0];
+        if (!error) {
+            m->ttfb.record(exchange.first_byte - exchange.written_at);
+            m->body.record(now - exchange.first_byte);
+        }
+        m->total.record(now - exchange.submitted);
+    }
+    if (!error && exchange.request.throttle() != nullptr) {
+        RateLimiter::instance().observe(*exchange.request.throttle(), exchange.response);
+    }
+    exchange.callback(error, exchange.response);
+}
+
+// record the response of exchange, labelled with its method and path
+static void capture(const Exchange &exchange) {
+    char line[256];
+    std::string label(line, exchange.request.gather(0, line, sizeof(line)));
+    capture_write(label.substr(0, label.find_first_of("?\r")), exchange.captured);
+}
+
+bool Connection::complete() {
+    std::shared_ptr<Exchange> done = queue.front();
+    queue.pop_front();
+    if (capture_enabled()) {
+        capture(*done);
+    }
+    written = written > 0 ? written - 1 : 0;
+    _last_used = std::chrono::steady_clock::now();
+    keep_alive(done->response);
+    clock.observe(done->response, done->written_at, done->first_byte);
+    finish_exchange(*done, nullptr);
+    if (closing) {
+        // requests after this one go to a new connection, the server has processed none of them
+        for (auto &exchange : queue) {
+            exchange->sent = 0;
+        }
+        closed();
+        return true;
+    } else if (queue.empty()) {
+        notify();
+    } else if (queue.front()->cancelled && queue.front()->sent > 0) {
+        // the response of an abandoned request is next, and is not waited for if it can be avoided
+        return abandon_front();
+    }
+    return false;
+}
+
+void Connection::closed() {
+    // a response delimited by the end of the connection is complete
+    if (!queue.empty() && queue.front()->parser.eof()) {
+        std::shared_ptr<Exchange> done = queue.front();
+        queue.pop_front();
+        if (capture_enabled()) {
+            capture(*done);
+        }
+        finish_exchange(*done, nullptr);
+    }
+
+    std::deque<std::shared_ptr<Exchange>> unanswered = take_unanswered();
+    shutdown();
+
+    // a request fails if part of its response has arrived, if it has already been replayed once,
+    // or if it is not idempotent and has been written, since the server may have acted on it,
+    // and a cancelled one is no longer wanted at all
+    Batch replay;
+    for (auto &exchange : unanswered) {
+        if (exchange->cancelled) {
+            continue;
+        }
+        if (exchange->received_any) {
+            finish_exchange(*exchange, std::make_exception_ptr(std::runtime_error("Server closes connection during SSL_read")));
+        } else if (exchange->sent > 0 && (exchange->replayed || !exchange->idempotent)) {
+            finish_exchange(*exchange, std::make_exception_ptr(std::runtime_error("Server closes connection during SSL_write")));
+        } else {
+            exchange->replayed = exchange->replayed || exchange->sent > 0;
+            exchange->sent = 0;
+            replay.push_back(exchange);
+        }
+    }
+    resend(std::move(replay));
+}
+
+void Connection::resend(Batch batch) {
+    if (batch.empty()) {
+        // establish again lazily on the next request
+        notify();
+    } else if (on_orphans) {
+        on_orphans(std::move(batch));
+    } else {
+        queue.assign(batch.begin(), batch.end());
+        re_establish();
+    }
+}
+
+void Connection::keep_alive(const HttpsResponse &response) {
+    auto it = response.header.find("connection");
+    if (it != response.header.end() && ResponseParser::has_token(it->second, "close")) {
+        closing = true;
+    }
+    it = response.header.find("keep-alive");
+    if (it != response.header.end()) {
+        size_t pos = it->second.find("timeout=");
+        unsigned long timeout;
+        if (pos != std::string::npos && sscanf(it->second.c_str() + pos + 8, "%lu", &timeout) == 1) {
+            _keep_alive = std::chrono::seconds(timeout);
+        }
+    }
+}
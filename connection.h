@@ -0,0 +1,245 @@
+/**
+ * connection.h
+ *
+ * Header file for one non-blocking https connection driven by the reactor
+ */
+
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <chrono>
+
+#include <openssl/ssl.h>
+
+#include "https.h"
+#include "reactor.h"
+#include "parser.h"
+#include "metrics.h"
+#include "net.h"
+#include "servertime.h"
+
+class Connection;
+
+// one request waiting for its response on a connection
+typedef struct Exchange {
+    // the serialized request and how much of it has been written
+    PreparedRequest request;
+    size_t sent = 0;
+    // whether any byte of the response has arrived, a request is replayed only if not
+    bool received_any = false;
+    // whether the request has already been replayed on a new connection
+    bool replayed = false;
+    // whether the request may be written before the response of the previous one arrives
+    bool pipelined = false;
+    // whether sending the request twice is harmless, so that it may go out as tls early data,
+    // and be replayed after the server closes the connection without answering
+    bool idempotent = false;
+    // whether the request has been settled without this copy, which is then dropped wherever it waits,
+    // unless some of it has been written
+    bool cancelled = false;
+    ResponseParser parser;
+    HttpsResponse response;
+    // the raw bytes of the response, kept only while capture_enabled()
+    std::string captured;
+    HttpsClient::Callback callback;
+    // when the request was submitted and written completely, and when the first byte of the response arrived
+    std::chrono::steady_clock::time_point submitted, written_at, first_byte;
+    // the number of bytes of the response
+    size_t received = 0;
+    // the connection the request was last handed to
+    std::weak_ptr<Connection> connection;
+} Exchange;
+
+// record the exchange in the metrics of its endpoint and call its callback, error is nullptr on success
+void finish_exchange(Exchange &exchange, std::exception_ptr error);
+
+// requests sent together on one connection
+typedef std::vector<std::shared_ptr<Exchange>> Batch;
+
+class Http2Session;
+
+/**
+ * A tls connection using a non-blocking socket.
+ * Requests are served in the order of submit(), and consecutive pipelined requests are written back-to-back.
+ * If http/2 is offered and the server selects it with alpn, requests are multiplexed as streams instead,
+ * as many at once as the server allows, and answered in any order.
+ * All methods must be called in the reactor thread.
+ */
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    // http2 offers http/2 before http/1.1 in the handshake
+    explicit Connection(Reactor &reactor, SSL_CTX *ctx, const std::string &host, bool http2 = false);
+    ~Connection();
+
+    // start the tcp and ssl connection, done is called once the handshake completes or fails
+    void establish(std::function<void(std::exception_ptr)> done);
+
+    // queue a request, the connection is re-established first if the server has closed it
+    void submit(std::shared_ptr<Exchange> exchange);
+
+    // release ssl and socket resource, queued requests fail
+    void close();
+
+    /**
+     * forget exchange, whose response is no longer wanted, such as the slower copy of a hedged request
+     * its stream is reset over http/2, and over http/1.1 it is dropped if not written yet. Once written, the responses
+     * ahead of it are read first, and when its own is next the connection is closed, the requests queued behind it
+     * being sent again elsewhere, unless one of them that is not idempotent has been written:
+     * its response is then read and discarded
+     */
+    void abandon(const std::shared_ptr<Exchange> &exchange);
+
+    // called when the connection becomes idle or closed, so that the owner can hand out more requests
+    void set_listener(std::function<void()> fn) { listener = std::move(fn); }
+
+    /**
+     * called with the requests to send again when the server closes the connection before answering them,
+     * otherwise the connection re-establishes itself and sends them again
+     */
+    void set_orphan_handler(std::function<void(Batch)> fn) { on_orphans = std::move(fn); }
+
+    enum State { CLOSED, CONNECTING, HANDSHAKE, READY };
+    State get_state() const { return state; }
+
+    // the number of requests queued on the connection, or in flight on its streams
+    size_t pending() const;
+
+    // whether the connection is established and has no request to serve
+    bool idle() const { return state == State::READY && pending() == 0; }
+
+    // whether the connection takes another batch at once, when idle or when it has room for more streams
+    bool accepting() const;
+
+    // whether the server has selected http/2
+    bool multiplexed() const { return h2 != nullptr; }
+
+    // when the last response was received, or when the connection was established
+    std::chrono::steady_clock::time_point last_used() const { return _last_used; }
+
+    // the idle timeout announced by the server with "Keep-Alive: timeout=", zero if not announced
+    std::chrono::seconds keep_alive() const { return _keep_alive; }
+private:
+    // advance the state machine as far as the socket allows and update the events to wait for
+    void drive();
+
+    // write idempotent requests as early data during the handshake, return the events to wait for or 0 when done
+    uint32_t write_early_data();
+
+    // write and read the queued requests, return the events to wait for
+    uint32_t transfer();
+
+    // the same over the streams of http/2
+    uint32_t transfer_h2();
+
+    // the stream of exchange has ended with its response or with error
+    void answered(std::shared_ptr<Exchange> exchange, std::exception_ptr error);
+
+    // the requests not answered, on the streams, refused by the server or still queued, in this order
+    std::deque<std::shared_ptr<Exchange>> take_unanswered();
+
+    // copy the unsent bytes of the requests that may be written now into out, so that they go out in one record
+    size_t gather(char *out, size_t len) const;
+
+    // the same bytes as iovecs pointing into the requests, for a socket whose records the kernel sends
+    size_t gather(struct iovec *iov, size_t count) const;
+
+    // n bytes of what gather() returned have been written
+    void advance(size_t n);
+
+    /**
+     * write the requests gathered as plaintext to the socket, whose records the kernel sends
+     * return the number of bytes written, 0 if the server has closed the connection and -1 if the socket is full
+     */
+    ssize_t send_plain();
+
+    // the response at the front has been parsed, return true if the server asks to close the connection after it
+    bool complete();
+
+    // the server closes the connection, hand the unanswered requests over or replay them
+    void closed();
+
+    // the request at the front is cancelled and written, close the connection to send the rest again elsewhere
+    // unless that loses one of them, return whether the connection is closed
+    bool abandon_front();
+
+    // send the requests again, on another connection if the owner takes them, otherwise on this one re-established
+    void resend(Batch batch);
+
+    // drop the cancelled requests not written yet, except those in a write to repeat
+    void drop_cancelled();
+
+    // establish a new connection and replay the queued requests on it
+    void re_establish();
+
+    // the tcp connect has completed, start the handshake on sockfd
+    void connected(std::exception_ptr error, int fd);
+
+    // fail every queued request with error and close
+    void fail(std::exception_ptr error);
+
+    // release ssl and socket without touching the queue
+    void shutdown();
+
+    // remember the keep-alive parameters of the server from the response
+    void keep_alive(const HttpsResponse &response);
+
+    void notify() {
+        if (listener) {
+            listener();
+        }
+    }
+
+    Reactor &reactor;
+    SSL_CTX *ctx;
+    std::string host;
+    HostMetrics &metrics;
+    // fed with the Date header of every response
+    ServerClock &clock;
+    // when the current phase of the connection started, and whether it has ever been established
+    std::chrono::steady_clock::time_point phase_start;
+    bool established_once;
+
+    State state;
+    // resolving the host and racing its addresses while CONNECTING
+    std::shared_ptr<TcpConnect> connecting;
+    SSL *ssl;
+    int sockfd;
+    // the events currently waited for
+    uint32_t interest;
+    // whether drive() is running
+    bool driving;
+    // the number of requests at the front of the queue written completely
+    size_t written;
+    // the length of the write to repeat with the same bytes after it would block, 0 if none
+    size_t pending_write;
+    // how many bytes of early data the resumed session still allows
+    size_t early_data;
+    // whether any request has been written as early data
+    bool sent_early;
+    // whether the kernel sends the records, so that requests are written to the socket without SSL_write
+    bool ktls_send;
+
+    std::chrono::steady_clock::time_point _last_used;
+    std::chrono::seconds _keep_alive;
+    // whether the server asks to close the connection after the current response
+    bool closing;
+
+    // whether http/2 is offered, and the session once the server has selected it
+    bool http2;
+    std::shared_ptr<Http2Session> h2;
+    // the requests the server has refused to process on this connection
+    std::deque<std::shared_ptr<Exchange>> refused;
+
+    std::function<void()> listener;
+    std::function<void(Batch)> on_orphans;
+    std::function<void(std::exception_ptr)> on_established;
+    std::deque<std::shared_ptr<Exchange>> queue;
+};
+
+#endif /* _CONNECTION_H_ */
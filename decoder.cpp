@@ -0,0 +1,130 @@
+#include <strings.h>
+
+#include <stdexcept>
+
+#include "decoder.h"
+#include "parser.h"
+
+const char *const ContentDecoder::ACCEPT = "gzip, deflate, br";
+
+ContentDecoder::Coding ContentDecoder::coding(const std::string &name) {
+    if (name.empty() || strcasecmp(name.c_str(), "identity") == 0) {
+        return IDENTITY;
+    }
+    if (strcasecmp(name.c_str(), "gzip") == 0 || strcasecmp(name.c_str(), "x-gzip") == 0) {
+        return GZIP;
+    }
+    if (strcasecmp(name.c_str(), "deflate") == 0) {
+        return DEFLATE;
+    }
+    if (strcasecmp(name.c_str(), "br") == 0) {
+        return BROTLI;
+    }
+    throw std::runtime_error("Unsupported Content-Encoding " + name);
+}
+
+ContentDecoder::ContentDecoder(Coding coding) : _coding(coding) {
+    if (coding == BROTLI) {
+        brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+        if (brotli == NULL) {
+            throw std::runtime_error("BrotliDecoderCreateInstance fails");
+        }
+    }
+}
+
+ContentDecoder::~ContentDecoder() {
+    if (brotli != nullptr) {
+        BrotliDecoderDestroyInstance(brotli);
+    } else if (started) {
+        inflateEnd(&zstream);
+    }
+}
+
+void ContentDecoder::feed(const char *data, size_t len, const BodySink &out) {
+    if (len == 0) {
+        return;
+    }
+    switch (_coding) {
+        case IDENTITY:
+            out(data, len);
+            break;
+        case GZIP:
+        case DEFLATE:
+            feed_zlib(data, len, out);
+            break;
+        case BROTLI:
+            feed_brotli(data, len, out);
+            break;
+    }
+}
+
+void ContentDecoder::feed_zlib(const char *data, size_t len, const BodySink &out) {
+    if (!started) {
+        // a zlib header starts with the method 8 and a window of at most 32K
+        unsigned char first = static_cast<unsigned char>(data[0]);
+        bool zlib = (first & 0x0f) == 8 && (first >> 4) <= 7;
+        int window = _coding == GZIP ? 16 + MAX_WBITS : (zlib ? MAX_WBITS : -MAX_WBITS);
+        if (inflateInit2(&zstream, window) != Z_OK) {
+            throw std::runtime_error("inflateInit fails");
+        }
+        started = true;
+    }
+    PooledBuffer buf;
+    zstream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    zstream.avail_in = static_cast<uInt>(len);
+    while (zstream.avail_in > 0 || zstream.avail_out == 0) {
+        if (ended) {
+            // the members of a gzip body follow each other, anything after a deflate stream is ignored
+            if (_coding != GZIP || zstream.avail_in == 0) {
+                return;
+            }
+            inflateReset(&zstream);
+            ended = false;
+        }
+        zstream.next_out = reinterpret_cast<Bytef *>(buf.data());
+        zstream.avail_out = static_cast<uInt>(buf.size());
+        int ret = inflate(&zstream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            throw std::runtime_error(_coding == GZIP ? "Malformed gzip body" : "Malformed deflate body");
+        }
+        size_t n = buf.size() - zstream.avail_out;
+        if (n > 0) {
+            out(buf.data(), n);
+        }
+        ended = ret == Z_STREAM_END;
+        if (ret == Z_BUF_ERROR) {
+            break;
+        }
+    }
+}
+
+void ContentDecoder::feed_brotli(const char *data, size_t len, const BodySink &out) {
+    if (ended) {
+        return;
+    }
+    started = true;
+    PooledBuffer buf;
+    const uint8_t *next_in = reinterpret_cast<const uint8_t *>(data);
+    size_t avail_in = len;
+    BrotliDecoderResult ret = BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
+    while (ret == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+        uint8_t *next_out = reinterpret_cast<uint8_t *>(buf.data());
+        size_t avail_out = buf.size();
+        ret = BrotliDecoderDecompressStream(brotli, &avail_in, &next_in, &avail_out, &next_out, NULL);
+        if (ret == BROTLI_DECODER_RESULT_ERROR) {
+            throw std::runtime_error("Malformed brotli body");
+        }
+        size_t n = buf.size() - avail_out;
+        if (n > 0) {
+            out(buf.data(), n);
+        }
+    }
+    ended = ret == BROTLI_DECODER_RESULT_SUCCESS;
+}
+
+void ContentDecoder::finish() {
+    // an empty body is not compressed at all
+    if (started && !ended && _coding != IDENTITY) {
+        throw std::runtime_error("Truncated compressed body");
+    }
+}
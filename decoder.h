@@ -0,0 +1,54 @@
+/**
+ * decoder.h
+ *
+ * Header file for the streaming decoding of compressed bodies
+ */
+
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <string>
+#include <cstddef>
+
+#include <zlib.h>
+#include <brotli/decode.h>
+
+#include "https.h"
+
+/**
+ * Inflates a body compressed with one of the codings of Content-Encoding as its fragments arrive,
+ * passing the decoded bytes on block by block, so that a compressed body is never held whole.
+ */
+class ContentDecoder {
+public:
+    enum Coding { IDENTITY, GZIP, DEFLATE, BROTLI };
+
+    // the value of Accept-Encoding offering every coding decoded here
+    static const char *const ACCEPT;
+
+    // the coding named by a value of Content-Encoding, throws if it is not supported
+    static Coding coding(const std::string &name);
+
+    explicit ContentDecoder(Coding coding);
+    ~ContentDecoder();
+
+    ContentDecoder(const ContentDecoder &) = delete;
+    ContentDecoder &operator=(const ContentDecoder &) = delete;
+
+    // decode a fragment of the body and pass what it yields to out, throws if the body is malformed
+    void feed(const char *data, size_t len, const BodySink &out);
+
+    // the body ends, throws if the compressed stream does not
+    void finish();
+private:
+    void feed_zlib(const char *data, size_t len, const BodySink &out);
+    void feed_brotli(const char *data, size_t len, const BodySink &out);
+
+    Coding _coding;
+    // deflate is sent with a zlib header by most servers and raw by a few, told apart by its first byte
+    bool started = false, ended = false;
+    z_stream zstream = {};
+    BrotliDecoderState *brotli = nullptr;
+};
+
+#endif /* _DECODER_H_ */
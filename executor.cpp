@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <chrono>
+
+#include "executor.h"
+
+// the executor and the index of the worker running on this thread, null outside the workers
+static thread_local Executor *current_executor = nullptr;
+static thread_local size_t current_worker = 0;
+
+size_t Executor::default_threads() {
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+Executor::Executor(size_t threads) : next(0), queued(0), stopping(false) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back(&Executor::loop, this, i);
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(idle_m);
+        stopping = true;
+    }
+    idle_cv.notify_all();
+    for (std::thread &thread : threads_) {
+        thread.join();
+    }
+}
+
+void Executor::submit(std::function<void()> task) {
+    size_t index = current_executor == this ? current_worker : next++ % workers.size();
+    {
+        std::lock_guard<std::mutex> lock(workers[index]->m);
+        workers[index]->tasks.push_back(std::move(task));
+    }
+    ++queued;
+    // a worker checks queued under idle_m before sleeping, so the notification cannot fall between the two
+    std::lock_guard<std::mutex> lock(idle_m);
+    idle_cv.notify_one();
+}
+
+bool Executor::take(size_t index, std::function<void()> &task) {
+    {
+        Worker &own = *workers[index];
+        std::lock_guard<std::mutex> lock(own.m);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+        Worker &victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.m);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Executor::on_worker() const {
+    return current_executor == this;
+}
+
+bool Executor::run_one() {
+    std::function<void()> task;
+    if (current_executor != this || !take(current_worker, task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+void Executor::loop(size_t index) {
+    current_executor = this;
+    current_worker = index;
+    std::function<void()> task;
+    while (true) {
+        if (take(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(idle_m);
+        idle_cv.wait(lock, [this] { return queued > 0 || stopping; });
+        if (queued == 0 && stopping) {
+            return;
+        }
+    }
+}
+
+void TaskGroup::run(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        ++pending;
+    }
+    executor.submit([this, task = std::move(task)] {
+        std::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(m);
+        if (error) {
+            errors.push_back(error);
+        }
+        if (--pending == 0) {
+            cv.notify_all();
+        }
+    });
+}
+
+std::vector<std::exception_ptr> TaskGroup::wait() {
+    std::unique_lock<std::mutex> lock(m);
+    while (pending > 0) {
+        lock.unlock();
+        bool ran = executor.run_one();
+        lock.lock();
+        if (ran) {
+            continue;
+        }
+        if (executor.on_worker()) {
+            // the tasks left are running on other workers, which may queue more of them
+            cv.wait_for(lock, std::chrono::milliseconds(1), [this] { return pending == 0; });
+        } else {
+            cv.wait(lock, [this] { return pending == 0; });
+        }
+    }
+    std::vector<std::exception_ptr> taken;
+    taken.swap(errors);
+    return taken;
+}
@@ -0,0 +1,103 @@
+/**
+ * executor.h
+ *
+ * Header file for the fixed pool of threads running the jobs of the rooms and the accounts
+ */
+
+#ifndef _EXECUTOR_H_
+#define _EXECUTOR_H_
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/**
+ * A fixed number of worker threads, each with its own queue of tasks.
+ * A task submitted by a worker goes to its own queue, and tasks submitted from other threads are spread over
+ * the queues in turn. Each queue is run in the order its tasks were submitted, so that tasks submitted in order
+ * of priority start in that order, and a worker whose queue is empty steals the oldest task of another before it sleeps.
+ * Thousands of rooms therefore cost thousands of small tasks rather than thousands of thread stacks.
+ */
+class Executor {
+public:
+    // the number of cores, at least one
+    static size_t default_threads();
+
+    explicit Executor(size_t threads = default_threads());
+
+    // run the tasks still queued, then join the workers
+    ~Executor();
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    // queue task, which must not throw, exceptions are caught by TaskGroup
+    void submit(std::function<void()> task);
+
+    // run one queued task on the calling worker, return false if there is none or the caller is not a worker
+    bool run_one();
+
+    // whether the calling thread is one of the workers
+    bool on_worker() const;
+
+    size_t threads() const { return workers.size(); }
+private:
+    typedef struct {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    } Worker;
+
+    void loop(size_t index);
+
+    // take the oldest task of the queue of worker index, or steal the oldest of another queue
+    bool take(size_t index, std::function<void()> &task);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads_;
+    // the queue receiving the next task submitted from outside the workers
+    std::atomic<size_t> next;
+
+    // the number of tasks queued, workers sleep while it is zero
+    std::atomic<size_t> queued;
+    std::mutex idle_m;
+    std::condition_variable idle_cv;
+    bool stopping;
+};
+
+/**
+ * Tasks run on an executor and waited for together.
+ * A task may run further tasks in the same group, such as the rooms found by listing the medals,
+ * and wait() returns once all of them have finished, with the exceptions of the tasks that threw.
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(Executor &executor) : executor(executor), pending(0) {}
+
+    // wait for the tasks still running, their errors are dropped
+    ~TaskGroup() { wait(); }
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void run(std::function<void()> task);
+
+    /**
+     * wait until every task run in the group has finished, and return the exceptions thrown since the last wait
+     * a worker waiting runs queued tasks meanwhile, so that a group waited for inside a task cannot starve the pool
+     */
+    std::vector<std::exception_ptr> wait();
+private:
+    Executor &executor;
+    std::mutex m;
+    std::condition_variable cv;
+    size_t pending;
+    std::vector<std::exception_ptr> errors;
+};
+
+#endif /* _EXECUTOR_H_ */
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "frame.h"
+
+const char h2::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+const unsigned char h2::ALPN[] = {2, 'h', '2', 8, 'h', 't', 't', 'p', '/', '1', '.', '1'};
+
+static void put_u32(std::string &out, uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+uint32_t h2::get_u32(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return static_cast<uint32_t>(u[0]) << 24 | static_cast<uint32_t>(u[1]) << 16 |
+           static_cast<uint32_t>(u[2]) << 8 | u[3];
+}
+
+void h2::put_frame(std::string &out, uint8_t type, uint8_t flags, uint32_t stream, const char *payload, size_t len) {
+    out += static_cast<char>(len >> 16);
+    out += static_cast<char>(len >> 8);
+    out += static_cast<char>(len);
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    put_u32(out, stream & 0x7fffffff);
+    out.append(payload, len);
+}
+
+void h2::put_settings(std::string &out, const std::vector<std::pair<uint16_t, uint32_t>> &settings) {
+    std::string payload;
+    for (auto &setting : settings) {
+        payload += static_cast<char>(setting.first >> 8);
+        payload += static_cast<char>(setting.first);
+        put_u32(payload, setting.second);
+    }
+    put_frame(out, SETTINGS, 0, 0, payload.data(), payload.length());
+}
+
+void h2::put_window_update(std::string &out, uint32_t stream, uint32_t increment) {
+    std::string payload;
+    put_u32(payload, increment);
+    put_frame(out, WINDOW_UPDATE, 0, stream, payload.data(), payload.length());
+}
+
+void h2::put_rst_stream(std::string &out, uint32_t stream, uint32_t error) {
+    std::string payload;
+    put_u32(payload, error);
+    put_frame(out, RST_STREAM, 0, stream, payload.data(), payload.length());
+}
+
+void h2::put_goaway(std::string &out, uint32_t last_stream, uint32_t error) {
+    std::string payload;
+    put_u32(payload, last_stream);
+    put_u32(payload, error);
+    put_frame(out, GOAWAY, 0, 0, payload.data(), payload.length());
+}
+
+void h2::put_headers(std::string &out, uint32_t stream, const std::string &block, bool end_stream, size_t max_frame) {
+    size_t offset = 0;
+    do {
+        size_t len = std::min(max_frame, block.length() - offset);
+        bool last = offset + len == block.length();
+        uint8_t type = offset == 0 ? HEADERS : CONTINUATION;
+        uint8_t flags = static_cast<uint8_t>((last ? END_HEADERS : 0) | (offset == 0 && end_stream ? END_STREAM : 0));
+        put_frame(out, type, flags, stream, block.data() + offset, len);
+        offset += len;
+    } while (offset < block.length());
+}
+
+std::pair<const char *, size_t> h2::content(const Frame &frame) {
+    const char *p = frame.payload;
+    size_t len = frame.length, pad = 0;
+    if (frame.flags & PADDED) {
+        if (len < 1) {
+            throw std::runtime_error("Padded frame without its pad length");
+        }
+        pad = static_cast<unsigned char>(*p);
+        ++p;
+        --len;
+    }
+    if (frame.type == HEADERS && (frame.flags & PRIORITY_FLAG)) {
+        // the stream dependency and the weight
+        if (len < 5) {
+            throw std::runtime_error("HEADERS frame too short for its priority");
+        }
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len) {
+        throw std::runtime_error("Padding longer than the frame");
+    }
+    return {p, len - pad};
+}
+
+h2::Frame h2::FrameReader::header(const char *p) const {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    Frame frame;
+    frame.length = static_cast<size_t>(u[0]) << 16 | static_cast<size_t>(u[1]) << 8 | u[2];
+    frame.type = u[3];
+    frame.flags = u[4];
+    frame.stream = get_u32(p + 5) & 0x7fffffff;
+    frame.payload = nullptr;
+    if (frame.length > max_frame) {
+        throw std::runtime_error("Frame of " + std::to_string(frame.length) + " bytes exceeds the maximum size");
+    }
+    return frame;
+}
+
+void h2::FrameReader::feed(const char *data, size_t len, const std::function<void(const Frame &)> &fn) {
+    if (!buffer.empty()) {
+        // complete the frame split across fragments first
+        if (buffer.length() < HEADER_LENGTH) {
+            size_t n = std::min(HEADER_LENGTH - buffer.length(), len);
+            buffer.append(data, n);
+            data += n;
+            len -= n;
+            if (buffer.length() < HEADER_LENGTH) {
+                return;
+            }
+        }
+        Frame frame = header(buffer.data());
+        size_t n = std::min(HEADER_LENGTH + frame.length - buffer.length(), len);
+        buffer.append(data, n);
+        data += n;
+        len -= n;
+        if (buffer.length() < HEADER_LENGTH + frame.length) {
+            return;
+        }
+        frame.payload = buffer.data() + HEADER_LENGTH;
+        fn(frame);
+        buffer.clear();
+    }
+    while (len >= HEADER_LENGTH) {
+        Frame frame = header(data);
+        if (len < HEADER_LENGTH + frame.length) {
+            break;
+        }
+        frame.payload = data + HEADER_LENGTH;
+        fn(frame);
+        data += HEADER_LENGTH + frame.length;
+        len -= HEADER_LENGTH + frame.length;
+    }
+    buffer.assign(data, len);
+}
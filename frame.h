@@ -0,0 +1,96 @@
+/**
+ * frame.h
+ *
+ * Header file for the frames of http/2, shared by the client and the mock server
+ */
+
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+namespace h2 {
+    // the bytes a client starts the connection with
+    extern const char PREFACE[];
+    const size_t PREFACE_LENGTH = 24;
+
+    // the protocols offered with alpn, in its wire format
+    extern const unsigned char ALPN[];
+    const size_t ALPN_LENGTH = 12;
+
+    const size_t HEADER_LENGTH = 9;
+    const uint32_t DEFAULT_WINDOW = 65535;
+    const uint32_t MAX_WINDOW = 0x7fffffff;
+    const size_t DEFAULT_FRAME_SIZE = 16384;
+
+    enum Type : uint8_t {
+        DATA = 0, HEADERS = 1, PRIORITY = 2, RST_STREAM = 3, SETTINGS = 4,
+        PUSH_PROMISE = 5, PING = 6, GOAWAY = 7, WINDOW_UPDATE = 8, CONTINUATION = 9
+    };
+
+    enum Flag : uint8_t { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY_FLAG = 0x20 };
+
+    enum Setting : uint16_t {
+        HEADER_TABLE_SIZE = 1, ENABLE_PUSH = 2, MAX_CONCURRENT_STREAMS = 3,
+        INITIAL_WINDOW_SIZE = 4, MAX_FRAME_SIZE = 5, MAX_HEADER_LIST_SIZE = 6
+    };
+
+    enum Error : uint32_t {
+        NO_ERROR = 0, PROTOCOL_ERROR = 1, INTERNAL_ERROR = 2, FLOW_CONTROL_ERROR = 3, STREAM_CLOSED = 5,
+        FRAME_SIZE_ERROR = 6, REFUSED_STREAM = 7, CANCEL = 8, COMPRESSION_ERROR = 9
+    };
+
+    // a frame as it is read, the payload points into the buffer of the reader
+    typedef struct {
+        uint8_t type, flags;
+        uint32_t stream;
+        const char *payload;
+        size_t length;
+    } Frame;
+
+    // append a frame with its payload
+    void put_frame(std::string &out, uint8_t type, uint8_t flags, uint32_t stream, const char *payload, size_t len);
+
+    void put_settings(std::string &out, const std::vector<std::pair<uint16_t, uint32_t>> &settings);
+    void put_window_update(std::string &out, uint32_t stream, uint32_t increment);
+    void put_rst_stream(std::string &out, uint32_t stream, uint32_t error);
+    void put_goaway(std::string &out, uint32_t last_stream, uint32_t error);
+
+    // a header block in a HEADERS frame followed by as many CONTINUATION frames as max_frame requires
+    void put_headers(std::string &out, uint32_t stream, const std::string &block, bool end_stream, size_t max_frame);
+
+    // a big-endian integer of the payload
+    uint32_t get_u32(const char *p);
+
+    /**
+     * the fragment of a HEADERS or DATA frame without its padding and priority fields
+     * throws if the padding is longer than the frame
+     */
+    std::pair<const char *, size_t> content(const Frame &frame);
+
+    /**
+     * Splits bytes fed in arbitrary fragments into frames.
+     * A frame is passed on in place if the fragment holds it whole, and is buffered otherwise.
+     */
+    class FrameReader {
+    public:
+        // frames larger than max_frame, the SETTINGS_MAX_FRAME_SIZE announced to the peer, are refused
+        explicit FrameReader(size_t max_frame = DEFAULT_FRAME_SIZE) : max_frame(max_frame) {}
+
+        // pass each complete frame to fn, throws if a frame is too large
+        void feed(const char *data, size_t len, const std::function<void(const Frame &)> &fn);
+    private:
+        // parse the header at p, throws if the frame is too large
+        Frame header(const char *p) const;
+
+        size_t max_frame;
+        std::string buffer;
+    };
+}
+
+#endif /* _FRAME_H_ */
@@ -0,0 +1,437 @@
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "hpack.h"
+
+// the static table of RFC 7541 appendix A, index 1 first
+static const HeaderField STATIC_TABLE[HpackTable::STATIC_FIELDS] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// the Huffman code of each byte and of the end of string, RFC 7541 appendix B
+static const struct {
+    uint32_t code;
+    uint8_t bits;
+} HUFFMAN[257] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// the dynamic table is never made larger than this, whatever the peer allows
+static const size_t MAX_TABLE_SIZE = 65536;
+
+const HeaderField *HpackTable::at(size_t index) const {
+    if (index == 0) {
+        return nullptr;
+    }
+    if (index <= STATIC_FIELDS) {
+        return &STATIC_TABLE[index - 1];
+    }
+    index -= STATIC_FIELDS + 1;
+    return index < fields.size() ? &fields[index] : nullptr;
+}
+
+size_t HpackTable::find(const HeaderField &field, bool &value_matches) const {
+    size_t name_index = 0;
+    value_matches = false;
+    for (size_t i = 0; i < STATIC_FIELDS; ++i) {
+        if (STATIC_TABLE[i].first == field.first) {
+            if (STATIC_TABLE[i].second == field.second) {
+                value_matches = true;
+                return i + 1;
+            }
+            name_index = name_index == 0 ? i + 1 : name_index;
+        }
+    }
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (fields[i].first == field.first) {
+            if (fields[i].second == field.second) {
+                value_matches = true;
+                return STATIC_FIELDS + 1 + i;
+            }
+            name_index = name_index == 0 ? STATIC_FIELDS + 1 + i : name_index;
+        }
+    }
+    return name_index;
+}
+
+void HpackTable::insert(HeaderField field) {
+    size_t room = entry_size(field);
+    // a field larger than the table empties it and is not added
+    evict(room > _max_size ? _max_size + 1 : room);
+    if (room <= _max_size) {
+        size += room;
+        fields.push_front(std::move(field));
+    }
+}
+
+void HpackTable::set_max_size(size_t size) {
+    _max_size = size;
+    evict(0);
+}
+
+void HpackTable::evict(size_t room) {
+    while (!fields.empty() && size + room > _max_size) {
+        size -= entry_size(fields.back());
+        fields.pop_back();
+    }
+}
+
+// append value with an integer prefix of prefix bits, the bits above it set to flags
+static void put_integer(std::string &out, size_t value, unsigned prefix, uint8_t flags) {
+    size_t max = (1u << prefix) - 1;
+    if (value < max) {
+        out += static_cast<char>(flags | value);
+        return;
+    }
+    out += static_cast<char>(flags | max);
+    for (value -= max; value >= 0x80; value >>= 7) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+    }
+    out += static_cast<char>(value);
+}
+
+static size_t get_integer(const unsigned char *&p, const unsigned char *end, unsigned prefix) {
+    size_t max = (1u << prefix) - 1;
+    size_t value = *p++ & max;
+    if (value < max) {
+        return value;
+    }
+    for (unsigned shift = 0; ; shift += 7) {
+        if (p == end) {
+            throw std::runtime_error("Truncated integer in header block");
+        }
+        if (shift > 28) {
+            throw std::runtime_error("Integer too large in header block");
+        }
+        unsigned char byte = *p++;
+        value += static_cast<size_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static void put_string(std::string &out, const std::string &s) {
+    size_t coded = huffman_length(s);
+    if (coded < s.length()) {
+        put_integer(out, coded, 7, 0x80);
+        huffman_encode(s, out);
+    } else {
+        put_integer(out, s.length(), 7, 0);
+        out += s;
+    }
+}
+
+static std::string get_string(const unsigned char *&p, const unsigned char *end) {
+    if (p == end) {
+        throw std::runtime_error("Truncated string in header block");
+    }
+    bool huffman = (*p & 0x80) != 0;
+    size_t len = get_integer(p, end, 7);
+    if (len > static_cast<size_t>(end - p)) {
+        throw std::runtime_error("Truncated string in header block");
+    }
+    std::string s;
+    if (huffman) {
+        huffman_decode(reinterpret_cast<const char *>(p), len, s);
+    } else {
+        s.assign(reinterpret_cast<const char *>(p), len);
+    }
+    p += len;
+    return s;
+}
+
+size_t huffman_length(const std::string &s) {
+    size_t bits = 0;
+    for (unsigned char c : s) {
+        bits += HUFFMAN[c].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(const std::string &s, std::string &out) {
+    uint64_t acc = 0;
+    unsigned n = 0;
+    for (unsigned char c : s) {
+        acc = acc << HUFFMAN[c].bits | HUFFMAN[c].code;
+        n += HUFFMAN[c].bits;
+        while (n >= 8) {
+            n -= 8;
+            out += static_cast<char>(acc >> n);
+        }
+    }
+    // the last byte is padded with the most significant bits of the end of string, all ones
+    if (n > 0) {
+        out += static_cast<char>(acc << (8 - n) | (0xff >> n));
+    }
+}
+
+namespace {
+// the Huffman code as a binary tree, a node is either a leaf with a symbol or has both children
+struct HuffmanTree {
+    struct Node {
+        int16_t child[2];
+        int16_t symbol;
+    };
+    std::vector<Node> nodes;
+
+    HuffmanTree() : nodes(1, Node{{-1, -1}, -1}) {
+        for (int16_t symbol = 0; symbol < 257; ++symbol) {
+            size_t node = 0;
+            for (int bit = HUFFMAN[symbol].bits - 1; bit >= 0; --bit) {
+                int b = (HUFFMAN[symbol].code >> bit) & 1;
+                if (nodes[node].child[b] == -1) {
+                    nodes[node].child[b] = static_cast<int16_t>(nodes.size());
+                    nodes.push_back(Node{{-1, -1}, -1});
+                }
+                node = static_cast<size_t>(nodes[node].child[b]);
+            }
+            nodes[node].symbol = symbol;
+        }
+    }
+};
+}
+
+void huffman_decode(const char *data, size_t len, std::string &out) {
+    static const HuffmanTree tree;
+    size_t node = 0;
+    // the bits read since the last symbol, and whether they are all ones
+    unsigned pending = 0;
+    bool ones = true;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char byte = static_cast<unsigned char>(data[i]);
+        for (int bit = 7; bit >= 0; --bit) {
+            int b = (byte >> bit) & 1;
+            int16_t next = tree.nodes[node].child[b];
+            if (next == -1) {
+                throw std::runtime_error("Malformed Huffman string in header block");
+            }
+            node = static_cast<size_t>(next);
+            ++pending;
+            ones = ones && b == 1;
+            int16_t symbol = tree.nodes[node].symbol;
+            if (symbol == 256) {
+                throw std::runtime_error("End of string in Huffman string of header block");
+            }
+            if (symbol >= 0) {
+                out += static_cast<char>(symbol);
+                node = 0;
+                pending = 0;
+                ones = true;
+            }
+        }
+    }
+    if (pending >= 8 || !ones) {
+        throw std::runtime_error("Malformed padding of Huffman string in header block");
+    }
+}
+
+// fields whose value changes from one message to the next are not worth a slot of the dynamic table
+static bool volatile_field(const std::string &name) {
+    return name == ":path" || name == "content-length" || name == "date";
+}
+
+void HpackEncoder::set_max_size(size_t size) {
+    size = std::min(size, MAX_TABLE_SIZE);
+    if (size != table.max_size()) {
+        table.set_max_size(size);
+        size_changed = true;
+    }
+}
+
+void HpackEncoder::encode(const std::vector<HeaderField> &headers, std::string &out) {
+    if (size_changed) {
+        put_integer(out, table.max_size(), 5, 0x20);
+        size_changed = false;
+    }
+    for (const HeaderField &field : headers) {
+        bool value_matches;
+        size_t index = table.find(field, value_matches);
+        if (index != 0 && value_matches) {
+            put_integer(out, index, 7, 0x80);
+            continue;
+        }
+        bool indexing = !volatile_field(field.first) && HpackTable::entry_size(field) <= table.max_size();
+        if (indexing) {
+            put_integer(out, index, 6, 0x40);
+        } else {
+            put_integer(out, index, 4, 0);
+        }
+        if (index == 0) {
+            put_string(out, field.first);
+        }
+        put_string(out, field.second);
+        if (indexing) {
+            table.insert(field);
+        }
+    }
+}
+
+void HpackDecoder::decode(const char *data, size_t len, const std::function<void(HeaderField &)> &fn) {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data), *end = p + len;
+    while (p < end) {
+        unsigned char first = *p;
+        if (first & 0x80) {
+            // an indexed field
+            const HeaderField *field = table.at(get_integer(p, end, 7));
+            if (field == nullptr) {
+                throw std::runtime_error("Invalid index in header block");
+            }
+            HeaderField copy = *field;
+            fn(copy);
+            continue;
+        }
+        if ((first & 0xe0) == 0x20) {
+            size_t size = get_integer(p, end, 5);
+            if (size > limit) {
+                throw std::runtime_error("Dynamic table size update beyond the limit");
+            }
+            table.set_max_size(size);
+            continue;
+        }
+        // a literal field, with incremental indexing, without indexing or never indexed
+        bool indexing = (first & 0xc0) == 0x40;
+        size_t index = get_integer(p, end, indexing ? 6 : 4);
+        HeaderField field;
+        if (index != 0) {
+            const HeaderField *named = table.at(index);
+            if (named == nullptr) {
+                throw std::runtime_error("Invalid index in header block");
+            }
+            field.first = named->first;
+        } else {
+            field.first = get_string(p, end);
+        }
+        field.second = get_string(p, end);
+        if (indexing) {
+            table.insert(field);
+        }
+        fn(field);
+    }
+}
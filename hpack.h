@@ -0,0 +1,89 @@
+/**
+ * hpack.h
+ *
+ * Header file for the header compression of http/2
+ */
+
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <functional>
+#include <cstddef>
+
+// a header field of http/2, the name in lower case
+typedef std::pair<std::string, std::string> HeaderField;
+
+/**
+ * The dynamic table of one direction of a connection, the newest field first.
+ * Each field takes its length plus 32 bytes, and the oldest fields are evicted beyond max_size.
+ */
+class HpackTable {
+public:
+    // the size both ends start with, and the number of fields of the static table before the dynamic ones
+    static const size_t DEFAULT_SIZE = 4096;
+    static const size_t STATIC_FIELDS = 61;
+
+    // the field at index, static fields first, nullptr if there is none
+    const HeaderField *at(size_t index) const;
+
+    // the index of the field, or of a field with its name only, 0 if there is none
+    size_t find(const HeaderField &field, bool &value_matches) const;
+
+    void insert(HeaderField field);
+    void set_max_size(size_t size);
+    size_t max_size() const { return _max_size; }
+
+    // the room a field takes in the table
+    static size_t entry_size(const HeaderField &field) { return field.first.length() + field.second.length() + 32; }
+private:
+    void evict(size_t room);
+
+    std::deque<HeaderField> fields;
+    size_t size = 0, _max_size = DEFAULT_SIZE;
+};
+
+/**
+ * Encodes header lists into header blocks.
+ * Fields already in a table become an index of a byte or two, such as the cookie and the user agent
+ * repeated by every request, and fields whose value is worth remembering are added to the dynamic table.
+ * String literals are Huffman coded when that is shorter.
+ */
+class HpackEncoder {
+public:
+    // the peer limits the dynamic table to size with SETTINGS_HEADER_TABLE_SIZE, announced in the next block
+    void set_max_size(size_t size);
+
+    // append the block of headers to out
+    void encode(const std::vector<HeaderField> &headers, std::string &out);
+private:
+    HpackTable table;
+    bool size_changed = false;
+};
+
+/**
+ * Decodes header blocks into header lists, the blocks of a connection in the order they arrive.
+ */
+class HpackDecoder {
+public:
+    // the limit of the dynamic table announced to the peer, DEFAULT_SIZE unless announced otherwise
+    void set_max_size(size_t size) { limit = size; }
+
+    // decode a complete header block and pass each field to fn, throws if the block is malformed
+    void decode(const char *data, size_t len, const std::function<void(HeaderField &)> &fn);
+private:
+    HpackTable table;
+    size_t limit = HpackTable::DEFAULT_SIZE;
+};
+
+// append s coded with the Huffman code of hpack, and the length it takes
+void huffman_encode(const std::string &s, std::string &out);
+size_t huffman_length(const std::string &s);
+
+// decode the Huffman coded string of len bytes into out, throws if it is malformed
+void huffman_decode(const char *data, size_t len, std::string &out);
+
+#endif /* _HPACK_H_ */
@@ -0,0 +1,436 @@
+#include <cctype>
+#include <algorithm>
+#include <stdexcept>
+
+#include "http2.h"
+
+const size_t Http2Session::MAX_STREAMS;
+const uint32_t Http2Session::STREAM_WINDOW, Http2Session::CONNECTION_WINDOW;
+
+// headers of http/1.1 that only concern its connection and are not sent in http/2
+static bool connection_specific(const std::string &name) {
+    return name == "host" || name == "connection" || name == "keep-alive" || name == "proxy-connection"
+           || name == "transfer-encoding" || name == "upgrade" || name == "te";
+}
+
+static std::runtime_error protocol_error(const std::string &what) {
+    return std::runtime_error("HTTP/2 protocol error: " + what);
+}
+
+Http2Session::Http2Session(Answered answered, Refused refused)
+    : answered(std::move(answered)), refused(std::move(refused)), next_stream(1), written(0), block_stream(0),
+      block_end_stream(false), max_streams(MAX_STREAMS), max_frame(h2::DEFAULT_FRAME_SIZE),
+      initial_window(h2::DEFAULT_WINDOW), send_window(h2::DEFAULT_WINDOW), unacked(0), goaway_received(false) {
+    out.append(h2::PREFACE, h2::PREFACE_LENGTH);
+    h2::put_settings(out, {{h2::ENABLE_PUSH, 0}, {h2::INITIAL_WINDOW_SIZE, STREAM_WINDOW}});
+    h2::put_window_update(out, 0, CONNECTION_WINDOW - h2::DEFAULT_WINDOW);
+}
+
+bool Http2Session::can_start() const {
+    return !going_away() && streams.size() < max_streams;
+}
+
+void Http2Session::start(std::shared_ptr<Exchange> exchange) {
+    // the request is serialized for http/1.1, its head is turned into a header list
+    std::string text(exchange->request.length(), '\0');
+    exchange->request.gather(0, &text[0], text.length());
+    size_t line_end = text.find("\r\n"), head_end = text.find("\r\n\r\n");
+    size_t space = text.find(' '), space2 = space == std::string::npos ? space : text.find(' ', space + 1);
+    if (head_end == std::string::npos || space2 == std::string::npos || space2 > line_end) {
+        answered(std::move(exchange), std::make_exception_ptr(std::runtime_error("Malformed request")));
+        return;
+    }
+    std::vector<HeaderField> headers = {
+        {":method", text.substr(0, space)},
+        {":scheme", "https"},
+        {":authority", ""},
+        {":path", text.substr(space + 1, space2 - space - 1)}
+    };
+    for (size_t pos = line_end + 2; pos < head_end; ) {
+        size_t end = text.find("\r\n", pos), colon = text.find(':', pos);
+        if (colon < end) {
+            std::string name = text.substr(pos, colon - pos);
+            std::transform(name.begin(), name.end(), name.begin(), [] (char c) {
+                return static_cast<char>(tolower(static_cast<unsigned char>(c)));
+            });
+            size_t value = text.find_first_not_of(" \t", colon + 1);
+            value = std::min(value, end);
+            if (name == "host") {
+                headers[2].second = text.substr(value, end - value);
+            } else if (!connection_specific(name)) {
+                headers.emplace_back(std::move(name), text.substr(value, end - value));
+            }
+        }
+        pos = end + 2;
+    }
+
+    std::string header_block;
+    encoder.encode(headers, header_block);
+    uint32_t id = next_stream;
+    next_stream += 2;
+    Stream &stream = streams[id];
+    stream.exchange = std::move(exchange);
+    stream.body = text.substr(head_end + 4);
+    stream.body_sent = 0;
+    stream.send_window = initial_window;
+    stream.unacked = 0;
+    stream.headers_received = false;
+
+    size_t before = out.length();
+    h2::put_headers(out, id, header_block, stream.body.empty(), max_frame);
+    stream.exchange->sent = out.length() - before;
+    if (stream.body.empty()) {
+        stream.exchange->written_at = std::chrono::steady_clock::now();
+    } else {
+        flush_body(stream, id);
+    }
+}
+
+void Http2Session::flush_body(Stream &stream, uint32_t id) {
+    while (stream.body_sent < stream.body.length()) {
+        int64_t allowed = std::min(send_window, stream.send_window);
+        if (allowed <= 0) {
+            return;
+        }
+        size_t n = std::min({max_frame, stream.body.length() - stream.body_sent, static_cast<size_t>(allowed)});
+        bool last = stream.body_sent + n == stream.body.length();
+        size_t before = out.length();
+        h2::put_frame(out, h2::DATA, last ? h2::END_STREAM : 0, id, stream.body.data() + stream.body_sent, n);
+        stream.exchange->sent += out.length() - before;
+        stream.body_sent += n;
+        send_window -= static_cast<int64_t>(n);
+        stream.send_window -= static_cast<int64_t>(n);
+        if (last) {
+            stream.exchange->written_at = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+void Http2Session::flush_bodies() {
+    for (auto &entry : streams) {
+        if (send_window <= 0) {
+            return;
+        }
+        flush_body(entry.second, entry.first);
+    }
+}
+
+size_t Http2Session::gather(char *buf, size_t len) const {
+    size_t n = std::min(len, out.length() - written);
+    out.copy(buf, n, written);
+    return n;
+}
+
+void Http2Session::advance(size_t n) {
+    written += n;
+    if (written == out.length()) {
+        out.clear();
+        written = 0;
+    }
+}
+
+void Http2Session::feed(const char *data, size_t len) {
+    reader.feed(data, len, [this] (const h2::Frame &frame) { on_frame(frame); });
+}
+
+void Http2Session::on_frame(const h2::Frame &frame) {
+    // the frames of a header block follow each other without anything in between
+    if (block_stream != 0 && (frame.type != h2::CONTINUATION || frame.stream != block_stream)) {
+        throw protocol_error("header block interrupted");
+    }
+    switch (frame.type) {
+        case h2::DATA:
+            on_data(frame);
+            break;
+        case h2::HEADERS: {
+            if (frame.stream == 0) {
+                throw protocol_error("HEADERS on stream 0");
+            }
+            auto content = h2::content(frame);
+            block.assign(content.first, content.second);
+            block_end_stream = (frame.flags & h2::END_STREAM) != 0;
+            if (frame.flags & h2::END_HEADERS) {
+                on_headers(frame.stream, block_end_stream);
+            } else {
+                block_stream = frame.stream;
+            }
+            break;
+        }
+        case h2::CONTINUATION:
+            if (block_stream == 0) {
+                throw protocol_error("CONTINUATION without HEADERS");
+            }
+            block.append(frame.payload, frame.length);
+            if (frame.flags & h2::END_HEADERS) {
+                block_stream = 0;
+                on_headers(frame.stream, block_end_stream);
+            }
+            break;
+        case h2::RST_STREAM:
+            if (frame.stream == 0 || frame.length != 4) {
+                throw protocol_error("malformed RST_STREAM");
+            }
+            on_reset(frame.stream, h2::get_u32(frame.payload));
+            break;
+        case h2::SETTINGS:
+            if (frame.stream != 0 || frame.length % 6 != 0) {
+                throw protocol_error("malformed SETTINGS");
+            }
+            if (!(frame.flags & h2::ACK)) {
+                on_settings(frame);
+            }
+            break;
+        case h2::PUSH_PROMISE:
+            throw protocol_error("push is disabled");
+        case h2::PING:
+            if (frame.length != 8) {
+                throw protocol_error("malformed PING");
+            }
+            if (!(frame.flags & h2::ACK)) {
+                h2::put_frame(out, h2::PING, h2::ACK, 0, frame.payload, frame.length);
+            }
+            break;
+        case h2::GOAWAY:
+            if (frame.length < 8) {
+                throw protocol_error("malformed GOAWAY");
+            }
+            on_goaway(h2::get_u32(frame.payload) & 0x7fffffff);
+            break;
+        case h2::WINDOW_UPDATE: {
+            if (frame.length != 4) {
+                throw protocol_error("malformed WINDOW_UPDATE");
+            }
+            int64_t increment = h2::get_u32(frame.payload) & 0x7fffffff;
+            if (frame.stream == 0) {
+                send_window += increment;
+                if (increment == 0 || send_window > h2::MAX_WINDOW) {
+                    throw protocol_error("invalid window of the connection");
+                }
+                flush_bodies();
+                break;
+            }
+            auto it = streams.find(frame.stream);
+            if (it != streams.end()) {
+                it->second.send_window += increment;
+                flush_body(it->second, it->first);
+            }
+            break;
+        }
+        default:
+            // PRIORITY and unknown frames are ignored
+            break;
+    }
+}
+
+void Http2Session::on_headers(uint32_t id, bool end) {
+    // the block is decoded even for a stream that is gone, the dynamic table depends on it
+    int status = 0;
+    Header header;
+    decoder.decode(block.data(), block.length(), [&status, &header] (HeaderField &field) {
+        if (field.first == ":status") {
+            status = atoi(field.second.c_str());
+            return;
+        }
+        std::string &value = header[field.first];
+        if (!value.empty()) {
+            value += field.first == "cookie" ? "; " : ", ";
+        }
+        value += field.second;
+    });
+    auto it = streams.find(id);
+    if (it == streams.end()) {
+        return;
+    }
+    Stream &stream = it->second;
+    Exchange &exchange = *stream.exchange;
+    if (!exchange.received_any) {
+        exchange.first_byte = std::chrono::steady_clock::now();
+        exchange.received_any = true;
+    }
+    exchange.received += block.length();
+    if (stream.headers_received) {
+        // trailers end the stream, their fields are dropped
+        if (!end) {
+            fail_stream(id, std::make_exception_ptr(protocol_error("trailers without END_STREAM")));
+            return;
+        }
+        end_stream(id);
+        return;
+    }
+    if (status < 100 || status > 999) {
+        fail_stream(id, std::make_exception_ptr(protocol_error("response without :status")));
+        return;
+    }
+    // an informational head is followed by the final one
+    if (status / 100 == 1) {
+        return;
+    }
+    stream.headers_received = true;
+    exchange.response.status = status;
+    exchange.response.header = std::move(header);
+    try {
+        exchange.parser.headers_framed(exchange.response);
+    } catch (...) {
+        fail_stream(id, std::current_exception());
+        return;
+    }
+    if (end) {
+        end_stream(id);
+    }
+}
+
+void Http2Session::on_data(const h2::Frame &frame) {
+    if (frame.stream == 0) {
+        throw protocol_error("DATA on stream 0");
+    }
+    auto content = h2::content(frame);
+    // flow control counts the padding too, the bytes are given back once half the window is used
+    unacked += frame.length;
+    if (unacked >= CONNECTION_WINDOW / 2) {
+        h2::put_window_update(out, 0, static_cast<uint32_t>(unacked));
+        unacked = 0;
+    }
+    auto it = streams.find(frame.stream);
+    if (it == streams.end()) {
+        return;
+    }
+    Stream &stream = it->second;
+    bool end = (frame.flags & h2::END_STREAM) != 0;
+    stream.unacked += frame.length;
+    if (!end && stream.unacked >= STREAM_WINDOW / 2) {
+        h2::put_window_update(out, frame.stream, static_cast<uint32_t>(stream.unacked));
+        stream.unacked = 0;
+    }
+    if (!stream.headers_received) {
+        fail_stream(frame.stream, std::make_exception_ptr(protocol_error("DATA before HEADERS")));
+        return;
+    }
+    Exchange &exchange = *stream.exchange;
+    exchange.received += content.second;
+    try {
+        exchange.parser.body_framed(content.first, content.second, exchange.response);
+    } catch (...) {
+        fail_stream(frame.stream, std::current_exception());
+        return;
+    }
+    if (end) {
+        end_stream(frame.stream);
+    }
+}
+
+void Http2Session::on_settings(const h2::Frame &frame) {
+    for (size_t i = 0; i < frame.length; i += 6) {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(frame.payload + i);
+        uint16_t id = static_cast<uint16_t>(p[0] << 8 | p[1]);
+        uint32_t value = h2::get_u32(frame.payload + i + 2);
+        switch (id) {
+            case h2::HEADER_TABLE_SIZE:
+                encoder.set_max_size(value);
+                break;
+            case h2::MAX_CONCURRENT_STREAMS:
+                max_streams = std::min<size_t>(value, MAX_STREAMS);
+                break;
+            case h2::INITIAL_WINDOW_SIZE: {
+                if (value > h2::MAX_WINDOW) {
+                    throw protocol_error("initial window too large");
+                }
+                // the change applies to the windows of the open streams too
+                int64_t delta = static_cast<int64_t>(value) - initial_window;
+                initial_window = value;
+                for (auto &entry : streams) {
+                    entry.second.send_window += delta;
+                }
+                break;
+            }
+            case h2::MAX_FRAME_SIZE:
+                if (value < h2::DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                    throw protocol_error("invalid maximum frame size");
+                }
+                max_frame = value;
+                break;
+            default:
+                break;
+        }
+    }
+    h2::put_frame(out, h2::SETTINGS, h2::ACK, 0, nullptr, 0);
+    flush_bodies();
+}
+
+void Http2Session::on_reset(uint32_t id, uint32_t error) {
+    auto it = streams.find(id);
+    if (it == streams.end()) {
+        return;
+    }
+    std::shared_ptr<Exchange> exchange = std::move(it->second.exchange);
+    streams.erase(it);
+    if (error == h2::REFUSED_STREAM && !exchange->received_any) {
+        // the server has not processed the stream, so sending it again is safe whatever its method
+        exchange->sent = 0;
+        refused(std::move(exchange));
+    } else {
+        answered(std::move(exchange), std::make_exception_ptr(
+            std::runtime_error("Stream reset by the server with error " + std::to_string(error))));
+    }
+}
+
+void Http2Session::on_goaway(uint32_t last_stream) {
+    goaway_received = true;
+    // the streams after last_stream have not been processed and may go to another connection
+    std::vector<std::shared_ptr<Exchange>> unprocessed;
+    for (auto it = streams.upper_bound(last_stream); it != streams.end(); it = streams.erase(it)) {
+        unprocessed.push_back(std::move(it->second.exchange));
+    }
+    for (auto &exchange : unprocessed) {
+        exchange->sent = 0;
+        refused(std::move(exchange));
+    }
+}
+
+void Http2Session::end_stream(uint32_t id) {
+    auto it = streams.find(id);
+    std::exception_ptr error;
+    try {
+        it->second.exchange->parser.end_framed();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    if (it->second.body_sent < it->second.body.length()) {
+        // the server has answered before reading the whole body
+        h2::put_rst_stream(out, id, h2::CANCEL);
+    }
+    std::shared_ptr<Exchange> exchange = std::move(it->second.exchange);
+    streams.erase(it);
+    answered(std::move(exchange), error);
+}
+
+void Http2Session::fail_stream(uint32_t id, std::exception_ptr error) {
+    auto it = streams.find(id);
+    h2::put_rst_stream(out, id, h2::CANCEL);
+    std::shared_ptr<Exchange> exchange = std::move(it->second.exchange);
+    streams.erase(it);
+    answered(std::move(exchange), error);
+}
+
+std::vector<std::shared_ptr<Exchange>> Http2Session::take_unanswered() {
+    std::vector<std::shared_ptr<Exchange>> unanswered;
+    for (auto &entry : streams) {
+        unanswered.push_back(std::move(entry.second.exchange));
+    }
+    streams.clear();
+    return unanswered;
+}
+
+bool Http2Session::cancel(const std::shared_ptr<Exchange> &exchange) {
+    for (auto it = streams.begin(); it != streams.end(); ++it) {
+        if (it->second.exchange == exchange) {
+            h2::put_rst_stream(out, it->first, h2::CANCEL);
+            streams.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Http2Session::go_away() {
+    h2::put_goaway(out, 0, h2::NO_ERROR);
+}
@@ -0,0 +1,130 @@
+/**
+ * http2.h
+ *
+ * Header file for the http/2 session multiplexing the requests of one connection
+ */
+
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <cstdint>
+
+#include "connection.h"
+#include "frame.h"
+#include "hpack.h"
+
+/**
+ * The client side of http/2 over bytes, the connection moving them to and from the socket.
+ * Every exchange started becomes a stream of its own, so that any number of requests are in flight
+ * at once and their responses arrive in any order. Request heads are converted from http/1.1 and compressed
+ * with hpack, bodies are sent as the flow control windows of the server allow, and the bodies of responses
+ * go through the parser of each exchange as if they were framed by the transport.
+ * The session never starts a stream after the server has sent GOAWAY, and hands back the streams it has not processed.
+ */
+class Http2Session {
+public:
+    // the streams in flight at most, whatever the server allows
+    static const size_t MAX_STREAMS = 128;
+    // the receive windows announced to the server, for each stream and for the whole connection
+    static const uint32_t STREAM_WINDOW = 1 << 20, CONNECTION_WINDOW = 1 << 24;
+
+    typedef std::function<void(std::shared_ptr<Exchange> exchange, std::exception_ptr error)> Answered;
+    typedef std::function<void(std::shared_ptr<Exchange> exchange)> Refused;
+
+    /**
+     * answered is called with each exchange once its response is complete or its stream has failed,
+     * refused with each exchange the server has not processed, its sent reset to 0 as nothing of it has taken effect,
+     * so that it may be sent again on another connection whatever its method
+     */
+    Http2Session(Answered answered, Refused refused);
+
+    // whether another stream may be started now
+    bool can_start() const;
+
+    // send the request of exchange on a new stream
+    void start(std::shared_ptr<Exchange> exchange);
+
+    // parse bytes from the server, throws on an error of the whole connection
+    void feed(const char *data, size_t len);
+
+    // the bytes waiting to be written, gathered into out, and the number of them written
+    bool has_output() const { return written < out.length(); }
+    size_t gather(char *buf, size_t len) const;
+    void advance(size_t n);
+
+    // the number of streams waiting for their response
+    size_t active() const { return streams.size(); }
+
+    // whether the server has sent GOAWAY or the stream ids are used up, no stream starts any more
+    bool going_away() const { return goaway_received || next_stream > 0x7fffffff; }
+
+    // the exchanges of the streams still waiting, in the order they started, the streams are forgotten
+    std::vector<std::shared_ptr<Exchange>> take_unanswered();
+
+    // reset the stream of exchange, whose response is no longer wanted, return false if it has none
+    bool cancel(const std::shared_ptr<Exchange> &exchange);
+
+    // tell the server the connection is about to close
+    void go_away();
+private:
+    typedef struct {
+        std::shared_ptr<Exchange> exchange;
+        // the body of the request and how much of it has been sent
+        std::string body;
+        size_t body_sent;
+        // how many bytes of the body the server allows on the stream
+        int64_t send_window;
+        // the bytes received on the stream not yet given back with WINDOW_UPDATE
+        size_t unacked;
+        // whether the final head of the response has arrived
+        bool headers_received;
+    } Stream;
+
+    void on_frame(const h2::Frame &frame);
+    void on_headers(uint32_t id, bool end);
+    void on_data(const h2::Frame &frame);
+    void on_settings(const h2::Frame &frame);
+    void on_reset(uint32_t id, uint32_t error);
+    void on_goaway(uint32_t last_stream);
+
+    // send as much of the body of the stream as the windows allow
+    void flush_body(Stream &stream, uint32_t id);
+    void flush_bodies();
+
+    // the response of the stream is complete, or the stream fails with error and is reset
+    void end_stream(uint32_t id);
+    void fail_stream(uint32_t id, std::exception_ptr error);
+
+    Answered answered;
+    Refused refused;
+
+    std::map<uint32_t, Stream> streams;
+    uint32_t next_stream;
+    h2::FrameReader reader;
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+
+    std::string out;
+    size_t written;
+
+    // a header block arriving in CONTINUATION frames, the stream it belongs to while it does
+    std::string block;
+    uint32_t block_stream;
+    bool block_end_stream;
+
+    // the settings of the server
+    size_t max_streams, max_frame;
+    int64_t initial_window;
+    // how many bytes of bodies the server allows on the connection, and the bytes received not yet given back
+    int64_t send_window;
+    size_t unacked;
+    bool goaway_received;
+};
+
+#endif /* _HTTP2_H_ */
@@ -1,136 +1,84 @@
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netdb.h>
 #include <openssl/err.h>
-#include <unistd.h>
+#include <signal.h>
+#include <strings.h>
 
 #include <cstring>
-#include <sstream>
-#include <iostream>
-#include <errno.h>
+#include <algorithm>
+#include <stdexcept>
+#include <mutex>
 
 #include "https.h"
-
-const size_t HttpsClient::BUFSIZE = 4096;
+#include "connection.h"
+#include "pool.h"
+#include "tls.h"
+#include "metrics.h"
+#include "limiter.h"
+#include "decoder.h"
+#include "retry.h"
 
 const Header HttpsClient::default_header = {
     {"Connection", "keep-alive"},
     {"Accept", "*/*"},
     {"User-Agent", "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/111.0.0.0 Safari/537.36"},
-    {"Accept-Encoding", "identity"},
+    {"Accept-Encoding", ContentDecoder::ACCEPT},
     {"Accept-Language", "zh-CN,zh;q=0.9"}
 };
 
+// the policy of new clients: no request waits more than 30 seconds, and a failure is tried twice more
+static std::mutex policy_mutex;
+static RetryPolicy default_policy = {std::chrono::seconds(30), 3, std::chrono::milliseconds(100), std::chrono::seconds(2),
+                                     false};
+
+void HttpsClient::set_default_policy(const RetryPolicy &policy) {
+    std::lock_guard<std::mutex> lock(policy_mutex);
+    default_policy = policy;
+}
+
+RetryPolicy HttpsClient::get_default_policy() {
+    std::lock_guard<std::mutex> lock(policy_mutex);
+    return default_policy;
+}
+
 void HttpsClient::ssl_init() {
     SSL_library_init();
     SSL_load_error_strings();
     OpenSSL_add_all_algorithms();
+    tls_init();
+    // writing to a connection closed by the server must fail with EPIPE rather than kill the process
+    signal(SIGPIPE, SIG_IGN);
 }
 
-HttpsClient::HttpsClient(const std::string &host, const std::string &cookie) : _host(host), _cookie(cookie) {
-    const SSL_METHOD *meth = SSLv23_client_method();
-    ctx = SSL_CTX_new(meth);
-    if(ctx == NULL) {
-        throw std::runtime_error("SSL_CTX_new fails");
-    }
-
-    ssl = SSL_new(ctx);
-    if(ssl == NULL) {
-        throw std::runtime_error("SSL_new fails");
-    }
-
-    establish();    
-}
-
-void HttpsClient::establish() {
-    // create a new socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd == -1) {
-        throw std::runtime_error("Creating new socket fails");
-    }
-    
-    // get ip address
-    struct hostent *ip = gethostbyname(_host.c_str());
-    if(ip == NULL) {
-        throw std::runtime_error("gethostbyname fails");
-    }
-
-    struct sockaddr_in addr;
-    memset(&addr, '\0', sizeof(addr));
-    addr.sin_family = AF_INET;
-    memcpy(&(addr.sin_addr), ip->h_addr, ip->h_length);
-    addr.sin_port = htons(443);
-
-    // tcp connect
-    if(connect(sockfd, (sockaddr *)&addr, sizeof(addr)) == -1) {
-        throw std::runtime_error("tcp connect fails");
-    }
-    
-    // ssl connect
-    SSL_set_fd(ssl, sockfd);
-    SSL_set_connect_state(ssl);
-    SSL_set_tlsext_host_name(ssl, _host.c_str());
-    if(SSL_connect(ssl) == -1) {
-        throw std::runtime_error("ssl connect fails");
-    }
+HttpsClient::HttpsClient(const std::string &host, const std::string &cookie)
+    : reactor(Reactor::instance()), _host(host), _cookie(cookie), policy(get_default_policy()),
+      pool(ConnectionPool::get(host)) {
+    // the handshake runs in the background, so that clients of several hosts connect in parallel
+    auto promise = std::make_shared<std::promise<void>>();
+    established = promise->get_future().share();
+    std::shared_ptr<ConnectionPool> p = pool;
+    reactor.post([p, promise] {
+        p->warm_up([promise] (std::exception_ptr error) {
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value();
+            }
+        });
+    });
 }
 
-void HttpsClient::re_establish() {
-    SSL_shutdown(ssl);
-    close(sockfd);
-    establish();
+void HttpsClient::wait_established() {
+    established.get();
 }
 
 HttpsClient::~HttpsClient() {
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(sockfd);
-    SSL_CTX_free(ctx);
-}
-
-void HttpsClient::read_fixed_size(char *recvbuf, std::string &recvdata, const size_t len_chunk) {
-    if (len_chunk == 0) {
-        return;
-    }
-    size_t num_received = 0;
-    do {
-        // ssl read
-        int ret = SSL_read(ssl, recvbuf, static_cast<int>(std::min(BUFSIZE - 1, len_chunk - num_received)));
-        if (ret <= 0) {
-            throw std::runtime_error("SSL_read fails");
-        }
-        num_received += ret;
-
-        // append to recvbuf
-        recvbuf[ret] = '\0';
-        recvdata += std::string(recvbuf);
-    } while (num_received < len_chunk);
-
-    // recvdata should end in "\r\n" and this terminator needs to be erased
-    if (recvdata.substr(recvdata.length() - 2) != "\r\n") {
-        throw std::runtime_error("read_fixed_size not ends in \\r\\n");
-    }
-    recvdata.erase(recvdata.length() - 2);
-}
-
-void HttpsClient::write_helper(const std::string &sendbuf) {
-    size_t sent = 0;
-    do {
-        int ret = SSL_write(ssl, sendbuf.c_str() + sent, static_cast<int>(sendbuf.length() - sent));
-        if (ret < 0) {
-            throw std::runtime_error("SSL_write fails");
-        } else if (ret == 0) {
-            // server side closes the connection
-            if (sent != 0) {
-                throw std::runtime_error("Server closes connection during SSL_write");
-            }
-            re_establish();
-        }
-        sent += ret;
-    } while (sent < sendbuf.length());
+    // the last reference to the pool is dropped in the reactor thread, where its connections live
+    std::shared_ptr<ConnectionPool> p = std::move(pool);
+    reactor.post([p] () mutable {
+        p.reset();
+    });
 }
 
-void HttpsClient::writeread(const HttpsRequest &request, const char *body, std::string &recvdata) {
+std::string HttpsClient::serialize(const HttpsRequest &request, const char *body) const {
     std::string sendbuf;
     
     // request line
@@ -149,115 +97,377 @@ void HttpsClient::writeread(const HttpsRequest &request, const char *body, std::
     for (auto it : request.header) {
         sendbuf += it.first + ": " + it.second + "\r\n";
     }
-    // sendbuf += "Cookie: " + request.cookie + "\r\n\r\n";
-    sendbuf += "Cookie: " + _cookie + "\r\n\r\n";
+    sendbuf += "Cookie: " + (request.cookie.empty() ? _cookie : request.cookie) + "\r\n\r\n";
 
     // message body
     if (body != nullptr) {
         sendbuf += std::string(body);
     }
+    return sendbuf;
+}
 
-    // get the lock to send and receive data
-    std::lock_guard<std::mutex> lock(m);
-
-    // send data
-    write_helper(sendbuf);
-
-    // recvbuf should be null-terminated
-    char recvbuf[BUFSIZE];
-    // record the position of "\r\n\r\n"
-    char *pos_double_crlf;
-    size_t num_received = 0;
-    // WARNING: ALWAYS ASSUME THAT "\r\n\r\n" EXISTS IN THE FIRST BUFSIZE(4096) BYTES OF RESPONSE
-    do {
-        int ret = SSL_read(ssl, recvbuf + num_received, static_cast<int>(BUFSIZE - 1 - num_received));
-        if (ret < 0) {
-            throw std::runtime_error("SSL_read fails");
-        } else if (ret == 0) {
-            // server side closes the connection
-            if (num_received != 0) {
-                throw std::runtime_error("Server closes connection during SSL_read");
-            }
-            re_establish();
-            write_helper(sendbuf);
+PreparedRequest HttpsClient::prepare(const HttpsRequest &request, const char *body) const {
+    return PreparedRequest(serialize(request, body), request.method == HttpsMethod::GET);
+}
+
+RequestTemplate HttpsClient::compile(const HttpsRequest &request, const char *body) const {
+    return RequestTemplate(_host, request.cookie.empty() ? _cookie : request.cookie, request, body);
+}
+
+// hand the batch over to the pool once the rate limits let each of its requests go, from the i-th on,
+// without the requests settled meanwhile, such as by their deadline
+static void admit(std::shared_ptr<ConnectionPool> pool, Batch batch, size_t i) {
+    RateLimiter &limiter = RateLimiter::instance();
+    for (; i < batch.size(); ++i) {
+        Throttle *throttle = batch[i]->request.throttle();
+        if (throttle != nullptr && !batch[i]->cancelled && !limiter.try_acquire(*throttle)) {
+            limiter.acquire(*throttle, [pool, batch, i] {
+                admit(pool, batch, i + 1);
+            });
+            return;
         }
-        num_received += ret;
-        recvbuf[num_received] = '\0';
-        // find the 
-        pos_double_crlf = strstr(recvbuf, "\r\n\r\n");
-    } while (pos_double_crlf == NULL);
-
-    // DEBUG OUTPUT
-    // *pos_double_crlf = '\0';
-    // std::cout << recvbuf << std::endl;
-    
-    // Response code not start with 2 ("HTTP/1.1 " has length 9)
-    int response_code;
-    if (sscanf(recvbuf + 9ul, "%d", &response_code) != 1 || response_code / 100 != 2) {
-        throw std::runtime_error("Status code indicates not success");
     }
+    batch.erase(std::remove_if(batch.begin(), batch.end(), [] (const std::shared_ptr<Exchange> &exchange) {
+        return exchange->cancelled;
+    }), batch.end());
+    pool->submit(batch);
+}
 
-    // Return if 204 No Content
-    if (response_code == 204) {
-        return;
+void HttpsClient::post(std::vector<std::shared_ptr<RetryingRequest>> requests) {
+    Batch batch;
+    for (auto &request : requests) {
+        batch.push_back(request->first());
     }
+    std::shared_ptr<ConnectionPool> p = pool;
+    reactor.post([p, requests, batch] {
+        for (auto &request : requests) {
+            request->start();
+        }
+        admit(p, batch, 0);
+    });
+}
 
-    // Check how the server sends data
-    const char *str_cntlen = "Content-Length: ";
-    char *pos_cntlen = strstr(recvbuf, str_cntlen);
-    if (pos_cntlen == NULL) {
-        // Transfer-encoding: chunked
-        size_t len_chunk;
-        // get the size of the first chunk
-        if (sscanf(pos_double_crlf + 4, "%lx", &len_chunk) != 1) {
-            throw std::runtime_error("Fail to get the size of first chunk");
+std::shared_ptr<RetryingRequest> HttpsClient::retrying(PreparedRequest request, BodySink sink, Callback callback) const {
+    // the copies sent again go through the rate limits on their own, and fail once the client has gone with its pool
+    std::weak_ptr<ConnectionPool> weak = pool;
+    auto send = [weak] (Batch batch) {
+        if (std::shared_ptr<ConnectionPool> p = weak.lock()) {
+            admit(p, std::move(batch), 0);
+            return;
         }
-        // determine how many bytes remain for the first chunk
-        char *data_chunk = strstr(pos_double_crlf + 4, "\r\n");
-        if (data_chunk == NULL) {
-            throw std::runtime_error("Fail to locate first chunk");
+        auto error = std::make_exception_ptr(std::runtime_error("Connection closed"));
+        for (auto &exchange : batch) {
+            finish_exchange(*exchange, error);
         }
-        // skip "\r\n"
-        data_chunk += 2;
-        recvdata = std::string(data_chunk);
-
-        // only one chunk
-        size_t endofchunk = recvdata.find("\r\n0\r\n");
-        if (endofchunk != std::string::npos) {
-            recvdata.erase(endofchunk);
-            return;
+    };
+    return std::make_shared<RetryingRequest>(reactor, std::move(request), std::move(sink), std::move(callback), policy,
+                                             std::move(send));
+}
+
+void HttpsClient::submit(const HttpsRequest &request, const char *body, Callback callback) {
+    submit(prepare(request, body), std::move(callback));
+}
+
+void HttpsClient::submit(PreparedRequest request, Callback callback) {
+    post({retrying(std::move(request), nullptr, std::move(callback))});
+}
+
+void HttpsClient::submit(const HttpsRequest &request, const char *body, BodySink sink, Callback callback) {
+    submit(prepare(request, body), std::move(sink), std::move(callback));
+}
+
+void HttpsClient::submit(PreparedRequest request, BodySink sink, Callback callback) {
+    post({retrying(std::move(request), std::move(sink), std::move(callback))});
+}
+
+void HttpsClient::submit_batch(const std::vector<HttpsRequest> &requests, const std::vector<const char *> &bodies,
+                               std::vector<Callback> callbacks) {
+    if (requests.size() != bodies.size()) {
+        throw std::runtime_error("Each request of a batch needs a body");
+    }
+    std::vector<PreparedRequest> prepared;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        prepared.push_back(prepare(requests[i], bodies[i]));
+    }
+    submit_batch(std::move(prepared), std::move(callbacks));
+}
+
+void HttpsClient::submit_batch(std::vector<PreparedRequest> requests, std::vector<Callback> callbacks) {
+    if (requests.size() != callbacks.size()) {
+        throw std::runtime_error("Each request of a batch needs a callback");
+    }
+    std::vector<std::shared_ptr<RetryingRequest>> batch;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        batch.push_back(retrying(std::move(requests[i]), nullptr, std::move(callbacks[i])));
+    }
+    post(std::move(batch));
+}
+
+std::exception_ptr status_error(int status) {
+    return std::make_exception_ptr(std::runtime_error("Status code " + std::to_string(status) + " indicates not success"));
+}
+
+// the callback fulfilling promise with the body, or with an error if the status code indicates not success
+static HttpsClient::Callback settle(std::shared_ptr<std::promise<std::string>> promise) {
+    return [promise] (std::exception_ptr error, HttpsResponse &response) {
+        if (error) {
+            promise->set_exception(error);
+        } else if (response.status / 100 != 2) {
+            promise->set_exception(status_error(response.status));
+        } else {
+            promise->set_value(std::move(response.body));
         }
+    };
+}
+
+std::future<std::string> HttpsClient::async_writeread(const HttpsRequest &request, const char *body) {
+    auto promise = std::make_shared<std::promise<std::string>>();
+    submit(request, body, settle(promise));
+    return promise->get_future();
+}
+
+void HttpsClient::writeread(const HttpsRequest &request, const char *body, std::string &recvdata) {
+    writeread(prepare(request, body), recvdata);
+}
+
+void HttpsClient::writeread(PreparedRequest request, std::string &recvdata) {
+    if (reactor.in_loop_thread()) {
+        throw std::runtime_error("writeread would block the reactor thread");
+    }
+    auto promise = std::make_shared<std::promise<std::string>>();
+    submit(std::move(request), settle(promise));
+    recvdata = promise->get_future().get();
+}
+
+void HttpsClient::writeread(const HttpsRequest &request, const char *body, BodySink sink) {
+    writeread(prepare(request, body), std::move(sink));
+}
+
+void HttpsClient::writeread(PreparedRequest request, BodySink sink) {
+    if (reactor.in_loop_thread()) {
+        throw std::runtime_error("writeread would block the reactor thread");
+    }
+    auto promise = std::make_shared<std::promise<void>>();
+    submit(std::move(request), std::move(sink), [promise] (std::exception_ptr error, HttpsResponse &response) {
+        if (error) {
+            promise->set_exception(error);
+        } else if (response.status / 100 != 2) {
+            promise->set_exception(status_error(response.status));
+        } else {
+            promise->set_value();
+        }
+    });
+    promise->get_future().get();
+}
+
+void HttpsClient::writeread_batch(const std::vector<HttpsRequest> &requests, const std::vector<const char *> &bodies,
+                                  std::vector<std::string> &recvdata) {
+    if (requests.size() != bodies.size()) {
+        throw std::runtime_error("Each request of a batch needs a body");
+    }
+    std::vector<PreparedRequest> prepared;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        prepared.push_back(prepare(requests[i], bodies[i]));
+    }
+    writeread_batch(std::move(prepared), recvdata);
+}
+
+std::vector<std::future<std::string>> HttpsClient::async_writeread_batch(std::vector<PreparedRequest> requests) {
+    std::vector<std::future<std::string>> futures;
+    std::vector<Callback> callbacks;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        futures.push_back(promise->get_future());
+        callbacks.push_back(settle(promise));
+    }
+    submit_batch(std::move(requests), std::move(callbacks));
+    return futures;
+}
+
+void HttpsClient::writeread_batch(std::vector<PreparedRequest> requests, std::vector<std::string> &recvdata) {
+    if (reactor.in_loop_thread()) {
+        throw std::runtime_error("writeread_batch would block the reactor thread");
+    }
+    std::vector<std::future<std::string>> futures = async_writeread_batch(std::move(requests));
+
+    // wait for every response before throwing the first failure
+    recvdata.assign(futures.size(), "");
+    std::exception_ptr first;
+    for (size_t i = 0; i < futures.size(); ++i) {
+        try {
+            recvdata[i] = futures[i].get();
+        } catch (...) {
+            first = first ? first : std::current_exception();
+        }
+    }
+    if (first) {
+        std::rethrow_exception(first);
+    }
+}
 
-        // read the data of chunk include "\r\n"
-        read_fixed_size(recvbuf, recvdata, len_chunk + 2 - recvdata.length());
-        do {
-            num_received = 0;
-            do {
-                int ret = SSL_read(ssl, recvbuf + num_received, 1);
-                if (ret <= 0) {
-                    throw std::runtime_error("SSL_read fails");
+PreparedRequest::PreparedRequest(std::string text, bool idempotent)
+    : text(std::make_shared<const std::string>(std::move(text))), _idempotent(idempotent) {
+    total = this->text->length();
+    std::string endpoint = metrics_endpoint_name(this->text->substr(0, this->text->find("\r\n")));
+    _metrics = &metrics_endpoint(endpoint);
+    std::string cookie;
+    size_t header = this->text->find("\r\nCookie: ");
+    if (header != std::string::npos) {
+        size_t start = header + 10;
+        cookie = this->text->substr(start, this->text->find("\r\n", start) - start);
+    }
+    _throttle = &RateLimiter::throttle(endpoint, cookie);
+    pieces.push_back({false, 0, total});
+}
+
+size_t PreparedRequest::gather(size_t offset, char *out, size_t len) const {
+    size_t copied = 0;
+    for (const Piece &piece : pieces) {
+        if (copied == len) {
+            break;
+        }
+        if (offset >= piece.length) {
+            offset -= piece.length;
+            continue;
+        }
+        const char *src = (piece.owned ? fields.data() : text->data()) + piece.offset + offset;
+        size_t n = std::min(piece.length - offset, len - copied);
+        memcpy(out + copied, src, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+size_t PreparedRequest::segments(size_t offset, struct iovec *iov, size_t count) const {
+    size_t filled = 0;
+    for (const Piece &piece : pieces) {
+        if (filled == count) {
+            break;
+        }
+        if (offset >= piece.length) {
+            offset -= piece.length;
+            continue;
+        }
+        const char *src = (piece.owned ? fields.data() : text->data()) + piece.offset + offset;
+        iov[filled].iov_base = const_cast<char *>(src);
+        iov[filled].iov_len = piece.length - offset;
+        ++filled;
+        offset = 0;
+    }
+    return filled;
+}
+
+// placeholders are a control character never found in a request, followed by the index of the field
+static const char FIELD_MARK = '\x01';
+
+std::string RequestTemplate::field(unsigned i) {
+    if (i >= 10) {
+        throw std::runtime_error("A request template has at most 10 fields");
+    }
+    return std::string(1, FIELD_MARK) + static_cast<char>('0' + i);
+}
+
+RequestTemplate::RequestTemplate(const std::string &host, const std::string &cookie, const HttpsRequest &request,
+                                 const char *body) : idempotent(request.method == HttpsMethod::GET) {
+    std::string buf;
+
+    // split str into constant text and fields
+    auto add = [this, &buf] (const std::string &str, bool in_body) {
+        size_t pos = 0;
+        while (pos < str.length()) {
+            size_t mark = str.find(FIELD_MARK, pos);
+            size_t end = mark == std::string::npos ? str.length() : mark;
+            if (end > pos) {
+                if (!parts.empty() && parts.back().kind == Part::TEXT && parts.back().in_body == in_body) {
+                    parts.back().length += end - pos;
+                } else {
+                    parts.push_back({Part::TEXT, buf.length(), end - pos, in_body});
+                }
+                buf.append(str, pos, end - pos);
+                if (in_body) {
+                    body_length += end - pos;
                 }
-                num_received += ret;
-            } while (recvbuf[num_received - 1] != '\n');
-            // read the size of chunk
-            if (sscanf(recvbuf, "%lx", &len_chunk) != 1) {
-                throw std::runtime_error("Fail to get the size of chunk");
             }
-            // read the data of chunk include "\r\n"
-            read_fixed_size(recvbuf, recvdata, len_chunk + 2);
-        } while (len_chunk != 0);
-    } else {
-        // Content-Length
-        size_t datalen;
-        if (sscanf(pos_cntlen + strlen(str_cntlen), "%lu", &datalen) != 1) {
-            throw std::runtime_error("Fail to get Content-Length");
+            if (mark == std::string::npos) {
+                break;
+            }
+            if (mark + 1 >= str.length() || str[mark + 1] < '0' || str[mark + 1] > '9') {
+                throw std::runtime_error("Malformed field in request template");
+            }
+            parts.push_back({Part::FIELD, static_cast<size_t>(str[mark + 1] - '0'), 0, in_body});
+            pos = mark + 2;
+        }
+    };
+
+    std::string head = request.method == HttpsMethod::GET ? "GET " : "POST ";
+    head += request.url + " HTTP/1.1\r\n";
+    std::string endpoint = metrics_endpoint_name(head);
+    metrics = &metrics_endpoint(endpoint);
+    throttle = &RateLimiter::throttle(endpoint, cookie);
+    head += "Host: " + host + "\r\n";
+    for (auto it : request.header) {
+        // the length depends on the fields, so it is filled in with them
+        if (strcasecmp(it.first.c_str(), "Content-Length") != 0) {
+            head += it.first + ": " + it.second + "\r\n";
         }
+    }
+    head += "Cookie: " + cookie + "\r\n";
+    if (body != nullptr) {
+        head += "Content-Length: ";
+    }
+    add(head, false);
+    if (body != nullptr) {
+        parts.push_back({Part::LENGTH, 0, 0, false});
+        add("\r\n", false);
+    }
+    add("\r\n", false);
+    if (body != nullptr) {
+        add(body, true);
+    }
+    text = std::make_shared<const std::string>(std::move(buf));
+}
 
-        recvdata = std::string(pos_double_crlf + 4ul);
-        if (recvdata.length() < datalen) {
-            read_fixed_size(recvbuf, recvdata, datalen - recvdata.length());
+PreparedRequest RequestTemplate::fill(std::initializer_list<std::string_view> values) const {
+    const std::string_view *value = values.begin();
+    size_t length = body_length, fields = 0;
+    for (const Part &part : parts) {
+        if (part.kind == Part::FIELD) {
+            if (part.offset >= values.size()) {
+                throw std::runtime_error("A field of the request template is not filled in");
+            }
+            fields += value[part.offset].size();
+            length += part.in_body ? value[part.offset].size() : 0;
+        }
+    }
+    std::string content_length = std::to_string(length);
+
+    PreparedRequest request;
+    request.text = text;
+    request._idempotent = idempotent;
+    request._metrics = metrics;
+    request._throttle = throttle;
+    request.fields.reserve(fields + content_length.length());
+    request.pieces.reserve(parts.size());
+    for (const Part &part : parts) {
+        std::string_view str;
+        switch (part.kind) {
+            case Part::TEXT:
+                request.pieces.push_back({false, part.offset, part.length});
+                request.total += part.length;
+                continue;
+            case Part::FIELD:
+                str = value[part.offset];
+                break;
+            case Part::LENGTH:
+                str = content_length;
+                break;
         }
+        request.pieces.push_back({true, request.fields.length(), str.size()});
+        request.fields.append(str.data(), str.size());
+        request.total += str.size();
     }
+    return request;
 }
 
 // the same boundary for all post
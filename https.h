@@ -10,8 +10,15 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
-#include <mutex>
+#include <memory>
+#include <functional>
+#include <future>
+#include <exception>
+#include <string_view>
+#include <chrono>
+#include <initializer_list>
 
+#include <sys/uio.h>
 #include <openssl/ssl.h>
 
 enum HttpsMethod { GET, POST };
@@ -27,9 +34,120 @@ typedef struct {
     HttpsMethod method;
     std::string url;
     Header header;
-    // std::string cookie;
+    // cookie of the account issuing the request, the client's own cookie is used if empty
+    std::string cookie;
 } HttpsRequest;
 
+// structure of https response
+typedef struct {
+    int status;
+    // names of the headers are in lower case
+    Header header;
+    std::string body;
+} HttpsResponse;
+
+// the error of a response whose status code indicates not success, naming the code
+std::exception_ptr status_error(int status);
+
+// how long a request may take and how it is sent again
+typedef struct {
+    // from submission to the response, retries included, zero for no limit
+    std::chrono::milliseconds deadline;
+    // the most copies of a request sent one after another, the first one included
+    unsigned attempts;
+    // the n-th retry waits a random time up to backoff * 2^(n-1), and at most max_backoff
+    std::chrono::milliseconds backoff, max_backoff;
+    // whether an idempotent request still unanswered at the p95 latency of its endpoint is sent once more
+    bool hedge;
+} RetryPolicy;
+
+struct EndpointMetrics;
+struct Throttle;
+
+// receives the body of a response fragment by fragment instead of HttpsResponse::body
+typedef std::function<void(const char *data, size_t len)> BodySink;
+
+/**
+ * A serialized request kept as a list of pieces and gathered into the tls record when it is written.
+ * The constant pieces point into the text of the RequestTemplate that produced it, only the fields are owned.
+ */
+class PreparedRequest {
+public:
+    // a request serialized in one piece
+    PreparedRequest(std::string text, bool idempotent);
+    PreparedRequest() : total(0), _idempotent(false), _metrics(nullptr), _throttle(nullptr) {}
+
+    // the total number of bytes of the request
+    size_t length() const { return total; }
+
+    // copy at most len bytes starting at offset into out, return the number of bytes copied
+    size_t gather(size_t offset, char *out, size_t len) const;
+
+    // point at most count iovecs at the bytes starting at offset, in place, return the number of iovecs filled
+    size_t segments(size_t offset, struct iovec *iov, size_t count) const;
+
+    // whether sending the request twice is harmless
+    bool idempotent() const { return _idempotent; }
+
+    // the metrics of the endpoint of the request
+    EndpointMetrics *metrics() const { return _metrics; }
+
+    // the rate limits of the endpoint and the account of the request
+    Throttle *throttle() const { return _throttle; }
+private:
+    friend class RequestTemplate;
+
+    typedef struct {
+        // whether the piece is in fields rather than in the text of the template
+        bool owned;
+        size_t offset, length;
+    } Piece;
+
+    std::shared_ptr<const std::string> text;
+    std::string fields;
+    std::vector<Piece> pieces;
+    size_t total;
+    bool _idempotent;
+    EndpointMetrics *_metrics;
+    Throttle *_throttle;
+};
+
+/**
+ * Requests to one endpoint serialized once, with placeholders for the fields that change between requests.
+ * Placeholders made by field(i) may appear in the url, the header values and the body,
+ * and Content-Length is computed when the fields are filled in.
+ */
+class RequestTemplate {
+public:
+    // the placeholder of the i-th field, i < 10
+    static std::string field(unsigned i);
+
+    // host and cookie are written in the template, body may be nullptr
+    RequestTemplate(const std::string &host, const std::string &cookie, const HttpsRequest &request, const char *body);
+    RequestTemplate() = default;
+
+    // the request with the i-th field replaced by values[i], the constant text is shared rather than copied
+    PreparedRequest fill(std::initializer_list<std::string_view> values = {}) const;
+private:
+    typedef struct {
+        enum { TEXT, FIELD, LENGTH } kind;
+        // the range of text, or the index of the field
+        size_t offset, length;
+        bool in_body;
+    } Part;
+
+    std::shared_ptr<const std::string> text;
+    std::vector<Part> parts;
+    // the length of the body without its fields
+    size_t body_length = 0;
+    bool idempotent = false;
+    EndpointMetrics *metrics = nullptr;
+    Throttle *throttle = nullptr;
+};
+
+class Reactor;
+class ConnectionPool;
+class RetryingRequest;
 
 class HttpsClient {
 public:
@@ -39,44 +157,102 @@ public:
     // header used in each request
     static const Header default_header;
 
-    // given the name of host and cookie, establish an https connection
+    // the policy of the clients created afterwards
+    static void set_default_policy(const RetryPolicy &policy);
+    static RetryPolicy get_default_policy();
+
+    /**
+     * given the name of host and cookie, establish an https connection in the pool of the host
+     * the handshake goes on in the background, requests submitted meanwhile wait for it
+     */
     explicit HttpsClient(const std::string &host, const std::string &cookie);
 
-    // release ssl and socket resource
+    // wait for the first connection to the host, throws if it cannot be established
+    void wait_established();
+
+    // release the pool, which closes its connections once no client of the host is left
     ~HttpsClient();
 
-    // send the request, body if not nullptr, and write the response in recvdata
-    void writeread(const HttpsRequest &request, const char *body, std::string &recvdata);
-private:
+    // the deadline, the retries and the hedging of the requests submitted afterwards
+    void set_policy(const RetryPolicy &policy) { this->policy = policy; }
+
+    /**
+     * called in the reactor thread when the response arrives or the request fails for good, retries included,
+     * error is nullptr on success, and response is valid whatever the status code is
+     */
+    typedef std::function<void(std::exception_ptr error, HttpsResponse &response)> Callback;
+
+    // serialize the request, body if not nullptr, for submit()
+    PreparedRequest prepare(const HttpsRequest &request, const char *body) const;
+
+    // serialize requests to the same endpoint once, with the host and cookie of the client unless request has its own
+    RequestTemplate compile(const HttpsRequest &request, const char *body) const;
 
-    // the buffer size used to read from socket, 4096 by default
-    static const size_t BUFSIZE;
+    // send the request, body if not nullptr, and call callback with the response, never blocks
+    void submit(const HttpsRequest &request, const char *body, Callback callback);
+    void submit(PreparedRequest request, Callback callback);
 
-    // establish ssl connection
-    void establish();
+    // send the request and pass the body of the response to sink as it arrives, sink is called in the reactor thread
+    void submit(const HttpsRequest &request, const char *body, BodySink sink, Callback callback);
+    void submit(PreparedRequest request, BodySink sink, Callback callback);
 
-    // re-establish when we haven't sent message for long time and server closed connection
-    void re_establish();
+    // send the request, body if not nullptr, the future throws if the status code indicates not success
+    std::future<std::string> async_writeread(const HttpsRequest &request, const char *body);
 
     /**
-     * using recvbuf, read len_chunk bytes from the socket and append to recvdata
-     * the content to be read is required to end in "\\r\\n", which will be erased by the function
+     * send the request, body if not nullptr, and write the response in recvdata
+     * blocks until the response arrives, so it must not be called in the reactor thread
      */
-    void read_fixed_size(char *recvbuf, std::string &recvdata, const size_t len_chunk);
+    void writeread(const HttpsRequest &request, const char *body, std::string &recvdata);
+    void writeread(PreparedRequest request, std::string &recvdata);
+
+    /**
+     * send the request and pass the body of the response to sink as it arrives, e.g. to a JsonExtractor
+     * blocks until the response ends, and throws if the status code indicates not success
+     */
+    void writeread(const HttpsRequest &request, const char *body, BodySink sink);
+    void writeread(PreparedRequest request, BodySink sink);
+
+    /**
+     * pipeline the requests back-to-back on one connection, bodies[i] is the body of requests[i] or nullptr,
+     * and callbacks[i] is called with the response of requests[i], in order
+     * if the server closes the connection in the middle, the requests not answered yet are sent again on another connection
+     * if they are idempotent or not written yet, and the others fail
+     */
+    void submit_batch(const std::vector<HttpsRequest> &requests, const std::vector<const char *> &bodies,
+                      std::vector<Callback> callbacks);
+    void submit_batch(std::vector<PreparedRequest> requests, std::vector<Callback> callbacks);
+
+    /**
+     * pipeline the requests and write the responses in recvdata in the same order
+     * blocks until all responses arrive, and throws the first failure
+     */
+    void writeread_batch(const std::vector<HttpsRequest> &requests, const std::vector<const char *> &bodies,
+                         std::vector<std::string> &recvdata);
+    void writeread_batch(std::vector<PreparedRequest> requests, std::vector<std::string> &recvdata);
+
+    // pipeline the requests, the i-th future gives the body of the i-th response or throws its failure
+    std::vector<std::future<std::string>> async_writeread_batch(std::vector<PreparedRequest> requests);
+private:
+    // build the request line, headers and body
+    std::string serialize(const HttpsRequest &request, const char *body) const;
+
+    // hand the first copies of the requests over to the pool as one batch, and start them in the reactor thread
+    void post(std::vector<std::shared_ptr<RetryingRequest>> requests);
 
-    // send all messages using SSL_write
-    void write_helper(const std::string &sendbuf);
+    // the request sending request under the policy of the client
+    std::shared_ptr<RetryingRequest> retrying(PreparedRequest request, BodySink sink, Callback callback) const;
 
-    // used for synchronization in writeread()
-    std::mutex m;
+    // all connections are driven by this reactor
+    Reactor &reactor;
 
     // store the host
     std::string _host, _cookie;
+    RetryPolicy policy;
 
-    // ssl and socket related
-    SSL_CTX *ctx;
-    SSL *ssl;
-    int sockfd;
+    // connections to the host, shared with other clients of the host
+    std::shared_ptr<ConnectionPool> pool;
+    std::shared_future<void> established;
 };
 
 /**
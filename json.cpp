@@ -0,0 +1,552 @@
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "json.h"
+
+#ifdef __SSE2__
+// bits of the bytes of the 16 at p equal to c
+static inline unsigned match(__m128i chunk, char c) {
+    return static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c))));
+}
+#endif
+
+// the first '"' or '\\' in [p, end), end if none
+static const char *find_quote(const char *p, const char *end) {
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        unsigned bits = match(chunk, '"') | match(chunk, '\\');
+        if (bits != 0) {
+            return p + __builtin_ctz(bits);
+        }
+    }
+#endif
+    for (; p < end; ++p) {
+        if (*p == '"' || *p == '\\') {
+            return p;
+        }
+    }
+    return end;
+}
+
+// the first '"', '{', '}', '[' or ']' in [p, end), end if none
+static const char *find_structural(const char *p, const char *end) {
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        // '[' and ']' differ from '{' and '}' only in bit 0x20
+        __m128i folded = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+        unsigned bits = match(chunk, '"') | match(folded, '{') | match(folded, '}');
+        if (bits != 0) {
+            return p + __builtin_ctz(bits);
+        }
+    }
+#endif
+    for (; p < end; ++p) {
+        char c = *p;
+        if (c == '"' || c == '{' || c == '}' || c == '[' || c == ']') {
+            return p;
+        }
+    }
+    return end;
+}
+
+static unsigned hex4(const char *p) {
+    unsigned value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= static_cast<unsigned>(c - '0');
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            value |= static_cast<unsigned>((c | 0x20) - 'a' + 10);
+        } else {
+            throw std::runtime_error("Invalid \\u escape in json string");
+        }
+    }
+    return value;
+}
+
+static void append_utf8(std::string &out, unsigned code) {
+    if (code < 0x80) {
+        out += static_cast<char>(code);
+    } else if (code < 0x800) {
+        out += static_cast<char>(0xc0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        out += static_cast<char>(0xe0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code & 0x3f));
+    }
+}
+
+// append the decoded content of the raw string in [p, end) to out
+static void unescape(const char *p, const char *end, std::string &out) {
+    while (p < end) {
+        const char *q = static_cast<const char *>(memchr(p, '\\', static_cast<size_t>(end - p)));
+        if (q == NULL) {
+            out.append(p, static_cast<size_t>(end - p));
+            return;
+        }
+        out.append(p, static_cast<size_t>(q - p));
+        p = q;
+        if (end - p < 2) {
+            throw std::runtime_error("Invalid escape in json string");
+        }
+        char c = p[1];
+        p += 2;
+        switch (c) {
+            case '"': case '\\': case '/': out += c; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                if (end - p < 4) {
+                    throw std::runtime_error("Invalid \\u escape in json string");
+                }
+                unsigned code = hex4(p);
+                p += 4;
+                // a high surrogate followed by a low one encodes a code point beyond the basic plane
+                if (code >= 0xd800 && code < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    unsigned low = hex4(p + 2);
+                    if (low >= 0xdc00 && low < 0xe000) {
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                    }
+                }
+                append_utf8(out, code);
+                break;
+            }
+            default:
+                throw std::runtime_error("Invalid escape in json string");
+        }
+    }
+}
+
+static bool number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+// the json number in [s, s + len), truncated to an integer and clamped to the range of int64_t
+static int64_t to_int64(const char *s, size_t len) {
+    const char *p = s, *end = s + len;
+    bool negative = p < end && *p == '-';
+    if (negative) {
+        ++p;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        throw std::runtime_error("Invalid json number");
+    }
+    // up to 18 digits cannot overflow
+    const char *digits = p;
+    uint64_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 18) {
+        value = value * 10 + static_cast<uint64_t>(*p - '0');
+        ++p;
+    }
+    if (p == end) {
+        return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+    }
+    // a long integer, clamped by strtoll, or a fraction or an exponent, both need it terminated
+    std::string number(s, len);
+    char *stop;
+    long long integer = strtoll(number.c_str(), &stop, 10);
+    if (stop == number.c_str() + len) {
+        return integer;
+    }
+    double d = strtod(number.c_str(), &stop);
+    if (stop != number.c_str() + len) {
+        throw std::runtime_error("Invalid json number");
+    }
+    // out of range, such as 1e400 which is infinite, the cast is undefined
+    const double limit = 9223372036854775808.0;
+    if (std::isnan(d)) {
+        return 0;
+    }
+    if (d >= limit) {
+        return std::numeric_limits<int64_t>::max();
+    }
+    if (d <= -limit) {
+        return std::numeric_limits<int64_t>::min();
+    }
+    return static_cast<int64_t>(d);
+}
+
+JsonExtractor::JsonExtractor() : nodes(1) {
+    nodes[0].element = NONE;
+    reset();
+}
+
+JsonExtractor::Handler &JsonExtractor::handler(const std::string &path) {
+    size_t current = 0;
+    size_t i = 0;
+    while (i < path.length()) {
+        if (path.compare(i, 2, "[]") == 0) {
+            if (nodes[current].element == NONE) {
+                nodes[current].element = nodes.size();
+                nodes.push_back(Node{{}, NONE});
+            }
+            current = nodes[current].element;
+            i += 2;
+            continue;
+        }
+        if (path[i] == '.') {
+            ++i;
+        }
+        size_t j = std::min(path.find_first_of(".[", i), path.length());
+        size_t child = member(current, path.data() + i, j - i);
+        if (child == NONE) {
+            child = nodes.size();
+            nodes.push_back(Node{{}, NONE});
+            edges.push_back(Edge{current, path.substr(i, j - i), child});
+        }
+        current = child;
+        i = j;
+    }
+    return nodes[current].handler;
+}
+
+size_t JsonExtractor::member(size_t parent, const char *key, size_t len) const {
+    // a handful of edges, compared by parent first
+    for (const Edge &edge : edges) {
+        if (edge.parent == parent && edge.key.length() == len && memcmp(edge.key.data(), key, len) == 0) {
+            return edge.child;
+        }
+    }
+    return NONE;
+}
+
+void JsonExtractor::on_number(const std::string &path, std::function<void(int64_t)> fn) {
+    handler(path).number = fn;
+}
+
+void JsonExtractor::on_string(const std::string &path, std::function<void(const std::string &)> fn) {
+    handler(path).string = fn;
+}
+
+void JsonExtractor::on_bool(const std::string &path, std::function<void(bool)> fn) {
+    handler(path).boolean = fn;
+}
+
+void JsonExtractor::on_end(const std::string &path, std::function<void()> fn) {
+    handler(path).end = fn;
+}
+
+void JsonExtractor::reset() {
+    state = State::VALUE;
+    node = 0;
+    stack.clear();
+    token.clear();
+    keep = false;
+    escaped = false;
+    skip_depth = 0;
+    skip_in_string = false;
+}
+
+void JsonExtractor::feed(const char *data, size_t len) {
+    const char *p = data, *end = data + len;
+    while (p < end) {
+        switch (state) {
+            case State::KEY:
+            case State::STRING:
+                p = scan_string(p, end, state == State::KEY || keep);
+                break;
+            case State::NUMBER:
+            case State::LITERAL:
+                p = scan_scalar(p, end);
+                break;
+            case State::SKIP:
+                p = scan_skip(p, end);
+                break;
+            default:
+                if (step(*p)) {
+                    ++p;
+                }
+                break;
+        }
+    }
+}
+
+void JsonExtractor::finish() {
+    if (state == State::NUMBER || state == State::LITERAL) {
+        end_scalar(token.data(), token.length());
+        token.clear();
+    }
+    if (state != State::END) {
+        throw std::runtime_error("Truncated json");
+    }
+}
+
+bool JsonExtractor::step(char c) {
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+        return true;
+    }
+    switch (state) {
+        case State::VALUE:
+            return begin_value(c);
+        case State::ARRAY_FIRST:
+            if (c == ']') {
+                close();
+                return true;
+            }
+            return begin_value(c);
+        case State::KEY_OR_END:
+            if (c == '}') {
+                close();
+                return true;
+            }
+            // fall through
+        case State::NEXT_KEY:
+            if (c != '"') {
+                throw std::runtime_error("Expect a key in json object");
+            }
+            state = State::KEY;
+            return true;
+        case State::COLON:
+            if (c != ':') {
+                throw std::runtime_error("Expect ':' in json object");
+            }
+            state = State::VALUE;
+            return true;
+        case State::NEXT:
+            if (stack.empty()) {
+                throw std::runtime_error("Unexpected data after json document");
+            }
+            if (c == ',') {
+                // a key or a value must follow, so that a trailing comma is refused
+                if (stack.back().type == '{') {
+                    state = State::NEXT_KEY;
+                } else {
+                    node = nodes[stack.back().node].element;
+                    state = State::VALUE;
+                }
+            } else if (c == (stack.back().type == '{' ? '}' : ']')) {
+                close();
+            } else {
+                throw std::runtime_error("Expect ',' or the end of a json object or array");
+            }
+            return true;
+        case State::END:
+            throw std::runtime_error("Unexpected data after json document");
+        default:
+            return true;
+    }
+}
+
+bool JsonExtractor::begin_value(char c) {
+    switch (c) {
+        case '{':
+        case '[':
+            if (node == NONE) {
+                skip_depth = 1;
+                skip_in_string = false;
+                escaped = false;
+                state = State::SKIP;
+                break;
+            }
+            stack.push_back(Frame{c, node});
+            if (c == '[') {
+                node = nodes[node].element;
+                state = State::ARRAY_FIRST;
+            } else {
+                state = State::KEY_OR_END;
+            }
+            break;
+        case '"':
+            keep = node != NONE && nodes[node].handler.string;
+            state = State::STRING;
+            break;
+        case 't':
+        case 'f':
+        case 'n':
+            // the scalar is read from this character on
+            state = State::LITERAL;
+            return false;
+        default:
+            if (c != '-' && (c < '0' || c > '9')) {
+                throw std::runtime_error("Invalid json value");
+            }
+            state = State::NUMBER;
+            return false;
+    }
+    return true;
+}
+
+void JsonExtractor::close() {
+    size_t closed = stack.back().node;
+    stack.pop_back();
+    const Handler &h = nodes[closed].handler;
+    if (h.end) {
+        h.end();
+    }
+    state = stack.empty() ? State::END : State::NEXT;
+}
+
+const char *JsonExtractor::scan_scalar(const char *p, const char *end) {
+    const char *q = p;
+    if (state == State::NUMBER) {
+        while (q < end && number_char(*q)) {
+            ++q;
+        }
+    } else {
+        while (q < end && *q >= 'a' && *q <= 'z') {
+            ++q;
+        }
+    }
+    if (q == end) {
+        // the scalar may go on in the next fragment
+        token.append(p, static_cast<size_t>(q - p));
+        return end;
+    }
+    if (token.empty()) {
+        end_scalar(p, static_cast<size_t>(q - p));
+    } else {
+        token.append(p, static_cast<size_t>(q - p));
+        end_scalar(token.data(), token.length());
+        token.clear();
+    }
+    return q;
+}
+
+void JsonExtractor::end_scalar(const char *s, size_t len) {
+    const Handler *h = node != NONE ? &nodes[node].handler : nullptr;
+    if (state == State::NUMBER) {
+        if (h != nullptr && h->number) {
+            h->number(to_int64(s, len));
+        }
+    } else {
+        bool value = len == 4 && memcmp(s, "true", 4) == 0;
+        bool null = len == 4 && memcmp(s, "null", 4) == 0;
+        if (!value && !null && !(len == 5 && memcmp(s, "false", 5) == 0)) {
+            throw std::runtime_error("Invalid json literal");
+        }
+        if (!null && h != nullptr && h->boolean) {
+            h->boolean(value);
+        }
+    }
+    state = stack.empty() ? State::END : State::NEXT;
+}
+
+const char *JsonExtractor::scan_string(const char *p, const char *end, bool keep) {
+    while (p < end) {
+        if (escaped) {
+            // the escaped byte, the rest of a \u escape is plain content
+            if (keep) {
+                token += *p;
+            }
+            escaped = false;
+            ++p;
+            continue;
+        }
+        const char *q = find_quote(p, end);
+        if (q != end && *q == '"' && token.empty()) {
+            // the whole string lies in this fragment without escape, no copy needed
+            if (keep) {
+                end_string(p, static_cast<size_t>(q - p), false);
+            } else {
+                state = stack.empty() ? State::END : State::NEXT;
+            }
+            return q + 1;
+        }
+        if (keep) {
+            token.append(p, static_cast<size_t>(q - p));
+        }
+        if (q == end) {
+            return end;
+        }
+        if (*q == '\\') {
+            if (keep) {
+                token += '\\';
+            }
+            escaped = true;
+            p = q + 1;
+            continue;
+        }
+        // the closing quote
+        if (keep) {
+            end_string(token.data(), token.length(), true);
+        } else {
+            state = stack.empty() ? State::END : State::NEXT;
+        }
+        token.clear();
+        return q + 1;
+    }
+    return end;
+}
+
+void JsonExtractor::end_string(const char *s, size_t len, bool raw) {
+    if (raw && memchr(s, '\\', len) != NULL) {
+        text.clear();
+        unescape(s, s + len, text);
+        s = text.data();
+        len = text.length();
+    }
+    if (state == State::KEY) {
+        node = member(stack.back().node, s, len);
+        state = State::COLON;
+        return;
+    }
+    if (s != text.data()) {
+        text.assign(s, len);
+    }
+    nodes[node].handler.string(text);
+    state = stack.empty() ? State::END : State::NEXT;
+}
+
+const char *JsonExtractor::scan_skip(const char *p, const char *end) {
+    while (p < end) {
+        if (skip_in_string) {
+            if (escaped) {
+                escaped = false;
+                ++p;
+                continue;
+            }
+            const char *q = find_quote(p, end);
+            if (q == end) {
+                return end;
+            }
+            if (*q == '\\') {
+                escaped = true;
+            } else {
+                skip_in_string = false;
+            }
+            p = q + 1;
+            continue;
+        }
+        const char *q = find_structural(p, end);
+        if (q == end) {
+            return end;
+        }
+        p = q + 1;
+        switch (*q) {
+            case '"':
+                skip_in_string = true;
+                break;
+            case '{':
+            case '[':
+                ++skip_depth;
+                break;
+            default:
+                if (--skip_depth == 0) {
+                    state = stack.empty() ? State::END : State::NEXT;
+                    return p;
+                }
+                break;
+        }
+    }
+    return end;
+}
@@ -0,0 +1,128 @@
+/**
+ * json.h
+ *
+ * Header file for the streaming extraction of fields from json responses
+ */
+
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+/**
+ * SAX-style extractor pulling typed fields out of a json document in one pass.
+ * A field is addressed by the keys leading to it from the root, separated by '.',
+ * where "[]" stands for every element of an array, e.g. "data.list[].room_info.room_id".
+ * Bytes may be fed in fragments of any size, such as the body fragments of a response as they arrive.
+ * The registered paths and their prefixes form a tree of nodes, so that the parser follows the document down it
+ * one key at a time instead of building and hashing the path of every value.
+ * Keys, numbers and literals are read in place within the fragment, and only copied when they straddle two.
+ * Objects and arrays leading to no field are skipped with a vectorized scan of the structural characters.
+ */
+class JsonExtractor {
+public:
+    JsonExtractor();
+
+    // called with each number, string or boolean found at path, numbers are truncated to integers within int64_t
+    void on_number(const std::string &path, std::function<void(int64_t)> fn);
+    void on_string(const std::string &path, std::function<void(const std::string &)> fn);
+    void on_bool(const std::string &path, std::function<void(bool)> fn);
+
+    // called when the object or array at path ends, e.g. to emit a record once all its fields are known
+    void on_end(const std::string &path, std::function<void()> fn);
+
+    // parse the next fragment of the document
+    void feed(const char *data, size_t len);
+
+    // the document ends, throws if it is truncated
+    void finish();
+
+    // parse another document with the same handlers
+    void reset();
+private:
+    enum State { VALUE, ARRAY_FIRST, KEY_OR_END, NEXT_KEY, KEY, COLON, NEXT, STRING, NUMBER, LITERAL, SKIP, END };
+
+    // the node of a value leading to no field
+    static const size_t NONE = SIZE_MAX;
+
+    typedef struct {
+        std::function<void(int64_t)> number;
+        std::function<void(const std::string &)> string;
+        std::function<void(bool)> boolean;
+        std::function<void()> end;
+    } Handler;
+
+    // a registered path or a prefix of one, the root being node 0
+    typedef struct {
+        Handler handler;
+        // the node of the elements if this is an array, NONE if they lead to no field
+        size_t element;
+    } Node;
+
+    // the member key of the object at node parent, leading to node child
+    typedef struct {
+        size_t parent;
+        std::string key;
+        size_t child;
+    } Edge;
+
+    // an open object or array, and its node
+    typedef struct {
+        char type;
+        size_t node;
+    } Frame;
+
+    // the node of path, added with every node leading to it if missing
+    Handler &handler(const std::string &path);
+
+    // the node of member key of the object at parent, NONE if no field lies under it
+    size_t member(size_t parent, const char *key, size_t len) const;
+
+    // consume one character outside strings, scalars and skipped values, return false to see it again in the new state
+    bool step(char c);
+
+    // start a value at the current node, return false if c is the first character of a scalar to read again
+    bool begin_value(char c);
+
+    // the object or array at the top of the stack ends
+    void close();
+
+    // consume the bytes of a number or literal, return the position after what is consumed
+    const char *scan_scalar(const char *p, const char *end);
+
+    // the number or literal in [s, s + len) ends
+    void end_scalar(const char *s, size_t len);
+
+    // consume the bytes of a string up to its closing quote, return the position after what is consumed
+    const char *scan_string(const char *p, const char *end, bool keep);
+
+    // the key or kept string in [s, s + len) ends, raw if it may hold escapes
+    void end_string(const char *s, size_t len, bool raw);
+
+    // consume the bytes of a skipped object or array, return the position after what is consumed
+    const char *scan_skip(const char *p, const char *end);
+
+    std::vector<Node> nodes;
+    std::vector<Edge> edges;
+
+    State state;
+    // the node of the value to come, or of the one being read
+    size_t node;
+    std::vector<Frame> stack;
+    // the raw key, string, number or literal being read, once it straddles two fragments
+    std::string token;
+    // the decoded string given to a handler
+    std::string text;
+    // whether the string being read is kept for a handler
+    bool keep;
+    // whether the previous byte of the string is an unescaped backslash
+    bool escaped;
+    // nesting level and string state of the value being skipped
+    size_t skip_depth;
+    bool skip_in_string;
+};
+
+#endif /* _JSON_H_ */
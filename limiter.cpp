@@ -0,0 +1,174 @@
+#include <time.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdlib>
+
+#include "limiter.h"
+
+// the api answers bursts from one account with 412 long before the limits of an endpoint
+RateLimit::Options RateLimiter::endpoint_options = {20, 20, 0.5, 500, 1, 0.5};
+RateLimit::Options RateLimiter::account_options = {10, 10, 0.2, 100, 1, 0.5};
+
+RateLimit::RateLimit(const Options &options)
+    : options(options), _rate(options.rate), tokens(options.burst), refilled(Reactor::Clock::now()) {}
+
+void RateLimit::refill(Reactor::Clock::time_point now) {
+    if (now > refilled) {
+        tokens = std::min(options.burst, tokens + _rate * std::chrono::duration<double>(now - refilled).count());
+        refilled = now;
+    }
+}
+
+bool RateLimit::take(Reactor::Clock::time_point now) {
+    if (_rate <= 0) {
+        return true;
+    }
+    refill(now);
+    if (now < blocked_until || tokens < 1) {
+        return false;
+    }
+    tokens -= 1;
+    return true;
+}
+
+Reactor::Clock::duration RateLimit::wait(Reactor::Clock::time_point now) {
+    if (_rate <= 0) {
+        return Reactor::Clock::duration::zero();
+    }
+    refill(now);
+    auto refilling = std::chrono::duration_cast<Reactor::Clock::duration>(
+        std::chrono::duration<double>(tokens < 1 ? (1 - tokens) / _rate : 0));
+    return std::max(refilling, blocked_until > now ? blocked_until - now : Reactor::Clock::duration::zero());
+}
+
+void RateLimit::observe(int status, std::chrono::seconds retry_after, Reactor::Clock::time_point now) {
+    if (options.rate <= 0) {
+        return;
+    }
+    if (status == 412 || status == 429 || status == 503) {
+        refill(now);
+        _rate = std::max(options.min_rate, _rate * options.decrease);
+        tokens = std::min(tokens, 0.0);
+        blocked_until = std::max(blocked_until, now + retry_after);
+    } else if (status / 100 == 2) {
+        refill(now);
+        // only a limit holding requests back is raised, an idle one would otherwise grow without bound
+        if (tokens < 1) {
+            _rate = std::min(options.max_rate, _rate + options.increase / _rate);
+        }
+    }
+}
+
+RateLimiter &RateLimiter::instance() {
+    // never destroyed, the reactor may still call it while the process exits
+    static RateLimiter *limiter = new RateLimiter(Reactor::instance());
+    return *limiter;
+}
+
+// the account of a cookie is its user id, or the whole cookie if it has none
+static std::string cookie_account(const std::string &cookie) {
+    static const std::string key = "DedeUserID=";
+    size_t pos = cookie.find(key);
+    if (pos == std::string::npos) {
+        return cookie;
+    }
+    pos += key.length();
+    return cookie.substr(pos, cookie.find(';', pos) - pos);
+}
+
+static std::mutex registry_mutex;
+static std::map<std::string, std::unique_ptr<RateLimit>> endpoints, accounts;
+static std::map<std::pair<RateLimit *, RateLimit *>, std::unique_ptr<Throttle>> throttles;
+
+Throttle &RateLimiter::throttle(const std::string &endpoint, const std::string &cookie) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::unique_ptr<RateLimit> &e = endpoints[endpoint];
+    if (!e) {
+        e = std::make_unique<RateLimit>(endpoint_options);
+    }
+    std::unique_ptr<RateLimit> &a = accounts[cookie_account(cookie)];
+    if (!a) {
+        a = std::make_unique<RateLimit>(account_options);
+    }
+    std::unique_ptr<Throttle> &t = throttles[{e.get(), a.get()}];
+    if (!t) {
+        t = std::make_unique<Throttle>();
+        t->endpoint = e.get();
+        t->account = a.get();
+    }
+    return *t;
+}
+
+bool RateLimiter::try_acquire(Throttle &throttle) {
+    if (!throttle.waiting.empty()) {
+        return false;
+    }
+    auto now = Reactor::Clock::now();
+    // both tokens or none, so that a request held back by its account does not spend the token of its endpoint
+    if (throttle.endpoint->wait(now) > Reactor::Clock::duration::zero() ||
+        throttle.account->wait(now) > Reactor::Clock::duration::zero()) {
+        return false;
+    }
+    throttle.endpoint->take(now);
+    throttle.account->take(now);
+    return true;
+}
+
+void RateLimiter::acquire(Throttle &throttle, std::function<void()> fn) {
+    if (try_acquire(throttle)) {
+        fn();
+        return;
+    }
+    throttle.waiting.push_back(std::move(fn));
+    drain(throttle);
+}
+
+void RateLimiter::drain(Throttle &throttle) {
+    while (!throttle.waiting.empty()) {
+        auto now = Reactor::Clock::now();
+        auto wait = std::max(throttle.endpoint->wait(now), throttle.account->wait(now));
+        if (wait > Reactor::Clock::duration::zero()) {
+            if (throttle.timer == 0) {
+                Throttle *t = &throttle;
+                throttle.timer = reactor.run_at(now + wait, [this, t] {
+                    t->timer = 0;
+                    drain(*t);
+                });
+            }
+            return;
+        }
+        throttle.endpoint->take(now);
+        throttle.account->take(now);
+        auto fn = std::move(throttle.waiting.front());
+        throttle.waiting.pop_front();
+        fn();
+    }
+}
+
+// the seconds of Retry-After, given as a number or as an http date
+static std::chrono::seconds retry_after(const HttpsResponse &response) {
+    auto it = response.header.find("retry-after");
+    if (it == response.header.end()) {
+        return std::chrono::seconds(0);
+    }
+    char *end;
+    long seconds = std::strtol(it->second.c_str(), &end, 10);
+    if (end != it->second.c_str() && *end == '\0') {
+        return std::chrono::seconds(std::max(seconds, 0L));
+    }
+    struct tm tm = {};
+    if (strptime(it->second.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return std::chrono::seconds(0);
+    }
+    return std::chrono::seconds(std::max<time_t>(timegm(&tm) - time(NULL), 0));
+}
+
+void RateLimiter::observe(Throttle &throttle, const HttpsResponse &response) {
+    auto now = Reactor::Clock::now();
+    std::chrono::seconds wait = retry_after(response);
+    throttle.endpoint->observe(response.status, wait, now);
+    throttle.account->observe(response.status, wait, now);
+}
@@ -0,0 +1,97 @@
+/**
+ * limiter.h
+ *
+ * Header file for the adaptive rate limits of the endpoints and accounts
+ */
+
+#ifndef _LIMITER_H_
+#define _LIMITER_H_
+
+#include <string>
+#include <deque>
+#include <functional>
+#include <chrono>
+
+#include "https.h"
+#include "reactor.h"
+
+/**
+ * A token bucket whose rate adapts to the server, additive increase while the responses succeed
+ * and multiplicative decrease when the server asks to slow down with 412, 429 or 503.
+ */
+class RateLimit {
+public:
+    typedef struct {
+        // tokens per second, no limit if not positive
+        double rate;
+        // tokens the bucket holds at most, the requests that may go out at once
+        double burst;
+        // the range the rate adapts in
+        double min_rate, max_rate;
+        // tokens per second gained over a second of successes at the limit, and the factor kept on a throttling status
+        double increase, decrease;
+    } Options;
+
+    explicit RateLimit(const Options &options);
+
+    // take a token if one is left and the server has not asked to wait
+    bool take(Reactor::Clock::time_point now);
+
+    // how long until take() may succeed
+    Reactor::Clock::duration wait(Reactor::Clock::time_point now);
+
+    // adapt the rate to the status of a response, retry_after is how long the server asks to wait, zero if not given
+    void observe(int status, std::chrono::seconds retry_after, Reactor::Clock::time_point now);
+
+    double rate() const { return _rate; }
+private:
+    void refill(Reactor::Clock::time_point now);
+
+    Options options;
+    double _rate, tokens;
+    Reactor::Clock::time_point refilled, blocked_until;
+};
+
+// the limits a request is subject to, those of its endpoint and of its account, and the requests waiting for them
+typedef struct Throttle {
+    RateLimit *endpoint, *account;
+    std::deque<std::function<void()>> waiting;
+    Reactor::TimerId timer = 0;
+} Throttle;
+
+/**
+ * Requests wait for a token of their endpoint and of their account in the reactor thread before going out,
+ * rather than the caller sleeping for a fixed time, and the limits adapt to the statuses of the responses.
+ */
+class RateLimiter {
+public:
+    // the limits given to each endpoint and to each account when first used
+    static RateLimit::Options endpoint_options, account_options;
+
+    // the limiter of the reactor shared by all clients of the process
+    static RateLimiter &instance();
+
+    explicit RateLimiter(Reactor &reactor) : reactor(reactor) {}
+
+    /**
+     * the throttle of requests to endpoint, named as in metrics_endpoint_name(), from the account of cookie
+     * created on first use and never freed, can be called from any thread
+     */
+    static Throttle &throttle(const std::string &endpoint, const std::string &cookie);
+
+    // take the tokens of throttle if no request waits for them, only in the loop thread
+    bool try_acquire(Throttle &throttle);
+
+    // run fn once the tokens of throttle are taken, at once if they are left, only in the loop thread
+    void acquire(Throttle &throttle, std::function<void()> fn);
+
+    // adapt the limits of throttle to the response, only in the loop thread
+    void observe(Throttle &throttle, const HttpsResponse &response);
+private:
+    // run the waiting requests the tokens allow, and wait for the tokens of the next one
+    void drain(Throttle &throttle);
+
+    Reactor &reactor;
+};
+
+#endif /* _LIMITER_H_ */
@@ -0,0 +1,550 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <future>
+#include <algorithm>
+#include <stdexcept>
+#include <strings.h>
+
+#include "live.h"
+#include "tls.h"
+#include "net.h"
+#include "json.h"
+#include "https.h"
+#include "decoder.h"
+
+// the header of every packet, in network order: length, header length, version, operation, sequence
+static const size_t HEADER_LENGTH = 16;
+
+// a message larger than this is refused rather than buffered
+static const size_t MAX_MESSAGE = 16 * 1024 * 1024;
+
+// the upgrade response is refused if its header grows larger than this
+static const size_t MAX_UPGRADE = 16 * 1024;
+
+// the bound of the backoff between reconnections
+static const std::chrono::seconds MAX_BACKOFF(60);
+
+// appended to Sec-WebSocket-Key before hashing it into Sec-WebSocket-Accept, by RFC 6455
+static const std::string WEBSOCKET_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+enum Opcode : uint8_t { CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xa };
+
+static void put_be(std::string &out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+static uint64_t get_be(const char *data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value = value << 8 | static_cast<uint8_t>(data[i]);
+    }
+    return value;
+}
+
+static std::string base64(const unsigned char *data, size_t len) {
+    std::string out(4 * ((len + 2) / 3), '\0');
+    int n = EVP_EncodeBlock(reinterpret_cast<unsigned char *>(&out[0]), data, static_cast<int>(len));
+    out.resize(n);
+    return out;
+}
+
+// inflate a compressed batch whole, coding is DEFLATE for the zlib batches
+static std::string inflate_batch(const std::string &in, ContentDecoder::Coding coding) {
+    std::string out;
+    ContentDecoder decoder(coding);
+    try {
+        decoder.feed(in.data(), in.size(), [&out] (const char *data, size_t len) { out.append(data, len); });
+        decoder.finish();
+    } catch (const std::runtime_error &) {
+        throw std::runtime_error(coding == ContentDecoder::BROTLI ? "Malformed brotli batch" : "Malformed zlib batch");
+    }
+    return out;
+}
+
+std::string live::encode(uint32_t operation, const std::string &body, uint16_t version) {
+    std::string out;
+    out.reserve(HEADER_LENGTH + body.size());
+    put_be(out, HEADER_LENGTH + body.size(), 4);
+    put_be(out, HEADER_LENGTH, 2);
+    put_be(out, version, 2);
+    put_be(out, operation, 4);
+    put_be(out, 1, 4);
+    out.append(body);
+    return out;
+}
+
+void live::decode(const char *data, size_t len, const std::function<void(LivePacket &)> &fn) {
+    size_t offset = 0;
+    while (offset < len) {
+        if (len - offset < HEADER_LENGTH) {
+            throw std::runtime_error("Truncated live packet");
+        }
+        const char *p = data + offset;
+        size_t total = get_be(p, 4);
+        size_t header = get_be(p + 4, 2);
+        if (header < HEADER_LENGTH || total < header || total > len - offset) {
+            throw std::runtime_error("Malformed live packet");
+        }
+        LivePacket packet;
+        packet.version = static_cast<uint16_t>(get_be(p + 6, 2));
+        packet.operation = static_cast<uint32_t>(get_be(p + 8, 4));
+        packet.body.assign(p + header, total - header);
+        offset += total;
+
+        // a batch is a compressed run of whole packets
+        if (packet.operation == Operation::COMMAND && packet.version == Version::ZLIB) {
+            std::string batch = inflate_batch(packet.body, ContentDecoder::DEFLATE);
+            decode(batch.data(), batch.size(), fn);
+        } else if (packet.operation == Operation::COMMAND && packet.version == Version::BROTLI) {
+            std::string batch = inflate_batch(packet.body, ContentDecoder::BROTLI);
+            decode(batch.data(), batch.size(), fn);
+        } else {
+            fn(packet);
+        }
+    }
+}
+
+LiveSocket::LiveSocket(Reactor &reactor, const Endpoint &endpoint, uint32_t roomid, uint64_t uid,
+                       const std::string &key, Handler handler)
+    : reactor(reactor), endpoint(endpoint), roomid(roomid), uid(uid), key(key), handler(std::move(handler)),
+      state(State::CLOSED), ssl(NULL), sockfd(-1), interest(0), closed(false), backoff(1), heartbeat(0), retry(0) {}
+
+LiveSocket::~LiveSocket() {
+    shutdown();
+}
+
+void LiveSocket::open() {
+    retry = 0;
+    if (closed) {
+        return;
+    }
+    std::weak_ptr<LiveSocket> self = shared_from_this();
+    last_received = std::chrono::steady_clock::now();
+    if (heartbeat == 0) {
+        heartbeat = reactor.run_after(endpoint.heartbeat, [self] {
+            if (auto s = self.lock()) {
+                s->beat();
+            }
+        });
+    }
+    state = State::CONNECTING;
+    connecting = tcp_connect(reactor, endpoint.host, endpoint.port, [self] (std::exception_ptr error, int fd) {
+        if (auto s = self.lock()) {
+            s->connected(error, fd);
+        } else if (fd != -1) {
+            ::close(fd);
+        }
+    });
+}
+
+void LiveSocket::connected(std::exception_ptr error, int fd) {
+    connecting.reset();
+    try {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        sockfd = fd;
+        ssl = SSL_new(tls_context());
+        if (ssl == NULL) {
+            throw std::runtime_error("SSL_new fails");
+        }
+        SSL_set_fd(ssl, sockfd);
+        SSL_set_connect_state(ssl);
+        SSL_set_tlsext_host_name(ssl, endpoint.host.c_str());
+        tls_resume(ssl, endpoint.host);
+
+        state = State::HANDSHAKE;
+        interest = EPOLLOUT;
+        std::weak_ptr<LiveSocket> self = shared_from_this();
+        reactor.add(sockfd, interest, [self] (uint32_t) {
+            if (auto s = self.lock()) {
+                s->drive();
+            }
+        });
+    } catch (const std::exception &e) {
+        std::cerr << "Room id = " << roomid << " fails to connect to the broadcast: " << e.what() << std::endl;
+        reconnect();
+        return;
+    }
+    drive();
+}
+
+void LiveSocket::close() {
+    closed = true;
+    reactor.cancel(heartbeat);
+    reactor.cancel(retry);
+    heartbeat = retry = 0;
+    shutdown();
+}
+
+void LiveSocket::shutdown() {
+    connecting.reset();
+    if (ssl != NULL) {
+        if (state == State::UPGRADE || state == State::OPEN) {
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        ssl = NULL;
+    }
+    if (sockfd != -1) {
+        reactor.remove(sockfd);
+        ::close(sockfd);
+        sockfd = -1;
+    }
+    state = State::CLOSED;
+    interest = 0;
+    outbuf.clear();
+    inbuf.clear();
+    fragments.clear();
+}
+
+void LiveSocket::reconnect() {
+    shutdown();
+    if (closed || retry != 0) {
+        return;
+    }
+    std::weak_ptr<LiveSocket> self = shared_from_this();
+    retry = reactor.run_after(backoff, [self] {
+        if (auto s = self.lock()) {
+            s->open();
+        }
+    });
+    backoff = std::min(backoff * 2, MAX_BACKOFF);
+}
+
+void LiveSocket::drive() {
+    // the handler may close the socket, which must outlive this call
+    std::shared_ptr<LiveSocket> self = shared_from_this();
+    uint32_t want = 0;
+    try {
+        if (state == State::HANDSHAKE) {
+            ERR_clear_error();
+            int ret = SSL_connect(ssl);
+            if (ret == 1) {
+                unsigned char random[16];
+                RAND_bytes(random, sizeof(random));
+                nonce = base64(random, sizeof(random));
+                outbuf = "GET " + endpoint.path + " HTTP/1.1\r\n"
+                         "Host: " + endpoint.host + "\r\n"
+                         "Upgrade: websocket\r\n"
+                         "Connection: Upgrade\r\n"
+                         "Sec-WebSocket-Key: " + nonce + "\r\n"
+                         "Sec-WebSocket-Version: 13\r\n"
+                         "Origin: https://live.bilibili.com\r\n" +
+                         HttpsClient::default_header.at("User-Agent") + "\r\n\r\n";
+                state = State::UPGRADE;
+            } else {
+                switch (SSL_get_error(ssl, ret)) {
+                    case SSL_ERROR_WANT_READ:
+                        want = EPOLLIN;
+                        break;
+                    case SSL_ERROR_WANT_WRITE:
+                        want = EPOLLOUT;
+                        break;
+                    default:
+                        throw std::runtime_error("ssl connect fails");
+                }
+            }
+        }
+        while (state == State::UPGRADE || state == State::OPEN) {
+            while (!outbuf.empty()) {
+                ERR_clear_error();
+                int n = SSL_write(ssl, outbuf.data(), static_cast<int>(outbuf.size()));
+                if (n > 0) {
+                    outbuf.erase(0, n);
+                    continue;
+                }
+                int err = SSL_get_error(ssl, n);
+                if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+                    throw std::runtime_error("ssl write fails");
+                }
+                break;
+            }
+            bool blocked = !outbuf.empty();
+            if (!receive()) {
+                throw std::runtime_error("The server closes the broadcast");
+            }
+            // write again only what the received frames have queued, such as the auth packet or a pong
+            if (blocked || outbuf.empty()) {
+                want = outbuf.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+                break;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Room id = " << roomid << " loses the broadcast: " << e.what() << std::endl;
+        reconnect();
+        return;
+    }
+    if (state != State::CLOSED && want != interest) {
+        interest = want;
+        reactor.modify(sockfd, interest);
+    }
+}
+
+bool LiveSocket::receive() {
+    char buf[16384];
+    while (state == State::UPGRADE || state == State::OPEN) {
+        ERR_clear_error();
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n <= 0) {
+            switch (SSL_get_error(ssl, n)) {
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                    return true;
+                case SSL_ERROR_ZERO_RETURN:
+                    return false;
+                default:
+                    throw std::runtime_error("ssl read fails");
+            }
+        }
+        last_received = std::chrono::steady_clock::now();
+        inbuf.append(buf, n);
+        size_t offset = 0;
+        while (offset < inbuf.size()) {
+            size_t used = state == State::UPGRADE ? upgrade(inbuf.data() + offset, inbuf.size() - offset)
+                                                  : frames(inbuf.data() + offset, inbuf.size() - offset);
+            // the handler has closed the socket, and inbuf with it
+            if (state == State::CLOSED) {
+                return true;
+            }
+            if (used == 0) {
+                break;
+            }
+            offset += used;
+        }
+        inbuf.erase(0, offset);
+    }
+    return true;
+}
+
+size_t LiveSocket::upgrade(const char *data, size_t len) {
+    std::string response(data, len);
+    size_t end = response.find("\r\n\r\n");
+    if (end == std::string::npos) {
+        if (len > MAX_UPGRADE) {
+            throw std::runtime_error("Upgrade response too large");
+        }
+        return 0;
+    }
+    response.resize(end + 2);
+    if (response.compare(0, 12, "HTTP/1.1 101") != 0) {
+        throw std::runtime_error("Upgrade refused: " + response.substr(0, response.find("\r\n")));
+    }
+
+    std::string expected;
+    {
+        std::string digest = nonce + WEBSOCKET_GUID;
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hash_len = 0;
+        EVP_Digest(digest.data(), digest.size(), hash, &hash_len, EVP_sha1(), NULL);
+        expected = base64(hash, hash_len);
+    }
+    const std::string name = "sec-websocket-accept:";
+    bool accepted = false;
+    for (size_t pos = response.find("\r\n") + 2; pos < response.size(); ) {
+        size_t eol = response.find("\r\n", pos);
+        if (eol - pos > name.size() && strncasecmp(response.data() + pos, name.data(), name.size()) == 0) {
+            size_t value = response.find_first_not_of(' ', pos + name.size());
+            accepted = response.compare(value, eol - value, expected) == 0;
+        }
+        pos = eol + 2;
+    }
+    if (!accepted) {
+        throw std::runtime_error("Sec-WebSocket-Accept mismatch");
+    }
+
+    state = State::OPEN;
+    std::string auth = "{\"uid\":" + std::to_string(uid) + ",\"roomid\":" + std::to_string(roomid) +
+                       ",\"protover\":3,\"platform\":\"web\",\"type\":2,\"key\":\"" + key + "\"}";
+    send_frame(Opcode::BINARY, live::encode(live::Operation::AUTH, auth));
+    return end + 4;
+}
+
+size_t LiveSocket::frames(const char *data, size_t len) {
+    if (len < 2) {
+        return 0;
+    }
+    bool fin = data[0] & 0x80;
+    uint8_t opcode = data[0] & 0x0f;
+    bool masked = data[1] & 0x80;
+    uint64_t length = data[1] & 0x7f;
+    size_t header = 2;
+    if (length == 126) {
+        if (len < 4) {
+            return 0;
+        }
+        length = get_be(data + 2, 2);
+        header = 4;
+    } else if (length == 127) {
+        if (len < 10) {
+            return 0;
+        }
+        length = get_be(data + 2, 8);
+        header = 10;
+    }
+    if (length > MAX_MESSAGE || fragments.size() + length > MAX_MESSAGE) {
+        throw std::runtime_error("Websocket message too large");
+    }
+    size_t mask = header;
+    header += masked ? 4 : 0;
+    if (len < header + length) {
+        return 0;
+    }
+    std::string payload(data + header, length);
+    if (masked) {
+        for (size_t i = 0; i < payload.size(); ++i) {
+            payload[i] ^= data[mask + i % 4];
+        }
+    }
+
+    switch (opcode) {
+        case Opcode::CONTINUATION:
+            fragments.append(payload);
+            if (fin) {
+                std::string whole;
+                whole.swap(fragments);
+                message(whole.data(), whole.size());
+            }
+            break;
+        case Opcode::TEXT:
+        case Opcode::BINARY:
+            if (fin) {
+                message(payload.data(), payload.size());
+            } else {
+                fragments = std::move(payload);
+            }
+            break;
+        case Opcode::CLOSE:
+            throw std::runtime_error("The server closes the websocket");
+        case Opcode::PING:
+            send_frame(Opcode::PONG, payload);
+            break;
+        default:
+            break;
+    }
+    return header + length;
+}
+
+void LiveSocket::message(const char *data, size_t len) {
+    live::decode(data, len, [this] (LivePacket &packet) {
+        if (closed) {
+            return;
+        }
+        if (packet.operation == live::Operation::AUTH_REPLY) {
+            int64_t code = -1;
+            JsonExtractor json;
+            json.on_number("code", [&code] (int64_t value) { code = value; });
+            json.feed(packet.body.data(), packet.body.size());
+            json.finish();
+            if (code != 0) {
+                throw std::runtime_error("Authentication fails");
+            }
+            backoff = std::chrono::seconds(1);
+            handler(packet);
+        } else if (packet.operation == live::Operation::COMMAND) {
+            handler(packet);
+        }
+    });
+}
+
+void LiveSocket::send_frame(uint8_t opcode, const std::string &payload) {
+    outbuf.push_back(static_cast<char>(0x80 | opcode));
+    if (payload.size() < 126) {
+        outbuf.push_back(static_cast<char>(0x80 | payload.size()));
+    } else if (payload.size() < 65536) {
+        outbuf.push_back(static_cast<char>(0x80 | 126));
+        put_be(outbuf, payload.size(), 2);
+    } else {
+        outbuf.push_back(static_cast<char>(0x80 | 127));
+        put_be(outbuf, payload.size(), 8);
+    }
+    unsigned char mask[4];
+    RAND_bytes(mask, sizeof(mask));
+    outbuf.append(reinterpret_cast<char *>(mask), sizeof(mask));
+    size_t offset = outbuf.size();
+    outbuf.append(payload);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        outbuf[offset + i] ^= mask[i % 4];
+    }
+}
+
+void LiveSocket::beat() {
+    std::weak_ptr<LiveSocket> self = shared_from_this();
+    heartbeat = reactor.run_after(endpoint.heartbeat, [self] {
+        if (auto s = self.lock()) {
+            s->beat();
+        }
+    });
+    if (state == State::CLOSED) {
+        return;
+    }
+    if (std::chrono::steady_clock::now() - last_received > endpoint.heartbeat * 3) {
+        std::cerr << "Room id = " << roomid << " loses the broadcast: no data for too long" << std::endl;
+        reconnect();
+        return;
+    }
+    if (state == State::OPEN) {
+        send_frame(Opcode::BINARY, live::encode(live::Operation::HEARTBEAT, ""));
+        drive();
+    }
+}
+
+LiveSubscriber::LiveSubscriber(Handler handler, const LiveSocket::Endpoint &endpoint)
+    : reactor(Reactor::instance()), endpoint(endpoint), handler(std::move(handler)) {}
+
+void LiveSubscriber::subscribe(uint32_t roomid, uint64_t uid, const std::string &key) {
+    std::shared_ptr<LiveSubscriber> self = shared_from_this();
+    reactor.post([self, roomid, uid, key] {
+        if (self->sockets.count(roomid)) {
+            return;
+        }
+        std::weak_ptr<LiveSubscriber> weak = self;
+        auto socket = std::make_shared<LiveSocket>(self->reactor, self->endpoint, roomid, uid, key,
+            [weak, roomid] (const LivePacket &packet) {
+                if (auto s = weak.lock()) {
+                    s->on_packet(roomid, packet);
+                }
+            });
+        self->sockets[roomid] = socket;
+        socket->open();
+    });
+}
+
+void LiveSubscriber::stop() {
+    std::shared_ptr<LiveSubscriber> self = shared_from_this();
+    auto promise = std::make_shared<std::promise<void>>();
+    reactor.post([self, promise] {
+        for (auto &it : self->sockets) {
+            it.second->close();
+        }
+        self->sockets.clear();
+        promise->set_value();
+    });
+    promise->get_future().wait();
+}
+
+void LiveSubscriber::on_packet(uint32_t roomid, const LivePacket &packet) {
+    if (packet.operation == live::Operation::AUTH_REPLY) {
+        handler(roomid, Event::SUBSCRIBED);
+        return;
+    }
+    // most commands are chats and gifts, only their name is looked at
+    std::string cmd;
+    JsonExtractor json;
+    json.on_string("cmd", [&cmd] (const std::string &value) { cmd = value; });
+    json.feed(packet.body.data(), packet.body.size());
+    json.finish();
+    if (cmd == "LIVE") {
+        handler(roomid, Event::LIVE);
+    } else if (cmd == "PREPARING") {
+        handler(roomid, Event::PREPARING);
+    }
+}
@@ -0,0 +1,165 @@
+/**
+ * live.h
+ *
+ * Header file for the subscriber of the live room broadcast over websocket
+ */
+
+#ifndef _LIVE_H_
+#define _LIVE_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include <openssl/ssl.h>
+
+#include "reactor.h"
+#include "net.h"
+
+// a packet of the broadcast protocol, carried in websocket binary messages
+typedef struct {
+    // 0 json, 1 heartbeat reply, 2 zlib batch, 3 brotli batch
+    uint16_t version;
+    // 2 heartbeat, 3 heartbeat reply, 5 command, 7 auth, 8 auth reply
+    uint32_t operation;
+    std::string body;
+} LivePacket;
+
+namespace live {
+    enum Version : uint16_t { JSON = 0, PLAIN = 1, ZLIB = 2, BROTLI = 3 };
+    enum Operation : uint32_t { HEARTBEAT = 2, HEARTBEAT_REPLY = 3, COMMAND = 5, AUTH = 7, AUTH_REPLY = 8 };
+
+    // the 16-byte header in network order followed by body
+    std::string encode(uint32_t operation, const std::string &body, uint16_t version = Version::PLAIN);
+
+    /**
+     * split a message into its packets and call fn with each one,
+     * compressed batches are inflated and the packets inside them are passed one by one
+     */
+    void decode(const char *data, size_t len, const std::function<void(LivePacket &)> &fn);
+}
+
+/**
+ * A websocket connection subscribed to the broadcast of one room, driven by the reactor.
+ * It authenticates with the room id, sends a heartbeat packet periodically, and reconnects with backoff
+ * when the server closes the connection or stops answering.
+ * All methods must be called in the reactor thread.
+ */
+class LiveSocket : public std::enable_shared_from_this<LiveSocket> {
+public:
+    typedef struct {
+        std::string host;
+        uint16_t port;
+        std::string path;
+        // how often a heartbeat packet is sent, the connection is dropped after three periods of silence
+        std::chrono::seconds heartbeat;
+    } Endpoint;
+
+    // called with the auth reply once the subscription is established, then with each command packet
+    typedef std::function<void(const LivePacket &packet)> Handler;
+
+    LiveSocket(Reactor &reactor, const Endpoint &endpoint, uint32_t roomid, uint64_t uid, const std::string &key,
+               Handler handler);
+    ~LiveSocket();
+
+    // connect, and keep reconnecting until close()
+    void open();
+
+    // close for good
+    void close();
+private:
+    enum State { CLOSED, CONNECTING, HANDSHAKE, UPGRADE, OPEN };
+
+    // the tcp connect has completed, start the handshake on sockfd
+    void connected(std::exception_ptr error, int fd);
+
+    // advance the state machine as far as the socket allows and update the events to wait for
+    void drive();
+
+    // read what the socket holds, return false once the connection is gone
+    bool receive();
+
+    // the http response to the upgrade request, return the bytes consumed
+    size_t upgrade(const char *data, size_t len);
+
+    // websocket frames from the server, return the bytes consumed
+    size_t frames(const char *data, size_t len);
+
+    // a complete binary or text message
+    void message(const char *data, size_t len);
+
+    // queue a websocket frame, masked as every frame from a client
+    void send_frame(uint8_t opcode, const std::string &payload);
+
+    // send the heartbeat and check that the server is alive, every heartbeat period
+    void beat();
+
+    // drop the connection and reconnect after the backoff
+    void reconnect();
+
+    // release ssl and socket
+    void shutdown();
+
+    Reactor &reactor;
+    Endpoint endpoint;
+    uint32_t roomid;
+    uint64_t uid;
+    std::string key;
+    Handler handler;
+
+    State state;
+    std::shared_ptr<TcpConnect> connecting;
+    SSL *ssl;
+    int sockfd;
+    uint32_t interest;
+    bool closed;
+
+    // the Sec-WebSocket-Key of the upgrade request
+    std::string nonce;
+    // bytes waiting to be written, and bytes received but not parsed yet
+    std::string outbuf, inbuf;
+    // the payload of a message fragmented over several frames
+    std::string fragments;
+
+    std::chrono::steady_clock::time_point last_received;
+    std::chrono::seconds backoff;
+    Reactor::TimerId heartbeat, retry;
+};
+
+/**
+ * Subscriptions to the broadcast of many rooms, one websocket each, all multiplexed on the reactor thread.
+ * The handler learns when a subscription is (re)established, so that the state of the room can be fetched once,
+ * and afterwards when the room starts (LIVE) or stops (PREPARING) streaming.
+ */
+class LiveSubscriber : public std::enable_shared_from_this<LiveSubscriber> {
+public:
+    enum Event { SUBSCRIBED, LIVE, PREPARING };
+
+    // called in the reactor thread
+    typedef std::function<void(uint32_t roomid, Event event)> Handler;
+
+    LiveSubscriber(Handler handler, const LiveSocket::Endpoint &endpoint);
+
+    /**
+     * subscribe to the broadcast of roomid, can be called from any thread
+     * uid and key are the account and the token given by getDanmuInfo, 0 and "" subscribe anonymously
+     */
+    void subscribe(uint32_t roomid, uint64_t uid, const std::string &key);
+
+    // close every subscription, can be called from any thread but the reactor thread
+    void stop();
+private:
+    // a command packet of roomid
+    void on_packet(uint32_t roomid, const LivePacket &packet);
+
+    Reactor &reactor;
+    LiveSocket::Endpoint endpoint;
+    Handler handler;
+    std::unordered_map<uint32_t, std::shared_ptr<LiveSocket>> sockets;
+};
+
+#endif /* _LIVE_H_ */
@@ -0,0 +1,376 @@
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include "metrics.h"
+#include "reactor.h"
+
+const uint64_t Histogram::bounds[Histogram::BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+
+Histogram::Histogram() : sum(0) {
+    for (auto &count : counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::record(std::chrono::steady_clock::duration latency) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    uint64_t value = us < 0 ? 0 : static_cast<uint64_t>(us);
+    size_t i = 0;
+    while (i < BUCKETS - 1 && value > bounds[i]) {
+        ++i;
+    }
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() const {
+    uint64_t total = 0;
+    for (const auto &count : counts) {
+        total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t Histogram::quantile(double q) const {
+    uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1, seen = 0;
+    for (size_t i = 0; i < BUCKETS - 1; ++i) {
+        seen += bucket(i);
+        if (seen >= rank) {
+            return bounds[i];
+        }
+    }
+    // beyond the last bound, the mean is the best guess left
+    return sum_us() / total;
+}
+
+void Histogram::assign(const Histogram &other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        counts[i].store(other.bucket(i), std::memory_order_relaxed);
+    }
+    sum.store(other.sum_us(), std::memory_order_relaxed);
+}
+
+void Histogram::merge(const Histogram &other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        counts[i].fetch_add(other.bucket(i), std::memory_order_relaxed);
+    }
+    sum.fetch_add(other.sum_us(), std::memory_order_relaxed);
+}
+
+// copy or add one counter, relaxed like the increments
+static void assign(std::atomic<uint64_t> &to, const std::atomic<uint64_t> &from) {
+    to.store(from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+static void merge(std::atomic<uint64_t> &to, const std::atomic<uint64_t> &from) {
+    to.fetch_add(from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void EndpointCounters::assign(const EndpointCounters &other) {
+    ttfb.assign(other.ttfb);
+    body.assign(other.body);
+    total.assign(other.total);
+    ::assign(requests, other.requests);
+    ::assign(bytes_sent, other.bytes_sent);
+    ::assign(bytes_received, other.bytes_received);
+    for (size_t i = 0; i < 6; ++i) {
+        ::assign(status[i], other.status[i]);
+    }
+    ::assign(retries, other.retries);
+    ::assign(hedges, other.hedges);
+    ::assign(timeouts, other.timeouts);
+    ::assign(late_writes, other.late_writes);
+}
+
+void EndpointCounters::merge(const EndpointCounters &other) {
+    ttfb.merge(other.ttfb);
+    body.merge(other.body);
+    total.merge(other.total);
+    ::merge(requests, other.requests);
+    ::merge(bytes_sent, other.bytes_sent);
+    ::merge(bytes_received, other.bytes_received);
+    for (size_t i = 0; i < 6; ++i) {
+        ::merge(status[i], other.status[i]);
+    }
+    ::merge(retries, other.retries);
+    ::merge(hedges, other.hedges);
+    ::merge(timeouts, other.timeouts);
+    ::merge(late_writes, other.late_writes);
+}
+
+void HostCounters::assign(const HostCounters &other) {
+    dns.assign(other.dns);
+    connect.assign(other.connect);
+    tls.assign(other.tls);
+    ::assign(connects, other.connects);
+    ::assign(reconnects, other.reconnects);
+    ::assign(failures, other.failures);
+    ::assign(ktls_send, other.ktls_send);
+    ::assign(ktls_recv, other.ktls_recv);
+}
+
+void HostCounters::merge(const HostCounters &other) {
+    dns.merge(other.dns);
+    connect.merge(other.connect);
+    tls.merge(other.tls);
+    ::merge(connects, other.connects);
+    ::merge(reconnects, other.reconnects);
+    ::merge(failures, other.failures);
+    ::merge(ktls_send, other.ktls_send);
+    ::merge(ktls_recv, other.ktls_recv);
+}
+
+// metrics by name, kept in a map so that the dumps are sorted
+static std::mutex registry_mutex;
+static std::map<std::string, std::unique_ptr<EndpointMetrics>> endpoints;
+static std::map<std::string, std::unique_ptr<HostMetrics>> hosts;
+
+EndpointMetrics &metrics_endpoint(const std::string &name) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::unique_ptr<EndpointMetrics> &metrics = endpoints[name];
+    if (!metrics) {
+        metrics = std::make_unique<EndpointMetrics>();
+        metrics->name = name;
+    }
+    return *metrics;
+}
+
+HostMetrics &metrics_host(const std::string &name) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::unique_ptr<HostMetrics> &metrics = hosts[name];
+    if (!metrics) {
+        metrics = std::make_unique<HostMetrics>();
+        metrics->name = name;
+    }
+    return *metrics;
+}
+
+void metrics_for_each(const std::function<void(const EndpointMetrics &)> &on_endpoint,
+                      const std::function<void(const HostMetrics &)> &on_host) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &it : endpoints) {
+        on_endpoint(*it.second);
+    }
+    for (auto &it : hosts) {
+        on_host(*it.second);
+    }
+}
+
+void metrics_clear() {
+    static const EndpointCounters no_requests;
+    static const HostCounters no_connections;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &it : endpoints) {
+        it.second->assign(no_requests);
+    }
+    for (auto &it : hosts) {
+        it.second->assign(no_connections);
+    }
+}
+
+std::string metrics_endpoint_name(const std::string &request_line) {
+    size_t space = request_line.find(' ');
+    if (space == std::string::npos) {
+        return request_line;
+    }
+    // the query and the fields of a template differ between requests to the same endpoint
+    size_t end = request_line.find_first_of("? \x01\r", space + 1);
+    return request_line.substr(0, end);
+}
+
+static void write_histogram(std::ostream &os, const std::string &metric, const std::string &labels, const Histogram &h) {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+        cumulative += h.bucket(i);
+        std::string le = i < Histogram::BUCKETS - 1 ? std::to_string(static_cast<double>(Histogram::bounds[i]) / 1e6)
+                                                    : "+Inf";
+        os << metric << "_bucket{" << labels << ",le=\"" << le << "\"} " << cumulative << "\n";
+    }
+    os << metric << "_sum{" << labels << "} " << static_cast<double>(h.sum_us()) / 1e6 << "\n";
+    os << metric << "_count{" << labels << "} " << cumulative << "\n";
+}
+
+void metrics_write_prometheus(std::ostream &os) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    os << "# TYPE bili_connect_phase_seconds histogram\n";
+    for (auto &it : hosts) {
+        const HostMetrics &m = *it.second;
+        write_histogram(os, "bili_connect_phase_seconds", "host=\"" + m.name + "\",phase=\"dns\"", m.dns);
+        write_histogram(os, "bili_connect_phase_seconds", "host=\"" + m.name + "\",phase=\"connect\"", m.connect);
+        write_histogram(os, "bili_connect_phase_seconds", "host=\"" + m.name + "\",phase=\"tls\"", m.tls);
+    }
+    os << "# TYPE bili_connections_total counter\n";
+    for (auto &it : hosts) {
+        const HostMetrics &m = *it.second;
+        os << "bili_connections_total{host=\"" << m.name << "\",kind=\"connect\"} " << m.connects << "\n";
+        os << "bili_connections_total{host=\"" << m.name << "\",kind=\"reconnect\"} " << m.reconnects << "\n";
+        os << "bili_connections_total{host=\"" << m.name << "\",kind=\"failure\"} " << m.failures << "\n";
+        os << "bili_connections_total{host=\"" << m.name << "\",kind=\"ktls_send\"} " << m.ktls_send << "\n";
+        os << "bili_connections_total{host=\"" << m.name << "\",kind=\"ktls_recv\"} " << m.ktls_recv << "\n";
+    }
+    os << "# TYPE bili_request_phase_seconds histogram\n";
+    for (auto &it : endpoints) {
+        const EndpointMetrics &m = *it.second;
+        write_histogram(os, "bili_request_phase_seconds", "endpoint=\"" + m.name + "\",phase=\"ttfb\"", m.ttfb);
+        write_histogram(os, "bili_request_phase_seconds", "endpoint=\"" + m.name + "\",phase=\"body\"", m.body);
+        write_histogram(os, "bili_request_phase_seconds", "endpoint=\"" + m.name + "\",phase=\"total\"", m.total);
+    }
+    os << "# TYPE bili_requests_total counter\n";
+    for (auto &it : endpoints) {
+        const EndpointMetrics &m = *it.second;
+        os << "bili_requests_total{endpoint=\"" << m.name << "\"} " << m.requests << "\n";
+    }
+    os << "# TYPE bili_responses_total counter\n";
+    for (auto &it : endpoints) {
+        const EndpointMetrics &m = *it.second;
+        for (size_t i = 0; i < 6; ++i) {
+            os << "bili_responses_total{endpoint=\"" << m.name << "\",code=\""
+               << (i == 0 ? std::string("error") : std::to_string(i) + "xx") << "\"} " << m.status[i] << "\n";
+        }
+    }
+    os << "# TYPE bili_attempts_total counter\n";
+    for (auto &it : endpoints) {
+        const EndpointMetrics &m = *it.second;
+        os << "bili_attempts_total{endpoint=\"" << m.name << "\",kind=\"retry\"} " << m.retries << "\n";
+        os << "bili_attempts_total{endpoint=\"" << m.name << "\",kind=\"hedge\"} " << m.hedges << "\n";
+        os << "bili_attempts_total{endpoint=\"" << m.name << "\",kind=\"timeout\"} " << m.timeouts << "\n";
+        os << "bili_attempts_total{endpoint=\"" << m.name << "\",kind=\"late\"} " << m.late_writes << "\n";
+    }
+    os << "# TYPE bili_bytes_total counter\n";
+    for (auto &it : endpoints) {
+        const EndpointMetrics &m = *it.second;
+        os << "bili_bytes_total{endpoint=\"" << m.name << "\",direction=\"sent\"} " << m.bytes_sent << "\n";
+        os << "bili_bytes_total{endpoint=\"" << m.name << "\",direction=\"received\"} " << m.bytes_received << "\n";
+    }
+}
+
+static void write_json_histogram(std::ostream &os, const char *name, const Histogram &h) {
+    os << "\"" << name << "\":{\"count\":" << h.count() << ",\"sum_us\":" << h.sum_us()
+       << ",\"p50_us\":" << h.quantile(0.5) << ",\"p99_us\":" << h.quantile(0.99)
+       << ",\"p999_us\":" << h.quantile(0.999) << ",\"buckets\":[";
+    for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+        os << (i ? "," : "") << h.bucket(i);
+    }
+    os << "]}";
+}
+
+void metrics_write_json(std::ostream &os) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    os << "{\"bounds_us\":[";
+    for (size_t i = 0; i < Histogram::BUCKETS - 1; ++i) {
+        os << (i ? "," : "") << Histogram::bounds[i];
+    }
+    os << "],\"hosts\":{";
+    bool first = true;
+    for (auto &it : hosts) {
+        const HostMetrics &m = *it.second;
+        os << (first ? "" : ",") << "\"" << m.name << "\":{\"connects\":" << m.connects
+           << ",\"reconnects\":" << m.reconnects << ",\"failures\":" << m.failures
+           << ",\"ktls_send\":" << m.ktls_send << ",\"ktls_recv\":" << m.ktls_recv << ",";
+        write_json_histogram(os, "dns", m.dns);
+        os << ",";
+        write_json_histogram(os, "connect", m.connect);
+        os << ",";
+        write_json_histogram(os, "tls", m.tls);
+        os << "}";
+        first = false;
+    }
+    os << "},\"endpoints\":{";
+    first = true;
+    for (auto &it : endpoints) {
+        const EndpointMetrics &m = *it.second;
+        os << (first ? "" : ",") << "\"" << m.name << "\":{\"requests\":" << m.requests
+           << ",\"bytes_sent\":" << m.bytes_sent << ",\"bytes_received\":" << m.bytes_received
+           << ",\"retries\":" << m.retries << ",\"hedges\":" << m.hedges << ",\"timeouts\":" << m.timeouts
+           << ",\"late_writes\":" << m.late_writes
+           << ",\"status\":{";
+        for (size_t i = 0; i < 6; ++i) {
+            os << (i ? "," : "") << "\"" << (i == 0 ? std::string("error") : std::to_string(i) + "xx") << "\":"
+               << m.status[i];
+        }
+        os << "},";
+        write_json_histogram(os, "ttfb", m.ttfb);
+        os << ",";
+        write_json_histogram(os, "body", m.body);
+        os << ",";
+        write_json_histogram(os, "total", m.total);
+        os << "}";
+        first = false;
+    }
+    os << "}}\n";
+}
+
+void metrics_dump(const std::string &path) {
+    // written aside and renamed, so that a reader never sees half a dump
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out) {
+            throw std::runtime_error("Fail to open " + tmp);
+        }
+        if (path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0) {
+            metrics_write_json(out);
+        } else {
+            metrics_write_prometheus(out);
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Fail to rename " + tmp);
+    }
+}
+
+// the signal handler only wakes the reactor up, which writes the dump
+static int signal_fd = -1;
+
+static void on_signal(int) {
+    uint64_t one = 1;
+    if (write(signal_fd, &one, sizeof(one)) == -1) {
+        // a dump is already pending
+    }
+}
+
+void metrics_dump_on_signal(int signo, const std::string &path) {
+    if (signal_fd != -1) {
+        throw std::runtime_error("Metrics are already dumped on a signal");
+    }
+    signal_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signal_fd == -1) {
+        throw std::runtime_error("eventfd fails");
+    }
+    Reactor &reactor = Reactor::instance();
+    int fd = signal_fd;
+    reactor.post([&reactor, fd, path] {
+        reactor.add(fd, EPOLLIN, [fd, path] (uint32_t) {
+            uint64_t count;
+            if (read(fd, &count, sizeof(count)) == -1) {
+                return;
+            }
+            try {
+                metrics_dump(path);
+            } catch (const std::exception &e) {
+                std::cerr << "Fail to dump the metrics: " << e.what() << std::endl;
+            }
+        });
+    });
+    struct sigaction action = {};
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(signo, &action, NULL);
+}
@@ -0,0 +1,108 @@
+/**
+ * metrics.h
+ *
+ * Header file for the latency histograms and counters of hosts and endpoints, and their export
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+#include <functional>
+
+/**
+ * Latencies counted in fixed buckets, recorded without lock from any thread.
+ * The buckets are those of a Prometheus histogram, from 100us to 10s and +Inf.
+ */
+class Histogram {
+public:
+    static const size_t BUCKETS = 17;
+    // upper bound of each bucket but the last, in microseconds
+    static const uint64_t bounds[BUCKETS - 1];
+
+    Histogram();
+
+    void record(std::chrono::steady_clock::duration latency);
+
+    uint64_t bucket(size_t i) const { return counts[i].load(std::memory_order_relaxed); }
+    uint64_t count() const;
+    uint64_t sum_us() const { return sum.load(std::memory_order_relaxed); }
+
+    // an estimate of the q-quantile in microseconds, the upper bound of the bucket holding it
+    uint64_t quantile(double q) const;
+
+    // set each bucket and the sum to that of other, or add those of other, value by value without lock
+    void assign(const Histogram &other);
+    void merge(const Histogram &other);
+private:
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> sum;
+};
+
+// the counters of the requests to one endpoint, which hold no pointer so that they can live in shared memory
+typedef struct EndpointCounters {
+    // from the request written to the first byte of the response, from there to its end, and from submit to the end
+    Histogram ttfb, body, total;
+    std::atomic<uint64_t> requests{0}, bytes_sent{0}, bytes_received{0};
+    // responses by status / 100, index 0 counts the requests failing without a response
+    std::atomic<uint64_t> status[6] = {};
+    // the copies sent again after a failure, sent early to cut the tail, and the requests out of time
+    std::atomic<uint64_t> retries{0}, hedges{0}, timeouts{0};
+    // the copies written after their request was settled, which the client must never do
+    std::atomic<uint64_t> late_writes{0};
+
+    // set every counter to that of other, or add those of other
+    void assign(const EndpointCounters &other);
+    void merge(const EndpointCounters &other);
+} EndpointCounters;
+
+// the requests to one endpoint, named by method and path
+typedef struct EndpointMetrics : EndpointCounters {
+    std::string name;
+} EndpointMetrics;
+
+// the counters of the connections to one host
+typedef struct HostCounters {
+    Histogram dns, connect, tls;
+    std::atomic<uint64_t> connects{0}, reconnects{0}, failures{0};
+    // the connections established whose records the kernel sends and receives
+    std::atomic<uint64_t> ktls_send{0}, ktls_recv{0};
+
+    void assign(const HostCounters &other);
+    void merge(const HostCounters &other);
+} HostCounters;
+
+// the connections to one host
+typedef struct HostMetrics : HostCounters {
+    std::string name;
+} HostMetrics;
+
+// the metrics of an endpoint or a host, created on first use and never freed, so that they can be kept by pointer
+EndpointMetrics &metrics_endpoint(const std::string &name);
+HostMetrics &metrics_host(const std::string &name);
+
+// call on_endpoint and on_host with every metrics of the registry, which is locked meanwhile
+void metrics_for_each(const std::function<void(const EndpointMetrics &)> &on_endpoint,
+                      const std::function<void(const HostMetrics &)> &on_host);
+
+// zero every metrics of the registry, which stay registered since they are kept by pointer
+void metrics_clear();
+
+// the name of the endpoint of a serialized request: its method and its path without the query
+std::string metrics_endpoint_name(const std::string &request_line);
+
+// all metrics as Prometheus text, or as json
+void metrics_write_prometheus(std::ostream &os);
+void metrics_write_json(std::ostream &os);
+
+// write all metrics to path, as json if it ends with ".json" and as Prometheus text otherwise
+void metrics_dump(const std::string &path);
+
+// dump all metrics to path from the reactor thread whenever the process receives signo
+void metrics_dump_on_signal(int signo, const std::string &path);
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,342 @@
+/**
+ * micro.cpp
+ *
+ * Replay a corpus of recorded responses through the parser and the json extractor,
+ * and time the encoders of request bodies, all in memory and without the network.
+ * Report the cost per byte and the allocations per call of each case, the bytes of a response being those of its
+ * decoded body whatever the case starts from, so that the cases of one response compare, and those of a request
+ * the bytes written,
+ * and fail if one regresses beyond a threshold over a baseline: one of the allocations alone, which do not depend
+ * on the machine and is kept in the tree, and one of the time too, recorded on the machine it is compared on.
+ */
+
+#include <unistd.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+
+#include "https.h"
+#include "parser.h"
+#include "json.h"
+#include "capture.h"
+
+// every allocation of the process is counted
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t n) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(n == 0 ? 1 : n);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+// one case is a call processing the i-th input and returning the bytes it is timed by
+typedef struct {
+    std::string name;
+    std::function<size_t(size_t i)> call;
+} Case;
+
+typedef struct {
+    double ns_per_byte;
+    double allocs_per_call;
+} Result;
+
+// how long each of the timed rounds runs, the best round is kept
+static const std::chrono::milliseconds ROUND(50);
+static const int ROUNDS = 9;
+
+// the cpu time of the calling thread, so that time given to other processes is not counted
+static std::chrono::nanoseconds thread_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+static Result measure(const Case &c) {
+    Result result = {0, 0};
+    // the first calls warm the caches and the pools up
+    for (size_t i = 0; i < 64; ++i) {
+        c.call(i);
+    }
+    size_t before = allocations.load();
+    const size_t counted = 1024;
+    for (size_t i = 0; i < counted; ++i) {
+        c.call(i);
+    }
+    result.allocs_per_call = static_cast<double>(allocations.load() - before) / counted;
+
+    size_t next = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        size_t bytes = 0;
+        auto start = thread_time();
+        std::chrono::nanoseconds elapsed(0);
+        while (elapsed < ROUND) {
+            for (int k = 0; k < 64; ++k) {
+                bytes += c.call(next++);
+            }
+            elapsed = thread_time() - start;
+        }
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(bytes);
+        if (round == 0 || ns < result.ns_per_byte) {
+            result.ns_per_byte = ns;
+        }
+    }
+    return result;
+}
+
+// the paths BiliApi reads, all other fields are skipped
+static void register_paths(JsonExtractor &json, int64_t &sum) {
+    auto add = [&sum] (int64_t value) { sum += value; };
+    json.on_number("code", add);
+    json.on_number("data.timestamp", add);
+    json.on_number("data.total_number", add);
+    json.on_number("data.live_status", add);
+    json.on_number("data.list[].room_info.room_id", add);
+    json.on_number("data.special_list[].room_info.room_id", add);
+    json.on_string("data.token", [&sum] (const std::string &value) { sum += static_cast<int64_t>(value.length()); });
+}
+
+// feed data to fn in fragments of at most size bytes
+template <typename F>
+static void fragments(const std::string &data, size_t size, F fn) {
+    for (size_t offset = 0; offset < data.length(); offset += size) {
+        fn(data.data() + offset, std::min(size, data.length() - offset));
+    }
+}
+
+/**
+ * read the baseline at path into baseline, one case per line with its ns/byte and its allocations per call,
+ * or with the latter alone if not timed, return false if it cannot be read
+ */
+static bool load_baseline(const std::string &path, bool timed, std::map<std::string, Result> &baseline) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        Result result = {0, 0};
+        if (fields >> name && (!timed || fields >> result.ns_per_byte) && fields >> result.allocs_per_call) {
+            baseline[name] = result;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    std::string corpus_path = "corpus.dat";
+    std::string baseline_path, allocs_path;
+    bool update = false;
+    double threshold = 10;
+    std::vector<size_t> sizes = {1448, 16384};
+    int opt;
+    while ((opt = getopt(argc, argv, "c:b:a:ut:f:")) != -1) {
+        switch (opt) {
+            case 'c':
+                corpus_path = optarg;
+                break;
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 'a':
+                allocs_path = optarg;
+                break;
+            case 'u':
+                update = true;
+                break;
+            case 't':
+                threshold = std::stod(optarg);
+                break;
+            case 'f': {
+                sizes.clear();
+                std::istringstream list(optarg);
+                std::string size;
+                while (std::getline(list, size, ',')) {
+                    sizes.push_back(std::max<size_t>(std::stoul(size), 1));
+                }
+                break;
+            }
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-c corpus] [-b baseline] [-a allocations baseline] [-u] [-t threshold %]"
+                          << " [-f fragment sizes, e.g. 1448,16384]" << std::endl;
+                return 1;
+        }
+    }
+
+    std::vector<CapturedResponse> corpus = capture_load(corpus_path);
+    if (corpus.empty()) {
+        std::cerr << corpus_path << " has no response" << std::endl;
+        return 1;
+    }
+    // the bodies, for the cases starting after the parser, and the bytes every case of a response is timed by
+    std::vector<std::string> bodies;
+    for (const CapturedResponse &captured : corpus) {
+        ResponseParser parser;
+        HttpsResponse response;
+        parser.feed(captured.bytes.data(), captured.bytes.length(), response);
+        bodies.push_back(response.body);
+    }
+    size_t n = corpus.size();
+    int64_t sink = 0;
+
+    std::vector<Case> cases;
+    for (size_t size : sizes) {
+        cases.push_back({"parser/" + std::to_string(size), [&corpus, &bodies, n, size] (size_t i) {
+            const std::string &bytes = corpus[i % n].bytes;
+            ResponseParser parser;
+            HttpsResponse response;
+            fragments(bytes, size, [&] (const char *data, size_t len) { parser.feed(data, len, response); });
+            return bodies[i % n].length();
+        }});
+        cases.push_back({"json/" + std::to_string(size), [&bodies, n, size, &sink] (size_t i) {
+            const std::string &body = bodies[i % n];
+            JsonExtractor json;
+            register_paths(json, sink);
+            fragments(body, size, [&] (const char *data, size_t len) { json.feed(data, len); });
+            json.finish();
+            return body.length();
+        }});
+        // the path of writeread with a sink, the body goes from the parser straight into the extractor
+        cases.push_back({"parser+json/" + std::to_string(size), [&corpus, &bodies, n, size, &sink] (size_t i) {
+            const std::string &bytes = corpus[i % n].bytes;
+            JsonExtractor json;
+            register_paths(json, sink);
+            ResponseParser parser;
+            parser.set_sink([&json] (const char *data, size_t len) { json.feed(data, len); });
+            HttpsResponse response;
+            fragments(bytes, size, [&] (const char *data, size_t len) { parser.feed(data, len, response); });
+            json.finish();
+            return bodies[i % n].length();
+        }});
+    }
+
+    // the bodies of bullet_chat and likeRoom
+    const std::string csrf = "0123456789abcdef0123456789abcdef";
+    Form chat = {{"bubble", "0"}, {"msg", "1"}, {"color", "16777215"}, {"mode", "1"}, {"fontsize", "25"},
+                 {"rnd", "1681331507"}, {"roomid", "21452505"}, {"csrf", csrf}, {"csrf_token", csrf}};
+    Form like = {{"room_id", "21452505"}, {"anchor_id", "10000"}, {"ts", "1700000000"}, {"csrf", csrf},
+                 {"csrf_token", csrf}, {"visit_id", ""}};
+    cases.push_back({"webkitform", [&chat] (size_t) {
+        Header header;
+        WebkitForm form(chat, header);
+        return std::char_traits<char>::length(form.c_str());
+    }});
+    cases.push_back({"urlencoded", [&like] (size_t) {
+        Header header;
+        FormUrlencoded form(like, header);
+        return std::char_traits<char>::length(form.c_str());
+    }});
+    // what the requests cost now that the forms are encoded once, filling the template and gathering it
+    HttpsRequest request;
+    request.method = HttpsMethod::POST;
+    request.url = "/msg/send";
+    request.header = HttpsClient::default_header;
+    Form chat_fields = chat;
+    chat_fields[1].second = RequestTemplate::field(1);
+    chat_fields[6].second = RequestTemplate::field(0);
+    WebkitForm chat_body(chat_fields, request.header);
+    RequestTemplate chat_template("api.live.bilibili.com", "SESSDATA=0123456789; bili_jct=" + csrf, request,
+                                  chat_body.c_str());
+    cases.push_back({"template/chat", [&chat_template] (size_t i) {
+        PreparedRequest prepared = chat_template.fill({std::to_string(21452505 + i % 1000), "1"});
+        char out[BufferPool::BLOCK];
+        size_t bytes = 0;
+        while (bytes < prepared.length()) {
+            bytes += prepared.gather(bytes, out, sizeof(out));
+        }
+        return bytes;
+    }});
+
+    // a baseline named but missing fails, rather than passing with nothing to compare with
+    std::map<std::string, Result> baseline, allocs_baseline;
+    if (!update && !baseline_path.empty() && !load_baseline(baseline_path, true, baseline)) {
+        std::cerr << "Fail to read the baseline " << baseline_path << std::endl;
+        return 1;
+    }
+    if (!update && !allocs_path.empty() && !load_baseline(allocs_path, false, allocs_baseline)) {
+        std::cerr << "Fail to read the baseline " << allocs_path << std::endl;
+        return 1;
+    }
+    std::ofstream updated, updated_allocs;
+    if (update && !baseline_path.empty()) {
+        updated.open(baseline_path);
+    }
+    if (update && !allocs_path.empty()) {
+        updated_allocs.open(allocs_path);
+    }
+
+    size_t total = 0, decoded = 0;
+    for (size_t i = 0; i < n; ++i) {
+        total += corpus[i].bytes.length();
+        decoded += bodies[i].length();
+    }
+    std::cout << n << " responses, " << total << " bytes on the wire, " << decoded << " bytes of decoded body"
+              << " by which every case of a response is timed" << std::endl;
+    std::cout << std::left << std::setw(20) << "case" << std::right << std::setw(10) << "ns/byte"
+              << std::setw(13) << "allocs/call" << std::setw(10) << "baseline" << std::endl;
+    bool regressed = false;
+    for (const Case &c : cases) {
+        Result result = measure(c);
+        std::cout << std::left << std::setw(20) << c.name << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(10) << result.ns_per_byte << std::setprecision(2) << std::setw(13) << result.allocs_per_call;
+        double limit = 1 + threshold / 100;
+        bool slower = false, allocates = false, missing = false;
+        if (!baseline_path.empty() && !update) {
+            auto it = baseline.find(c.name);
+            missing = it == baseline.end();
+            if (!missing) {
+                slower = result.ns_per_byte > it->second.ns_per_byte * limit;
+                allocates = result.allocs_per_call > it->second.allocs_per_call * limit + 0.005;
+                std::cout << std::setprecision(3) << std::setw(10) << it->second.ns_per_byte;
+            }
+        }
+        if (!allocs_path.empty() && !update) {
+            auto it = allocs_baseline.find(c.name);
+            missing = missing || it == allocs_baseline.end();
+            allocates = allocates || (it != allocs_baseline.end() && result.allocs_per_call > it->second.allocs_per_call * limit + 0.005);
+        }
+        // a case without a baseline is not checked, which must not pass unnoticed
+        std::cout << (slower ? "  slower" : "") << (allocates ? "  allocates more" : "") << (missing ? "  no baseline" : "")
+                  << std::endl;
+        regressed = regressed || slower || allocates || missing;
+        if (updated.is_open()) {
+            updated << c.name << " " << result.ns_per_byte << " " << result.allocs_per_call << std::endl;
+        }
+        if (updated_allocs.is_open()) {
+            updated_allocs << c.name << " " << std::fixed << std::setprecision(2) << result.allocs_per_call << std::endl;
+        }
+    }
+    if (sink == 42) {
+        // keep the extracted values alive
+        std::cout << std::endl;
+    }
+    if (regressed) {
+        std::cout << "regression beyond " << threshold << "% over the baseline" << std::endl;
+        return 1;
+    }
+    return 0;
+}
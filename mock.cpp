@@ -0,0 +1,981 @@
+/**
+ * mock.cpp
+ *
+ * A local tls server answering the endpoints of BiliApi, so that the client can be measured without production.
+ * Each connection is served by its own thread, and requests pipelined together are answered with one write.
+ * Clients offering h2 with alpn are served http/2, the others http/1.1.
+ * A websocket upgrade of /sub is served the live room broadcast, replaying a recording of its frames
+ * from the first heartbeat on, and then closing.
+ */
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <strings.h>
+
+#include "frame.h"
+#include "hpack.h"
+
+typedef struct {
+    uint16_t port;
+    // every response is delayed by this much, requests pipelined together are delayed together
+    std::chrono::milliseconds latency;
+    enum { LENGTH, CHUNKED, MIXED } framing;
+    // the connection is closed after this many responses, 0 keeps it open
+    size_t close_after;
+    // the percentage of responses failing with 500
+    unsigned error_rate;
+    // the percentage of http/1.1 writes stalled for STALL halfway, in a response or between two pipelined ones
+    unsigned stall_rate;
+    // the number of medals of every account
+    size_t medals;
+    // the requests per second each endpoint answers before failing with 429, 0 for no limit
+    size_t rate;
+    // the content codings the bodies may be compressed with, in order of preference, the first one accepted is used
+    std::vector<std::string> codings;
+    // whether h2 is selected when the client offers it
+    bool http2;
+} MockOptions;
+
+// how long a stalled response is held back, longer than any latency the client should wait for
+static const std::chrono::milliseconds STALL(1000);
+
+// the number of requests served, printed when the server exits
+static std::atomic<uint64_t> served(0);
+
+// select h2 if the client offers it and arg points to true, http/1.1 otherwise
+static int select_protocol(SSL *, const unsigned char **out, unsigned char *outlen,
+                           const unsigned char *in, unsigned int inlen, void *arg) {
+    bool http2 = *static_cast<const bool *>(arg);
+    // skip h2 at the head of the list of the server when it is off
+    const unsigned char *protocols = http2 ? h2::ALPN : h2::ALPN + 3;
+    unsigned int length = static_cast<unsigned int>(http2 ? h2::ALPN_LENGTH : h2::ALPN_LENGTH - 3);
+    if (SSL_select_next_proto(const_cast<unsigned char **>(out), outlen, protocols, length, in, inlen)
+        != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// a self-signed certificate made at startup, the client does not verify it
+static SSL_CTX *make_context(const bool *http2) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        throw std::runtime_error("SSL_CTX_new fails");
+    }
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    if (key == NULL) {
+        throw std::runtime_error("Generating the key fails");
+    }
+    X509 *cert = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    if (X509_sign(cert, key, EVP_sha256()) == 0 || SSL_CTX_use_certificate(ctx, cert) != 1
+        || SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+        throw std::runtime_error("Signing the certificate fails");
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_alpn_select_cb(ctx, select_protocol, const_cast<bool *>(http2));
+    return ctx;
+}
+
+// the value of query parameter name in path, 0 if absent
+static size_t query(const std::string &path, const std::string &name) {
+    size_t pos = path.find("?" + name + "=");
+    if (pos == std::string::npos) {
+        pos = path.find("&" + name + "=");
+    }
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    return std::strtoul(path.c_str() + pos + name.length() + 2, NULL, 10);
+}
+
+// the body answering path, empty if no endpoint matches
+static std::string route(const std::string &path, const MockOptions &options) {
+    if (path.find("/sign/DoSign") != std::string::npos) {
+        return "{\"code\":0,\"message\":\"0\",\"ttl\":1,\"data\":{\"text\":\"3000 exp\",\"specialText\":\"\","
+               "\"allDays\":31,\"hadSignDays\":1,\"isBonusDay\":0}}";
+    }
+    if (path.find("/rtc/getTimestamp") != std::string::npos) {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        return "{\"code\":0,\"message\":\"0\",\"data\":{\"timestamp\":" +
+               std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now).count()) +
+               ",\"microtimestamp\":" + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(now).count()) +
+               "}}";
+    }
+    if (path.find("/fansMedal/panel") != std::string::npos) {
+        size_t page = std::max<size_t>(query(path, "page"), 1);
+        size_t size = std::max<size_t>(query(path, "page_size"), 1);
+        std::string body = "{\"code\":0,\"message\":\"0\",\"data\":{\"list\":[";
+        // a twentieth of the medals at the highest level, a quarter of them at the limit of the day,
+        // a third of them not lit, and the rooms streaming as getRoomPlayInfo tells
+        auto minutes = std::chrono::duration_cast<std::chrono::minutes>(std::chrono::system_clock::now().time_since_epoch());
+        for (size_t i = (page - 1) * size; i < std::min(page * size, options.medals); ++i) {
+            if (i != (page - 1) * size) {
+                body += ",";
+            }
+            body += "{\"medal\":{\"level\":" + std::to_string(i % 20 + 1) + ",\"medal_name\":\"medal\","
+                    "\"today_feed\":" + std::to_string(i * 7 % 4 * 500) + ",\"day_limit\":1500,"
+                    "\"is_lighted\":" + std::to_string(i % 3 != 0) + "},\"anchor_info\":{\"nick_name\":\"anchor\"},"
+                    "\"room_info\":{\"room_id\":" + std::to_string(1000 + i) + ",\"living_status\":" +
+                    std::to_string((static_cast<size_t>(minutes.count()) + 1000 + i) % 2) + "}}";
+        }
+        return body + "],\"special_list\":[],\"total_number\":" + std::to_string(options.medals) + "}}";
+    }
+    if (path.find("/getRoomPlayInfo") != std::string::npos) {
+        // every room starts or ends its stream every minute
+        auto minutes = std::chrono::duration_cast<std::chrono::minutes>(std::chrono::system_clock::now().time_since_epoch());
+        size_t status = (static_cast<size_t>(minutes.count()) + query(path, "room_id")) % 2;
+        return "{\"code\":0,\"message\":\"0\",\"data\":{\"room_id\":" + std::to_string(query(path, "room_id")) +
+               ",\"live_status\":" + std::to_string(status) + ",\"live_time\":0}}";
+    }
+    if (path.find("/getDanmuInfo") != std::string::npos) {
+        return "{\"code\":0,\"message\":\"0\",\"data\":{\"token\":\"mock\",\"host_list\":[{\"host\":\"localhost\","
+               "\"wss_port\":443}]}}";
+    }
+    if (path.find("/msg/send") != std::string::npos || path.find("/likeReportV3") != std::string::npos
+        || path.find("/roomEntryAction") != std::string::npos || path.find("/heartBeat") != std::string::npos) {
+        return "{\"code\":0,\"message\":\"\",\"data\":{}}";
+    }
+    return "";
+}
+
+// whether the endpoint of path has answered its rate of requests within the current second
+static bool over_rate(const std::string &path, const MockOptions &options) {
+    static std::mutex m;
+    static std::unordered_map<std::string, std::pair<int64_t, size_t>> windows;
+    if (options.rate == 0) {
+        return false;
+    }
+    int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::lock_guard<std::mutex> lock(m);
+    std::pair<int64_t, size_t> &window = windows[path.substr(0, path.find('?'))];
+    if (window.first != second) {
+        window = {second, 0};
+    }
+    return ++window.second > options.rate;
+}
+
+// the first coding of the options listed in the Accept-Encoding of the request, empty for identity
+static std::string negotiate(const std::string &accept, const MockOptions &options) {
+    // the codings of the header without their weights
+    std::vector<std::string> accepted;
+    for (size_t pos = 0; pos <= accept.length();) {
+        size_t comma = std::min(accept.find(',', pos), accept.length());
+        std::string token = accept.substr(pos, std::min(accept.find(';', pos), comma) - pos);
+        size_t start = token.find_first_not_of(" \t");
+        if (start != std::string::npos) {
+            accepted.push_back(token.substr(start, token.find_last_not_of(" \t") + 1 - start));
+        }
+        pos = comma + 1;
+    }
+    for (const std::string &coding : options.codings) {
+        for (const std::string &name : accepted) {
+            if (strcasecmp(name.c_str(), coding.c_str()) == 0) {
+                return coding;
+            }
+        }
+    }
+    return "";
+}
+
+// body compressed with coding, gzip, deflate with a zlib header or br
+static std::string compress(const std::string &body, const std::string &coding) {
+    std::string out;
+    if (coding == "br") {
+        size_t size = BrotliEncoderMaxCompressedSize(body.length());
+        out.resize(size);
+        if (!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, body.length(),
+                                   reinterpret_cast<const uint8_t *>(body.data()), &size,
+                                   reinterpret_cast<uint8_t *>(&out[0]))) {
+            throw std::runtime_error("BrotliEncoderCompress fails");
+        }
+        out.resize(size);
+        return out;
+    }
+    z_stream stream = {};
+    if (deflateInit2(&stream, 6, Z_DEFLATED, coding == "gzip" ? 16 + MAX_WBITS : MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit fails");
+    }
+    out.resize(deflateBound(&stream, static_cast<uLong>(body.length())));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+    stream.avail_in = static_cast<uInt>(body.length());
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.length());
+    int ret = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        throw std::runtime_error("deflate fails");
+    }
+    return out;
+}
+
+// the answer to one request before it is framed, the headers in the case http/1.1 writes them
+typedef struct {
+    int status;
+    std::string reason;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+} Reply;
+
+// the reply to path, its body compressed with coding unless coding is empty
+static Reply answer(const std::string &path, const std::string &coding, const MockOptions &options, std::mt19937 &rng) {
+    Reply reply = {200, "OK", {}, route(path, options)};
+    if (reply.body.empty()) {
+        reply = {404, "Not Found", {}, "{\"code\":-404,\"message\":\"not found\"}"};
+    } else if (over_rate(path, options)) {
+        reply = {429, "Too Many Requests", {{"Retry-After", "1"}}, "{\"code\":-429,\"message\":\"too many requests\"}"};
+    } else if (std::uniform_int_distribution<unsigned>(0, 99)(rng) < options.error_rate) {
+        reply = {500, "Internal Server Error", {}, "{\"code\":-500,\"message\":\"error\"}"};
+    }
+    reply.headers.push_back({"Content-Type", "application/json; charset=utf-8"});
+    // the client estimates the server clock from it
+    char date[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&now, &tm));
+    reply.headers.push_back({"Date", date});
+    if (!coding.empty()) {
+        reply.body = compress(reply.body, coding);
+        reply.headers.push_back({"Content-Encoding", coding});
+        reply.headers.push_back({"Vary", "Accept-Encoding"});
+    }
+    return reply;
+}
+
+// whether the body of the next response is sent in pieces, chunks in http/1.1 and several DATA frames in http/2
+static bool chunked(const MockOptions &options, std::mt19937 &rng) {
+    return options.framing == MockOptions::CHUNKED
+           || (options.framing == MockOptions::MIXED && std::uniform_int_distribution<int>(0, 1)(rng));
+}
+
+// append the reply as an http/1.1 response to out
+static void respond(const Reply &reply, bool close, const MockOptions &options, std::mt19937 &rng, std::string &out) {
+    out += "HTTP/1.1 " + std::to_string(reply.status) + " " + reply.reason + "\r\n";
+    for (auto &header : reply.headers) {
+        out += header.first + ": " + header.second + "\r\n";
+    }
+    out += close ? "Connection: close\r\n" : "Connection: keep-alive\r\nKeep-Alive: timeout=60\r\n";
+    const std::string &body = reply.body;
+    if (!chunked(options, rng)) {
+        out += "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+        return;
+    }
+    out += "Transfer-Encoding: chunked\r\n\r\n";
+    // two chunks, so that the client has to join them
+    size_t half = body.length() / 2;
+    char size[32];
+    snprintf(size, sizeof(size), "%zx\r\n", half);
+    out += size + body.substr(0, half) + "\r\n";
+    snprintf(size, sizeof(size), "%zx\r\n", body.length() - half);
+    out += size + body.substr(half) + "\r\n0\r\n\r\n";
+}
+
+static bool write_all(SSL *ssl, const std::string &data) {
+    size_t offset = 0;
+    while (offset < data.length()) {
+        int n = SSL_write(ssl, data.data() + offset, static_cast<int>(data.length() - offset));
+        if (n <= 0) {
+            return false;
+        }
+        offset += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+namespace broadcast {
+    // of the packets, as in live.h
+    enum Version : uint16_t { JSON = 0, PLAIN = 1, ZLIB = 2, BROTLI = 3 };
+    enum Operation : uint32_t { HEARTBEAT = 2, HEARTBEAT_REPLY = 3, COMMAND = 5, AUTH = 7, AUTH_REPLY = 8 };
+    // of the websocket frames
+    enum Opcode : uint8_t { CONTINUATION = 0x0, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xa };
+}
+
+// how often the broadcast sends the next frame of its recording
+static const std::chrono::milliseconds REPLAY_INTERVAL(20);
+
+// appended to Sec-WebSocket-Key before hashing it into Sec-WebSocket-Accept, by RFC 6455
+static const std::string WEBSOCKET_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static void put_be(std::string &out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+static uint64_t get_be(const char *data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value = value << 8 | static_cast<uint8_t>(data[i]);
+    }
+    return value;
+}
+
+// the Sec-WebSocket-Accept answering key
+static std::string websocket_accept(const std::string &key) {
+    std::string digest = key + WEBSOCKET_GUID;
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len = 0;
+    EVP_Digest(digest.data(), digest.size(), hash, &hash_len, EVP_sha1(), NULL);
+    std::string out(4 * ((hash_len + 2) / 3), '\0');
+    EVP_EncodeBlock(reinterpret_cast<unsigned char *>(&out[0]), hash, static_cast<int>(hash_len));
+    return out;
+}
+
+// a packet of the broadcast: the 16-byte header in network order followed by body
+static std::string packet(uint32_t operation, uint16_t version, const std::string &body) {
+    std::string out;
+    put_be(out, 16 + body.length(), 4);
+    put_be(out, 16, 2);
+    put_be(out, version, 2);
+    put_be(out, operation, 4);
+    put_be(out, 1, 4);
+    return out + body;
+}
+
+// a websocket frame of the server, which is not masked
+static std::string ws_frame(uint8_t opcode, const std::string &payload, bool fin = true) {
+    std::string out(1, static_cast<char>((fin ? 0x80 : 0) | opcode));
+    if (payload.length() < 126) {
+        out.push_back(static_cast<char>(payload.length()));
+    } else if (payload.length() < 65536) {
+        out.push_back(static_cast<char>(126));
+        put_be(out, payload.length(), 2);
+    } else {
+        out.push_back(static_cast<char>(127));
+        put_be(out, payload.length(), 8);
+    }
+    return out + payload;
+}
+
+/**
+ * the frames of the broadcast of roomid, recorded from a busy room: commands in plain packets and in batches
+ * compressed with zlib and brotli, a message fragmented over two frames around a ping, a message longer than 64KiB,
+ * and the stream of the room starting and ending twice
+ */
+static std::vector<std::string> recording(size_t roomid) {
+    using namespace broadcast;
+    std::string room = std::to_string(roomid);
+    auto command = [] (const std::string &json) { return packet(Operation::COMMAND, Version::JSON, json); };
+    std::string danmu = command("{\"cmd\":\"DANMU_MSG\",\"info\":[[0,1,25,16777215,1700000000000,0,0,\"\",0,0,0,\"\",0,"
+                                "\"{}\",\"{}\",{}],\"\\u4f60\\u597d\",[10001,\"viewer\",0,0,0,10000,1,\"\"]]}");
+    std::string gift = command("{\"cmd\":\"SEND_GIFT\",\"data\":{\"giftName\":\"\\u8fa3\\u6761\",\"num\":1,"
+                               "\"uname\":\"viewer\",\"uid\":10001}}");
+    std::string interact = command("{\"cmd\":\"INTERACT_WORD\",\"data\":{\"uname\":\"viewer\",\"uid\":10001,"
+                                   "\"roomid\":" + room + "}}");
+    std::string rank = command("{\"cmd\":\"ONLINE_RANK_COUNT\",\"data\":{\"count\":42}}");
+    std::string live = command("{\"cmd\":\"LIVE\",\"live_key\":\"0\",\"voice_background\":\"\",\"sub_session_key\":\"\","
+                               "\"live_platform\":\"pc\",\"live_model\":0,\"roomid\":" + room + "}");
+    std::string preparing = command("{\"cmd\":\"PREPARING\",\"roomid\":\"" + room + "\"}");
+    auto batch = [] (uint16_t version, const std::string &packets) {
+        return packet(Operation::COMMAND, version, compress(packets, version == Version::ZLIB ? "deflate" : "br"));
+    };
+    std::string flood;
+    while (flood.length() < 65536) {
+        flood += danmu;
+    }
+    std::string fragmented = live + danmu;
+    return {
+        ws_frame(Opcode::BINARY, danmu),
+        ws_frame(Opcode::BINARY, batch(Version::ZLIB, interact + danmu + gift)),
+        ws_frame(Opcode::BINARY, fragmented.substr(0, 20), false),
+        ws_frame(Opcode::PING, "ping"),
+        ws_frame(Opcode::CONTINUATION, fragmented.substr(20)),
+        ws_frame(Opcode::BINARY, batch(Version::BROTLI, rank + danmu + danmu + gift)),
+        ws_frame(Opcode::BINARY, batch(Version::ZLIB, preparing + rank)),
+        ws_frame(Opcode::BINARY, flood),
+        ws_frame(Opcode::BINARY, batch(Version::BROTLI, interact + live)),
+        ws_frame(Opcode::BINARY, preparing),
+    };
+}
+
+// the first complete frame of the client in data, unmasked, return the bytes it takes, 0 if incomplete
+static size_t client_frame(const std::string &data, uint8_t &opcode, std::string &payload) {
+    if (data.length() < 2) {
+        return 0;
+    }
+    opcode = data[0] & 0x0f;
+    size_t length = data[1] & 0x7f;
+    size_t header = 2;
+    if (length == 126) {
+        if (data.length() < 4) {
+            return 0;
+        }
+        length = get_be(data.data() + 2, 2);
+        header = 4;
+    } else if (length == 127) {
+        if (data.length() < 10) {
+            return 0;
+        }
+        length = get_be(data.data() + 2, 8);
+        header = 10;
+    }
+    // every frame of a client is masked
+    size_t mask = header;
+    header += 4;
+    if (data.length() < header + length) {
+        return 0;
+    }
+    payload.assign(data, header, length);
+    for (size_t i = 0; i < length; ++i) {
+        payload[i] = static_cast<char>(payload[i] ^ data[mask + i % 4]);
+    }
+    return header + length;
+}
+
+/**
+ * serve the broadcast on a connection upgraded to websocket, in holding what the client has sent after the upgrade:
+ * answer the auth packet and the heartbeats, and once authenticated replay the recording of the room,
+ * then close as the server does when it restarts, so that the client has to reconnect
+ * returns whether the server closes
+ */
+static bool serve_broadcast(SSL *ssl, std::string in) {
+    using namespace broadcast;
+    int fd = SSL_get_fd(ssl);
+    std::vector<std::string> frames;
+    size_t next = 0;
+    // the replay starts with the first heartbeat, so that every play exercises its reply
+    bool replaying = false;
+    auto due = std::chrono::steady_clock::now();
+    while (true) {
+        uint8_t opcode;
+        std::string payload, out;
+        for (size_t used; (used = client_frame(in, opcode, payload)) != 0;) {
+            in.erase(0, used);
+            if (opcode == Opcode::CLOSE) {
+                write_all(ssl, ws_frame(Opcode::CLOSE, payload));
+                return true;
+            }
+            if (opcode != Opcode::BINARY) {
+                continue;
+            }
+            for (size_t offset = 0; payload.length() - offset >= 16;) {
+                size_t total = get_be(payload.data() + offset, 4);
+                size_t header = get_be(payload.data() + offset + 4, 2);
+                uint32_t operation = static_cast<uint32_t>(get_be(payload.data() + offset + 8, 4));
+                if (total < header || total > payload.length() - offset) {
+                    return false;
+                }
+                std::string body = payload.substr(offset + header, total - header);
+                offset += total;
+                if (operation == Operation::AUTH && frames.empty()) {
+                    out += ws_frame(Opcode::BINARY, packet(Operation::AUTH_REPLY, Version::PLAIN, "{\"code\":0}"));
+                    size_t roomid = body.find("\"roomid\":");
+                    frames = recording(roomid == std::string::npos ? 0 : std::strtoul(body.c_str() + roomid + 9, NULL, 10));
+                } else if (operation == Operation::HEARTBEAT) {
+                    if (!frames.empty() && !replaying) {
+                        replaying = true;
+                        due = std::chrono::steady_clock::now() + REPLAY_INTERVAL;
+                    }
+                    // the popularity of the room
+                    std::string popularity;
+                    put_be(popularity, 42, 4);
+                    out += ws_frame(Opcode::BINARY, packet(Operation::HEARTBEAT_REPLY, Version::PLAIN, popularity));
+                }
+            }
+        }
+        if (replaying && std::chrono::steady_clock::now() >= due) {
+            if (next == frames.size()) {
+                std::string status;
+                // going away
+                put_be(status, 1001, 2);
+                write_all(ssl, out + ws_frame(Opcode::CLOSE, status));
+                return true;
+            }
+            out += frames[next++];
+            due += REPLAY_INTERVAL;
+        }
+        if (!out.empty() && !write_all(ssl, out)) {
+            return false;
+        }
+        if (SSL_pending(ssl) == 0) {
+            int timeout = -1;
+            if (replaying) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now());
+                timeout = static_cast<int>(std::max<int64_t>(left.count(), 0));
+            }
+            struct pollfd ready = {fd, POLLIN, 0};
+            if (poll(&ready, 1, timeout) <= 0) {
+                continue;
+            }
+        }
+        char buf[16384];
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n <= 0) {
+            return false;
+        }
+        in.append(buf, static_cast<size_t>(n));
+    }
+}
+
+// serve http/1.1 until the client closes or close_after responses, returns whether the server closes
+static bool serve_http1(SSL *ssl, const MockOptions &options, std::mt19937 &rng) {
+    std::string in, out;
+    char buf[16384];
+    size_t responses = 0;
+    bool closing = false, stalled = false;
+    while (!closing) {
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        in.append(buf, static_cast<size_t>(n));
+        // answer every complete request received so far
+        size_t offset = 0;
+        while (!closing) {
+            size_t end = in.find("\r\n\r\n", offset);
+            if (end == std::string::npos) {
+                break;
+            }
+            size_t length = 0;
+            std::string accept, websocket_key;
+            for (size_t pos = in.find("\r\n", offset) + 2; pos < end; pos = in.find("\r\n", pos) + 2) {
+                if (strncasecmp(in.data() + pos, "Content-Length:", 15) == 0) {
+                    length = std::strtoul(in.c_str() + pos + 15, NULL, 10);
+                } else if (strncasecmp(in.data() + pos, "Accept-Encoding:", 16) == 0) {
+                    accept = in.substr(pos + 16, in.find("\r\n", pos) - pos - 16);
+                } else if (strncasecmp(in.data() + pos, "Sec-WebSocket-Key:", 18) == 0) {
+                    size_t value = in.find_first_not_of(' ', pos + 18);
+                    websocket_key = in.substr(value, in.find("\r\n", pos) - value);
+                }
+            }
+            if (in.length() < end + 4 + length) {
+                break;
+            }
+            size_t space = in.find(' ', offset);
+            std::string path = in.substr(space + 1, in.find(' ', space + 1) - space - 1);
+            offset = end + 4 + length;
+            if (!websocket_key.empty() && path.compare(0, 4, "/sub") == 0) {
+                out += "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: " + websocket_accept(websocket_key) + "\r\n\r\n";
+                if (!write_all(ssl, out)) {
+                    return false;
+                }
+                return serve_broadcast(ssl, in.substr(offset));
+            }
+            closing = options.close_after != 0 && ++responses >= options.close_after;
+            respond(answer(path, negotiate(accept, options), options, rng), closing, options, rng, out);
+            stalled = stalled || std::uniform_int_distribution<unsigned>(0, 99)(rng) < options.stall_rate;
+            ++served;
+        }
+        in.erase(0, offset);
+        if (out.empty()) {
+            continue;
+        }
+        if (options.latency.count() > 0) {
+            std::this_thread::sleep_for(options.latency);
+        }
+        if (stalled) {
+            // the client has the first half, and waits for the rest with the responses behind
+            if (!write_all(ssl, out.substr(0, out.length() / 2))) {
+                break;
+            }
+            out.erase(0, out.length() / 2);
+            std::this_thread::sleep_for(STALL);
+            stalled = false;
+        }
+        if (!write_all(ssl, out)) {
+            break;
+        }
+        out.clear();
+    }
+    return closing;
+}
+
+/**
+ * The server side of one http/2 connection, enough of it for the client: requests are answered as soon as
+ * their stream ends, bodies are sent as the windows of the client allow, and after close_after responses
+ * the server sends GOAWAY, finishes the streams it has accepted and closes, leaving the later ones to be retried.
+ */
+class Http2Server {
+public:
+    Http2Server(const MockOptions &options, std::mt19937 &rng) : options(options), rng(rng) {
+        h2::put_settings(out, {{h2::MAX_CONCURRENT_STREAMS, 100}});
+    }
+
+    // serve until the client closes or the connection has gone away, returns whether the server closes
+    bool serve(SSL *ssl) {
+        std::string in;
+        char buf[16384];
+        while (in.length() < h2::PREFACE_LENGTH) {
+            int n = SSL_read(ssl, buf, sizeof(buf));
+            if (n <= 0) {
+                return false;
+            }
+            in.append(buf, static_cast<size_t>(n));
+        }
+        if (in.compare(0, h2::PREFACE_LENGTH, h2::PREFACE) != 0) {
+            return false;
+        }
+        auto on_frame = [this](const h2::Frame &frame) { this->on_frame(frame); };
+        reader.feed(in.data() + h2::PREFACE_LENGTH, in.length() - h2::PREFACE_LENGTH, on_frame);
+        while (true) {
+            flush();
+            if (!out.empty()) {
+                if (options.latency.count() > 0) {
+                    std::this_thread::sleep_for(options.latency);
+                }
+                if (!write_all(ssl, out)) {
+                    return false;
+                }
+                out.clear();
+            }
+            if (going_away && bodies.empty()
+                && (requests.empty() || requests.begin()->first > last_stream)) {
+                return true;
+            }
+            int n = SSL_read(ssl, buf, sizeof(buf));
+            if (n <= 0) {
+                return false;
+            }
+            reader.feed(buf, static_cast<size_t>(n), on_frame);
+        }
+    }
+private:
+    typedef struct {
+        std::string path, accept;
+    } Request;
+
+    // a body waiting for the window of its stream or of the connection
+    typedef struct {
+        uint32_t stream;
+        std::string data;
+        size_t offset;
+        int64_t window;
+        bool pieces;
+    } Body;
+
+    void on_frame(const h2::Frame &frame) {
+        switch (frame.type) {
+            case h2::SETTINGS:
+                if (!(frame.flags & h2::ACK)) {
+                    on_settings(frame);
+                }
+                break;
+            case h2::HEADERS: {
+                auto content = h2::content(frame);
+                block.assign(content.first, content.second);
+                block_end_stream = frame.flags & h2::END_STREAM;
+                if (frame.flags & h2::END_HEADERS) {
+                    on_headers(frame.stream);
+                }
+                break;
+            }
+            case h2::CONTINUATION:
+                block.append(frame.payload, frame.length);
+                if (frame.flags & h2::END_HEADERS) {
+                    on_headers(frame.stream);
+                }
+                break;
+            case h2::DATA:
+                if (frame.length > 0) {
+                    // give the window back at once, the mock keeps no limit of its own
+                    h2::put_window_update(out, 0, static_cast<uint32_t>(frame.length));
+                    if (!(frame.flags & h2::END_STREAM)) {
+                        h2::put_window_update(out, frame.stream, static_cast<uint32_t>(frame.length));
+                    }
+                }
+                if (frame.flags & h2::END_STREAM) {
+                    reply(frame.stream);
+                }
+                break;
+            case h2::PING:
+                if (!(frame.flags & h2::ACK) && frame.length == 8) {
+                    h2::put_frame(out, h2::PING, h2::ACK, 0, frame.payload, frame.length);
+                }
+                break;
+            case h2::WINDOW_UPDATE:
+                if (frame.length == 4) {
+                    int64_t increment = h2::get_u32(frame.payload) & 0x7fffffff;
+                    if (frame.stream == 0) {
+                        window += increment;
+                    }
+                    for (auto &body : bodies) {
+                        if (body.stream == frame.stream) {
+                            body.window += increment;
+                        }
+                    }
+                }
+                break;
+            case h2::RST_STREAM:
+                requests.erase(frame.stream);
+                bodies.erase(std::remove_if(bodies.begin(), bodies.end(),
+                                            [&](const Body &body) { return body.stream == frame.stream; }),
+                             bodies.end());
+                break;
+            case h2::GOAWAY:
+                if (!going_away) {
+                    going_away = true;
+                    last_stream = frame.length >= 4 ? h2::get_u32(frame.payload) & 0x7fffffff : 0;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void on_settings(const h2::Frame &frame) {
+        for (size_t offset = 0; offset + 6 <= frame.length; offset += 6) {
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(frame.payload + offset);
+            uint32_t value = h2::get_u32(frame.payload + offset + 2);
+            switch (p[0] << 8 | p[1]) {
+                case h2::HEADER_TABLE_SIZE:
+                    encoder.set_max_size(value);
+                    break;
+                case h2::INITIAL_WINDOW_SIZE:
+                    for (auto &body : bodies) {
+                        body.window += static_cast<int64_t>(value) - initial_window;
+                    }
+                    initial_window = value;
+                    break;
+                default:
+                    break;
+            }
+        }
+        h2::put_frame(out, h2::SETTINGS, h2::ACK, 0, NULL, 0);
+    }
+
+    void on_headers(uint32_t stream) {
+        Request request;
+        decoder.decode(block.data(), block.length(), [&](HeaderField &field) {
+            if (field.first == ":path") {
+                request.path = field.second;
+            } else if (field.first == "accept-encoding") {
+                request.accept = field.second;
+            }
+        });
+        if (requests.count(stream) != 0) {
+            // trailers
+            if (block_end_stream) {
+                reply(stream);
+            }
+            return;
+        }
+        requests[stream] = request;
+        if (block_end_stream) {
+            reply(stream);
+        }
+    }
+
+    // answer the request of the stream, unless it came after GOAWAY
+    void reply(uint32_t stream) {
+        auto it = requests.find(stream);
+        if (it == requests.end() || (going_away && stream > last_stream)) {
+            return;
+        }
+        Reply reply = answer(it->second.path, negotiate(it->second.accept, options), options, rng);
+        requests.erase(it);
+        bool pieces = chunked(options, rng);
+        std::vector<HeaderField> fields = {{":status", std::to_string(reply.status)}};
+        for (auto &header : reply.headers) {
+            std::string name = header.first;
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            fields.push_back({name, header.second});
+        }
+        if (!pieces) {
+            fields.push_back({"content-length", std::to_string(reply.body.length())});
+        }
+        std::string headers;
+        encoder.encode(fields, headers);
+        h2::put_headers(out, stream, headers, reply.body.empty(), h2::DEFAULT_FRAME_SIZE);
+        if (!reply.body.empty()) {
+            bodies.push_back({stream, std::move(reply.body), 0, initial_window, pieces});
+        }
+        ++served;
+        if (options.close_after != 0 && ++responses >= options.close_after && !going_away) {
+            going_away = true;
+            last_stream = stream;
+            h2::put_goaway(out, stream, h2::NO_ERROR);
+        }
+    }
+
+    // send as much of the waiting bodies as the windows allow, a body in pieces as two DATA frames at least
+    void flush() {
+        for (auto it = bodies.begin(); it != bodies.end();) {
+            Body &body = *it;
+            while (body.offset < body.data.length() && window > 0 && body.window > 0) {
+                size_t len = std::min(body.data.length() - body.offset, h2::DEFAULT_FRAME_SIZE);
+                if (body.pieces && body.offset == 0 && body.data.length() > 1) {
+                    len = std::min(len, body.data.length() / 2);
+                }
+                len = static_cast<size_t>(std::min(static_cast<int64_t>(len), std::min(window, body.window)));
+                bool last = body.offset + len == body.data.length();
+                h2::put_frame(out, h2::DATA, last ? h2::END_STREAM : 0, body.stream, body.data.data() + body.offset, len);
+                body.offset += len;
+                window -= static_cast<int64_t>(len);
+                body.window -= static_cast<int64_t>(len);
+            }
+            it = body.offset == body.data.length() ? bodies.erase(it) : it + 1;
+        }
+    }
+
+    const MockOptions &options;
+    std::mt19937 &rng;
+    h2::FrameReader reader;
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    std::string out;
+
+    // the streams whose request has not ended yet, and the header block being received
+    std::map<uint32_t, Request> requests;
+    std::string block;
+    bool block_end_stream = false;
+
+    std::deque<Body> bodies;
+    // the send window of the connection, and the one each stream starts with
+    int64_t window = h2::DEFAULT_WINDOW;
+    int64_t initial_window = h2::DEFAULT_WINDOW;
+
+    size_t responses = 0;
+    bool going_away = false;
+    uint32_t last_stream = 0;
+};
+
+static void serve(SSL_CTX *ctx, int fd, MockOptions options) {
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    std::mt19937 rng(std::random_device{}());
+    if (SSL_accept(ssl) == 1) {
+        const unsigned char *protocol;
+        unsigned int length;
+        SSL_get0_alpn_selected(ssl, &protocol, &length);
+        bool closing;
+        try {
+            closing = length == 2 && memcmp(protocol, "h2", 2) == 0 ? Http2Server(options, rng).serve(ssl)
+                                                                    : serve_http1(ssl, options, rng);
+        } catch (const std::exception &e) {
+            // a malformed frame or header block of the client
+            std::cerr << e.what() << std::endl;
+            closing = false;
+        }
+        if (closing) {
+            SSL_shutdown(ssl);
+        }
+    }
+    SSL_free(ssl);
+    close(fd);
+}
+
+static void on_signal(int) {
+    std::cout << "served " << served.load() << " requests" << std::endl;
+    _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    MockOptions options = {8443, std::chrono::milliseconds(0), MockOptions::LENGTH, 0, 0, 0, 75, 0, {"br", "gzip", "deflate"}, true};
+    int opt;
+    while ((opt = getopt(argc, argv, "p:l:t:k:e:s:m:r:z:1")) != -1) {
+        switch (opt) {
+            case 'p':
+                options.port = static_cast<uint16_t>(std::stoul(optarg));
+                break;
+            case 'l':
+                options.latency = std::chrono::milliseconds(std::stoul(optarg));
+                break;
+            case 't':
+                if (strcmp(optarg, "chunked") == 0) {
+                    options.framing = MockOptions::CHUNKED;
+                } else if (strcmp(optarg, "mixed") == 0) {
+                    options.framing = MockOptions::MIXED;
+                } else {
+                    options.framing = MockOptions::LENGTH;
+                }
+                break;
+            case 'k':
+                options.close_after = std::stoul(optarg);
+                break;
+            case 'e':
+                options.error_rate = static_cast<unsigned>(std::stoul(optarg));
+                break;
+            case 's':
+                options.stall_rate = static_cast<unsigned>(std::stoul(optarg));
+                break;
+            case 'm':
+                options.medals = std::stoul(optarg);
+                break;
+            case 'r':
+                options.rate = std::stoul(optarg);
+                break;
+            case 'z':
+                // identity leaves the bodies as they are
+                options.codings.clear();
+                if (strcmp(optarg, "identity") != 0) {
+                    options.codings.push_back(optarg);
+                }
+                break;
+            case '1':
+                options.http2 = false;
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-p port] [-l latency ms] [-t length|chunked|mixed]"
+                          << " [-k responses per connection] [-e error %] [-s stall %] [-m medals]"
+                          << " [-r requests per second of each endpoint] [-z br|gzip|deflate|identity]"
+                          << " [-1 for http/1.1 only]" << std::endl;
+                return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    SSL_CTX *ctx = make_context(&options.http2);
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(options.port);
+    if (bind(listener, (sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 1024) == -1) {
+        std::cerr << "Fail to listen on port " << options.port << std::endl;
+        return 1;
+    }
+    std::cout << "listening on 127.0.0.1:" << options.port << std::endl;
+
+    while (true) {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::thread(serve, ctx, fd, options).detach();
+    }
+}
@@ -0,0 +1,238 @@
+#include <iostream>
+#include <future>
+#include <stdexcept>
+
+#include "monitor.h"
+
+const RoomMonitor::Options RoomMonitor::default_options = {
+    std::chrono::seconds(10), std::chrono::seconds(30), std::chrono::seconds(1), std::chrono::milliseconds(500), 16,
+    true, {"broadcastlv.chat.bilibili.com", 443, "/sub", std::chrono::seconds(30)}
+};
+
+RoomMonitor::RoomMonitor(const Options &options)
+    : reactor(Reactor::instance()), options(options), rng(std::random_device()()), flushing(false), stopped(false) {}
+
+void RoomMonitor::watch(const BiliApi &api, uint32_t roomid) {
+    std::shared_ptr<RoomMonitor> self = shared_from_this();
+    const BiliApi *p = &api;
+    reactor.post([self, p, roomid] {
+        if (self->stopped || !self->watched.insert({p, roomid}).second) {
+            return;
+        }
+        size_t i = self->rooms.size();
+        self->rooms.push_back({p, roomid, State::OFFLINE, 0, 0});
+        if (self->options.push) {
+            std::vector<size_t> &indices = self->subscribed[roomid];
+            indices.push_back(i);
+            if (indices.size() == 1) {
+                self->subscribe(i);
+            } else {
+                // the broadcast is already subscribed by another account, only the status is missing
+                self->poll(i);
+            }
+            return;
+        }
+        // the first polls of rooms watched together are spread over a whole period
+        std::uniform_int_distribution<int64_t> spread(0, self->options.poll.count());
+        std::chrono::milliseconds delay(spread(self->rng));
+        self->rooms[i].poll = self->reactor.run_at(self->deadline(delay), [self, i] { self->poll(i); });
+    });
+}
+
+void RoomMonitor::stop() {
+    std::shared_ptr<RoomMonitor> self = shared_from_this();
+    auto promise = std::make_shared<std::promise<void>>();
+    reactor.post([self, promise] {
+        self->stopped = true;
+        for (Room &room : self->rooms) {
+            self->reactor.cancel(room.poll);
+            self->reactor.cancel(room.heartbeat);
+        }
+        promise->set_value();
+    });
+    promise->get_future().wait();
+    // set in the reactor thread before the promise
+    if (subscriber) {
+        subscriber->stop();
+    }
+}
+
+Reactor::Clock::time_point RoomMonitor::deadline(std::chrono::milliseconds period) {
+    std::uniform_int_distribution<int64_t> jitter(-options.jitter.count(), options.jitter.count());
+    auto at = Reactor::Clock::now() + period + std::chrono::milliseconds(jitter(rng));
+    auto window = std::chrono::duration_cast<Reactor::Clock::duration>(options.window);
+    if (window.count() <= 0) {
+        return at;
+    }
+    auto since = at.time_since_epoch();
+    return Reactor::Clock::time_point((since + window - Reactor::Clock::duration(1)) / window * window);
+}
+
+void RoomMonitor::poll(size_t i) {
+    Room &room = rooms[i];
+    room.poll = 0;
+    std::shared_ptr<RoomMonitor> self = shared_from_this();
+    send(room, room.api->play_info_request(room.roomid), [self, i] (std::exception_ptr error, HttpsResponse &response) {
+        self->on_status(i, error, response);
+    });
+}
+
+void RoomMonitor::on_status(size_t i, std::exception_ptr error, HttpsResponse &response) {
+    if (stopped) {
+        return;
+    }
+    Room &room = rooms[i];
+    if (!options.push) {
+        std::shared_ptr<RoomMonitor> self = shared_from_this();
+        room.poll = reactor.run_at(deadline(options.poll), [self, i] { self->poll(i); });
+    }
+
+    uint32_t status = 0;
+    try {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (response.status / 100 != 2) {
+            std::rethrow_exception(status_error(response.status));
+        }
+        status = BiliApi::parse_live_status(response.body);
+    } catch (const std::exception &e) {
+        std::cerr << "Room id = " << room.roomid << " fails to get the status: " << e.what() << std::endl;
+        return;
+    }
+
+    if (status == 1) {
+        go_live(i);
+    } else {
+        go_offline(i);
+    }
+}
+
+void RoomMonitor::go_live(size_t i) {
+    Room &room = rooms[i];
+    if (room.state == State::LIVE) {
+        return;
+    }
+    std::cout << "Room id = " << room.roomid << " starts the stream." << std::endl;
+    uint32_t roomid = room.roomid;
+    send(room, room.api->entry_request(roomid), [roomid] (std::exception_ptr error, HttpsResponse &) {
+        if (error) {
+            std::cerr << "Room id = " << roomid << " fails to enter the room" << std::endl;
+        }
+    });
+    room.state = State::LIVE;
+    std::shared_ptr<RoomMonitor> self = shared_from_this();
+    room.heartbeat = reactor.run_at(deadline(options.heartbeat), [self, i] { self->heartbeat(i); });
+}
+
+void RoomMonitor::go_offline(size_t i) {
+    Room &room = rooms[i];
+    if (room.state == State::OFFLINE) {
+        return;
+    }
+    std::cout << "Room id = " << room.roomid << " ends the stream." << std::endl;
+    reactor.cancel(room.heartbeat);
+    room.heartbeat = 0;
+    room.state = State::OFFLINE;
+}
+
+void RoomMonitor::subscribe(size_t i) {
+    std::shared_ptr<RoomMonitor> self = shared_from_this();
+    if (!subscriber) {
+        std::weak_ptr<RoomMonitor> weak = self;
+        subscriber = std::make_shared<LiveSubscriber>([weak] (uint32_t roomid, LiveSubscriber::Event event) {
+            if (auto s = weak.lock()) {
+                s->on_broadcast(roomid, event);
+            }
+        }, options.broadcast);
+    }
+    const Room &room = rooms[i];
+    send(room, room.api->danmu_info_request(room.roomid), [self, i] (std::exception_ptr error, HttpsResponse &response) {
+        if (self->stopped) {
+            return;
+        }
+        const Room &room = self->rooms[i];
+        uint64_t uid = 0;
+        std::string token;
+        try {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            if (response.status / 100 != 2) {
+                std::rethrow_exception(status_error(response.status));
+            }
+            token = BiliApi::parse_danmu_token(response.body);
+            uid = room.api->uid();
+        } catch (const std::exception &e) {
+            // the broadcast still tells the start and the end of streams to anonymous subscribers
+            std::cerr << "Room id = " << room.roomid << " fails to get the broadcast token: " << e.what() << std::endl;
+            token.clear();
+            uid = 0;
+        }
+        self->subscriber->subscribe(room.roomid, uid, token);
+    });
+}
+
+void RoomMonitor::on_broadcast(uint32_t roomid, LiveSubscriber::Event event) {
+    auto it = subscribed.find(roomid);
+    if (stopped || it == subscribed.end()) {
+        return;
+    }
+    for (size_t i : it->second) {
+        switch (event) {
+            case LiveSubscriber::Event::SUBSCRIBED:
+                // the stream may have started or ended while the broadcast was not subscribed
+                poll(i);
+                break;
+            case LiveSubscriber::Event::LIVE:
+                go_live(i);
+                break;
+            case LiveSubscriber::Event::PREPARING:
+                go_offline(i);
+                break;
+        }
+    }
+}
+
+void RoomMonitor::heartbeat(size_t i) {
+    Room &room = rooms[i];
+    uint32_t roomid = room.roomid;
+    send(room, room.api->heartbeat_request(roomid), [roomid] (std::exception_ptr error, HttpsResponse &) {
+        if (error) {
+            std::cerr << "Room id = " << roomid << " fails to send the heartbeat" << std::endl;
+        }
+    });
+    std::shared_ptr<RoomMonitor> self = shared_from_this();
+    room.heartbeat = reactor.run_at(deadline(options.heartbeat), [self, i] { self->heartbeat(i); });
+}
+
+void RoomMonitor::send(const Room &room, PreparedRequest request, HttpsClient::Callback callback) {
+    const std::shared_ptr<HttpsClient> &client = room.api->client();
+    Burst &burst = bursts[client.get()];
+    burst.client = client;
+    burst.requests.push_back(std::move(request));
+    burst.callbacks.push_back(std::move(callback));
+    if (burst.requests.size() >= options.max_batch) {
+        client->submit_batch(std::move(burst.requests), std::move(burst.callbacks));
+        burst.requests.clear();
+        burst.callbacks.clear();
+    }
+    // the timers of the window all fire before the posted flush runs
+    if (!flushing) {
+        flushing = true;
+        std::shared_ptr<RoomMonitor> self = shared_from_this();
+        reactor.post([self] { self->flush(); });
+    }
+}
+
+void RoomMonitor::flush() {
+    flushing = false;
+    for (auto &it : bursts) {
+        Burst &burst = it.second;
+        if (!burst.requests.empty()) {
+            burst.client->submit_batch(std::move(burst.requests), std::move(burst.callbacks));
+            burst.requests.clear();
+            burst.callbacks.clear();
+        }
+    }
+}
@@ -0,0 +1,118 @@
+/**
+ * monitor.h
+ *
+ * Header file for the monitoring of live rooms driven by the timers of the reactor
+ */
+
+#ifndef _MONITOR_H_
+#define _MONITOR_H_
+
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <utility>
+
+#include "https.h"
+#include "bilibili.h"
+#include "reactor.h"
+#include "live.h"
+
+/**
+ * Watch live rooms of any number of accounts from the reactor thread, rather than with one sleeping thread per room.
+ * Each room is a state machine: when the stream starts roomEntryAction is sent and the room turns LIVE,
+ * where heartbeats are sent until the stream ends and the room is OFFLINE again.
+ * The start and the end of streams are pushed by the broadcast of the room, whose status is then only fetched
+ * when the subscription is (re)established. Without push, the status of every room is polled instead.
+ * Timers are jittered so that rooms watched together spread out, and their deadlines are rounded up to a window,
+ * so that the requests due in the same window leave as one pipelined batch per connection.
+ */
+class RoomMonitor : public std::enable_shared_from_this<RoomMonitor> {
+public:
+    typedef struct {
+        // how often the status of a room is polled
+        std::chrono::milliseconds poll;
+        // how often a live room sends a heartbeat
+        std::chrono::milliseconds heartbeat;
+        // each timer fires up to this much earlier or later than its period
+        std::chrono::milliseconds jitter;
+        // deadlines are rounded up to a multiple of this, so that timers due close together fire together
+        std::chrono::milliseconds window;
+        // the maximum number of requests pipelined in one batch
+        size_t max_batch;
+        // whether the start and the end of streams are pushed by the broadcast, rather than polled
+        bool push;
+        // the server of the broadcast
+        LiveSocket::Endpoint broadcast;
+    } Options;
+
+    static const Options default_options;
+
+    explicit RoomMonitor(const Options &options = default_options);
+
+    // start watching roomid with the requests of api, which must outlive the monitor, can be called from any thread
+    void watch(const BiliApi &api, uint32_t roomid);
+
+    // stop all rooms and wait until no timer is left, can be called from any thread but the reactor thread
+    void stop();
+private:
+    enum State { OFFLINE, LIVE };
+
+    typedef struct {
+        const BiliApi *api;
+        uint32_t roomid;
+        State state;
+        Reactor::TimerId poll, heartbeat;
+    } Room;
+
+    // the requests due in the current window on one client, and their callbacks
+    typedef struct {
+        std::shared_ptr<HttpsClient> client;
+        std::vector<PreparedRequest> requests;
+        std::vector<HttpsClient::Callback> callbacks;
+    } Burst;
+
+    // a deadline about period from now, jittered and rounded up to the window
+    Reactor::Clock::time_point deadline(std::chrono::milliseconds period);
+
+    // the timers of room i fire
+    void poll(size_t i);
+    void heartbeat(size_t i);
+
+    // the status of room i arrives
+    void on_status(size_t i, std::exception_ptr error, HttpsResponse &response);
+
+    // the stream of room i starts or ends
+    void go_live(size_t i);
+    void go_offline(size_t i);
+
+    // fetch the token of room i and subscribe to its broadcast
+    void subscribe(size_t i);
+
+    // an event of the broadcast of roomid, for every room watching it
+    void on_broadcast(uint32_t roomid, LiveSubscriber::Event event);
+
+    // queue a request for the burst of its client
+    void send(const Room &room, PreparedRequest request, HttpsClient::Callback callback);
+
+    // submit the queued requests, one batch per client
+    void flush();
+
+    Reactor &reactor;
+    Options options;
+    std::mt19937 rng;
+
+    std::vector<Room> rooms;
+    std::set<std::pair<const BiliApi *, uint32_t>> watched;
+    // the rooms of each room id, watched by several accounts but subscribed once
+    std::unordered_map<uint32_t, std::vector<size_t>> subscribed;
+    std::shared_ptr<LiveSubscriber> subscriber;
+    std::unordered_map<HttpsClient *, Burst> bursts;
+    // whether flush() has been posted for the current window
+    bool flushing;
+    bool stopped;
+};
+
+#endif /* _MONITOR_H_ */
@@ -0,0 +1,183 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <cerrno>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+
+#include "net.h"
+#include "metrics.h"
+
+const std::chrono::milliseconds TcpConnect::STAGGER(250);
+
+// the address each redirected host connects to instead
+static std::mutex redirects_mutex;
+static std::unordered_map<std::string, std::pair<std::string, uint16_t>> redirects;
+
+void tcp_redirect(const std::string &host, const std::string &target, uint16_t port) {
+    std::lock_guard<std::mutex> lock(redirects_mutex);
+    redirects[host] = {target, port};
+}
+
+std::shared_ptr<TcpConnect> tcp_connect(Reactor &reactor, const std::string &host, uint16_t port, TcpConnect::Callback done) {
+    auto connect = std::make_shared<TcpConnect>(reactor, host, port, std::move(done));
+    std::weak_ptr<TcpConnect> weak = connect;
+    reactor.post([weak] {
+        if (auto c = weak.lock()) {
+            c->start();
+        }
+    });
+    return connect;
+}
+
+TcpConnect::TcpConnect(Reactor &reactor, const std::string &host, uint16_t port, Callback done)
+    : reactor(reactor), name(host), host(host), port(port), done(std::move(done)), metrics(metrics_host(host)), next(0),
+      timer(0) {
+    std::lock_guard<std::mutex> lock(redirects_mutex);
+    auto it = redirects.find(name);
+    if (it != redirects.end()) {
+        this->host = it->second.first;
+        this->port = it->second.second;
+    }
+}
+
+TcpConnect::~TcpConnect() {
+    abandon();
+}
+
+void TcpConnect::start() {
+    started = std::chrono::steady_clock::now();
+    std::weak_ptr<TcpConnect> self = shared_from_this();
+    // the resolver is that of the reactor of the process, which drives every connection
+    Resolver::instance().resolve(host, [self] (std::exception_ptr error, const std::vector<Address> &found) {
+        if (auto c = self.lock()) {
+            c->resolved(error, found);
+        }
+    });
+}
+
+void TcpConnect::resolved(std::exception_ptr error, const std::vector<Address> &found) {
+    auto now = std::chrono::steady_clock::now();
+    metrics.dns.record(now - started);
+    started = now;
+    if (error) {
+        finish(error, -1);
+        return;
+    }
+    // alternate the families, starting with the first one of the answer
+    std::vector<Address> first, second;
+    for (const Address &address : found) {
+        (address.addr.ss_family == found.front().addr.ss_family ? first : second).push_back(address);
+    }
+    for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+        if (i < first.size()) {
+            addresses.push_back(first[i]);
+        }
+        if (i < second.size()) {
+            addresses.push_back(second[i]);
+        }
+    }
+    schedule();
+}
+
+bool TcpConnect::attempt_next() {
+    while (next < addresses.size()) {
+        Address address = addresses[next];
+        ++next;
+        if (address.addr.ss_family == AF_INET6) {
+            reinterpret_cast<struct sockaddr_in6 *>(&address.addr)->sin6_port = htons(port);
+        } else {
+            reinterpret_cast<struct sockaddr_in *>(&address.addr)->sin_port = htons(port);
+        }
+        int fd = socket(address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            last_error = strerror(errno);
+            continue;
+        }
+        // completes when the socket becomes writable
+        if (connect(fd, reinterpret_cast<const struct sockaddr *>(&address.addr), address.len) == -1 && errno != EINPROGRESS) {
+            last_error = strerror(errno);
+            close(fd);
+            continue;
+        }
+        std::weak_ptr<TcpConnect> self = shared_from_this();
+        reactor.add(fd, EPOLLOUT, [self, fd] (uint32_t events) {
+            if (auto c = self.lock()) {
+                c->on_event(fd, events);
+            }
+        });
+        attempts.push_back(fd);
+        return true;
+    }
+    return false;
+}
+
+void TcpConnect::schedule() {
+    reactor.cancel(timer);
+    timer = 0;
+    if (!attempt_next()) {
+        if (attempts.empty()) {
+            finish(std::make_exception_ptr(std::runtime_error("tcp connect to " + host + " fails: " + last_error)), -1);
+        }
+        return;
+    }
+    if (next < addresses.size()) {
+        std::weak_ptr<TcpConnect> self = shared_from_this();
+        timer = reactor.run_after(STAGGER, [self] {
+            if (auto c = self.lock()) {
+                c->timer = 0;
+                c->schedule();
+            }
+        });
+    }
+}
+
+void TcpConnect::on_event(int fd, uint32_t) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+        err = errno;
+    }
+    attempts.erase(std::remove(attempts.begin(), attempts.end(), fd), attempts.end());
+    reactor.remove(fd);
+    if (err == 0) {
+        metrics.connect.record(std::chrono::steady_clock::now() - started);
+        finish(nullptr, fd);
+        return;
+    }
+    last_error = strerror(err);
+    close(fd);
+    // a failed attempt does not wait for the stagger
+    schedule();
+}
+
+void TcpConnect::finish(std::exception_ptr error, int fd) {
+    // done may drop the last reference to this
+    std::shared_ptr<TcpConnect> self = shared_from_this();
+    abandon();
+    if (done) {
+        auto fn = std::move(done);
+        done = nullptr;
+        fn(error, fd);
+    } else if (fd != -1) {
+        close(fd);
+    }
+}
+
+void TcpConnect::abandon() {
+    reactor.cancel(timer);
+    timer = 0;
+    for (int fd : attempts) {
+        reactor.remove(fd);
+        close(fd);
+    }
+    attempts.clear();
+    next = addresses.size();
+}
@@ -0,0 +1,87 @@
+/**
+ * net.h
+ *
+ * Header file for the tcp sockets under the tls connections
+ */
+
+#ifndef _NET_H_
+#define _NET_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <chrono>
+#include <cstdint>
+
+#include "reactor.h"
+#include "resolver.h"
+
+struct HostMetrics;
+
+/**
+ * A tcp connect racing every address of a host, the happy eyeballs of RFC 8305.
+ * Attempts alternate between IPv6 and IPv4 and start one STAGGER apart, or at once when the previous one fails,
+ * and the first socket connected wins while the others are closed.
+ * Destroying the connect before it completes cancels it. All methods must be called in the reactor thread.
+ */
+class TcpConnect : public std::enable_shared_from_this<TcpConnect> {
+public:
+    // called with the connected non-blocking socket, which the caller owns and registers itself, or with the error
+    typedef std::function<void(std::exception_ptr error, int sockfd)> Callback;
+
+    // the delay before the next address is tried while the previous attempts are still pending
+    static const std::chrono::milliseconds STAGGER;
+
+    TcpConnect(Reactor &reactor, const std::string &host, uint16_t port, Callback done);
+    ~TcpConnect();
+
+    // resolve the host and start the first attempt
+    void start();
+private:
+    void resolved(std::exception_ptr error, const std::vector<Address> &found);
+
+    // start connecting to the next address, return false if none is left
+    bool attempt_next();
+
+    // start the next attempt now or after the stagger
+    void schedule();
+
+    void on_event(int fd, uint32_t events);
+
+    // call done once, with the winning socket or the error
+    void finish(std::exception_ptr error, int fd);
+
+    // close the pending attempts and cancel the timer
+    void abandon();
+
+    Reactor &reactor;
+    // the name asked for, and the host and port connected to, which differ if redirected
+    std::string name, host;
+    uint16_t port;
+    Callback done;
+    HostMetrics &metrics;
+
+    std::vector<Address> addresses;
+    size_t next;
+    // the sockets still connecting
+    std::vector<int> attempts;
+    Reactor::TimerId timer;
+    std::chrono::steady_clock::time_point started;
+    std::string last_error;
+};
+
+/**
+ * Resolve host without blocking and connect to host:port, done is called in the reactor thread and never before this returns.
+ * Keep the returned connect until done is called, dropping it cancels the connect. Only in the reactor thread.
+ */
+std::shared_ptr<TcpConnect> tcp_connect(Reactor &reactor, const std::string &host, uint16_t port, TcpConnect::Callback done);
+
+/**
+ * Connect to target:port whenever host is asked for, whatever the port, e.g. to run against a local mock server.
+ * The tls server name and the Host header are still those of host. Affects the connections opened afterwards.
+ */
+void tcp_redirect(const std::string &host, const std::string &target, uint16_t port);
+
+#endif /* _NET_H_ */
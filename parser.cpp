@@ -0,0 +1,305 @@
+#include <strings.h>
+
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "parser.h"
+
+// a status line, header line or chunk size line longer than this is rejected
+static const size_t MAX_LINE = 65536;
+
+// the body is reserved up front up to this size, larger bodies grow as they arrive
+static const size_t MAX_RESERVE = 1 << 24;
+
+BufferPool &BufferPool::local() {
+    static thread_local BufferPool pool;
+    return pool;
+}
+
+BufferPool::~BufferPool() {
+    for (char *block : blocks) {
+        delete[] block;
+    }
+}
+
+char *BufferPool::acquire() {
+    if (blocks.empty()) {
+        return new char[BLOCK];
+    }
+    char *block = blocks.back();
+    blocks.pop_back();
+    return block;
+}
+
+void BufferPool::release(char *block) {
+    blocks.push_back(block);
+}
+
+ResponseParser::ResponseParser() : state(State::STATUS_LINE), remaining(0) {}
+
+size_t ResponseParser::feed(const char *data, size_t len, HttpsResponse &response) {
+    size_t pos = 0;
+    while (pos < len && state != State::DONE) {
+        switch (state) {
+            case State::BODY:
+            case State::CHUNK_DATA: {
+                size_t n = std::min(remaining, len - pos);
+                body(data + pos, n, response);
+                pos += n;
+                remaining -= n;
+                if (remaining == 0) {
+                    if (state == State::BODY) {
+                        on_body_end();
+                    } else {
+                        state = State::CHUNK_END;
+                    }
+                }
+                break;
+            }
+            case State::BODY_UNTIL_CLOSE:
+                body(data + pos, len - pos, response);
+                pos = len;
+                break;
+            default: {
+                // the other states consume lines
+                const char *lf = static_cast<const char *>(memchr(data + pos, '\n', len - pos));
+                if (lf == NULL) {
+                    partial.append(data + pos, len - pos);
+                    if (partial.length() > MAX_LINE) {
+                        throw std::runtime_error("Response line too long");
+                    }
+                    pos = len;
+                    break;
+                }
+                size_t end = static_cast<size_t>(lf - data);
+                if (partial.empty()) {
+                    // the whole line is in this fragment, parse it in place
+                    size_t n = end - pos;
+                    on_line(data + pos, n > 0 && data[end - 1] == '\r' ? n - 1 : n, response);
+                } else {
+                    partial.append(data + pos, end - pos);
+                    if (!partial.empty() && partial.back() == '\r') {
+                        partial.pop_back();
+                    }
+                    std::string line;
+                    line.swap(partial);
+                    on_line(line.data(), line.length(), response);
+                }
+                pos = end + 1;
+                break;
+            }
+        }
+    }
+    return pos;
+}
+
+void ResponseParser::body(const char *data, size_t len, HttpsResponse &response) {
+    if (decoder) {
+        if (sink) {
+            decoder->feed(data, len, sink);
+        } else {
+            decoder->feed(data, len, [&response] (const char *data, size_t len) { response.body.append(data, len); });
+        }
+    } else if (sink) {
+        sink(data, len);
+    } else {
+        response.body.append(data, len);
+    }
+}
+
+bool ResponseParser::eof() {
+    if (state == State::BODY_UNTIL_CLOSE) {
+        on_body_end();
+        return true;
+    }
+    return false;
+}
+
+void ResponseParser::on_line(const char *line, size_t len, HttpsResponse &response) {
+    switch (state) {
+        case State::STATUS_LINE: {
+            // "HTTP/1.1 200 OK"
+            const char *space = static_cast<const char *>(memchr(line, ' ', len));
+            if (len < 5 || strncmp(line, "HTTP/", 5) != 0 || space == NULL || line + len - space < 4) {
+                throw std::runtime_error("Fail to get the status code");
+            }
+            response.status = 0;
+            for (const char *p = space + 1; p < space + 4; ++p) {
+                if (*p < '0' || *p > '9') {
+                    throw std::runtime_error("Fail to get the status code");
+                }
+                response.status = response.status * 10 + (*p - '0');
+            }
+            response.header.clear();
+            response.body.clear();
+            state = State::HEADER_LINE;
+            break;
+        }
+        case State::HEADER_LINE: {
+            if (len == 0) {
+                on_headers_end(response);
+                break;
+            }
+            const char *colon = static_cast<const char *>(memchr(line, ':', len));
+            if (colon == NULL) {
+                throw std::runtime_error("Malformed header line");
+            }
+            std::string name(line, static_cast<size_t>(colon - line));
+            std::transform(name.begin(), name.end(), name.begin(), [] (char c) {
+                return static_cast<char>(tolower(static_cast<unsigned char>(c)));
+            });
+            const char *value = colon + 1, *end = line + len;
+            while (value < end && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+                --end;
+            }
+            // repeated fields are joined into one list, as http/2 does
+            std::string &field = response.header[name];
+            if (!field.empty()) {
+                field += ", ";
+            }
+            field.append(value, static_cast<size_t>(end - value));
+            break;
+        }
+        case State::CHUNK_SIZE: {
+            // the size may be followed by chunk extensions after ';'
+            size_t size = 0, i = 0;
+            for (; i < len && isxdigit(static_cast<unsigned char>(line[i])); ++i) {
+                if (size >> 60) {
+                    throw std::runtime_error("Chunk too large");
+                }
+                size = size * 16 + static_cast<size_t>(isdigit(static_cast<unsigned char>(line[i])) ? line[i] - '0' : (line[i] | 0x20) - 'a' + 10);
+            }
+            if (i == 0) {
+                throw std::runtime_error("Fail to get the size of chunk");
+            }
+            remaining = size;
+            state = size == 0 ? State::TRAILER : State::CHUNK_DATA;
+            break;
+        }
+        case State::CHUNK_END:
+            if (len != 0) {
+                throw std::runtime_error("Chunk not ends in \\r\\n");
+            }
+            state = State::CHUNK_SIZE;
+            break;
+        case State::TRAILER:
+            if (len == 0) {
+                on_body_end();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+bool ResponseParser::has_token(const std::string &list, const char *token) {
+    size_t len = strlen(token);
+    for (size_t pos = 0; pos < list.length();) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = list.length();
+        }
+        size_t begin = pos, end = comma;
+        while (begin < end && (list[begin] == ' ' || list[begin] == '\t')) {
+            ++begin;
+        }
+        while (end > begin && (list[end - 1] == ' ' || list[end - 1] == '\t')) {
+            --end;
+        }
+        if (end - begin == len && strncasecmp(list.data() + begin, token, len) == 0) {
+            return true;
+        }
+        pos = comma + 1;
+    }
+    return false;
+}
+
+size_t ResponseParser::content_length(const std::string &value) {
+    // repeated fields are joined into a list, whose values must all be the same
+    size_t length = 0;
+    bool first = true;
+    for (size_t pos = 0; pos <= value.length(); ++pos) {
+        while (pos < value.length() && (value[pos] == ' ' || value[pos] == '\t')) {
+            ++pos;
+        }
+        size_t n = 0, digits = 0;
+        for (; pos < value.length() && isdigit(static_cast<unsigned char>(value[pos])); ++pos, ++digits) {
+            size_t digit = static_cast<size_t>(value[pos] - '0');
+            if (n > (SIZE_MAX - digit) / 10) {
+                throw std::runtime_error("Content-Length too large");
+            }
+            n = n * 10 + digit;
+        }
+        while (pos < value.length() && (value[pos] == ' ' || value[pos] == '\t')) {
+            ++pos;
+        }
+        // a sign, junk after the digits or an empty value would frame the body wrongly
+        if (digits == 0 || (pos < value.length() && value[pos] != ',') || (!first && n != length)) {
+            throw std::runtime_error("Invalid Content-Length " + value);
+        }
+        length = n;
+        first = false;
+    }
+    return length;
+}
+
+void ResponseParser::on_headers_end(HttpsResponse &response) {
+    // informational responses are followed by the real one
+    if (response.status / 100 == 1) {
+        state = State::STATUS_LINE;
+        return;
+    }
+    if (response.status == 204 || response.status == 304) {
+        state = State::DONE;
+        return;
+    }
+    select_decoder(response);
+    auto it = response.header.find("transfer-encoding");
+    if (it != response.header.end() && has_token(it->second, "chunked")) {
+        state = State::CHUNK_SIZE;
+        return;
+    }
+    it = response.header.find("content-length");
+    if (it == response.header.end()) {
+        state = State::BODY_UNTIL_CLOSE;
+        return;
+    }
+    remaining = content_length(it->second);
+    // the decoded length of a compressed body is not known
+    if (!sink && !decoder) {
+        response.body.reserve(std::min<size_t>(remaining, MAX_RESERVE));
+    }
+    state = remaining == 0 ? State::DONE : State::BODY;
+}
+
+void ResponseParser::select_decoder(const HttpsResponse &response) {
+    decoder.reset();
+    auto encoding = response.header.find("content-encoding");
+    if (encoding != response.header.end()) {
+        ContentDecoder::Coding coding = ContentDecoder::coding(encoding->second);
+        if (coding != ContentDecoder::IDENTITY) {
+            decoder = std::make_unique<ContentDecoder>(coding);
+        }
+    }
+}
+
+void ResponseParser::headers_framed(HttpsResponse &response) {
+    response.body.clear();
+    select_decoder(response);
+    state = State::FRAMED;
+}
+
+void ResponseParser::on_body_end() {
+    if (decoder) {
+        decoder->finish();
+        decoder.reset();
+    }
+    state = State::DONE;
+}
@@ -0,0 +1,115 @@
+/**
+ * parser.h
+ *
+ * Header file for the incremental parser of https responses and the buffers it reads from
+ */
+
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "https.h"
+#include "decoder.h"
+
+/**
+ * Fixed-size blocks reused by all connections of a thread, so that reading a response allocates nothing.
+ * A block is large enough for the plaintext of a full tls record.
+ */
+class BufferPool {
+public:
+    static const size_t BLOCK = 16384;
+
+    // the pool of the calling thread
+    static BufferPool &local();
+
+    ~BufferPool();
+    char *acquire();
+    void release(char *block);
+private:
+    std::vector<char *> blocks;
+};
+
+// a block of the thread's pool held for the lifetime of the object
+class PooledBuffer {
+public:
+    PooledBuffer() : block(BufferPool::local().acquire()) {}
+    ~PooledBuffer() { BufferPool::local().release(block); }
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+    char *data() { return block; }
+    size_t size() const { return BufferPool::BLOCK; }
+private:
+    char *block;
+};
+
+/**
+ * State machine parsing one response from bytes fed in arbitrary fragments.
+ * Headers of any size and chunk boundaries anywhere are handled without scanning the same byte twice,
+ * header names are stored in lower case, and the body is appended to the response as it arrives,
+ * or passed to a sink if one is set. A body with a Content-Encoding is decoded on the way.
+ */
+class ResponseParser {
+public:
+    ResponseParser();
+
+    /**
+     * parse data into response, return the number of bytes consumed
+     * fewer than len bytes are consumed only when the response completes, the rest belongs to the next response
+     */
+    size_t feed(const char *data, size_t len, HttpsResponse &response);
+
+    // the server closes the connection, return true if that completes a response delimited by the close
+    bool eof();
+
+    // whether the whole response has been parsed
+    bool done() const { return state == State::DONE; }
+
+    // whether the comma separated list of a header holds token, compared case insensitively
+    static bool has_token(const std::string &list, const char *token);
+
+    // the value of a Content-Length header, throw unless it is digits only and fits in size_t
+    static size_t content_length(const std::string &value);
+
+    // pass the body to sink instead of appending it to the response
+    void set_sink(BodySink sink) { this->sink = std::move(sink); }
+
+    /**
+     * the status and the headers of a response framed by the transport, as in http/2, have been put into response
+     * its body is then passed with body_framed() and ends with end_framed()
+     */
+    void headers_framed(HttpsResponse &response);
+    void body_framed(const char *data, size_t len, HttpsResponse &response) { body(data, len, response); }
+    void end_framed() { on_body_end(); }
+private:
+    enum State { STATUS_LINE, HEADER_LINE, BODY, BODY_UNTIL_CLOSE, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER, FRAMED, DONE };
+
+    // parse a complete line without its "\r\n"
+    void on_line(const char *line, size_t len, HttpsResponse &response);
+
+    // a fragment of the body arrives
+    void body(const char *data, size_t len, HttpsResponse &response);
+
+    // decide how the body is delimited and decoded once the headers end
+    void on_headers_end(HttpsResponse &response);
+
+    // the whole body has arrived
+    void on_body_end();
+
+    // decode the body if the response has a Content-Encoding
+    void select_decoder(const HttpsResponse &response);
+
+    State state;
+    // a line split across fragments
+    std::string partial;
+    // bytes left in the body or in the current chunk
+    size_t remaining;
+    BodySink sink;
+    // the decoder of a compressed body, null for an identity body
+    std::unique_ptr<ContentDecoder> decoder;
+};
+
+#endif /* _PARSER_H_ */
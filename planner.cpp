@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <limits>
+
+#include "planner.h"
+#include "json.h"
+
+// numbers of the panel into the fields of a record, negative ones as 0
+static uint32_t to_u32(int64_t value) {
+    return static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(value, 0), std::numeric_limits<uint32_t>::max()));
+}
+
+// the intimacy left to earn today, the most possible if the panel does not tell the limit
+static uint32_t intimacy_left(const Medal &medal) {
+    if (medal.day_limit == 0) {
+        return std::numeric_limits<uint32_t>::max();
+    }
+    return medal.day_limit > medal.today_feed ? medal.day_limit - medal.today_feed : 0;
+}
+
+uint8_t ExpPlanner::actions(const Medal &medal) {
+    uint32_t left = intimacy_left(medal);
+    if (left == 0) {
+        return 0;
+    }
+    uint8_t actions = EXP_CHAT | EXP_WATCH;
+    if (left > CHAT_INTIMACY) {
+        actions |= EXP_LIKE;
+    }
+    return actions;
+}
+
+void ExpPlanner::parse(JsonExtractor &json, std::vector<Medal> &medals) {
+    // the fields of the element being parsed, a medal lit unless the panel tells otherwise
+    static const Medal blank = {0, 0, 0, 0, true, false};
+    auto current = std::make_shared<Medal>(blank);
+    // the worn medals are listed apart from the others
+    for (const std::string list : {"data.special_list[]", "data.list[]"}) {
+        json.on_number(list + ".room_info.room_id", [current] (int64_t value) { current->roomid = to_u32(value); });
+        json.on_number(list + ".room_info.living_status", [current] (int64_t value) { current->live = value == 1; });
+        json.on_number(list + ".medal.level", [current] (int64_t value) {
+            current->level = static_cast<uint8_t>(std::min<uint32_t>(to_u32(value), 255));
+        });
+        json.on_number(list + ".medal.today_feed", [current] (int64_t value) { current->today_feed = to_u32(value); });
+        json.on_number(list + ".medal.day_limit", [current] (int64_t value) { current->day_limit = to_u32(value); });
+        json.on_number(list + ".medal.is_lighted", [current] (int64_t value) { current->lit = value != 0; });
+        json.on_end(list, [current, &medals] {
+            // a medal whose anchor has no room any more has nothing to do
+            if (current->roomid != 0) {
+                medals.push_back(*current);
+            }
+            *current = blank;
+        });
+    }
+}
+
+std::vector<ExpTask> ExpPlanner::plan() const {
+    std::vector<const Medal *> order;
+    for (const Medal &medal : medals) {
+        if (actions(medal) != 0) {
+            order.push_back(&medal);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [] (const Medal *a, const Medal *b) {
+        if (a->live != b->live) {
+            return a->live;
+        }
+        if (a->lit != b->lit) {
+            return !a->lit;
+        }
+        return intimacy_left(*a) > intimacy_left(*b);
+    });
+    std::vector<ExpTask> tasks;
+    tasks.reserve(order.size());
+    for (const Medal *medal : order) {
+        tasks.push_back({medal->roomid, actions(*medal)});
+    }
+    return tasks;
+}
+
+size_t ExpPlanner::skipped() const {
+    return static_cast<size_t>(std::count_if(medals.begin(), medals.end(),
+                                             [] (const Medal &medal) { return actions(medal) == 0; }));
+}
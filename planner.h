@@ -0,0 +1,72 @@
+/**
+ * planner.h
+ *
+ * Header file for the plan of the actions still earning intimacy with each medal today
+ */
+
+#ifndef _PLANNER_H_
+#define _PLANNER_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class JsonExtractor;
+
+// what the medal panel tells about one medal, as much as the planner needs
+typedef struct {
+    uint32_t roomid;
+    // the intimacy earned today and the most that can be earned in a day, 0 if the panel does not tell
+    uint32_t today_feed, day_limit;
+    uint8_t level;
+    // whether the medal is lit, and whether its room is streaming
+    bool lit, live;
+} Medal;
+
+// the actions of a room, as bits
+enum ExpAction : uint8_t {
+    EXP_CHAT = 1,
+    EXP_LIKE = 2,
+    // entering the room and sending heartbeats while it streams
+    EXP_WATCH = 4,
+    EXP_ALL = EXP_CHAT | EXP_LIKE | EXP_WATCH
+};
+
+typedef struct {
+    uint32_t roomid;
+    uint8_t actions;
+} ExpTask;
+
+/**
+ * Decides what is still worth doing for each medal today.
+ * A medal whose intimacy of the day has reached the limit the panel reports earns nothing more
+ * and gets no request at all, whatever its level. Otherwise the chat comes first, the like only if the chat leaves
+ * intimacy to earn, and watching for as long as any is left.
+ * A medal that is not lit is not skipped: the chat is what lights it again, after which it earns like the others.
+ * The rooms are planned with the streaming ones first, since they may go offline, then the medals that are not lit,
+ * then those with the most intimacy left to earn.
+ */
+class ExpPlanner {
+public:
+    // the intimacy the first chat of the day earns
+    static const uint32_t CHAT_INTIMACY = 100;
+
+    // the actions still earning intimacy for medal, 0 if none
+    static uint8_t actions(const Medal &medal);
+
+    // collect the medals of a page of the panel, special_list and list alike, into medals
+    static void parse(JsonExtractor &json, std::vector<Medal> &medals);
+
+    void add(const Medal &medal) { medals.push_back(medal); }
+
+    // the rooms with something left to do, in the order to do them
+    std::vector<ExpTask> plan() const;
+
+    // the number of medals added, and of those with nothing left to do today
+    size_t size() const { return medals.size(); }
+    size_t skipped() const;
+private:
+    std::vector<Medal> medals;
+};
+
+#endif /* _PLANNER_H_ */
@@ -0,0 +1,257 @@
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+
+#include "pool.h"
+#include "tls.h"
+
+// the pools of the process and the options of new pools
+static std::mutex registry_mutex;
+static std::unordered_map<std::string, std::weak_ptr<ConnectionPool>> registry;
+static ConnectionPool::Options default_options = {8, 1, std::chrono::seconds(60), false};
+
+// how long to wait before opening a connection again after a handshake fails
+static const std::chrono::seconds RETRY_DELAY(1);
+
+void ConnectionPool::set_default_options(const Options &options) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    default_options = options;
+}
+
+ConnectionPool::Options ConnectionPool::get_default_options() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    return default_options;
+}
+
+std::shared_ptr<ConnectionPool> ConnectionPool::get(const std::string &host) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::shared_ptr<ConnectionPool> pool = registry[host].lock();
+    if (!pool) {
+        pool = std::make_shared<ConnectionPool>(Reactor::instance(), host, default_options);
+        registry[host] = pool;
+    }
+    return pool;
+}
+
+ConnectionPool::ConnectionPool(Reactor &reactor, const std::string &host, const Options &options)
+    : reactor(reactor), host(host), options(options), dispatching(false), multiplexing(false), reaper(0) {
+    this->options.max_size = std::max<size_t>(this->options.max_size, 1);
+}
+
+ConnectionPool::~ConnectionPool() {
+    reactor.cancel(reaper);
+    dispatching = true;
+    for (auto &c : connections) {
+        c->set_listener(nullptr);
+        c->close();
+    }
+    connections.clear();
+    auto error = std::make_exception_ptr(std::runtime_error("Connection closed"));
+    for (auto &batch : waiting) {
+        for (auto &exchange : batch) {
+            finish_exchange(*exchange, error);
+        }
+    }
+}
+
+void ConnectionPool::warm_up(std::function<void(std::exception_ptr)> done) {
+    for (auto &c : connections) {
+        if (c->get_state() == Connection::State::READY) {
+            done(nullptr);
+            return;
+        }
+    }
+    warm_up_waiters.push_back(std::move(done));
+    // a failed handshake must not make the first request of a new client wait for RETRY_DELAY
+    retry_after = std::chrono::steady_clock::time_point();
+    dispatch();
+}
+
+void ConnectionPool::submit(Batch batch) {
+    if (batch.empty()) {
+        return;
+    }
+    for (size_t i = 1; i < batch.size(); ++i) {
+        batch[i]->pipelined = true;
+    }
+    waiting.push_back(std::move(batch));
+    dispatch();
+}
+
+void ConnectionPool::dispatch() {
+    if (dispatching) {
+        return;
+    }
+    dispatching = true;
+    if (!reaper) {
+        reap();
+    }
+
+    connections.erase(std::remove_if(connections.begin(), connections.end(), [] (const std::shared_ptr<Connection> &c) {
+        return c->get_state() == Connection::State::CLOSED && c->pending() == 0;
+    }), connections.end());
+
+    // the requests settled while waiting, none of them written, are dropped
+    for (auto &batch : waiting) {
+        batch.erase(std::remove_if(batch.begin(), batch.end(), [] (const std::shared_ptr<Exchange> &exchange) {
+            return exchange->cancelled;
+        }), batch.end());
+        if (!batch.empty()) {
+            batch.front()->pipelined = false;
+        }
+    }
+    waiting.erase(std::remove_if(waiting.begin(), waiting.end(), [] (const Batch &batch) { return batch.empty(); }),
+                  waiting.end());
+
+    // hold the connections, a failing one may be dropped meanwhile
+    std::vector<std::shared_ptr<Connection>> candidates = connections;
+    for (auto &c : candidates) {
+        if (waiting.empty()) {
+            break;
+        }
+        // a multiplexed connection takes batches as long as it has room for their streams
+        while (!waiting.empty() && c->accepting()) {
+            Batch batch = std::move(waiting.front());
+            waiting.pop_front();
+            for (auto &exchange : batch) {
+                c->submit(std::move(exchange));
+            }
+        }
+    }
+
+    warm();
+    dispatching = false;
+}
+
+void ConnectionPool::warm() {
+    size_t ready = 0;
+    for (auto &c : connections) {
+        Connection::State state = c->get_state();
+        bool opening = state == Connection::State::CONNECTING || state == Connection::State::HANDSHAKE;
+        if (c->accepting() || (opening && c->pending() == 0)) {
+            ++ready;
+        }
+        // a connection on its way to a host speaking http/2 is going to take every waiting request
+        if (multiplexing && opening) {
+            ready += waiting.size();
+        }
+    }
+    // every waiting request and the spares deserve a connection of their own
+    std::weak_ptr<ConnectionPool> self = shared_from_this();
+    while (ready < waiting.size() + options.spare && connections.size() < options.max_size
+           && std::chrono::steady_clock::now() >= retry_after) {
+        auto c = std::make_shared<Connection>(reactor, tls_context(), host, options.http2);
+        c->set_listener([self] {
+            if (auto pool = self.lock()) {
+                pool->dispatch();
+            }
+        });
+        c->set_orphan_handler([self] (Batch batch) {
+            if (auto pool = self.lock()) {
+                // unanswered requests keep their turn, before the requests queued after them
+                batch.front()->pipelined = false;
+                pool->waiting.push_front(std::move(batch));
+                pool->dispatch();
+            }
+        });
+        connections.push_back(c);
+        c->establish([self] (std::exception_ptr error) {
+            if (auto pool = self.lock()) {
+                pool->established(error);
+            }
+        });
+
+        // an idempotent batch fitting in early data goes out with the handshake instead of waiting for it
+        if (c->get_state() != Connection::State::CLOSED && !waiting.empty() && early_data_fits(waiting.front())) {
+            Batch batch = std::move(waiting.front());
+            waiting.pop_front();
+            for (auto &exchange : batch) {
+                c->submit(std::move(exchange));
+            }
+        } else {
+            ready += multiplexing ? waiting.size() + 1 : 1;
+        }
+    }
+}
+
+bool ConnectionPool::early_data_fits(const Batch &batch) const {
+    // connections offering http/2 send no early data
+    if (options.http2) {
+        return false;
+    }
+    size_t size = 0;
+    for (auto &exchange : batch) {
+        if (!exchange->idempotent) {
+            return false;
+        }
+        size += exchange->request.length();
+    }
+    return size <= tls_early_data(host);
+}
+
+void ConnectionPool::established(std::exception_ptr error) {
+    if (!error) {
+        for (auto &c : connections) {
+            multiplexing = multiplexing || c->multiplexed();
+        }
+        auto waiters = std::move(warm_up_waiters);
+        warm_up_waiters.clear();
+        for (auto &done : waiters) {
+            done(nullptr);
+        }
+        dispatch();
+        return;
+    }
+
+    retry_after = std::chrono::steady_clock::now() + RETRY_DELAY;
+    for (auto &c : connections) {
+        if (c->get_state() != Connection::State::CLOSED) {
+            // another connection may still succeed
+            return;
+        }
+    }
+    // nothing is going to serve the waiting requests
+    auto waiters = std::move(warm_up_waiters);
+    warm_up_waiters.clear();
+    for (auto &done : waiters) {
+        done(error);
+    }
+    std::deque<Batch> failed;
+    failed.swap(waiting);
+    for (auto &batch : failed) {
+        for (auto &exchange : batch) {
+            finish_exchange(*exchange, error);
+        }
+    }
+}
+
+void ConnectionPool::reap() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<Connection>> idle;
+    for (auto &c : connections) {
+        if (!c->idle()) {
+            continue;
+        }
+        std::chrono::seconds timeout = options.idle_timeout;
+        if (c->keep_alive().count() > 0) {
+            timeout = std::min(timeout, c->keep_alive());
+        }
+        // retire with a margin of a fifth of the timeout, the server may count from an earlier time
+        if (now - c->last_used() >= timeout - timeout / 5) {
+            idle.push_back(c);
+        }
+    }
+    for (auto &c : idle) {
+        // the listener drops it and warms a spare up
+        c->close();
+    }
+
+    std::weak_ptr<ConnectionPool> self = shared_from_this();
+    reaper = reactor.run_after(std::chrono::seconds(1), [self] {
+        if (auto pool = self.lock()) {
+            pool->dispatch();
+            pool->reap();
+        }
+    });
+}
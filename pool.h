@@ -0,0 +1,94 @@
+/**
+ * pool.h
+ *
+ * Header file for the pool of connections to one host
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <chrono>
+
+#include "connection.h"
+#include "reactor.h"
+
+/**
+ * Connections to one host shared by all clients of the process.
+ * Requests go to idle connections, a batch of requests is pipelined on one connection,
+ * a few spare connections are kept established in advance,
+ * and idle connections are retired before the server closes them, so that no request pays for a reconnect.
+ * Once the host speaks http/2, every request goes to one multiplexed connection,
+ * and another is opened only when it has no room for more streams or is going away.
+ * All methods but get() must be called in the reactor thread.
+ */
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool> {
+public:
+    typedef struct {
+        // the maximum number of connections to the host
+        size_t max_size;
+        // the number of idle connections established in advance
+        size_t spare;
+        // idle timeout of the server, used when it does not announce one with "Keep-Alive: timeout="
+        std::chrono::seconds idle_timeout;
+        // whether http/2 is offered, http/1.1 is used if the server does not select it
+        bool http2;
+    } Options;
+
+    // options of the pools created afterwards
+    static void set_default_options(const Options &options);
+    static Options get_default_options();
+
+    // the pool of host, created on first use
+    static std::shared_ptr<ConnectionPool> get(const std::string &host);
+
+    explicit ConnectionPool(Reactor &reactor, const std::string &host, const Options &options);
+
+    // close all connections, queued requests fail
+    ~ConnectionPool();
+
+    // make sure a connection is established, done is called once one is ready or all have failed
+    void warm_up(std::function<void(std::exception_ptr)> done);
+
+    // hand the requests to an idle connection, or queue them until one becomes idle
+    void submit(Batch batch);
+private:
+    // drop closed connections, hand out queued requests and warm connections up
+    void dispatch();
+
+    // open connections for the queued requests and the spares
+    void warm();
+
+    // whether the batch may be sent as early data of a resumed session
+    bool early_data_fits(const Batch &batch) const;
+
+    // a connection opened by warm() completes its handshake
+    void established(std::exception_ptr error);
+
+    // retire the connections idle for too long, called every second
+    void reap();
+
+    Reactor &reactor;
+    std::string host;
+    Options options;
+
+    std::vector<std::shared_ptr<Connection>> connections;
+    // requests waiting for an idle connection, a batch goes to one connection
+    std::deque<Batch> waiting;
+    std::vector<std::function<void(std::exception_ptr)>> warm_up_waiters;
+
+    // whether dispatch() is running
+    bool dispatching;
+    // whether a connection to the host has selected http/2
+    bool multiplexing;
+    // after a failed handshake, no connection is opened before this time
+    std::chrono::steady_clock::time_point retry_after;
+    Reactor::TimerId reaper;
+};
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,154 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <cerrno>
+
+#include "reactor.h"
+
+// the number of events handled by one epoll_wait
+static const int MAX_EVENTS = 256;
+
+const std::chrono::milliseconds Reactor::TICK(5);
+
+Reactor &Reactor::instance() {
+    static Reactor reactor;
+    return reactor;
+}
+
+Reactor::Reactor() : generation(0), timers(TICK), stopping(false) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        throw std::runtime_error("epoll_create1 fails");
+    }
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd == -1) {
+        close(epfd);
+        throw std::runtime_error("eventfd fails");
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = static_cast<uint64_t>(wakefd);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) == -1) {
+        close(wakefd);
+        close(epfd);
+        throw std::runtime_error("epoll_ctl fails");
+    }
+    thread = std::thread(&Reactor::loop, this);
+}
+
+Reactor::~Reactor() {
+    stopping = true;
+    post([] {});
+    thread.join();
+    // release what the functions and handlers hold while epoll is still open
+    posted.clear();
+    timers.clear();
+    handlers.clear();
+    close(wakefd);
+    close(epfd);
+}
+
+void Reactor::add(int fd, uint32_t events, Handler handler) {
+    Entry &entry = handlers[fd];
+    entry.generation = ++generation;
+    entry.handler = std::make_shared<Handler>(std::move(handler));
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = static_cast<uint64_t>(entry.generation) << 32 | static_cast<uint32_t>(fd);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        handlers.erase(fd);
+        throw std::runtime_error("epoll_ctl add fails");
+    }
+}
+
+void Reactor::modify(int fd, uint32_t events) {
+    auto it = handlers.find(fd);
+    if (it == handlers.end()) {
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = static_cast<uint64_t>(it->second.generation) << 32 | static_cast<uint32_t>(fd);
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        throw std::runtime_error("epoll_ctl mod fails");
+    }
+}
+
+void Reactor::remove(int fd) {
+    if (handlers.erase(fd)) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+void Reactor::post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        posted.push_back(std::move(fn));
+    }
+    uint64_t one = 1;
+    if (write(wakefd, &one, sizeof(one)) == -1) {
+        // the counter is saturated, so the loop is going to wake up anyway
+    }
+}
+
+void Reactor::run_posted() {
+    uint64_t count;
+    if (read(wakefd, &count, sizeof(count)) == -1) {
+        // nothing to read, another wake up has drained the counter
+    }
+    std::vector<std::function<void()>> fns;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        fns.swap(posted);
+    }
+    for (auto &fn : fns) {
+        fn();
+    }
+}
+
+Reactor::TimerId Reactor::run_after(std::chrono::milliseconds delay, std::function<void()> fn) {
+    return timers.schedule(Clock::now() + delay, std::move(fn));
+}
+
+Reactor::TimerId Reactor::run_at(Clock::time_point deadline, std::function<void()> fn) {
+    return timers.schedule(deadline, std::move(fn));
+}
+
+void Reactor::cancel(TimerId id) {
+    timers.cancel(id);
+}
+
+int Reactor::run_timers() {
+    timers.advance(Clock::now());
+    return timers.timeout(Clock::now());
+}
+
+void Reactor::loop() {
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, run_timers());
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("epoll_wait fails");
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+            if (fd == wakefd) {
+                run_posted();
+                continue;
+            }
+            // skip events of fds removed or reused by an earlier handler of this round
+            auto it = handlers.find(fd);
+            if (it == handlers.end() || it->second.generation != events[i].data.u64 >> 32) {
+                continue;
+            }
+            // hold the handler, it may remove itself
+            std::shared_ptr<Handler> handler = it->second.handler;
+            (*handler)(events[i].events);
+        }
+    }
+}
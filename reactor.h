@@ -0,0 +1,97 @@
+/**
+ * reactor.h
+ *
+ * Header file for the epoll event loop driving all connections
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+
+#include "timer.h"
+
+/**
+ * An epoll loop running in its own thread.
+ * Handlers and posted functions are always called in the loop thread, so the state they touch needs no lock.
+ * Handlers must not throw.
+ */
+class Reactor {
+public:
+    // called with the epoll events of the fd
+    typedef std::function<void(uint32_t events)> Handler;
+
+    typedef TimerWheel::Clock Clock;
+    typedef TimerWheel::TimerId TimerId;
+
+    // deadlines of timers are rounded up to this
+    static const std::chrono::milliseconds TICK;
+
+    // the reactor shared by all clients of the process
+    static Reactor &instance();
+
+    Reactor();
+    ~Reactor();
+
+    // register fd with the events to wait for, only in the loop thread
+    void add(int fd, uint32_t events, Handler handler);
+
+    // change the events to wait for, only in the loop thread
+    void modify(int fd, uint32_t events);
+
+    // unregister fd before closing it, only in the loop thread
+    void remove(int fd);
+
+    // run fn in the loop thread, can be called from any thread
+    void post(std::function<void()> fn);
+
+    // run fn once after delay, only in the loop thread
+    TimerId run_after(std::chrono::milliseconds delay, std::function<void()> fn);
+
+    // run fn once at deadline, only in the loop thread
+    TimerId run_at(Clock::time_point deadline, std::function<void()> fn);
+
+    // cancel a timer which has not fired yet, only in the loop thread
+    void cancel(TimerId id);
+
+    // whether the caller is running in the loop thread
+    bool in_loop_thread() const { return std::this_thread::get_id() == thread.get_id(); }
+private:
+    // wait for events and dispatch them until stopped
+    void loop();
+
+    // run the functions posted by other threads
+    void run_posted();
+
+    // run the timers which are due, return the milliseconds to wait for the next one or -1
+    int run_timers();
+
+    // a registered fd, generation tells apart fds reused after being closed
+    typedef struct {
+        uint32_t generation;
+        std::shared_ptr<Handler> handler;
+    } Entry;
+
+    int epfd;
+    // eventfd used to wake up epoll_wait when a function is posted
+    int wakefd;
+    uint32_t generation;
+    std::unordered_map<int, Entry> handlers;
+
+    std::mutex m;
+    std::vector<std::function<void()>> posted;
+
+    TimerWheel timers;
+
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+#endif /* _REACTOR_H_ */
@@ -0,0 +1,486 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+
+#include "resolver.h"
+
+const std::chrono::milliseconds Resolver::TIMEOUT(1000);
+
+// the record types asked for, the index of each is that of Lookup::ids
+static const uint16_t TYPES[2] = {1 /* A */, 28 /* AAAA */};
+
+// answers are kept at least this long, so that a zero ttl does not send a query per connection, and at most this long
+static const uint32_t MIN_TTL = 5, MAX_TTL = 3600;
+
+// the largest udp answer without edns
+static const size_t MAX_MESSAGE = 512;
+
+Resolver &Resolver::instance() {
+    // never destroyed, the reactor may still call it while the process exits
+    static Resolver *resolver = new Resolver(Reactor::instance());
+    return *resolver;
+}
+
+Resolver::Resolver(Reactor &reactor) : reactor(reactor) {
+    load_config();
+}
+
+Resolver::~Resolver() {
+    for (auto &it : lookups) {
+        reactor.cancel(it.second->timer);
+        close_sockets(*it.second);
+    }
+}
+
+// the address if text is numeric
+static bool parse_address(const std::string &text, Address &address) {
+    memset(&address, 0, sizeof(address));
+    auto *in6 = reinterpret_cast<struct sockaddr_in6 *>(&address.addr);
+    auto *in = reinterpret_cast<struct sockaddr_in *>(&address.addr);
+    if (inet_pton(AF_INET6, text.c_str(), &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        address.len = sizeof(struct sockaddr_in6);
+        return true;
+    }
+    if (inet_pton(AF_INET, text.c_str(), &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        address.len = sizeof(struct sockaddr_in);
+        return true;
+    }
+    return false;
+}
+
+// names are compared in lower case and without the trailing dot
+static std::string normalize(const std::string &name) {
+    std::string result = name;
+    if (!result.empty() && result.back() == '.') {
+        result.pop_back();
+    }
+    std::transform(result.begin(), result.end(), result.begin(), [] (unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+void Resolver::load_config() {
+    std::ifstream resolv("/etc/resolv.conf");
+    std::string line;
+    while (std::getline(resolv, line)) {
+        std::istringstream fields(line);
+        std::string keyword, server;
+        Address address;
+        if (fields >> keyword >> server && keyword == "nameserver" && parse_address(server, address)) {
+            auto *in = reinterpret_cast<struct sockaddr_in *>(&address.addr);
+            auto *in6 = reinterpret_cast<struct sockaddr_in6 *>(&address.addr);
+            if (address.addr.ss_family == AF_INET) {
+                in->sin_port = htons(53);
+            } else {
+                in6->sin6_port = htons(53);
+            }
+            nameservers.push_back(address.addr);
+        }
+    }
+    if (nameservers.empty()) {
+        // the default of the resolver of libc
+        Address address;
+        parse_address("127.0.0.1", address);
+        reinterpret_cast<struct sockaddr_in *>(&address.addr)->sin_port = htons(53);
+        nameservers.push_back(address.addr);
+    }
+
+    std::ifstream static_hosts("/etc/hosts");
+    while (std::getline(static_hosts, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string text, name;
+        Address address;
+        if (!(fields >> text) || !parse_address(text, address)) {
+            continue;
+        }
+        while (fields >> name) {
+            std::vector<Address> &addresses = hosts[normalize(name)];
+            // IPv6 first, as in the answers of the nameservers
+            addresses.insert(address.addr.ss_family == AF_INET6 ? addresses.begin() : addresses.end(), address);
+        }
+    }
+}
+
+// the query for the type of record, or throws if name is not a valid domain name
+static std::string encode_query(uint16_t id, const std::string &name, uint16_t type) {
+    std::string message;
+    // recursion desired, one question
+    const unsigned char header[12] = {static_cast<unsigned char>(id >> 8), static_cast<unsigned char>(id), 0x01, 0x00,
+                                      0, 1, 0, 0, 0, 0, 0, 0};
+    message.append(reinterpret_cast<const char *>(header), sizeof(header));
+    size_t start = 0;
+    while (start < name.length()) {
+        size_t dot = name.find('.', start);
+        size_t end = dot == std::string::npos ? name.length() : dot;
+        if (end == start || end - start > 63) {
+            throw std::runtime_error("Invalid host name " + name);
+        }
+        message += static_cast<char>(end - start);
+        message.append(name, start, end - start);
+        start = end + 1;
+    }
+    message += '\0';
+    message += static_cast<char>(type >> 8);
+    message += static_cast<char>(type);
+    message += '\0';
+    message += '\1';
+    return message;
+}
+
+// skip the possibly compressed name at offset, return the offset after it or 0 if the message ends first
+static size_t skip_name(const unsigned char *data, size_t len, size_t offset) {
+    while (offset < len) {
+        unsigned char label = data[offset];
+        if ((label & 0xc0) == 0xc0) {
+            return offset + 2 <= len ? offset + 2 : 0;
+        }
+        if (label == 0) {
+            return offset + 1;
+        }
+        offset += 1 + label;
+    }
+    return 0;
+}
+
+static uint16_t read16(const unsigned char *p) {
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+static uint32_t read32(const unsigned char *p) {
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 | static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+// the offset after the question if the message answers the query id for the type of record of name, 0 otherwise
+static size_t match(const unsigned char *data, size_t len, uint16_t id, const std::string &name, uint16_t type) {
+    if (len < 12 || !(data[2] & 0x80) || read16(data) != id) {
+        return 0;
+    }
+    // the question must be the one asked, in any case
+    std::string question = encode_query(id, name, type);
+    if (read16(data + 4) != 1 || len < question.length() ||
+        !std::equal(question.begin() + 12, question.end(), data + 12, [] (char a, unsigned char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == std::tolower(b);
+        })) {
+        return 0;
+    }
+    return question.length();
+}
+
+void Resolver::resolve(const std::string &host, Callback callback) {
+    Address numeric;
+    if (parse_address(host, numeric)) {
+        callback(nullptr, {numeric});
+        return;
+    }
+    std::string name = normalize(host);
+    auto fixed = hosts.find(name);
+    if (fixed != hosts.end()) {
+        callback(nullptr, fixed->second);
+        return;
+    }
+    auto cached = cache.find(name);
+    if (cached != cache.end() && cached->second.expires > Reactor::Clock::now()) {
+        callback(nullptr, cached->second.addresses);
+        return;
+    }
+    auto pending = lookups.find(name);
+    if (pending != lookups.end()) {
+        pending->second->callbacks.push_back(std::move(callback));
+        return;
+    }
+    try {
+        encode_query(0, name, TYPES[0]);
+    } catch (...) {
+        callback(std::current_exception(), {});
+        return;
+    }
+    auto lookup = std::make_unique<Lookup>();
+    lookup->name = name;
+    lookup->fd = -1;
+    lookup->tcp[0] = lookup->tcp[1] = -1;
+    lookup->tries = 0;
+    lookup->timer = 0;
+    lookup->callbacks.push_back(std::move(callback));
+    Lookup &ref = *lookup;
+    lookups[name] = std::move(lookup);
+    send(ref);
+}
+
+void Resolver::send(Lookup &lookup) {
+    static std::random_device random;
+    std::string name = lookup.name;
+    while (lookup.tries < nameservers.size() * ATTEMPTS) {
+        const struct sockaddr_storage &server = nameservers[lookup.tries % nameservers.size()];
+        ++lookup.tries;
+        close_sockets(lookup);
+        // a new socket per nameserver, so that the kernel picks a new random source port for it
+        lookup.fd = socket(server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (lookup.fd == -1) {
+            continue;
+        }
+        socklen_t len = server.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        if (connect(lookup.fd, reinterpret_cast<const struct sockaddr *>(&server), len) == -1) {
+            continue;
+        }
+        bool sent = true;
+        for (int i = 0; i < 2; ++i) {
+            lookup.ids[i] = static_cast<uint16_t>(random());
+            lookup.answered[i] = false;
+            lookup.truncated[i] = false;
+            lookup.found[i].clear();
+            std::string query = encode_query(lookup.ids[i], name, TYPES[i]);
+            sent = sent && ::send(lookup.fd, query.data(), query.length(), 0) == static_cast<ssize_t>(query.length());
+        }
+        if (!sent) {
+            continue;
+        }
+        lookup.ttl = MAX_TTL;
+        reactor.add(lookup.fd, EPOLLIN, [this, name] (uint32_t) { receive(name); });
+        reactor.cancel(lookup.timer);
+        lookup.timer = reactor.run_after(TIMEOUT, [this, name] { timeout(name); });
+        return;
+    }
+    finish(name);
+}
+
+void Resolver::receive(const std::string &name) {
+    auto it = lookups.find(name);
+    if (it == lookups.end()) {
+        return;
+    }
+    Lookup &lookup = *it->second;
+    unsigned char data[MAX_MESSAGE];
+    ssize_t n;
+    while ((n = recv(lookup.fd, data, sizeof(data), 0)) >= 0) {
+        size_t len = static_cast<size_t>(n);
+        if (len < 12) {
+            continue;
+        }
+        uint16_t id = read16(data);
+        // a query asked again over tcp is answered there
+        auto waiting = [&lookup] (int i) { return !lookup.answered[i] && lookup.tcp[i] == -1; };
+        int i = id == lookup.ids[0] && waiting(0) ? 0 : id == lookup.ids[1] && waiting(1) ? 1 : -1;
+        size_t offset;
+        if (i < 0 || (offset = match(data, len, id, name, TYPES[i])) == 0) {
+            continue;
+        }
+        if (!accept(lookup, i, data, len, offset)) {
+            // the nameserver fails, the next one may not
+            send(lookup);
+            return;
+        }
+        // the records that fit are kept in case tcp fails too
+        if (lookup.truncated[i] && ask_tcp(lookup, i)) {
+            continue;
+        }
+        lookup.answered[i] = true;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && !(lookup.answered[0] && lookup.answered[1])) {
+        // such as the port unreachable, the next nameserver is tried without waiting for the timeout
+        send(lookup);
+        return;
+    }
+    if (lookup.answered[0] && lookup.answered[1]) {
+        finish(name);
+    }
+}
+
+bool Resolver::accept(Lookup &lookup, int i, const unsigned char *data, size_t len, size_t offset) {
+    int rcode = data[3] & 0x0f;
+    if (rcode != 0 && rcode != 3) {
+        return false;
+    }
+    lookup.truncated[i] = (data[2] & 0x02) != 0;
+    lookup.found[i].clear();
+    for (uint16_t answers = read16(data + 6); answers > 0; --answers) {
+        offset = skip_name(data, len, offset);
+        // a message ending before its records is truncated too
+        if (offset == 0 || offset + 10 > len || offset + 10 + read16(data + offset + 8) > len) {
+            lookup.truncated[i] = true;
+            break;
+        }
+        uint16_t type = read16(data + offset), rdlength = read16(data + offset + 8);
+        uint32_t ttl = read32(data + offset + 4);
+        offset += 10;
+        // the records of the chain of CNAMEs expire too
+        lookup.ttl = std::min(lookup.ttl, ttl);
+        Address address;
+        memset(&address, 0, sizeof(address));
+        if (type == TYPES[0] && rdlength == 4) {
+            auto *in = reinterpret_cast<struct sockaddr_in *>(&address.addr);
+            in->sin_family = AF_INET;
+            memcpy(&in->sin_addr, data + offset, 4);
+            address.len = sizeof(struct sockaddr_in);
+            lookup.found[0].push_back(address);
+        } else if (type == TYPES[1] && rdlength == 16) {
+            auto *in6 = reinterpret_cast<struct sockaddr_in6 *>(&address.addr);
+            in6->sin6_family = AF_INET6;
+            memcpy(&in6->sin6_addr, data + offset, 16);
+            address.len = sizeof(struct sockaddr_in6);
+            lookup.found[1].push_back(address);
+        }
+        offset += rdlength;
+    }
+    return true;
+}
+
+bool Resolver::ask_tcp(Lookup &lookup, int i) {
+    const struct sockaddr_storage &server = nameservers[(lookup.tries - 1) % nameservers.size()];
+    int fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+    socklen_t len = server.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    if (connect(fd, reinterpret_cast<const struct sockaddr *>(&server), len) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+    std::string query = encode_query(lookup.ids[i], lookup.name, TYPES[i]);
+    lookup.tcp[i] = fd;
+    lookup.tcp_out[i].clear();
+    lookup.tcp_out[i] += static_cast<char>(query.length() >> 8);
+    lookup.tcp_out[i] += static_cast<char>(query.length());
+    lookup.tcp_out[i] += query;
+    lookup.tcp_in[i].clear();
+    std::string name = lookup.name;
+    // writable once connected
+    reactor.add(fd, EPOLLOUT, [this, name, i] (uint32_t) { receive_tcp(name, i); });
+    // the nameserver is given the time of one more answer
+    reactor.cancel(lookup.timer);
+    lookup.timer = reactor.run_after(TIMEOUT, [this, name] { timeout(name); });
+    return true;
+}
+
+void Resolver::receive_tcp(const std::string &name, int i) {
+    auto it = lookups.find(name);
+    if (it == lookups.end() || it->second->tcp[i] == -1) {
+        return;
+    }
+    Lookup &lookup = *it->second;
+    int fd = lookup.tcp[i];
+    std::string &out = lookup.tcp_out[i], &in = lookup.tcp_in[i];
+    // whether the connection is done with, answered or failing
+    bool done;
+    if (!out.empty()) {
+        ssize_t n = ::send(fd, out.data(), out.length(), MSG_NOSIGNAL);
+        if (n >= 0) {
+            out.erase(0, static_cast<size_t>(n));
+            if (out.empty()) {
+                reactor.modify(fd, EPOLLIN);
+            }
+            return;
+        }
+        done = errno != EAGAIN && errno != EWOULDBLOCK;
+    } else {
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            in.append(buf, static_cast<size_t>(n));
+        }
+        size_t len = in.length() >= 2 ? read16(reinterpret_cast<const unsigned char *>(in.data())) : 0;
+        if (in.length() >= 2 && in.length() - 2 >= len) {
+            const unsigned char *data = reinterpret_cast<const unsigned char *>(in.data()) + 2;
+            size_t offset = match(data, len, lookup.ids[i], name, TYPES[i]);
+            std::vector<Address> udp = lookup.found[i];
+            if (offset != 0 && !accept(lookup, i, data, len, offset)) {
+                send(lookup);
+                return;
+            }
+            // an answer truncated even over tcp is used if it has more records than the udp one
+            if (lookup.truncated[i] && lookup.found[i].size() < udp.size()) {
+                lookup.found[i].swap(udp);
+            }
+            done = true;
+        } else {
+            done = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+    }
+    if (!done) {
+        return;
+    }
+    // the records of the udp answer are kept if the connection fails, they are better than none
+    reactor.remove(fd);
+    close(fd);
+    lookup.tcp[i] = -1;
+    out.clear();
+    in.clear();
+    lookup.answered[i] = true;
+    if (lookup.answered[0] && lookup.answered[1]) {
+        finish(name);
+    }
+}
+
+void Resolver::timeout(const std::string &name) {
+    auto it = lookups.find(name);
+    if (it == lookups.end()) {
+        return;
+    }
+    Lookup &lookup = *it->second;
+    lookup.timer = 0;
+    if (!lookup.found[0].empty() || !lookup.found[1].empty()) {
+        // one family has answered, the other is not waited for any longer
+        finish(name);
+    } else {
+        send(lookup);
+    }
+}
+
+void Resolver::finish(const std::string &name) {
+    auto it = lookups.find(name);
+    if (it == lookups.end()) {
+        return;
+    }
+    std::unique_ptr<Lookup> lookup = std::move(it->second);
+    lookups.erase(it);
+    reactor.cancel(lookup->timer);
+    close_sockets(*lookup);
+
+    std::vector<Address> addresses = lookup->found[1];
+    addresses.insert(addresses.end(), lookup->found[0].begin(), lookup->found[0].end());
+    std::exception_ptr error;
+    if (!addresses.empty()) {
+        // a truncated answer may lack addresses, it serves the callers waiting for it only
+        if (!lookup->truncated[0] && !lookup->truncated[1]) {
+            uint32_t ttl = std::max(MIN_TTL, std::min(lookup->ttl, MAX_TTL));
+            cache[name] = {addresses, Reactor::Clock::now() + std::chrono::seconds(ttl)};
+        }
+    } else if (cache.count(name)) {
+        // an expired answer is better than none while the nameservers are unreachable
+        addresses = cache[name].addresses;
+    } else {
+        error = std::make_exception_ptr(std::runtime_error(
+            lookup->answered[0] || lookup->answered[1] ? "No address for " + name : "Nameservers do not answer for " + name));
+    }
+    for (auto &callback : lookup->callbacks) {
+        callback(error, addresses);
+    }
+}
+
+void Resolver::close_sockets(Lookup &lookup) {
+    if (lookup.fd != -1) {
+        reactor.remove(lookup.fd);
+        close(lookup.fd);
+        lookup.fd = -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (lookup.tcp[i] != -1) {
+            reactor.remove(lookup.tcp[i]);
+            close(lookup.tcp[i]);
+            lookup.tcp[i] = -1;
+        }
+        lookup.tcp_out[i].clear();
+        lookup.tcp_in[i].clear();
+    }
+}
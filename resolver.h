@@ -0,0 +1,114 @@
+/**
+ * resolver.h
+ *
+ * Header file for the caching dns resolver driven by the reactor
+ */
+
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include <sys/socket.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <exception>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+
+#include "reactor.h"
+
+// an IPv4 or IPv6 address, the port is left to the caller
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t len;
+} Address;
+
+/**
+ * Resolve names to their IPv4 and IPv6 addresses without blocking, asking the nameservers of /etc/resolv.conf over udp,
+ * and again over tcp when the udp answer is truncated.
+ * Answers are cached for their ttl and shared by every caller, and concurrent lookups of one name send one query.
+ * Numeric addresses and the names of /etc/hosts are answered without a query.
+ * All methods must be called in the reactor thread.
+ */
+class Resolver {
+public:
+    // called with the addresses of the name in the order of the answer, IPv6 first, or with the error
+    typedef std::function<void(std::exception_ptr error, const std::vector<Address> &addresses)> Callback;
+
+    // how long one nameserver is waited for, and how many times the nameservers are tried in turn
+    static const std::chrono::milliseconds TIMEOUT;
+    static const int ATTEMPTS = 2;
+
+    // the resolver of the reactor shared by all clients of the process
+    static Resolver &instance();
+
+    explicit Resolver(Reactor &reactor);
+    ~Resolver();
+
+    // call callback with the addresses of name, at once if they are known, otherwise in the reactor thread later
+    void resolve(const std::string &name, Callback callback);
+private:
+    typedef struct {
+        std::vector<Address> addresses;
+        Reactor::Clock::time_point expires;
+    } Entry;
+
+    // the queries for one name in flight, A and AAAA sent together to one nameserver
+    typedef struct {
+        std::string name;
+        int fd;
+        uint16_t ids[2];
+        bool answered[2];
+        std::vector<Address> found[2];
+        // whether found holds the records of a truncated answer, which may lack some and is not cached
+        bool truncated[2];
+        // the tcp connection asking again a query whose udp answer is truncated, -1 if none,
+        // with the query left to write and the answer read so far, both prefixed by their length
+        int tcp[2];
+        std::string tcp_out[2], tcp_in[2];
+        // the smallest ttl of the records in the answers
+        uint32_t ttl;
+        // the number of nameservers tried so far
+        size_t tries;
+        Reactor::TimerId timer;
+        std::vector<Callback> callbacks;
+    } Lookup;
+
+    // read the nameservers and the static names
+    void load_config();
+
+    // send the queries of the lookup to its next nameserver, or finish it if none is left
+    void send(Lookup &lookup);
+
+    // read the answers arriving for the lookup
+    void receive(const std::string &name);
+
+    // the answer to query i is truncated, ask it again over tcp to the same nameserver, return whether it is sent
+    bool ask_tcp(Lookup &lookup, int i);
+
+    // write the query i over tcp and read its answer
+    void receive_tcp(const std::string &name, int i);
+
+    // parse the records of a message answering query i, return false if the nameserver fails and another is tried
+    bool accept(Lookup &lookup, int i, const unsigned char *data, size_t len, size_t offset);
+
+    // close the sockets of the lookup
+    void close_sockets(Lookup &lookup);
+
+    // the nameserver has not answered in time
+    void timeout(const std::string &name);
+
+    // cache the answers of the lookup, or fall back to the expired ones, and call the callbacks
+    void finish(const std::string &name);
+
+    Reactor &reactor;
+    std::vector<struct sockaddr_storage> nameservers;
+    std::unordered_map<std::string, std::vector<Address>> hosts;
+    std::unordered_map<std::string, Entry> cache;
+    std::unordered_map<std::string, std::unique_ptr<Lookup>> lookups;
+};
+
+#endif /* _RESOLVER_H_ */
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+#include "retry.h"
+#include "metrics.h"
+
+// a random duration up to bound, so that the clients failing together do not retry together
+static std::chrono::milliseconds jitter(std::chrono::milliseconds bound) {
+    typedef std::chrono::milliseconds::rep Rep;
+    static thread_local std::mt19937 rng(std::random_device{}());
+    std::uniform_int_distribution<Rep> uniform(0, std::max<Rep>(bound.count(), 0));
+    return std::chrono::milliseconds(uniform(rng));
+}
+
+RetryingRequest::RetryingRequest(Reactor &reactor, PreparedRequest request, BodySink sink,
+                                 HttpsClient::Callback callback, const RetryPolicy &policy, Send send)
+    : reactor(reactor), request(std::move(request)), idempotent(this->request.idempotent()),
+      metrics(this->request.metrics()), sink(std::move(sink)), callback(std::move(callback)),
+      policy(policy), send(std::move(send)), submitted(std::chrono::steady_clock::now()), attempts(0), in_flight(0),
+      hedged(false), settled(false), owner(nullptr), deadline_timer(0), hedge_timer(0), retry_timer(0) {}
+
+std::shared_ptr<Exchange> RetryingRequest::first() {
+    std::shared_ptr<Exchange> exchange = copy(std::move(request));
+    exchange->submitted = submitted;
+    return exchange;
+}
+
+void RetryingRequest::start() {
+    std::shared_ptr<RetryingRequest> self = shared_from_this();
+    if (policy.deadline.count() > 0) {
+        deadline_timer = reactor.run_at(submitted + policy.deadline, [self] {
+            self->deadline_timer = 0;
+            self->expire();
+        });
+    }
+    if (policy.hedge && idempotent && metrics != nullptr && metrics->total.count() >= HEDGE_SAMPLES) {
+        auto p95 = std::chrono::microseconds(metrics->total.quantile(0.95));
+        hedge_timer = reactor.run_at(submitted + p95, [self] {
+            self->hedge_timer = 0;
+            self->hedge();
+        });
+    }
+}
+
+std::shared_ptr<Exchange> RetryingRequest::copy(PreparedRequest request) {
+    auto exchange = std::make_shared<Exchange>();
+    exchange->idempotent = idempotent;
+    exchange->submitted = std::chrono::steady_clock::now();
+    exchange->request = std::move(request);
+    // the exchange owns its parser and its callback, so they never outlive it
+    const Exchange *e = exchange.get();
+    std::shared_ptr<RetryingRequest> self = shared_from_this();
+    if (sink) {
+        exchange->parser.set_sink([self, e] (const char *data, size_t len) { self->body(*e, data, len); });
+    }
+    exchange->callback = [self, e] (std::exception_ptr error, HttpsResponse &response) {
+        self->answered(*e, error, response);
+    };
+    ++in_flight;
+    copies.push_back(exchange);
+    return exchange;
+}
+
+bool RetryingRequest::retryable(int status) const {
+    // 429 means the request was not processed, 5xx may mean it was
+    return status == 429 || (status >= 500 && idempotent);
+}
+
+void RetryingRequest::body(const Exchange &exchange, const char *data, size_t len) {
+    // the body of an error that is retried, or given to the caller as a status, is not what the sink expects
+    if (settled || retryable(exchange.response.status)) {
+        return;
+    }
+    if (owner == nullptr) {
+        owner = &exchange;
+    }
+    if (owner == &exchange) {
+        sink(data, len);
+    }
+}
+
+void RetryingRequest::answered(const Exchange &exchange, std::exception_ptr error, HttpsResponse &response) {
+    --in_flight;
+    copies.erase(std::remove_if(copies.begin(), copies.end(), [&exchange] (const std::weak_ptr<Exchange> &sent) {
+        std::shared_ptr<Exchange> e = sent.lock();
+        return !e || e.get() == &exchange;
+    }), copies.end());
+    // a copy whose sibling has fed the sink has nothing to say
+    if (settled || (owner != nullptr && owner != &exchange)) {
+        return;
+    }
+    if (!error && !retryable(response.status)) {
+        settle(nullptr, response);
+        return;
+    }
+    if (in_flight > 0 && owner == nullptr) {
+        // the hedge may still succeed
+        return;
+    }
+    // a request which may have been acted upon is not sent twice, nor one whose body has reached the sink
+    bool again = owner == nullptr && (!error || idempotent || exchange.sent == 0);
+    if (!again || !retry(exchange)) {
+        settle(error, response);
+    }
+}
+
+bool RetryingRequest::retry(const Exchange &failed) {
+    if (attempts + 1 >= policy.attempts) {
+        return false;
+    }
+    // full jitter over an exponential bound
+    std::chrono::milliseconds::rep scale = 1;
+    scale <<= std::min(attempts, 16u);
+    std::chrono::milliseconds wait = jitter(std::min(policy.max_backoff, policy.backoff * scale));
+    if (policy.deadline.count() > 0 && std::chrono::steady_clock::now() + wait >= submitted + policy.deadline) {
+        return false;
+    }
+    ++attempts;
+    if (metrics != nullptr) {
+        ++metrics->retries;
+    }
+    std::shared_ptr<RetryingRequest> self = shared_from_this();
+    retry_timer = reactor.run_after(wait, [self, request = failed.request] {
+        self->retry_timer = 0;
+        if (!self->settled) {
+            self->send({self->copy(request)});
+        }
+    });
+    return true;
+}
+
+void RetryingRequest::hedge() {
+    // nothing to hedge once answered, waiting for a retry, or streaming into the sink
+    if (settled || hedged || in_flight == 0 || owner != nullptr) {
+        return;
+    }
+    for (auto &sent : copies) {
+        if (std::shared_ptr<Exchange> first = sent.lock()) {
+            hedged = true;
+            if (metrics != nullptr) {
+                ++metrics->hedges;
+            }
+            send({copy(first->request)});
+            return;
+        }
+    }
+}
+
+void RetryingRequest::expire() {
+    if (settled) {
+        return;
+    }
+    if (metrics != nullptr) {
+        ++metrics->timeouts;
+    }
+    HttpsResponse response = {0, {}, ""};
+    settle(std::make_exception_ptr(std::runtime_error("No response within " + std::to_string(policy.deadline.count())
+                                                      + "ms")), response);
+}
+
+void RetryingRequest::settle(std::exception_ptr error, HttpsResponse &response) {
+    settled = true;
+    reactor.cancel(deadline_timer);
+    reactor.cancel(hedge_timer);
+    reactor.cancel(retry_timer);
+    deadline_timer = hedge_timer = retry_timer = 0;
+    // the copies still in flight hold this until they end, the callback is not needed any more
+    HttpsClient::Callback done = std::move(callback);
+    callback = nullptr;
+    sink = nullptr;
+    // the copies not written yet are dropped wherever they wait, in the rate limits, the pool or a connection,
+    // and those held by a connection are abandoned once the callbacks running now have returned,
+    // a connection cannot be closed from inside its own
+    std::vector<std::shared_ptr<Exchange>> losers;
+    for (auto &sent : copies) {
+        if (std::shared_ptr<Exchange> exchange = sent.lock()) {
+            exchange->cancelled = true;
+            losers.push_back(std::move(exchange));
+        }
+    }
+    copies.clear();
+    if (!losers.empty()) {
+        reactor.post([losers] {
+            for (auto &exchange : losers) {
+                if (std::shared_ptr<Connection> connection = exchange->connection.lock()) {
+                    connection->abandon(exchange);
+                }
+            }
+        });
+    }
+    done(error, response);
+}
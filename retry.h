@@ -0,0 +1,96 @@
+/**
+ * retry.h
+ *
+ * Header file for the deadline, the retries and the hedge of one request
+ */
+
+#ifndef _RETRY_H_
+#define _RETRY_H_
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <exception>
+#include <chrono>
+
+#include "https.h"
+#include "reactor.h"
+#include "connection.h"
+
+/**
+ * One request sent until it is answered, fails for good or runs out of time, each copy being an exchange of its own.
+ * A copy failing without a response, or answered with 429, is sent again after a backoff of random length,
+ * and so is an idempotent request answered with 5xx. A request that is not idempotent is only sent again
+ * if not a byte of it was written, since the server may have acted on it.
+ * An idempotent request still unanswered at the p95 latency of its endpoint is sent once more, and the first copy
+ * to answer wins, the other being abandoned. A sink receives the body of a single copy, so a request whose body
+ * has started is not sent again. Once the request is settled, by an answer or by its deadline, the copies not written
+ * yet are never written.
+ * All methods but the constructor and first() run in the reactor thread.
+ */
+class RetryingRequest : public std::enable_shared_from_this<RetryingRequest> {
+public:
+    // hand the exchange of another copy over to the pool, through the rate limits
+    typedef std::function<void(Batch)> Send;
+
+    // the latencies an endpoint needs before its p95 is trusted to time a hedge
+    static const uint64_t HEDGE_SAMPLES = 20;
+
+    // sink may be empty, the request counts as submitted from now on
+    RetryingRequest(Reactor &reactor, PreparedRequest request, BodySink sink, HttpsClient::Callback callback,
+                    const RetryPolicy &policy, Send send);
+
+    // the exchange of the first copy, made by the thread submitting the request before start()
+    std::shared_ptr<Exchange> first();
+
+    // arm the deadline and the hedge once the first copy is handed over to the pool
+    void start();
+private:
+    // a new copy of request, answered to this
+    std::shared_ptr<Exchange> copy(PreparedRequest request);
+
+    // a fragment of the body of the copy exchange
+    void body(const Exchange &exchange, const char *data, size_t len);
+
+    // the copy exchange has been answered, or has failed with error
+    void answered(const Exchange &exchange, std::exception_ptr error, HttpsResponse &response);
+
+    // whether a response with status is worth another copy
+    bool retryable(int status) const;
+
+    // send a copy of failed after a backoff, return false if no attempt or not enough time is left
+    bool retry(const Exchange &failed);
+
+    // the hedge timer fires
+    void hedge();
+
+    // the deadline passes without an answer
+    void expire();
+
+    // call the callback once, stop every timer and abandon the copies still in flight
+    void settle(std::exception_ptr error, HttpsResponse &response);
+
+    Reactor &reactor;
+    // the request until the first copy takes it, later copies are made from the copies before them
+    PreparedRequest request;
+    bool idempotent;
+    EndpointMetrics *metrics;
+    BodySink sink;
+    HttpsClient::Callback callback;
+    RetryPolicy policy;
+    Send send;
+    std::chrono::steady_clock::time_point submitted;
+
+    // the copies sent, the hedge excluded, and those not answered yet
+    unsigned attempts;
+    size_t in_flight;
+    bool hedged;
+    bool settled;
+    // the copy whose body the sink has started to receive, nullptr until then
+    const Exchange *owner;
+    // every copy sent, those still held by a connection are abandoned once settled
+    std::vector<std::weak_ptr<Exchange>> copies;
+    Reactor::TimerId deadline_timer, hedge_timer, retry_timer;
+};
+
+#endif /* _RETRY_H_ */
@@ -0,0 +1,187 @@
+#include <fstream>
+#include <iomanip>
+
+#include "runner.h"
+#include "bilibili.h"
+#include "pool.h"
+
+static std::string trim(const std::string &s) {
+    const char *blank = " \t\r\n";
+    size_t begin = s.find_first_not_of(blank);
+    if (begin == std::string::npos) {
+        return "";
+    }
+    return s.substr(begin, s.find_last_not_of(blank) + 1 - begin);
+}
+
+std::vector<Account> load_accounts(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Fail to open " + path);
+    }
+    std::vector<Account> accounts;
+    std::string line;
+    size_t lineno = 0;
+    while (std::getline(in, line)) {
+        ++lineno;
+        line = trim(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        if (line.front() == '[' && line.back() == ']') {
+            accounts.push_back({trim(line.substr(1, line.length() - 2)), "", ""});
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (accounts.empty() || eq == std::string::npos) {
+            throw std::runtime_error(path + ":" + std::to_string(lineno) + ": expect [name] or key = cookie");
+        }
+        std::string key = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+        if (key == "bili") {
+            accounts.back().bili_cookie = value;
+        } else if (key == "api") {
+            accounts.back().api_cookie = value;
+        } else {
+            throw std::runtime_error(path + ":" + std::to_string(lineno) + ": unknown key " + key);
+        }
+    }
+    for (const Account &account : accounts) {
+        if (account.api_cookie.empty()) {
+            throw std::runtime_error("Account " + account.name + " has no api cookie");
+        }
+    }
+    return accounts;
+}
+
+Runner::Runner(const std::vector<Account> &accounts, size_t concurrency)
+    : accounts(accounts), concurrency(std::max<size_t>(concurrency, 1)), jobs(nullptr) {
+    for (const Account &account : accounts) {
+        summary.push_back({account.name, false, 0, 0, 0, 0, false, false, "", {}, {}});
+    }
+}
+
+void Runner::run() {
+    // the workers share the pool of the host, which opens up to one connection per worker, or multiplexes them over http/2
+    ConnectionPool::set_default_options({concurrency, 1, std::chrono::seconds(60), ConnectionPool::get_default_options().http2});
+    std::shared_ptr<HttpsClient> connection;
+    try {
+        connection = std::make_shared<HttpsClient>(BiliApi::host, "");
+        connection->wait_established();
+    } catch (const std::exception &e) {
+        for (AccountSummary &s : summary) {
+            s.error = e.what();
+        }
+        return;
+    }
+
+    Executor executor(concurrency);
+    TaskGroup group(executor);
+    jobs = &group;
+
+    // the requests of each account are serialized once and reused by all its jobs
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < accounts.size(); ++i) {
+        summary[i].start = summary[i].finish = now;
+        try {
+            apis.push_back(std::make_unique<BiliApi>(accounts[i].api_cookie, connection));
+            apis.back()->set_checkpoint(checkpoint.get());
+        } catch (const std::exception &e) {
+            apis.emplace_back();
+            summary[i].error = e.what();
+            continue;
+        }
+        push({JobKind::SIGN, i, 0, 0});
+        push({JobKind::MEDAL, i, 0, 0});
+    }
+
+    // the errors are recorded in the summary of each account by the jobs themselves
+    group.wait();
+    jobs = nullptr;
+}
+
+void Runner::push(const Job &job) {
+    jobs->run([this, job] {
+        try {
+            execute(job);
+            finish(job, "");
+        } catch (const std::exception &e) {
+            finish(job, e.what());
+        }
+    });
+}
+
+void Runner::execute(const Job &job) {
+    BiliApi &api = *apis[job.account];
+    switch (job.kind) {
+        case JobKind::SIGN: {
+            std::string recvdata;
+            api.sign(recvdata);
+            break;
+        }
+        case JobKind::MEDAL: {
+            // the monitor needs the rooms even if their chats and likes are sent
+            if (checkpoint && !monitor && checkpoint->done(api.uid(), 0, Checkpoint::ROOMS)) {
+                std::lock_guard<std::mutex> lock(m);
+                summary[job.account].resumed = true;
+                break;
+            }
+            // the whole panel is planned at once, so that the rooms earning the most go first
+            ExpPlanner planner;
+            api.fansMedal([&planner] (const Medal &medal) { planner.add(medal); });
+            std::vector<ExpTask> tasks = planner.plan();
+            {
+                std::lock_guard<std::mutex> lock(m);
+                summary[job.account].medals = planner.size();
+                summary[job.account].rooms_skipped = planner.skipped();
+            }
+            for (const ExpTask &task : tasks) {
+                push({JobKind::ROOM, job.account, task.roomid, task.actions});
+            }
+            break;
+        }
+        case JobKind::ROOM:
+            api.getExp(job.roomid, job.actions);
+            if (monitor && (job.actions & EXP_WATCH)) {
+                monitor->watch(api, job.roomid);
+            }
+            break;
+    }
+}
+
+void Runner::finish(const Job &job, const std::string &error) {
+    std::lock_guard<std::mutex> lock(m);
+    AccountSummary &s = summary[job.account];
+    if (job.kind == JobKind::SIGN) {
+        s.signed_in = error.empty();
+    } else if (job.kind == JobKind::MEDAL) {
+        s.listed = error.empty() && !s.resumed;
+    } else if (job.kind == JobKind::ROOM) {
+        ++(error.empty() ? s.rooms_done : s.rooms_failed);
+    }
+    if (checkpoint && s.listed && s.rooms_failed == 0 && s.rooms_done + s.rooms_skipped == s.medals) {
+        // the next run today does not even list the medals
+        checkpoint->mark(apis[job.account]->uid(), 0, Checkpoint::ROOMS);
+    }
+    if (!error.empty() && s.error.empty()) {
+        s.error = error;
+    }
+    s.finish = std::chrono::steady_clock::now();
+}
+
+void Runner::print_summary(std::ostream &os) const {
+    for (const AccountSummary &s : summary) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(s.finish - s.start);
+        os << std::left << std::setw(16) << s.name
+           << " sign=" << (s.signed_in ? "ok" : "fail")
+           << " medals=" << s.medals
+           << " rooms=" << (s.resumed ? "done earlier today" : std::to_string(s.rooms_done) + "/" +
+                                                std::to_string(s.rooms_done + s.rooms_failed))
+           << " capped=" << s.rooms_skipped
+           << " time=" << elapsed.count() << "ms";
+        if (!s.error.empty()) {
+            os << " error=\"" << s.error << "\"";
+        }
+        os << std::endl;
+    }
+}
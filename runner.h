@@ -0,0 +1,117 @@
+/**
+ * runner.h
+ *
+ * Header file for running many accounts from one process
+ */
+
+#ifndef _RUNNER_H_
+#define _RUNNER_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+
+#include "https.h"
+#include "bilibili.h"
+#include "monitor.h"
+#include "checkpoint.h"
+#include "executor.h"
+
+// cookies of one account
+typedef struct {
+    std::string name;
+    // cookie for www.bilibili.com, optional
+    std::string bili_cookie;
+    // cookie for api.live.bilibili.com
+    std::string api_cookie;
+} Account;
+
+/**
+ * Load accounts from a config file made of sections like
+ *
+ *   [name]
+ *   bili = <cookie of www.bilibili.com>
+ *   api = <cookie of api.live.bilibili.com>
+ *
+ * Empty lines and lines starting with '#' are ignored
+ */
+std::vector<Account> load_accounts(const std::string &path);
+
+// what happened to one account during a run
+typedef struct {
+    std::string name;
+    bool signed_in;
+    size_t medals;
+    size_t rooms_done;
+    size_t rooms_failed;
+    // the medals with no intimacy left to earn today, which get no request
+    size_t rooms_skipped;
+    // whether every medal has been listed, and whether the rooms were skipped as done by an earlier run today
+    bool listed;
+    bool resumed;
+    // the first error met by the account, empty if none
+    std::string error;
+    std::chrono::steady_clock::time_point start, finish;
+} AccountSummary;
+
+/**
+ * Drive all accounts as jobs of one task group.
+ * The jobs run on an executor of as many workers as the concurrency, sharing the connection pool of the host
+ * with every account, so the number of threads, of sockets and the run time depend on the concurrency
+ * rather than on the number of accounts and rooms.
+ */
+class Runner {
+public:
+    // concurrency is the number of requests in flight at the same time
+    explicit Runner(const std::vector<Account> &accounts, size_t concurrency);
+    ~Runner() = default;
+
+    // run all accounts and return when every job is done
+    void run();
+
+    // hand each room to monitor once its exp is earned, the runner must outlive the monitor
+    void watch(std::shared_ptr<RoomMonitor> monitor) { this->monitor = std::move(monitor); }
+
+    // skip the steps checkpoint records as done today, and record the others, the runner must not outlive it
+    void set_checkpoint(std::shared_ptr<Checkpoint> checkpoint) { this->checkpoint = std::move(checkpoint); }
+
+    // print one line per account
+    void print_summary(std::ostream &os) const;
+private:
+    enum JobKind { SIGN, MEDAL, ROOM };
+    typedef struct {
+        JobKind kind;
+        size_t account;
+        uint32_t roomid;
+        // the ExpAction bits of a room
+        uint8_t actions;
+    } Job;
+
+    // run one job and push the jobs depending on it
+    void execute(const Job &job);
+
+    // run job in the group of the current run, recording its result
+    void push(const Job &job);
+
+    // record the result of a job, error is empty on success
+    void finish(const Job &job, const std::string &error);
+
+    const std::vector<Account> &accounts;
+    size_t concurrency;
+    std::vector<AccountSummary> summary;
+    // the api of each account, null if its cookie is invalid
+    std::vector<std::unique_ptr<BiliApi>> apis;
+    std::shared_ptr<RoomMonitor> monitor;
+    std::shared_ptr<Checkpoint> checkpoint;
+
+    // guards the summary, which the jobs update from every worker
+    std::mutex m;
+    // the jobs of the current run
+    TaskGroup *jobs;
+};
+
+#endif /* _RUNNER_H_ */
@@ -0,0 +1,124 @@
+#include <time.h>
+
+#include <cmath>
+#include <map>
+#include <memory>
+#include <algorithm>
+
+#include "servertime.h"
+
+const std::chrono::seconds ServerClock::STALE(600);
+const double ServerClock::MAX_UNCERTAINTY = 2;
+
+// the drift is fitted only over samples spanning this many seconds, and kept within this many seconds per second
+static const double DRIFT_SPAN = 300, MAX_DRIFT = 5e-4;
+
+static double seconds(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double>(t.time_since_epoch()).count();
+}
+
+ServerClock &ServerClock::of(const std::string &host) {
+    static std::mutex registry_mutex;
+    static std::map<std::string, std::unique_ptr<ServerClock>> clocks;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::unique_ptr<ServerClock> &clock = clocks[host];
+    if (!clock) {
+        clock = std::make_unique<ServerClock>();
+    }
+    return *clock;
+}
+
+void ServerClock::observe(int64_t server_seconds, std::chrono::steady_clock::time_point sent,
+                          std::chrono::steady_clock::time_point received) {
+    double s = static_cast<double>(server_seconds), t0 = seconds(sent), t1 = seconds(received);
+    if (server_seconds <= 0 || t1 < t0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m);
+    // the server read s at some time in [t0, t1], its clock then showed a time in [s, s + 1)
+    samples.push_back({(t0 + t1) / 2, s - t1, s + 1 - t0});
+    if (samples.size() > SAMPLES) {
+        samples.pop_front();
+    }
+    update();
+}
+
+void ServerClock::observe(const HttpsResponse &response, std::chrono::steady_clock::time_point sent,
+                          std::chrono::steady_clock::time_point received) {
+    auto it = response.header.find("date");
+    if (it == response.header.end()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (it->second == last_date) {
+            return;
+        }
+        last_date = it->second;
+    }
+    struct tm tm = {};
+    if (strptime(it->second.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return;
+    }
+    observe(static_cast<int64_t>(timegm(&tm)), sent, received);
+}
+
+void ServerClock::update() {
+    // the drift is the slope of the midpoints of the offsets over the local time
+    _drift = 0;
+    if (samples.size() >= 4 && samples.back().t - samples.front().t >= DRIFT_SPAN) {
+        double n = static_cast<double>(samples.size()), st = 0, so = 0, stt = 0, sto = 0;
+        for (const Sample &sample : samples) {
+            double mid = (sample.low + sample.high) / 2;
+            st += sample.t;
+            so += mid;
+            stt += sample.t * sample.t;
+            sto += sample.t * mid;
+        }
+        double denominator = n * stt - st * st;
+        if (denominator > 0) {
+            _drift = std::max(-MAX_DRIFT, std::min(MAX_DRIFT, (n * sto - st * so) / denominator));
+        }
+    }
+    // the intervals moved to the time of the newest sample, the oldest ones are dropped while they disagree
+    t_ref = samples.back().t;
+    while (true) {
+        double low = -INFINITY, high = INFINITY;
+        for (const Sample &sample : samples) {
+            double shift = _drift * (t_ref - sample.t);
+            low = std::max(low, sample.low + shift);
+            high = std::min(high, sample.high + shift);
+        }
+        if (low <= high || samples.size() == 1) {
+            _offset = (low + high) / 2;
+            _uncertainty = std::max(high - low, 0.0);
+            return;
+        }
+        // the clock of the server or ours has stepped
+        samples.pop_front();
+    }
+}
+
+std::optional<int64_t> ServerClock::now() const {
+    double t = seconds(std::chrono::steady_clock::now());
+    std::lock_guard<std::mutex> lock(m);
+    if (samples.empty() || t - t_ref > static_cast<double>(STALE.count()) || _uncertainty > MAX_UNCERTAINTY) {
+        return std::nullopt;
+    }
+    return static_cast<int64_t>(std::floor(t + _offset + _drift * (t - t_ref)));
+}
+
+double ServerClock::offset() const {
+    std::lock_guard<std::mutex> lock(m);
+    return _offset;
+}
+
+double ServerClock::drift() const {
+    std::lock_guard<std::mutex> lock(m);
+    return _drift;
+}
+
+double ServerClock::uncertainty() const {
+    std::lock_guard<std::mutex> lock(m);
+    return _uncertainty;
+}
@@ -0,0 +1,70 @@
+/**
+ * servertime.h
+ *
+ * Header file for the estimate of the clock of a server from the times it reports
+ */
+
+#ifndef _SERVERTIME_H_
+#define _SERVERTIME_H_
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <optional>
+#include <cstdint>
+
+#include "https.h"
+
+/**
+ * The offset and drift of the clock of a server from the local steady clock, NTP-style.
+ * The server reports whole seconds, in the Date header of its responses or in the body of an api,
+ * so a sample taken between sending a request and receiving its answer bounds the offset to an interval
+ * around the midpoint of the round trip. The intervals of the recent samples are intersected,
+ * after correcting them for the drift fitted over their midpoints, and the offset is the middle of what is left.
+ * Shared by every client of the host, can be used from any thread.
+ */
+class ServerClock {
+public:
+    // the estimate is not trusted once its last sample is older than this, or its uncertainty wider than this
+    static const std::chrono::seconds STALE;
+    static const double MAX_UNCERTAINTY;
+    // the number of samples kept
+    static const size_t SAMPLES = 32;
+
+    // the clock of host, created on first use and never freed
+    static ServerClock &of(const std::string &host);
+
+    // the server read its clock as server_seconds, a unix time, between sent and received
+    void observe(int64_t server_seconds, std::chrono::steady_clock::time_point sent,
+                 std::chrono::steady_clock::time_point received);
+
+    // the same from the Date header of a response, if it has one
+    void observe(const HttpsResponse &response, std::chrono::steady_clock::time_point sent,
+                 std::chrono::steady_clock::time_point received);
+
+    // the current unix time of the server in whole seconds, nothing if the estimate is missing or stale
+    std::optional<int64_t> now() const;
+
+    // the offset of the server in seconds, its drift in seconds per second, and the width of the offset interval
+    double offset() const;
+    double drift() const;
+    double uncertainty() const;
+private:
+    typedef struct {
+        // the midpoint of the round trip on the steady clock, and the bounds of the offset, all in seconds
+        double t, low, high;
+    } Sample;
+
+    // fit the drift and intersect the intervals again
+    void update();
+
+    mutable std::mutex m;
+    std::deque<Sample> samples;
+    // the last Date header parsed, most responses repeat it within a second
+    std::string last_date;
+    // the estimate at the time of the newest sample
+    double t_ref = 0, _offset = 0, _drift = 0, _uncertainty = 0;
+};
+
+#endif /* _SERVERTIME_H_ */
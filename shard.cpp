@@ -0,0 +1,341 @@
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <stdexcept>
+
+#include "shard.h"
+
+const std::chrono::milliseconds ShardSupervisor::PUBLISH_INTERVAL(200);
+const std::chrono::milliseconds ShardSupervisor::POLL_INTERVAL(50);
+
+// set by the signal handlers of the supervisor, and read by its loop
+static volatile sig_atomic_t dump_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_dump(int) {
+    dump_requested = 1;
+}
+
+static void on_stop(int) {
+    stop_requested = 1;
+}
+
+static void set_handler(int signo, void (*handler)(int)) {
+    struct sigaction action = {};
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    // no SA_RESTART, so that a signal cuts the sleep of the loop short
+    sigaction(signo, &action, NULL);
+}
+
+// the cores the process may run on, in order
+static std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        cpus.push_back(0);
+    }
+    return cpus;
+}
+
+// whether a worker exited on its own and with status 0
+static bool succeeded(int status) {
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static std::string describe(int status) {
+    if (status == -1) {
+        return "running";
+    }
+    if (WIFSIGNALED(status)) {
+        return "signal " + std::to_string(WTERMSIG(status));
+    }
+    return std::to_string(WEXITSTATUS(status));
+}
+
+size_t ShardSupervisor::default_shards() {
+    return allowed_cpus().size();
+}
+
+ShardSupervisor::ShardSupervisor(size_t shards) : shards(std::max<size_t>(shards, 1)), slots(nullptr), size(0) {
+    std::vector<int> cpus = allowed_cpus();
+    for (size_t i = 0; i < this->shards.size(); ++i) {
+        this->shards[i] = {-1, cpus[i % cpus.size()], 0, -1};
+    }
+    // anonymous and shared, so that the workers forked afterwards write into the pages the supervisor reads
+    size = sizeof(Slot) * this->shards.size();
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("Fail to map the metrics of the shards");
+    }
+    slots = static_cast<Slot *>(addr);
+    for (size_t i = 0; i < this->shards.size(); ++i) {
+        new (&slots[i]) Slot();
+    }
+}
+
+ShardSupervisor::~ShardSupervisor() {
+    munmap(slots, size);
+}
+
+EndpointCounters *ShardSupervisor::endpoint(SharedMetrics &metrics, const std::string &name) {
+    size_t count = metrics.endpoints.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        if (strncmp(metrics.endpoint[i].name, name.c_str(), NAME_SIZE - 1) == 0) {
+            return &metrics.endpoint[i].counters;
+        }
+    }
+    if (count == ENDPOINTS) {
+        return nullptr;
+    }
+    SharedEndpoint &entry = metrics.endpoint[count];
+    snprintf(entry.name, NAME_SIZE, "%s", name.c_str());
+    entry.counters.assign(EndpointCounters());
+    // the name is complete before a reader can see the entry
+    metrics.endpoints.store(count + 1, std::memory_order_release);
+    return &entry.counters;
+}
+
+HostCounters *ShardSupervisor::host(SharedMetrics &metrics, const std::string &name) {
+    size_t count = metrics.hosts.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        if (strncmp(metrics.host[i].name, name.c_str(), NAME_SIZE - 1) == 0) {
+            return &metrics.host[i].counters;
+        }
+    }
+    if (count == HOSTS) {
+        return nullptr;
+    }
+    SharedHost &entry = metrics.host[count];
+    snprintf(entry.name, NAME_SIZE, "%s", name.c_str());
+    entry.counters.assign(HostCounters());
+    metrics.hosts.store(count + 1, std::memory_order_release);
+    return &entry.counters;
+}
+
+void ShardSupervisor::publish(SharedMetrics &metrics) {
+    // a reader may see one counter updated before another, never a torn one
+    metrics_for_each([&metrics] (const EndpointMetrics &m) {
+        if (EndpointCounters *counters = endpoint(metrics, m.name)) {
+            counters->assign(m);
+        }
+    }, [&metrics] (const HostMetrics &m) {
+        if (HostCounters *counters = host(metrics, m.name)) {
+            counters->assign(m);
+        }
+    });
+}
+
+void ShardSupervisor::retire(SharedMetrics &from, SharedMetrics &to) {
+    for (size_t i = 0; i < from.endpoints.load(std::memory_order_relaxed); ++i) {
+        if (EndpointCounters *counters = endpoint(to, from.endpoint[i].name)) {
+            counters->merge(from.endpoint[i].counters);
+        }
+    }
+    for (size_t i = 0; i < from.hosts.load(std::memory_order_relaxed); ++i) {
+        if (HostCounters *counters = host(to, from.host[i].name)) {
+            counters->merge(from.host[i].counters);
+        }
+    }
+    // the next worker of the shard appends its entries afresh
+    from.endpoints.store(0, std::memory_order_relaxed);
+    from.hosts.store(0, std::memory_order_relaxed);
+}
+
+void ShardSupervisor::collect(const SharedMetrics &metrics) {
+    size_t endpoints = metrics.endpoints.load(std::memory_order_acquire);
+    for (size_t i = 0; i < endpoints; ++i) {
+        metrics_endpoint(metrics.endpoint[i].name).merge(metrics.endpoint[i].counters);
+    }
+    size_t hosts = metrics.hosts.load(std::memory_order_acquire);
+    for (size_t i = 0; i < hosts; ++i) {
+        metrics_host(metrics.host[i].name).merge(metrics.host[i].counters);
+    }
+}
+
+void ShardSupervisor::aggregate() {
+    metrics_clear();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        collect(slots[i].retired);
+        collect(slots[i].live);
+    }
+}
+
+void ShardSupervisor::work_in_child(size_t index, const Work &work) {
+    // a worker left without its supervisor stops rather than running on unsupervised
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(shards[index].cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        std::cerr << "Fail to pin shard " << index << " to cpu " << shards[index].cpu << std::endl;
+    }
+
+    // the registry copied by fork holds what the supervisor aggregated, not what this worker did
+    metrics_clear();
+    SharedMetrics &live = slots[index].live;
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    std::thread publisher([&] {
+        std::unique_lock<std::mutex> lock(m);
+        while (!cv.wait_for(lock, PUBLISH_INTERVAL, [&done] { return done; })) {
+            publish(live);
+        }
+    });
+    int status = 1;
+    try {
+        status = work(index, shards.size());
+    } catch (const std::exception &e) {
+        std::cerr << "Shard " << index << " fails: " << e.what() << std::endl;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m);
+        done = true;
+    }
+    cv.notify_one();
+    publisher.join();
+    publish(live);
+    std::cout.flush();
+    std::cerr.flush();
+    // the objects of the supervisor copied by fork are not the worker's to destroy
+    _exit(status);
+}
+
+void ShardSupervisor::start(size_t index, const Work &work) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        throw std::runtime_error("Fail to fork shard " + std::to_string(index));
+    }
+    if (pid == 0) {
+        work_in_child(index, work);
+    }
+    shards[index].pid = pid;
+    shards[index].status = -1;
+}
+
+int ShardSupervisor::run(const Work &work, const std::string &metrics_path) {
+    set_handler(SIGUSR1, on_dump);
+    set_handler(SIGINT, on_stop);
+    set_handler(SIGTERM, on_stop);
+    auto dump = [this, &metrics_path] {
+        if (!metrics_path.empty()) {
+            aggregate();
+            metrics_dump(metrics_path);
+        }
+    };
+
+    start_time = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        start(i, work);
+    }
+    size_t running = shards.size();
+    bool stopping = false;
+    while (running > 0) {
+        if (stop_requested && !stopping) {
+            stopping = true;
+            for (const Shard &shard : shards) {
+                if (shard.pid != -1) {
+                    kill(shard.pid, SIGTERM);
+                }
+            }
+        }
+        if (dump_requested) {
+            dump_requested = 0;
+            try {
+                dump();
+            } catch (const std::exception &e) {
+                std::cerr << "Fail to dump the metrics: " << e.what() << std::endl;
+            }
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid == -1 && errno != EINTR) {
+            throw std::runtime_error("waitpid fails");
+        }
+        if (pid <= 0) {
+            std::this_thread::sleep_for(POLL_INTERVAL);
+            continue;
+        }
+        for (size_t i = 0; i < shards.size(); ++i) {
+            Shard &shard = shards[i];
+            if (shard.pid != pid) {
+                continue;
+            }
+            retire(slots[i].live, slots[i].retired);
+            shard.pid = -1;
+            shard.status = status;
+            if (WIFSIGNALED(status) && !stopping && !stop_requested && shard.restarts < MAX_RESTARTS) {
+                // only the accounts of this shard start again, resuming from the checkpoint if there is one
+                ++shard.restarts;
+                std::cerr << "Shard " << i << " crashes with signal " << WTERMSIG(status) << ", restarting" << std::endl;
+                start(i, work);
+            } else {
+                --running;
+                if (!succeeded(status)) {
+                    std::cerr << "Shard " << i << " exits with " << describe(status) << std::endl;
+                }
+            }
+            break;
+        }
+    }
+    finish_time = std::chrono::steady_clock::now();
+    dump();
+
+    for (const Shard &shard : shards) {
+        if (!succeeded(shard.status)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void ShardSupervisor::print_summary(std::ostream &os) const {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        const Shard &shard = shards[i];
+        os << std::left << std::setw(16) << ("shard " + std::to_string(i))
+           << " cpu=" << shard.cpu
+           << " restarts=" << shard.restarts
+           << " exit=" << describe(shard.status) << std::endl;
+    }
+    uint64_t requests = 0;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        for (const SharedMetrics *metrics : {&slots[i].retired, &slots[i].live}) {
+            size_t endpoints = metrics->endpoints.load(std::memory_order_acquire);
+            for (size_t j = 0; j < endpoints; ++j) {
+                requests += metrics->endpoint[j].counters.requests.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(finish_time - start_time);
+    os << std::left << std::setw(16) << "all shards"
+       << " requests=" << requests
+       << " time=" << elapsed.count() << "ms"
+       << " rate=" << (elapsed.count() > 0 ? requests * 1000 / static_cast<uint64_t>(elapsed.count()) : requests)
+       << "/s" << std::endl;
+}
@@ -0,0 +1,121 @@
+/**
+ * shard.h
+ *
+ * Header file for the supervisor running the accounts in worker processes pinned to cores
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ostream>
+#include <functional>
+#include <sys/types.h>
+
+#include "metrics.h"
+
+/**
+ * Runs a function in a fixed number of forked worker processes, each pinned to one of the cores the supervisor may use.
+ * Every worker publishes the metrics of its registry into its own slot of a shared anonymous mapping, made of atomics
+ * it alone writes, so that the supervisor sums up all slots without lock and without stopping any worker.
+ * A worker killed by a signal is forked again in place, with the metrics of its earlier lives kept,
+ * while the other workers run on undisturbed.
+ */
+class ShardSupervisor {
+public:
+    // the work of one worker, given its shard and the number of shards, returning the exit status of the worker
+    typedef std::function<int(size_t shard, size_t shards)> Work;
+
+    // the most endpoints and hosts a slot holds, more than the api has
+    static const size_t ENDPOINTS = 64;
+    static const size_t HOSTS = 16;
+    // the longest name kept, longer ones are cut
+    static const size_t NAME_SIZE = 96;
+    // the times a shard is forked again before it is given up
+    static const unsigned MAX_RESTARTS = 5;
+    // how often the workers publish their metrics, and the supervisor checks on them
+    static const std::chrono::milliseconds PUBLISH_INTERVAL;
+    static const std::chrono::milliseconds POLL_INTERVAL;
+
+    // the number of cores the process may run on, at least one
+    static size_t default_shards();
+
+    // map the slots of shards workers, throws if the mapping fails
+    explicit ShardSupervisor(size_t shards);
+    ~ShardSupervisor();
+
+    ShardSupervisor(const ShardSupervisor &) = delete;
+    ShardSupervisor &operator=(const ShardSupervisor &) = delete;
+
+    /**
+     * fork the workers running work and wait until every one has exited or been given up,
+     * the metrics are written to metrics_path whenever the supervisor receives SIGUSR1 and at the end if it is not empty,
+     * SIGINT and SIGTERM stop the workers, return 0 if every worker exited with status 0
+     */
+    int run(const Work &work, const std::string &metrics_path);
+
+    // sum up the metrics of every worker into the registry of this process
+    void aggregate();
+
+    // print one line per shard and the requests of all of them
+    void print_summary(std::ostream &os) const;
+private:
+    typedef struct {
+        char name[NAME_SIZE];
+        EndpointCounters counters;
+    } SharedEndpoint;
+
+    typedef struct {
+        char name[NAME_SIZE];
+        HostCounters counters;
+    } SharedHost;
+
+    // the metrics of a worker, the names of the first endpoints and hosts being published before their number grows
+    typedef struct {
+        std::atomic<size_t> endpoints, hosts;
+        SharedEndpoint endpoint[ENDPOINTS];
+        SharedHost host[HOSTS];
+    } SharedMetrics;
+
+    // the metrics of the worker running a shard, and of its earlier lives, which only the supervisor writes
+    typedef struct {
+        SharedMetrics live, retired;
+    } Slot;
+
+    // what the supervisor knows of a shard
+    typedef struct {
+        pid_t pid;
+        int cpu;
+        unsigned restarts;
+        // the wait status of the last worker, or -1 while one runs
+        int status;
+    } Shard;
+
+    // fork the worker of shard index
+    void start(size_t index, const Work &work);
+
+    // run in the forked worker, never returns
+    [[noreturn]] void work_in_child(size_t index, const Work &work);
+
+    // the entries of metrics named name, appended if missing, nullptr if full, only from the single writer of metrics
+    static EndpointCounters *endpoint(SharedMetrics &metrics, const std::string &name);
+    static HostCounters *host(SharedMetrics &metrics, const std::string &name);
+
+    // copy the registry of this process into metrics
+    static void publish(SharedMetrics &metrics);
+
+    // add all of from to to, then zero from, once its worker has exited
+    static void retire(SharedMetrics &from, SharedMetrics &to);
+
+    // add the metrics to the registry of this process
+    static void collect(const SharedMetrics &metrics);
+
+    std::vector<Shard> shards;
+    Slot *slots;
+    size_t size;
+    std::chrono::steady_clock::time_point start_time, finish_time;
+};
+
+#endif /* _SHARD_H_ */
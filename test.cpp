@@ -1,15 +1,177 @@
 #include <string>
 #include <vector>
 #include <iostream>
-#include <thread>
+#include <future>
+#include <algorithm>
+#include <unistd.h>
+#include <signal.h>
 
 #include "https.h"
 #include "bilibili.h"
+#include "runner.h"
+#include "monitor.h"
+#include "capture.h"
+#include "metrics.h"
+#include "checkpoint.h"
+#include "pool.h"
+#include "tls.h"
+#include "executor.h"
+#include "shard.h"
 
-int main() {
+// keep watching the rooms until the process is killed
+static void watch_forever() {
+    std::promise<void>().get_future().wait();
+}
+
+// where the metrics are written at the end of the run and on SIGUSR1, nowhere if empty
+static std::string metrics_path;
+
+static void dump_metrics() {
+    if (!metrics_path.empty()) {
+        metrics_dump(metrics_path);
+    }
+}
+
+// run the accounts of shard out of shards listed in the config file from this process, every account if shards is 0
+static int run_accounts(const std::string &path, size_t shard, size_t shards, size_t concurrency, bool watch,
+                        const RoomMonitor::Options &options, std::shared_ptr<Checkpoint> checkpoint) {
+    std::vector<Account> accounts = load_accounts(path);
+    if (shards > 0) {
+        std::vector<Account> own;
+        for (size_t i = shard; i < accounts.size(); i += shards) {
+            own.push_back(accounts[i]);
+        }
+        accounts.swap(own);
+    }
+    Runner runner(accounts, concurrency);
+    runner.set_checkpoint(checkpoint);
+    std::shared_ptr<RoomMonitor> monitor;
+    if (watch) {
+        monitor = std::make_shared<RoomMonitor>(options);
+        runner.watch(monitor);
+    }
+    runner.run();
+    runner.print_summary(std::cout);
+    // the supervisor of the shards writes the metrics of them all
+    if (shards == 0) {
+        dump_metrics();
+    }
+    if (watch) {
+        watch_forever();
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
     HttpsClient::ssl_init();
     std::string recvdata;
 
+    // -c <file> runs all accounts of the file, -j <n> sets the number of concurrent requests,
+    // -w keeps watching the rooms afterwards, entering them and sending heartbeats while they stream,
+    // -p polls the status of the watched rooms rather than subscribing to their broadcast,
+    // -b <host:port> subscribes to another broadcast server, such as a local stand-in replaying recorded frames,
+    // -R <file> records the raw responses into a corpus for bili-micro,
+    // -m <file> writes the latencies and counters of every endpoint at the end of the run and on SIGUSR1,
+    // as json if the file ends with .json and as Prometheus text otherwise,
+    // -C <file> keeps the progress of the day in the file, so that a run started again skips what is done,
+    // -2 offers http/2, so that the requests of every account share one multiplexed connection per host,
+    // -K lets the kernel encrypt and decrypt the records where it supports the cipher,
+    // -S <n> spreads the accounts of -c over n worker processes pinned to cores, 0 for one per core,
+    // the metrics of -m being those of every worker,
+    // -t <ms> fails a request unanswered after this long, retries included, 0 for never,
+    // -H sends an idempotent request once more when it is still unanswered at the p95 latency of its endpoint
+    std::string config;
+    size_t concurrency = 4;
+    bool watch = false;
+    RoomMonitor::Options options = RoomMonitor::default_options;
+    std::shared_ptr<Checkpoint> checkpoint;
+    bool sharded = false;
+    size_t shards = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:j:wpb:R:m:C:2KS:t:H")) != -1) {
+        switch (opt) {
+            case 'c':
+                config = optarg;
+                break;
+            case 'j':
+                concurrency = std::stoul(optarg);
+                break;
+            case 'w':
+                watch = true;
+                break;
+            case 'p':
+                options.push = false;
+                break;
+            case 'b': {
+                std::string endpoint = optarg;
+                size_t colon = endpoint.rfind(':');
+                options.broadcast.host = endpoint.substr(0, colon);
+                if (colon != std::string::npos) {
+                    options.broadcast.port = static_cast<uint16_t>(std::stoul(endpoint.substr(colon + 1)));
+                }
+                break;
+            }
+            case 'R':
+                capture_open(optarg);
+                break;
+            case 'C':
+                checkpoint = std::make_shared<Checkpoint>(optarg);
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case '2': {
+                ConnectionPool::Options pool_options = ConnectionPool::get_default_options();
+                pool_options.http2 = true;
+                ConnectionPool::set_default_options(pool_options);
+                break;
+            }
+            case 'K':
+                tls_enable_ktls();
+                break;
+            case 'S':
+                sharded = true;
+                shards = std::stoul(optarg);
+                break;
+            case 't': {
+                RetryPolicy policy = HttpsClient::get_default_policy();
+                policy.deadline = std::chrono::milliseconds(std::stoul(optarg));
+                HttpsClient::set_default_policy(policy);
+                break;
+            }
+            case 'H': {
+                RetryPolicy policy = HttpsClient::get_default_policy();
+                policy.hedge = true;
+                HttpsClient::set_default_policy(policy);
+                break;
+            }
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-c accounts.conf] [-j concurrency] [-w] [-p] [-b host:port]"
+                          << " [-R corpus] [-m metrics] [-C checkpoint] [-2] [-K] [-S shards] [-t deadline ms] [-H]"
+                          << std::endl;
+                return 1;
+        }
+    }
+    if (sharded) {
+        if (config.empty() || capture_enabled()) {
+            std::cerr << "-S needs -c, and cannot record a corpus" << std::endl;
+            return 1;
+        }
+        // nothing may have started the reactor thread yet, which fork would not copy
+        ShardSupervisor supervisor(shards == 0 ? ShardSupervisor::default_shards() : shards);
+        int status = supervisor.run([&] (size_t shard, size_t count) {
+            return run_accounts(config, shard, count, concurrency, watch, options, checkpoint);
+        }, metrics_path);
+        supervisor.print_summary(std::cout);
+        return status;
+    }
+    if (!metrics_path.empty()) {
+        metrics_dump_on_signal(SIGUSR1, metrics_path);
+    }
+    if (!config.empty()) {
+        return run_accounts(config, 0, 0, concurrency, watch, options, checkpoint);
+    }
+
     // fill in the cookie here
     std::string bilicookie = "";
     std::string apicookie = "";
@@ -21,26 +183,43 @@ int main() {
         apicookie = getenv("ACTION_API");
     }
 
+    // both clients connect in parallel, requests wait for the handshake of their host
     Bilibili bili(bilicookie);
     BiliApi biliapi(apicookie);
+    biliapi.set_checkpoint(checkpoint.get());
 
     biliapi.sign(recvdata);
-    std::cout << recvdata << std::endl;
-
-    std::vector<uint32_t> room_id;
-    biliapi.fansMedal(room_id);
-    if (!room_id.size()) {
-        return 0;
+    if (!recvdata.empty()) {
+        std::cout << recvdata << std::endl;
     }
-    for (size_t i = 0; i < room_id.size() - 1; ++i) {
-        std::thread(
-            [&biliapi] (uint32_t roomid) -> void {
-                biliapi.getExp(roomid);
+
+    // only the rooms still earning intimacy get requests, the rate limits of the endpoints pace them
+    std::shared_ptr<RoomMonitor> monitor = watch ? std::make_shared<RoomMonitor>(options) : nullptr;
+    ExpPlanner planner;
+    biliapi.fansMedal([&planner] (const Medal &medal) { planner.add(medal); });
+    std::cout << planner.size() << " medals, " << planner.skipped() << " with nothing to earn today" << std::endl;
+    Executor executor(std::max(Executor::default_threads(), concurrency));
+    TaskGroup rooms(executor);
+    for (const ExpTask &task : planner.plan()) {
+        rooms.run([&biliapi, &monitor, task] {
+            biliapi.getExp(task.roomid, task.actions);
+            if (monitor && (task.actions & EXP_WATCH)) {
+                monitor->watch(biliapi, task.roomid);
             }
-        , room_id[i]).detach();
-        std::this_thread::sleep_for(std::chrono::seconds(5));
+        });
+    }
+    // a room failing does not stop the others
+    for (std::exception_ptr &error : rooms.wait()) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception &e) {
+            std::cerr << "Room fails: " << e.what() << std::endl;
+        }
+    }
+    dump_metrics();
+    if (watch) {
+        watch_forever();
     }
-    biliapi.getExp(room_id.back());
 
     return 0;
 }
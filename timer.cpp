@@ -0,0 +1,110 @@
+#include "timer.h"
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick)
+    : tick(tick), origin(Clock::now()), current(0), next_id(0) {}
+
+TimerWheel::TimerId TimerWheel::schedule(Clock::time_point deadline, std::function<void()> fn) {
+    // round up, a timer never fires before its deadline
+    uint64_t expires = 0;
+    if (deadline > origin) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - origin).count();
+        auto length = std::chrono::duration_cast<std::chrono::nanoseconds>(tick).count();
+        expires = static_cast<uint64_t>((ns + length - 1) / length);
+    }
+    TimerId id = ++next_id;
+    Slot pending;
+    pending.push_back({id, expires, std::move(fn)});
+    place(pending, pending.begin());
+    return id;
+}
+
+void TimerWheel::place(Slot &from, Slot::iterator it) {
+    // a timer already due runs in the next tick
+    if (it->expires < current) {
+        it->expires = current;
+    }
+    uint64_t delta = it->expires - current;
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delta >= static_cast<uint64_t>(1) << (BITS * (level + 1))) {
+        ++level;
+    }
+    uint64_t expires = it->expires;
+    if (level == LEVELS - 1 && delta >= static_cast<uint64_t>(1) << (BITS * LEVELS)) {
+        // beyond the last level, the timer waits in the farthest slot and is placed again from there
+        expires = current + (static_cast<uint64_t>(1) << (BITS * LEVELS)) - 1;
+    }
+    Slot &slot = wheels[level][(expires >> (BITS * level)) & MASK];
+    slot.splice(slot.end(), from, it);
+    index[it->id] = {&slot, it};
+}
+
+void TimerWheel::cancel(TimerId id) {
+    auto found = index.find(id);
+    if (found != index.end()) {
+        found->second.slot->erase(found->second.it);
+        index.erase(found);
+    }
+}
+
+void TimerWheel::cascade(unsigned level) {
+    Slot &slot = wheels[level][(current >> (BITS * level)) & MASK];
+    while (!slot.empty()) {
+        place(slot, slot.begin());
+    }
+}
+
+void TimerWheel::advance(Clock::time_point now) {
+    if (now < origin) {
+        return;
+    }
+    uint64_t target = static_cast<uint64_t>((now - origin) / tick);
+    while (current <= target) {
+        // at the start of each turn of a level, the next slot of the level above is spread over it
+        for (unsigned level = 1; level < LEVELS && (current & ((static_cast<uint64_t>(1) << (BITS * level)) - 1)) == 0; ++level) {
+            cascade(level);
+        }
+        Slot &slot = wheels[0][current & MASK];
+        running.splice(running.end(), slot);
+        for (Timer &timer : running) {
+            index[timer.id].slot = &running;
+        }
+        // timers scheduled by the callbacks expire after this tick, so they never land in running
+        ++current;
+        while (!running.empty()) {
+            std::function<void()> fn = std::move(running.front().fn);
+            index.erase(running.front().id);
+            running.pop_front();
+            fn();
+        }
+    }
+}
+
+int TimerWheel::timeout(Clock::time_point now) const {
+    if (index.empty()) {
+        return -1;
+    }
+    // the next occupied slot of the current turn, or the start of a turn, when the levels above cascade
+    uint64_t due = (current & MASK) == 0 ? current : (current | MASK) + 1;
+    for (uint64_t t = current; t < due; ++t) {
+        if (!wheels[0][t & MASK].empty()) {
+            due = t;
+            break;
+        }
+    }
+    Clock::time_point deadline = origin + tick * static_cast<int64_t>(due);
+    if (deadline <= now) {
+        return 0;
+    }
+    // round up so that the tick is due when epoll_wait returns
+    return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1;
+}
+
+void TimerWheel::clear() {
+    for (auto &wheel : wheels) {
+        for (Slot &slot : wheel) {
+            slot.clear();
+        }
+    }
+    running.clear();
+    index.clear();
+}
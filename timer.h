@@ -0,0 +1,78 @@
+/**
+ * timer.h
+ *
+ * Header file for the hierarchical timer wheel scheduling the timers of the reactor
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Timers kept in LEVELS wheels of SLOTS slots, a slot of each level spanning a whole turn of the level below.
+ * Scheduling and cancelling cost O(1) whatever the number of timers, and a timer moves down one level
+ * each time the level below completes a turn, so it is touched at most LEVELS times before it fires.
+ * Deadlines are rounded up to a tick, and the timers due in the same tick fire together.
+ * Not thread-safe, the reactor uses it from its loop thread only.
+ */
+class TimerWheel {
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef uint64_t TimerId;
+
+    explicit TimerWheel(std::chrono::milliseconds tick);
+
+    // run fn once at deadline or in the first tick after it
+    TimerId schedule(Clock::time_point deadline, std::function<void()> fn);
+
+    // cancel a timer which has not fired yet
+    void cancel(TimerId id);
+
+    // run the timers due at now, they may schedule and cancel timers
+    void advance(Clock::time_point now);
+
+    // the milliseconds from now to the next tick holding a timer, -1 if there is no timer
+    int timeout(Clock::time_point now) const;
+
+    // drop all timers without running them
+    void clear();
+private:
+    static const unsigned LEVELS = 4, BITS = 8, SLOTS = 1 << BITS;
+    static const uint64_t MASK = SLOTS - 1;
+
+    typedef struct {
+        TimerId id;
+        uint64_t expires;
+        std::function<void()> fn;
+    } Timer;
+    typedef std::list<Timer> Slot;
+
+    // where a timer is, so that it can be cancelled
+    typedef struct {
+        Slot *slot;
+        Slot::iterator it;
+    } Location;
+
+    // move the timer at it of from into the slot matching its expiry
+    void place(Slot &from, Slot::iterator it);
+
+    // move the timers of the slot of level due in the current turn of the level below down
+    void cascade(unsigned level);
+
+    std::chrono::milliseconds tick;
+    Clock::time_point origin;
+    // the next tick to run
+    uint64_t current;
+    TimerId next_id;
+    Slot wheels[LEVELS][SLOTS];
+    // the timers of the tick being run
+    Slot running;
+    std::unordered_map<TimerId, Location> index;
+};
+
+#endif /* _TIMER_H_ */
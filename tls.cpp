@@ -0,0 +1,88 @@
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "tls.h"
+
+static SSL_CTX *ctx = NULL;
+
+// the last session received from each host, owned by the cache
+static std::mutex sessions_mutex;
+static std::unordered_map<std::string, SSL_SESSION *> sessions;
+
+// called by openssl when the server issues a session ticket, return 1 to keep the reference
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+    const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (host == NULL) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    SSL_SESSION *&cached = sessions[host];
+    if (cached != NULL) {
+        SSL_SESSION_free(cached);
+    }
+    cached = session;
+    return 1;
+}
+
+void tls_init() {
+    if (ctx != NULL) {
+        return;
+    }
+    const SSL_METHOD *meth = SSLv23_client_method();
+    ctx = SSL_CTX_new(meth);
+    if(ctx == NULL) {
+        throw std::runtime_error("SSL_CTX_new fails");
+    }
+    // SSL_write may be retried with the rest of the buffer after SSL_ERROR_WANT_WRITE
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // read as many records as the socket holds with one recv rather than one recv per record header and body
+    SSL_CTX_set_read_ahead(ctx, 1);
+    SSL_CTX_set_default_read_buffer_len(ctx, 65536);
+    // a connection closed without close_notify is reported as SSL_ERROR_ZERO_RETURN
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // sessions are kept by new_session() only, keyed by host rather than by the internal cache
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session);
+}
+
+void tls_enable_ktls() {
+    // openssl installs the keys into the socket after the handshake, and falls back silently if that fails
+    SSL_CTX_set_options(tls_context(), SSL_OP_ENABLE_KTLS);
+}
+
+bool tls_ktls_send(SSL *ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) == 1;
+}
+
+bool tls_ktls_recv(SSL *ssl) {
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl)) == 1;
+}
+
+SSL_CTX *tls_context() {
+    if (ctx == NULL) {
+        throw std::runtime_error("HttpsClient::ssl_init() has not been called");
+    }
+    return ctx;
+}
+
+size_t tls_resume(SSL *ssl, const std::string &host) {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(host);
+    if (it == sessions.end() || !SSL_SESSION_is_resumable(it->second)) {
+        return 0;
+    }
+    if (SSL_set_session(ssl, it->second) != 1) {
+        return 0;
+    }
+    return SSL_SESSION_get_max_early_data(it->second);
+}
+
+size_t tls_early_data(const std::string &host) {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(host);
+    if (it == sessions.end() || !SSL_SESSION_is_resumable(it->second)) {
+        return 0;
+    }
+    return SSL_SESSION_get_max_early_data(it->second);
+}
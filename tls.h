@@ -0,0 +1,44 @@
+/**
+ * tls.h
+ *
+ * Header file for the tls context and session cache shared by all connections
+ */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <string>
+
+#include <openssl/ssl.h>
+
+/**
+ * Create the SSL_CTX of the process, done by HttpsClient::ssl_init().
+ * It caches the last session ticket of each host, so that new connections resume it instead of a full handshake.
+ */
+void tls_init();
+
+/**
+ * Let the kernel encrypt and decrypt the records of connections established from now on, where the kernel
+ * and the negotiated cipher support it. Other connections keep doing it in user space.
+ */
+void tls_enable_ktls();
+
+// whether the kernel sends the records of ssl, so that plaintext may be written to its socket directly
+bool tls_ktls_send(SSL *ssl);
+
+// whether the kernel receives the records of ssl
+bool tls_ktls_recv(SSL *ssl);
+
+// the SSL_CTX shared by all connections
+SSL_CTX *tls_context();
+
+/**
+ * Resume the cached session of host on ssl, before the handshake.
+ * Return how many bytes of early data the session allows, zero if none or if no session is cached.
+ */
+size_t tls_resume(SSL *ssl, const std::string &host);
+
+// how many bytes of early data a new connection to host may send, zero if none
+size_t tls_early_data(const std::string &host);
+
+#endif /* _TLS_H_ */